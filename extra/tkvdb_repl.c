@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tkvdb.h"
+
+static void
+usage(const char *prog_name)
+{
+	fprintf(stderr, "Usage: %s [-f] [-i MSEC] [-n ID] send FILE.DB\n",
+		prog_name);
+	fprintf(stderr, "       %s recv FILE.DB\n", prog_name);
+	fprintf(stderr, "       %s id FILE.DB\n", prog_name);
+	fprintf(stderr, "  send  write transactions to stdout\n");
+	fprintf(stderr, "  recv  apply transactions from stdin\n");
+	fprintf(stderr, "  id    print id of next transaction expected by"
+		" follower\n");
+	fprintf(stderr, "  -f    follow: wait for new transactions\n");
+	fprintf(stderr, "  -i    polling interval in milliseconds"
+		" (default 10)\n");
+	fprintf(stderr, "  -n    id of first transaction to send"
+		" (default 0)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	tkvdb *db;
+	TKVDB_RES r;
+	int ret = EXIT_FAILURE;
+
+	int opt;
+	int follow = 0;
+	unsigned long interval = 10;
+	uint64_t next_id = 0;
+	const char *cmd;
+
+	while ((opt = getopt(argc, argv, ":fi:n:")) != -1) {
+		switch (opt) {
+			case 'f':
+				follow = 1;
+				break;
+			case 'i':
+				interval = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				next_id = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				goto fail;
+		}
+	}
+
+	if ((optind + 2) != argc) {
+		usage(argv[0]);
+		goto fail;
+	}
+	cmd = argv[optind];
+
+	db = tkvdb_open(argv[optind + 1], NULL);
+	if (!db) {
+		fprintf(stderr, "Can't open %s\n", argv[optind + 1]);
+		goto fail;
+	}
+
+	if (strcmp(cmd, "send") == 0) {
+		for (;;) {
+			r = tkvdb_repl_send(db, &next_id, STDOUT_FILENO);
+			if (r != TKVDB_OK) {
+				fprintf(stderr, "Can't send transactions,"
+					" error code %d\n", r);
+				goto fail_db;
+			}
+			if (!follow) {
+				break;
+			}
+			usleep(interval * 1000);
+		}
+	} else if (strcmp(cmd, "recv") == 0) {
+		r = tkvdb_repl_recv(db, STDIN_FILENO);
+		if (r != TKVDB_OK) {
+			fprintf(stderr, "Can't apply transactions,"
+				" error code %d\n", r);
+			goto fail_db;
+		}
+	} else if (strcmp(cmd, "id") == 0) {
+		r = tkvdb_repl_next_id(db, &next_id);
+		if (r != TKVDB_OK) {
+			fprintf(stderr, "Can't read database info,"
+				" error code %d\n", r);
+			goto fail_db;
+		}
+		printf("%llu\n", (unsigned long long)next_id);
+	} else {
+		usage(argv[0]);
+		goto fail_db;
+	}
+
+	ret = EXIT_SUCCESS;
+
+fail_db:
+	tkvdb_close(db);
+fail:
+	return ret;
+}
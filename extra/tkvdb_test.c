@@ -6,6 +6,10 @@
 
 #include <ctype.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "tkvdb.h"
 
@@ -226,6 +230,17 @@ test_seek(void)
 		dtk.len = kvs[idx].klen;
 		r = tkvdb_seek(c, &dtk, TKVDB_SEEK_EQ);
 		TEST_CHECK(r == TKVDB_OK);
+
+		/* cursor is positioned at found key */
+		r = tkvdb_next(c);
+		if (idx < (N - 1)) {
+			TEST_CHECK(r == TKVDB_OK);
+			TEST_CHECK((tkvdb_cursor_keysize(c) == kvs[idx + 1].klen)
+				&& (memcmp(tkvdb_cursor_key(c), kvs[idx + 1].key,
+				kvs[idx + 1].klen) == 0));
+		} else {
+			TEST_CHECK(r == TKVDB_NOT_FOUND);
+		}
 	}
 
 	/* nonexistent */
@@ -509,6 +524,3105 @@ test_vacuum(void)
 	tkvdb_close(db);
 }
 
+struct diff_res
+{
+	size_t n;
+	TKVDB_DIFF op[200];
+	char key[200][20];
+};
+
+static TKVDB_RES
+diff_cb(void *arg, TKVDB_DIFF op, const tkvdb_datum *key,
+	const tkvdb_datum *val)
+{
+	struct diff_res *res = arg;
+
+	(void)val;
+	if (res->n >= 200) {
+		return TKVDB_ENOMEM;
+	}
+	res->op[res->n] = op;
+	memcpy(res->key[res->n], key->data, key->len);
+	res->key[res->n][key->len] = '\0';
+	res->n++;
+
+	return TKVDB_OK;
+}
+
+/* count diff entries, keys must be of growing length */
+static TKVDB_RES
+diff_len_cb(void *arg, TKVDB_DIFF op, const tkvdb_datum *key,
+	const tkvdb_datum *val)
+{
+	size_t *n = arg;
+
+	(void)val;
+	if ((op != TKVDB_DIFF_PUT) || (key->len != (*n + 1))) {
+		return TKVDB_CORRUPTED;
+	}
+	(*n)++;
+
+	return TKVDB_OK;
+}
+
+void
+test_diff(void)
+{
+	const char fn[] = "data_test_diff.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_datum dtk, dtv;
+	uint64_t root1, root2, root3, root4, gap_begin, gap_end;
+	struct diff_res res;
+	char key[20], deep[100];
+	size_t i, n;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<100; i++) {
+		sprintf(key, "k%03u", (unsigned int)i);
+		dtk.data = key;
+		dtk.len = strlen(key);
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtk) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root1, &gap_begin, &gap_end) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	dtk.data = "k050"; dtk.len = 4;
+	dtv.data = "new"; dtv.len = 3;
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	dtk.data = "k0505"; dtk.len = 5;
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	dtk.data = "k"; dtk.len = 1;
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	dtk.data = "k010"; dtk.len = 4;
+	TEST_CHECK(tkvdb_del(tr, &dtk, 0) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root2, &gap_begin, &gap_end) == TKVDB_OK);
+
+	/* whole database */
+	res.n = 0;
+	TEST_CHECK(tkvdb_diff(db, 0, root1, &diff_cb, &res) == TKVDB_OK);
+	TEST_CHECK(res.n == 100);
+	for (i=0; i<res.n; i++) {
+		sprintf(key, "k%03u", (unsigned int)i);
+		TEST_CHECK(res.op[i] == TKVDB_DIFF_PUT);
+		TEST_CHECK(strcmp(res.key[i], key) == 0);
+	}
+
+	/* changes */
+	res.n = 0;
+	TEST_CHECK(tkvdb_diff(db, root1, root2, &diff_cb, &res) == TKVDB_OK);
+	TEST_CHECK(res.n == 4);
+	TEST_CHECK((res.op[0] == TKVDB_DIFF_PUT) && !strcmp(res.key[0], "k"));
+	TEST_CHECK((res.op[1] == TKVDB_DIFF_DEL) && !strcmp(res.key[1], "k010"));
+	TEST_CHECK((res.op[2] == TKVDB_DIFF_PUT) && !strcmp(res.key[2], "k050"));
+	TEST_CHECK((res.op[3] == TKVDB_DIFF_PUT) && !strcmp(res.key[3], "k0505"));
+
+	/* and back */
+	res.n = 0;
+	TEST_CHECK(tkvdb_diff(db, root2, root1, &diff_cb, &res) == TKVDB_OK);
+	TEST_CHECK(res.n == 4);
+	TEST_CHECK((res.op[0] == TKVDB_DIFF_DEL) && !strcmp(res.key[0], "k"));
+	TEST_CHECK((res.op[1] == TKVDB_DIFF_PUT) && !strcmp(res.key[1], "k010"));
+	TEST_CHECK((res.op[2] == TKVDB_DIFF_PUT) && !strcmp(res.key[2], "k050"));
+	TEST_CHECK((res.op[3] == TKVDB_DIFF_DEL) && !strcmp(res.key[3], "k0505"));
+
+	/* each key is a prefix of the next one, one trie level per key */
+	memset(deep, 'd', sizeof(deep));
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=1; i<=sizeof(deep); i++) {
+		dtk.data = deep;
+		dtk.len = i;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtk) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root3, &gap_begin, &gap_end) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	dtk.data = deep;
+	dtk.len = 10;
+	TEST_CHECK(tkvdb_del(tr, &dtk, 0) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root4, &gap_begin, &gap_end) == TKVDB_OK);
+
+	n = 0;
+	TEST_CHECK(tkvdb_diff(db, root2, root3, &diff_len_cb, &n) == TKVDB_OK);
+	TEST_CHECK(n == sizeof(deep));
+
+	res.n = 0;
+	TEST_CHECK(tkvdb_diff(db, root3, root4, &diff_cb, &res) == TKVDB_OK);
+	TEST_CHECK((res.n == 1) && (res.op[0] == TKVDB_DIFF_DEL)
+		&& (strlen(res.key[0]) == 10));
+
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+	unlink(fn);
+}
+
+
+static void
+check_same_tr(tkvdb_tr *tr1, tkvdb_tr *tr2)
+{
+	tkvdb_cursor *c1, *c2;
+	TKVDB_RES r1, r2;
+	size_t n = 0;
+
+	c1 = tkvdb_cursor_create(tr1);
+	c2 = tkvdb_cursor_create(tr2);
+
+	r1 = tkvdb_first(c1);
+	r2 = tkvdb_first(c2);
+	while ((r1 == TKVDB_OK) && (r2 == TKVDB_OK)) {
+		TEST_CHECK(tkvdb_cursor_keysize(c1) == tkvdb_cursor_keysize(c2));
+		TEST_CHECK(memcmp(tkvdb_cursor_key(c1), tkvdb_cursor_key(c2),
+			tkvdb_cursor_keysize(c1)) == 0);
+		TEST_CHECK(tkvdb_cursor_valsize(c1) == tkvdb_cursor_valsize(c2));
+		TEST_CHECK(memcmp(tkvdb_cursor_val(c1), tkvdb_cursor_val(c2),
+			tkvdb_cursor_valsize(c1)) == 0);
+		n++;
+		r1 = tkvdb_next(c1);
+		r2 = tkvdb_next(c2);
+	}
+	TEST_CHECK(r1 == r2);
+	TEST_CHECK(n > 0);
+
+	tkvdb_cursor_free(c1);
+	tkvdb_cursor_free(c2);
+}
+
+static void
+check_same_content(tkvdb *db1, tkvdb *db2)
+{
+	tkvdb_tr *tr1, *tr2;
+
+	tr1 = tkvdb_tr_create(db1);
+	tr2 = tkvdb_tr_create(db2);
+	TEST_CHECK(tkvdb_begin(tr1) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr2) == TKVDB_OK);
+	check_same_tr(tr1, tr2);
+	tkvdb_tr_free(tr1);
+	tkvdb_tr_free(tr2);
+}
+
+/* feed first size bytes of stream to follower through pipe */
+static TKVDB_RES
+repl_recv_pipe(tkvdb *follower, FILE *stream, long size)
+{
+	int fds[2];
+	pid_t pid;
+	TKVDB_RES r;
+
+	TEST_CHECK(pipe(fds) == 0);
+	pid = fork();
+	TEST_CHECK(pid >= 0);
+	if (pid == 0) {
+		char buf[4096];
+		size_t n;
+
+		close(fds[0]);
+		rewind(stream);
+		while (size > 0) {
+			n = fread(buf, 1, (size_t)size < sizeof(buf)
+				? (size_t)size : sizeof(buf), stream);
+			if ((n == 0) || (write(fds[1], buf, n) != (ssize_t)n)) {
+				break;
+			}
+			size -= n;
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+	r = tkvdb_repl_recv(follower, fds[0]);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	return r;
+}
+
+void
+test_repl(void)
+{
+	const char fn[] = "data_test_primary.tkv";
+	const char fn_follower[] = "data_test_follower.tkv";
+	const char fn_stream[] = "data_test_stream.bin";
+	tkvdb *db, *follower;
+	tkvdb_tr *tr;
+	FILE *stream;
+	struct stat st;
+	off_t follower_size;
+	uint64_t next_id, one = 1;
+	size_t i, j;
+
+	unlink(fn);
+	unlink(fn_follower);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	follower = tkvdb_open(fn_follower, NULL);
+	TEST_CHECK(follower != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	for (i=0; i<N/TR_SIZE; i++) {
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+
+		for (j=0; j<TR_SIZE; j++) {
+			tkvdb_datum key, val;
+
+			key.data = kvs_unsorted[i * TR_SIZE + j].key;
+			key.len  = kvs_unsorted[i * TR_SIZE + j].klen;
+			val.data = kvs_unsorted[i * TR_SIZE + j].val;
+			val.len  = kvs_unsorted[i * TR_SIZE + j].vlen;
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+		}
+
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+		if ((i % 50) == 0) {
+			/* ship transactions through stream file */
+			stream = tmpfile();
+			TEST_CHECK(stream != NULL);
+			TEST_CHECK(tkvdb_repl_next_id(follower, &next_id)
+				== TKVDB_OK);
+			TEST_CHECK(tkvdb_repl_send(db, &next_id,
+				fileno(stream)) == TKVDB_OK);
+			TEST_CHECK(next_id == (i + 1));
+			rewind(stream);
+			TEST_CHECK(tkvdb_repl_recv(follower, fileno(stream))
+				== TKVDB_OK);
+			fclose(stream);
+
+			check_same_content(db, follower);
+		}
+	}
+
+	/* stream breaks in the middle of last transaction,
+	 * which is larger than copy buffer */
+	for (i=0; i<3; i++) {
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		for (j=0; j<((i < 2) ? TR_SIZE : N); j++) {
+			tkvdb_datum key;
+
+			key.data = kvs_unsorted[j].key;
+			key.len  = kvs_unsorted[j].klen;
+			TEST_CHECK(tkvdb_put(tr, &key, &key) == TKVDB_OK);
+		}
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	}
+	stream = tmpfile();
+	TEST_CHECK(stream != NULL);
+	TEST_CHECK(tkvdb_repl_next_id(follower, &next_id) == TKVDB_OK);
+	TEST_CHECK(tkvdb_repl_send(db, &next_id, fileno(stream)) == TKVDB_OK);
+	/* size of pipe is unknown, partial transaction is cut off */
+	TEST_CHECK(repl_recv_pipe(follower, stream, ftell(stream) - 10)
+		== TKVDB_IO_ERROR);
+	fclose(stream);
+
+	/* truncated file is rejected before anything is written */
+	stream = tmpfile();
+	TEST_CHECK(stream != NULL);
+	TEST_CHECK(tkvdb_repl_next_id(follower, &next_id) == TKVDB_OK);
+	TEST_CHECK(tkvdb_repl_send(db, &next_id, fileno(stream)) == TKVDB_OK);
+	TEST_CHECK(ftruncate(fileno(stream), ftell(stream) - 10) == 0);
+	TEST_CHECK(stat(fn_follower, &st) == 0);
+	follower_size = st.st_size;
+	rewind(stream);
+	TEST_CHECK(tkvdb_repl_recv(follower, fileno(stream))
+		== TKVDB_CORRUPTED);
+	TEST_CHECK(stat(fn_follower, &st) == 0);
+	TEST_CHECK(st.st_size == follower_size);
+
+	/* tail shorter than footer */
+	TEST_CHECK(pwrite(fileno(stream), &one, sizeof(one), 40)
+		== sizeof(one));
+	rewind(stream);
+	TEST_CHECK(tkvdb_repl_recv(follower, fileno(stream))
+		== TKVDB_CORRUPTED);
+	fclose(stream);
+
+	/* follower ends with complete transaction and recv is resumed */
+	stream = tmpfile();
+	TEST_CHECK(stream != NULL);
+	TEST_CHECK(tkvdb_repl_next_id(follower, &next_id) == TKVDB_OK);
+	TEST_CHECK(tkvdb_repl_send(db, &next_id, fileno(stream)) == TKVDB_OK);
+	rewind(stream);
+	TEST_CHECK(tkvdb_repl_recv(follower, fileno(stream)) == TKVDB_OK);
+	fclose(stream);
+	check_same_content(db, follower);
+
+	/* replaying the same stream again must fail */
+	stream = fopen(fn_stream, "w+");
+	TEST_CHECK(stream != NULL);
+	next_id = 0;
+	TEST_CHECK(tkvdb_repl_send(db, &next_id, fileno(stream)) == TKVDB_OK);
+	rewind(stream);
+	TEST_CHECK(tkvdb_repl_recv(follower, fileno(stream)) == TKVDB_MODIFIED);
+	fclose(stream);
+	unlink(fn_stream);
+
+	tkvdb_tr_free(tr);
+	tkvdb_close(follower);
+	tkvdb_close(db);
+	unlink(fn);
+	unlink(fn_follower);
+}
+
+
+void
+test_history(void)
+{
+	const char fn[] = "data_test_hist.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr, *snap, *vac, *tres;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	uint64_t root_off, gap_begin, gap_end;
+	char val[20];
+	size_t i;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	/* transaction i puts "key" => i and "key-i" => i */
+	for (i=0; i<10; i++) {
+		char key[20];
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		sprintf(val, "%u", (unsigned int)i);
+		dtv.data = val;
+		dtv.len = strlen(val);
+		dtk.data = "key";
+		dtk.len = 3;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+		sprintf(key, "key-%u", (unsigned int)i);
+		dtk.data = key;
+		dtk.len = strlen(key);
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+		if (i == 0) {
+			/* live key moved by vacuum */
+			dtk.data = "a";
+			dtk.len = 1;
+			TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	}
+
+	for (i=0; i<10; i++) {
+		snap = tkvdb_tr_create_at(db, i);
+		TEST_CHECK(snap != NULL);
+		TEST_CHECK(tkvdb_begin(snap) == TKVDB_OK);
+
+		sprintf(val, "%u", (unsigned int)i);
+		dtk.data = "key";
+		dtk.len = 3;
+		TEST_CHECK(tkvdb_get(snap, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK((dtv.len == strlen(val))
+			&& (memcmp(dtv.data, val, dtv.len) == 0));
+
+		/* key from next transaction */
+		sprintf(val, "key-%u", (unsigned int)i + 1);
+		dtk.data = val;
+		dtk.len = strlen(val);
+		TEST_CHECK(tkvdb_get(snap, &dtk, &dtv) == TKVDB_NOT_FOUND);
+
+		TEST_CHECK(tkvdb_put(snap, &dtk, &dtk) == TKVDB_READONLY);
+		TEST_CHECK(tkvdb_rollback(snap) == TKVDB_OK);
+		tkvdb_tr_free(snap);
+	}
+
+	TEST_CHECK(tkvdb_tr_create_at(db, 10) == NULL);
+
+	/* nodes of old transactions are reclaimed by vacuum */
+	vac = tkvdb_tr_create(db);
+	tres = tkvdb_tr_create(db);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK((vac != NULL) && (tres != NULL) && (c != NULL));
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_vacuum(tr, vac, tres, c) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root_off, &gap_begin, &gap_end)
+		== TKVDB_OK);
+	TEST_CHECK(gap_end > 0);
+	tkvdb_cursor_free(c);
+	tkvdb_tr_free(tres);
+	tkvdb_tr_free(vac);
+
+	for (i=0; i<10; i++) {
+		TEST_CHECK(tkvdb_tr_create_at(db, i) == NULL);
+	}
+	/* transaction of vacuum */
+	snap = tkvdb_tr_create_at(db, 10);
+	TEST_CHECK(snap != NULL);
+	TEST_CHECK(tkvdb_begin(snap) == TKVDB_OK);
+	dtk.data = "a";
+	dtk.len = 1;
+	TEST_CHECK(tkvdb_get(snap, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(snap) == TKVDB_OK);
+	tkvdb_tr_free(snap);
+
+	/* transactions after vacuum are readable */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	dtk.data = "key";
+	dtk.len = 3;
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtk) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	snap = tkvdb_tr_create_at(db, 11);
+	TEST_CHECK(snap != NULL);
+	TEST_CHECK(tkvdb_begin(snap) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get(snap, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK((dtv.len == 3) && (memcmp(dtv.data, "key", 3) == 0));
+	dtk.data = "key-0";
+	dtk.len = 5;
+	TEST_CHECK(tkvdb_get(snap, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(snap) == TKVDB_OK);
+	tkvdb_tr_free(snap);
+
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+	unlink(fn);
+}
+
+
+void
+test_backup(void)
+{
+	const char fn[] = "data_test.tkv";
+	const char fn_backup[] = "data_test_backup.tkv";
+	tkvdb *db, *backup;
+	tkvdb_tr *tr;
+	tkvdb_datum dtk, dtv;
+	char bigval[10000];
+	FILE *f;
+	int fds[2];
+
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+
+	/* node bigger than read block */
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	memset(bigval, 'x', sizeof(bigval));
+	dtk.data = "big value";
+	dtk.len = 9;
+	dtv.data = bigval;
+	dtv.len = sizeof(bigval);
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	f = fopen(fn_backup, "w");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(tkvdb_backup(db, fileno(f)) == TKVDB_OK);
+	fclose(f);
+
+	/* pwrite() doesn't work on pipe */
+	TEST_CHECK(pipe(fds) == 0);
+	TEST_CHECK(tkvdb_backup(db, fds[1]) == TKVDB_IO_ERROR);
+	close(fds[0]);
+	close(fds[1]);
+
+	backup = tkvdb_open(fn_backup, NULL);
+	TEST_CHECK(backup != NULL);
+	check_same_content(db, backup);
+
+	/* backup has only live data */
+	tkvdb_tr_free(tr);
+	tr = tkvdb_tr_create(backup);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK((dtv.len == sizeof(bigval))
+		&& (memcmp(dtv.data, bigval, dtv.len) == 0));
+	TEST_CHECK(tkvdb_del(tr, &dtk, 0) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_del(tr, &dtk, 0) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	check_same_content(db, backup);
+
+	tkvdb_close(backup);
+	tkvdb_close(db);
+	unlink(fn_backup);
+}
+
+
+void
+test_compact(void)
+{
+	const char fn[] = "data_test_compact.tkv";
+	const char fn_new[] = "data_test_compact.tkv.new";
+	const char fn_ref[] = "data_test_compact_ref.tkv";
+	tkvdb *db, *db2, *ref;
+	tkvdb_tr *tr, *tr_old, *tr2;
+	tkvdb_datum key, val;
+	tkvdb_compact_params params;
+	struct stat st_before, st_after;
+	FILE *f;
+	size_t i, j;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	/* overwrite the same keys many times */
+	for (i=0; i<50; i++) {
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		for (j=0; j<N/10; j++) {
+			key.data = kvs[j].key;
+			key.len  = kvs[j].klen;
+			val.data = kvs[(i + j) % N].val;
+			val.len  = kvs[(i + j) % N].vlen;
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+		}
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	}
+	tkvdb_tr_free(tr);
+
+	f = fopen(fn_ref, "w");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(tkvdb_backup(db, fileno(f)) == TKVDB_OK);
+	fclose(f);
+
+	/* transaction begun before compaction and other handle of file */
+	tr_old = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr_old) == TKVDB_OK);
+	db2 = tkvdb_open(fn, NULL);
+	TEST_CHECK(db2 != NULL);
+	tr2 = tkvdb_tr_create(db2);
+	TEST_CHECK(tkvdb_begin(tr2) == TKVDB_OK);
+
+	TEST_CHECK(stat(fn, &st_before) == 0);
+	tkvdb_compact_params_init(&params);
+	TEST_CHECK(tkvdb_compact_to(db, fn_new, &params) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st_after) == 0);
+	TEST_CHECK(st_after.st_size * 10 < st_before.st_size);
+	TEST_CHECK(access(fn_new, F_OK) != 0);
+
+	/* offsets of old file are not read from new one */
+	key.data = kvs[0].key;
+	key.len  = kvs[0].klen;
+	TEST_CHECK(tkvdb_get(tr_old, &key, &val) == TKVDB_MODIFIED);
+	TEST_CHECK(tkvdb_put(tr_old, &key, &key) == TKVDB_MODIFIED);
+	TEST_CHECK(tkvdb_rollback(tr_old) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr_old) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get(tr_old, &key, &val) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr_old) == TKVDB_OK);
+	tkvdb_tr_free(tr_old);
+
+	/* other handle doesn't commit into replaced file */
+	TEST_CHECK(tkvdb_put(tr2, &key, &key) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr2) == TKVDB_MODIFIED);
+	TEST_CHECK(tkvdb_rollback(tr2) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr2) == TKVDB_MODIFIED);
+	tkvdb_tr_free(tr2);
+	tkvdb_close(db2);
+
+	ref = tkvdb_open(fn_ref, NULL);
+	TEST_CHECK(ref != NULL);
+	check_same_content(db, ref);
+
+	/* database is still usable after compaction */
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (j=0; j<N/10; j++) {
+		key.data = kvs[j].key;
+		key.len  = kvs[j].klen;
+		TEST_CHECK(tkvdb_del(tr, &key, 0) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (j=0; j<N/10; j++) {
+		key.data = kvs[j].key;
+		key.len  = kvs[j].klen;
+		TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_NOT_FOUND);
+	}
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_close(ref);
+	tkvdb_close(db);
+	unlink(fn);
+	unlink(fn_ref);
+}
+
+
+void
+test_spill(void)
+{
+	const char fn[] = "data_test_spill.tkv";
+	const char fn_follower[] = "data_test_spill_follower.tkv";
+	tkvdb *db, *db2, *follower;
+	tkvdb_params *params;
+	tkvdb_tr *tr, *tr2;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	struct stat st;
+	off_t size;
+	uint64_t next_id;
+	FILE *stream;
+	size_t i;
+
+	unlink(fn);
+	unlink(fn_follower);
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_SPILL, 64 * 1024);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tkvdb_params_free(params);
+
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	/* nodes are written to file before commit */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len  = kvs_unsorted[i].klen;
+		dtv.data = kvs_unsorted[i].val;
+		dtv.len  = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(stat(fn, &st) == 0);
+	TEST_CHECK(st.st_size > 0);
+
+	/* spilled nodes are not visible to others */
+	db2 = tkvdb_open(fn, NULL);
+	TEST_CHECK(db2 != NULL);
+	tr2 = tkvdb_tr_create(db2);
+	TEST_CHECK(tkvdb_begin(tr2) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get(tr2, &dtk, &dtv) == TKVDB_EMPTY);
+	TEST_CHECK(tkvdb_rollback(tr2) == TKVDB_OK);
+
+	/* rollback truncates file */
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st) == 0);
+	TEST_CHECK(st.st_size == 0);
+
+	/* two spilled transactions */
+	for (i=0; i<N; i++) {
+		if ((i % (N / 2)) == 0) {
+			if (i > 0) {
+				TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+			}
+			TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		}
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len  = kvs_unsorted[i].klen;
+		dtv.data = kvs_unsorted[i].val;
+		dtv.len  = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	TEST_CHECK(tkvdb_first(c) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		TEST_CHECK(tkvdb_cursor_keysize(c) == kvs[i].klen);
+		TEST_CHECK(memcmp(tkvdb_cursor_key(c), kvs[i].key,
+			kvs[i].klen) == 0);
+		TEST_CHECK(tkvdb_cursor_valsize(c) == kvs[i].vlen);
+		TEST_CHECK(memcmp(tkvdb_cursor_val(c), kvs[i].val,
+			kvs[i].vlen) == 0);
+		tkvdb_next(c);
+	}
+	tkvdb_cursor_free(c);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* no spill while cursor is open, puts during iteration are safe */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st) == 0);
+	size = st.st_size;
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	TEST_CHECK(tkvdb_first(c) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		TEST_CHECK(tkvdb_cursor_keysize(c) == kvs[i].klen);
+		TEST_CHECK(memcmp(tkvdb_cursor_key(c), kvs[i].key,
+			kvs[i].klen) == 0);
+		dtk.data = kvs[i].key;
+		dtk.len  = kvs[i].klen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtk) == TKVDB_OK);
+		tkvdb_next(c);
+	}
+	TEST_CHECK(stat(fn, &st) == 0);
+	TEST_CHECK(st.st_size == size);
+	tkvdb_cursor_free(c);
+	/* and spill happens on next put after cursor is freed */
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtk) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st) == 0);
+	TEST_CHECK(st.st_size > size);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* uncommitted spill at the end of file */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len  = kvs_unsorted[i].klen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtk) == TKVDB_OK);
+	}
+
+	TEST_CHECK(tkvdb_begin(tr2) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get(tr2, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK((dtv.len == kvs_unsorted[N - 1].vlen)
+		&& (memcmp(dtv.data, kvs_unsorted[N - 1].val, dtv.len) == 0));
+	TEST_CHECK(tkvdb_rollback(tr2) == TKVDB_OK);
+
+	/* spilled blocks are skipped by replication */
+	follower = tkvdb_open(fn_follower, NULL);
+	TEST_CHECK(follower != NULL);
+	stream = tmpfile();
+	TEST_CHECK(stream != NULL);
+	next_id = 0;
+	TEST_CHECK(tkvdb_repl_send(db, &next_id, fileno(stream)) == TKVDB_OK);
+	TEST_CHECK(next_id == 2);
+	rewind(stream);
+	TEST_CHECK(tkvdb_repl_recv(follower, fileno(stream)) == TKVDB_OK);
+	fclose(stream);
+	check_same_content(db2, follower);
+
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	tkvdb_tr_free(tr2);
+	tkvdb_tr_free(tr);
+	tkvdb_close(follower);
+	tkvdb_close(db2);
+	tkvdb_close(db);
+	unlink(fn);
+	unlink(fn_follower);
+}
+
+
+static void
+savepoint_check(tkvdb_tr *tr, size_t from, size_t to, int alt_val)
+{
+	size_t i;
+
+	for (i=from; i<to; i++) {
+		tkvdb_datum key, val;
+		struct kv *kv = &kvs_unsorted[i];
+
+		key.data = kv->key;
+		key.len  = kv->klen;
+		TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+		if (alt_val) {
+			TEST_CHECK((val.len == kv->klen)
+				&& (memcmp(val.data, kv->key, val.len) == 0));
+		} else {
+			TEST_CHECK((val.len == kv->vlen)
+				&& (memcmp(val.data, kv->val, val.len) == 0));
+		}
+	}
+}
+
+static void
+savepoint_apply(tkvdb_tr *tr, size_t from, size_t to, int op)
+{
+	size_t i;
+
+	for (i=from; i<to; i++) {
+		tkvdb_datum key, val;
+		struct kv *kv = &kvs_unsorted[i];
+
+		key.data = kv->key;
+		key.len  = kv->klen;
+		if (op == 0) {
+			val.data = kv->val;
+			val.len  = kv->vlen;
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+		} else if (op == 1) {
+			/* value is the key */
+			TEST_CHECK(tkvdb_put(tr, &key, &key) == TKVDB_OK);
+		} else {
+			TEST_CHECK(tkvdb_del(tr, &key, 0) == TKVDB_OK);
+		}
+	}
+}
+
+void
+test_savepoint(void)
+{
+	const char fn[] = "data_test_savepoint.tkv";
+	int prealloc;
+
+	for (prealloc=0; prealloc<2; prealloc++) {
+		tkvdb *db;
+		tkvdb_tr *tr;
+		tkvdb_cursor *c;
+		tkvdb_datum key, val;
+		size_t sp0, sp1, i;
+
+		unlink(fn);
+		db = tkvdb_open(fn, NULL);
+		TEST_CHECK(db != NULL);
+		if (prealloc) {
+			tr = tkvdb_tr_create_m(db, 256 * 1024 * 1024, 0);
+		} else {
+			tr = tkvdb_tr_create(db);
+		}
+		TEST_CHECK(tr != NULL);
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		savepoint_apply(tr, 0, N / 2, 0);
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		savepoint_apply(tr, N / 2, N * 3 / 4, 0);
+
+		TEST_CHECK(tkvdb_savepoint(tr, &sp0) == TKVDB_OK);
+		savepoint_apply(tr, N * 3 / 4, N, 0);
+		savepoint_apply(tr, 0, N / 4, 2);
+		savepoint_apply(tr, N / 4, N / 2, 1);
+
+		TEST_CHECK(tkvdb_savepoint(tr, &sp1) == TKVDB_OK);
+		TEST_CHECK(sp1 == sp0 + 1);
+		savepoint_apply(tr, N / 2, N, 2);
+		savepoint_apply(tr, N / 4, N / 2, 0);
+
+		/* changes after inner savepoint are undone */
+		TEST_CHECK(tkvdb_rollback_to(tr, sp1) == TKVDB_OK);
+		savepoint_check(tr, N / 4, N / 2, 1);
+		savepoint_check(tr, N / 2, N, 0);
+
+		/* inner savepoint is gone after rollback to outer one */
+		TEST_CHECK(tkvdb_rollback_to(tr, sp0) == TKVDB_OK);
+		TEST_CHECK(tkvdb_rollback_to(tr, sp1) == TKVDB_NOT_FOUND);
+		savepoint_check(tr, 0, N * 3 / 4, 0);
+		for (i=N*3/4; i<N; i++) {
+			key.data = kvs_unsorted[i].key;
+			key.len  = kvs_unsorted[i].klen;
+			TEST_CHECK(tkvdb_get(tr, &key, &val)
+				== TKVDB_NOT_FOUND);
+		}
+
+		/* outer savepoint is still active */
+		savepoint_apply(tr, 0, N * 3 / 4, 2);
+		TEST_CHECK(tkvdb_rollback_to(tr, sp0) == TKVDB_OK);
+		savepoint_apply(tr, N * 3 / 4, N, 0);
+		TEST_CHECK(tkvdb_savepoint_release(tr, sp0) == TKVDB_OK);
+		TEST_CHECK(tkvdb_rollback_to(tr, sp0) == TKVDB_NOT_FOUND);
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		c = tkvdb_cursor_create(tr);
+		TEST_CHECK(c != NULL);
+		TEST_CHECK(tkvdb_first(c) == TKVDB_OK);
+		for (i=0; i<N; i++) {
+			TEST_CHECK(tkvdb_cursor_keysize(c) == kvs[i].klen);
+			TEST_CHECK(memcmp(tkvdb_cursor_key(c), kvs[i].key,
+				kvs[i].klen) == 0);
+			TEST_CHECK(tkvdb_cursor_valsize(c) == kvs[i].vlen);
+			tkvdb_next(c);
+		}
+		tkvdb_cursor_free(c);
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+		/* nodes read from disk after savepoint */
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		TEST_CHECK(tkvdb_savepoint(tr, &sp0) == TKVDB_OK);
+		savepoint_check(tr, 0, N, 0);
+		TEST_CHECK(tkvdb_rollback_to(tr, sp0) == TKVDB_OK);
+		savepoint_check(tr, 0, N, 0);
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+		tkvdb_tr_free(tr);
+		tkvdb_close(db);
+
+		/* first put after savepoint creates root */
+		if (prealloc) {
+			tr = tkvdb_tr_create_m(NULL, 256 * 1024 * 1024, 0);
+		} else {
+			tr = tkvdb_tr_create(NULL);
+		}
+		TEST_CHECK(tr != NULL);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		TEST_CHECK(tkvdb_savepoint(tr, &sp0) == TKVDB_OK);
+		savepoint_apply(tr, 0, N, 0);
+		savepoint_check(tr, 0, N, 0);
+		TEST_CHECK(tkvdb_rollback_to(tr, sp0) == TKVDB_OK);
+		key.data = kvs_unsorted[0].key;
+		key.len  = kvs_unsorted[0].klen;
+		TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_EMPTY);
+		savepoint_apply(tr, 0, N, 1);
+		savepoint_check(tr, 0, N, 1);
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+		tkvdb_tr_free(tr);
+	}
+	unlink(fn);
+}
+
+
+static void
+merge_put(tkvdb_tr *tr, const char *k, const char *v)
+{
+	tkvdb_datum key, val;
+
+	key.data = (void *)k;
+	key.len = strlen(k);
+	val.data = (void *)v;
+	val.len = strlen(v);
+	TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+}
+
+void
+test_merge(void)
+{
+	const char fn[] = "data_test_merge.tkv";
+	const char fn_other[] = "data_test_merge_other.tkv";
+	/* keys splitting nodes in different places */
+	const char *dst_keys[] = {"abcdef", "abx", "q", "qrst", NULL};
+	const char *src_keys[] = {"ab", "abcdeg", "abcdef", "abcdefgh",
+		"qr", "z", NULL};
+	tkvdb *db, *other;
+	tkvdb_tr *dst, *src1, *src2, *ref;
+	size_t i;
+
+	unlink(fn);
+	unlink(fn_other);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	dst = tkvdb_tr_create(db);
+	TEST_CHECK(dst != NULL);
+	src1 = tkvdb_tr_create(NULL);
+	src2 = tkvdb_tr_create(NULL);
+	ref = tkvdb_tr_create(NULL);
+
+	TEST_CHECK(tkvdb_begin(dst) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(src1) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(src2) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(ref) == TKVDB_OK);
+
+	for (i=0; i<N/2; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs_unsorted[i].key;
+		key.len  = kvs_unsorted[i].klen;
+		val.data = kvs_unsorted[i].val;
+		val.len  = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(dst, &key, &val) == TKVDB_OK);
+		TEST_CHECK(tkvdb_put(ref, &key, &val) == TKVDB_OK);
+	}
+	for (i=0; dst_keys[i]; i++) {
+		merge_put(dst, dst_keys[i], "dst");
+		merge_put(ref, dst_keys[i], "dst");
+	}
+	TEST_CHECK(tkvdb_commit(dst) == TKVDB_OK);
+
+	/* overlapping batches, values of later batch win */
+	for (i=N/4; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs_unsorted[i].key;
+		key.len  = kvs_unsorted[i].klen;
+		if (i < N * 3 / 4) {
+			TEST_CHECK(tkvdb_put(src1, &key, &key) == TKVDB_OK);
+		}
+		val.data = kvs_unsorted[i].val;
+		val.len  = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(src2, &key, &val) == TKVDB_OK);
+	}
+	for (i=N/4; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs_unsorted[i].key;
+		key.len  = kvs_unsorted[i].klen;
+		val.data = kvs_unsorted[i].val;
+		val.len  = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(ref, &key, &val) == TKVDB_OK);
+	}
+	for (i=0; src_keys[i]; i++) {
+		merge_put(src1, src_keys[i], "src");
+		merge_put(ref, src_keys[i], "src");
+	}
+
+	TEST_CHECK(tkvdb_begin(dst) == TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_merge(dst, src1) == TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_merge(dst, src2) == TKVDB_OK);
+	check_same_tr(dst, ref);
+	TEST_CHECK(tkvdb_commit(dst) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(dst) == TKVDB_OK);
+	check_same_tr(dst, ref);
+
+	/* merging transaction of other database puts pairs one by one */
+	other = tkvdb_open(fn_other, NULL);
+	TEST_CHECK(other != NULL);
+	tkvdb_tr_free(src1);
+	src1 = tkvdb_tr_create(other);
+	TEST_CHECK(tkvdb_begin(src1) == TKVDB_OK);
+	merge_put(src1, "abc", "other");
+	merge_put(ref, "abc", "other");
+	TEST_CHECK(tkvdb_commit(src1) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(src1) == TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_merge(dst, src1) == TKVDB_OK);
+	check_same_tr(dst, ref);
+	TEST_CHECK(tkvdb_rollback(dst) == TKVDB_OK);
+
+	tkvdb_tr_free(src1);
+	tkvdb_tr_free(src2);
+	tkvdb_tr_free(ref);
+	tkvdb_tr_free(dst);
+	tkvdb_close(other);
+	tkvdb_close(db);
+	unlink(fn);
+	unlink(fn_other);
+}
+
+
+/* check that keys "<pfx><i>" for i in [from, to) have values "<i>" */
+static void
+prefix_check(tkvdb_tr *tr, const char *pfx, size_t from, size_t to,
+	TKVDB_RES expected)
+{
+	size_t i;
+
+	for (i=from; i<to; i++) {
+		char k[64], v[32];
+		tkvdb_datum key, val;
+
+		sprintf(k, "%s%u", pfx, (unsigned int)i);
+		sprintf(v, "%u", (unsigned int)i);
+		key.data = k;
+		key.len = strlen(k);
+		TEST_CHECK(tkvdb_get(tr, &key, &val) == expected);
+		if (expected == TKVDB_OK) {
+			TEST_CHECK((val.len == strlen(v))
+				&& (memcmp(val.data, v, val.len) == 0));
+		}
+	}
+}
+
+void
+test_prefix_move(void)
+{
+	const char fn[] = "data_test_prefix.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_datum from, to;
+	size_t i, sp;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	/* committed and in-memory parts of subtrees */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		char k[64], v[32];
+
+		sprintf(k, "%s%u", (i < N / 2) ? "tenant-a/" : "tenant-b/",
+			(unsigned int)i);
+		sprintf(v, "%u", (unsigned int)i);
+		merge_put(tr, k, v);
+		if (i == N / 4) {
+			TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+			TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		}
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=N; i<N+10; i++) {
+		char k[64], v[32];
+
+		sprintf(k, "tenant-a/%u", (unsigned int)i);
+		sprintf(v, "%u", (unsigned int)i);
+		merge_put(tr, k, v);
+	}
+
+	from.data = "tenant-a/";
+	from.len = strlen(from.data);
+	to.data = "tenant-a/x";
+	to.len = strlen(to.data);
+	TEST_CHECK(tkvdb_move_prefix(tr, &from, &to) == TKVDB_INVALID);
+
+	/* copy, source is kept */
+	to.data = "tenant-c/";
+	to.len = strlen(to.data);
+	TEST_CHECK(tkvdb_copy_prefix(tr, &from, &to) == TKVDB_OK);
+	prefix_check(tr, "tenant-a/", 0, N / 2, TKVDB_OK);
+	prefix_check(tr, "tenant-c/", 0, N / 2, TKVDB_OK);
+	prefix_check(tr, "tenant-c/", N, N + 10, TKVDB_OK);
+	prefix_check(tr, "tenant-c/", N / 2, N, TKVDB_NOT_FOUND);
+
+	/* undone move */
+	TEST_CHECK(tkvdb_savepoint(tr, &sp) == TKVDB_OK);
+	to.data = "x";
+	to.len = 1;
+	TEST_CHECK(tkvdb_move_prefix(tr, &from, &to) == TKVDB_OK);
+	prefix_check(tr, "tenant-a/", 0, N / 2, TKVDB_NOT_FOUND);
+	prefix_check(tr, "x", 0, N / 2, TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback_to(tr, sp) == TKVDB_OK);
+	TEST_CHECK(tkvdb_savepoint_release(tr, sp) == TKVDB_OK);
+	prefix_check(tr, "x", 0, N / 2, TKVDB_NOT_FOUND);
+	prefix_check(tr, "tenant-a/", 0, N / 2, TKVDB_OK);
+
+	/* move, keys under new prefix are merged */
+	to.data = "tenant-b/";
+	to.len = strlen(to.data);
+	TEST_CHECK(tkvdb_move_prefix(tr, &from, &to) == TKVDB_OK);
+	prefix_check(tr, "tenant-a/", 0, N + 10, TKVDB_NOT_FOUND);
+	prefix_check(tr, "tenant-b/", 0, N + 10, TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(tr, "tenant-a/", 0, N + 10, TKVDB_NOT_FOUND);
+	prefix_check(tr, "tenant-b/", 0, N + 10, TKVDB_OK);
+	prefix_check(tr, "tenant-c/", 0, N / 2, TKVDB_OK);
+
+	/* prefix ending inside of node */
+	from.data = "tenant-";
+	from.len = strlen(from.data);
+	to.data = "old/";
+	to.len = strlen(to.data);
+	TEST_CHECK(tkvdb_move_prefix(tr, &from, &to) == TKVDB_OK);
+	prefix_check(tr, "old/b/", 0, N + 10, TKVDB_OK);
+	prefix_check(tr, "old/c/", 0, N / 2, TKVDB_OK);
+	prefix_check(tr, "tenant-b/", 0, N, TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_move_prefix(tr, &from, &to) == TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(tr, "old/b/", 0, N + 10, TKVDB_OK);
+	prefix_check(tr, "old/c/", 0, N / 2, TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+	unlink(fn);
+}
+
+
+void
+test_keyspaces(void)
+{
+	const char fn[] = "data_test_keyspaces.tkv";
+	const char fn_new[] = "data_test_keyspaces.tkv.new";
+	tkvdb *db;
+	tkvdb_tr *tr, *users, *orders, *vac, *tres;
+	tkvdb_cursor *c;
+	tkvdb_compact_params params;
+	uint64_t root_off, gap_begin, gap_end;
+	size_t i, n;
+	TKVDB_RES r;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+	users = tkvdb_tr_keyspace(tr, "users");
+	orders = tkvdb_tr_keyspace(tr, "orders");
+	TEST_CHECK((users != NULL) && (orders != NULL) && (users != orders));
+	TEST_CHECK(tkvdb_tr_keyspace(tr, "users") == users);
+	TEST_CHECK(tkvdb_tr_keyspace(orders, "users") == users);
+
+	/* the same keys in different keyspaces, committed atomically */
+	TEST_CHECK(tkvdb_begin(users) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		char k[64], v[32];
+
+		sprintf(k, "k%u", (unsigned int)i);
+		sprintf(v, "%u", (unsigned int)i);
+		merge_put((i < N / 2) ? users : orders, k, v);
+	}
+	TEST_CHECK(tkvdb_commit(orders) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(users, "k", 0, N / 2, TKVDB_OK);
+	prefix_check(users, "k", N / 2, N, TKVDB_NOT_FOUND);
+	prefix_check(orders, "k", N / 2, N, TKVDB_OK);
+	prefix_check(orders, "k", 0, N / 2, TKVDB_NOT_FOUND);
+	prefix_check(tr, "k", 0, N, TKVDB_NOT_FOUND);
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(tkvdb_first(c) == TKVDB_EMPTY);
+	tkvdb_cursor_free(c);
+
+	/* changes in keyspaces are rolled back together */
+	merge_put(tr, "k0", "0");
+	merge_put(users, "k", "x");
+	TEST_CHECK(tkvdb_rollback(users) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(tr, "k", 0, 1, TKVDB_NOT_FOUND);
+	prefix_check(users, "", 0, 1, TKVDB_NOT_FOUND);
+
+	/* keyspaces are kept when only default root is changed */
+	merge_put(tr, "k0", "0");
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	/* reopen */
+	tkvdb_close(db);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	users = tkvdb_tr_keyspace(tr, "users");
+	orders = tkvdb_tr_keyspace(tr, "orders");
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(tr, "k", 0, 1, TKVDB_OK);
+	prefix_check(users, "k", 0, N / 2, TKVDB_OK);
+	prefix_check(orders, "k", N / 2, N, TKVDB_OK);
+	prefix_check(tkvdb_tr_keyspace(tr, "unknown"), "k", 0, N,
+		TKVDB_EMPTY);
+
+	/* scan of one keyspace */
+	c = tkvdb_cursor_create(users);
+	n = 0;
+	for (r = tkvdb_first(c); r == TKVDB_OK; r = tkvdb_next(c)) {
+		n++;
+	}
+	TEST_CHECK(n == N / 2);
+	tkvdb_cursor_free(c);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	/* vacuum moves live keys of keyspaces out of oldest transaction */
+	tr = tkvdb_tr_create(db);
+	vac = tkvdb_tr_create(db);
+	tres = tkvdb_tr_create(db);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_vacuum(tr, vac, tres, c) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root_off, &gap_begin, &gap_end)
+		== TKVDB_OK);
+	TEST_CHECK(gap_end > 0);
+	tkvdb_cursor_free(c);
+	tkvdb_tr_free(tres);
+	tkvdb_tr_free(vac);
+	tkvdb_tr_free(tr);
+
+	/* next commit may reuse the gap */
+	tr = tkvdb_tr_create(db);
+	users = tkvdb_tr_keyspace(tr, "users");
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	merge_put(users, "new0", "0");
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_close(db);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	users = tkvdb_tr_keyspace(tr, "users");
+	orders = tkvdb_tr_keyspace(tr, "orders");
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(tr, "k", 0, 1, TKVDB_OK);
+	prefix_check(users, "k", 0, N / 2, TKVDB_OK);
+	prefix_check(users, "new", 0, 1, TKVDB_OK);
+	prefix_check(orders, "k", N / 2, N, TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_compact_params_init(&params);
+	params.page_size = 4096;
+	TEST_CHECK(tkvdb_compact_to(db, fn_new, &params) == TKVDB_OK);
+
+	tr = tkvdb_tr_create(db);
+	users = tkvdb_tr_keyspace(tr, "users");
+	orders = tkvdb_tr_keyspace(tr, "orders");
+	TEST_CHECK(tkvdb_begin(orders) == TKVDB_OK);
+	prefix_check(tr, "k", 0, 1, TKVDB_OK);
+	prefix_check(users, "k", 0, N / 2, TKVDB_OK);
+	prefix_check(orders, "k", N / 2, N, TKVDB_OK);
+	prefix_check(orders, "k", 0, N / 2, TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_close(db);
+	unlink(fn);
+}
+
+
+/* allocator counting blocks and bytes */
+struct count_alloc
+{
+	size_t blocks, bytes, max_bytes;
+	int bad_size;
+};
+
+static void *
+count_alloc_alloc(void *ctx, size_t size)
+{
+	struct count_alloc *ca = ctx;
+	size_t *p;
+
+	p = malloc(sizeof(size_t) * 2 + size);
+	if (!p) {
+		return NULL;
+	}
+	p[0] = size;
+	ca->blocks++;
+	ca->bytes += size;
+	if (ca->bytes > ca->max_bytes) {
+		ca->max_bytes = ca->bytes;
+	}
+	return p + 2;
+}
+
+static void
+count_alloc_free(void *ctx, void *ptr, size_t size)
+{
+	struct count_alloc *ca = ctx;
+	size_t *p = (size_t *)ptr - 2;
+
+	if (p[0] != size) {
+		ca->bad_size = 1;
+	}
+	ca->blocks--;
+	ca->bytes -= size;
+	free(p);
+}
+
+/* bump allocator, memory is released only by reset */
+struct arena
+{
+	uint8_t buf[4 * 1024 * 1024];
+	size_t used;
+	size_t resets;
+};
+
+static void *
+arena_alloc(void *ctx, size_t size)
+{
+	struct arena *a = ctx;
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+	if ((a->used + size) > sizeof(a->buf)) {
+		return NULL;
+	}
+	p = a->buf + a->used;
+	a->used += size;
+	return p;
+}
+
+static void
+arena_free(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	(void)ptr;
+	(void)size;
+}
+
+static void
+arena_reset(void *ctx)
+{
+	struct arena *a = ctx;
+
+	a->used = 0;
+	a->resets++;
+}
+
+void
+test_allocator(void)
+{
+	const char fn[] = "data_test_allocator.tkv";
+	struct count_alloc ca = {0, 0, 0, 0};
+	tkvdb_allocator alloc = {count_alloc_alloc, count_alloc_free,
+		NULL, &ca};
+	static struct arena ar;
+	tkvdb_allocator arena = {arena_alloc, arena_free, arena_reset, &ar};
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	tkvdb_datum key, val;
+	size_t i, sp;
+	TKVDB_RES r;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set_allocator(params, &alloc);
+
+	/* in-memory transaction, every block is returned with its size */
+	tr = tkvdb_tr_create_p(NULL, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		char k[64], v[32];
+
+		sprintf(k, "k%u", (unsigned int)i);
+		sprintf(v, "%u", (unsigned int)i);
+		merge_put(i % 2 ? tr : tkvdb_tr_keyspace(tr, "ks"), k, v);
+	}
+	TEST_CHECK(tkvdb_savepoint(tr, &sp) == TKVDB_OK);
+	merge_put(tr, "k1", "changed");
+	merge_put(tr, "x", "new");
+	TEST_CHECK(tkvdb_rollback_to(tr, sp) == TKVDB_OK);
+	TEST_CHECK(tkvdb_savepoint_release(tr, sp) == TKVDB_OK);
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	for (i=0, r=tkvdb_first(c); r == TKVDB_OK; r=tkvdb_next(c)) {
+		i++;
+	}
+	TEST_CHECK(i == N / 2);
+	tkvdb_cursor_free(c);
+
+	TEST_CHECK(ca.blocks > N);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK(ca.blocks == 0);
+	TEST_CHECK(ca.bytes == 0);
+	TEST_CHECK(!ca.bad_size);
+
+	/* preallocated buffer is taken from allocator too */
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 0);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, 256 * 1024);
+	tr = tkvdb_tr_create_p(db, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(ca.max_bytes >= 256 * 1024);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	merge_put(tr, "key", "val");
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK(ca.blocks == 0);
+
+	/* transactions created by tkvdb_tr_create() use allocator of db */
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(ca.blocks == 1);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	key.data = "key";
+	key.len = 3;
+	TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK(ca.blocks > 1);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK(ca.blocks == 0);
+	TEST_CHECK(!ca.bad_size);
+
+	/* arena is reset at once when transaction is freed */
+	tkvdb_param_set_allocator(params, &arena);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 1);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, sizeof(ar.buf));
+	tr = tkvdb_tr_create_p(db, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N / 10; i++) {
+		char k[64];
+
+		sprintf(k, "a%u", (unsigned int)i);
+		merge_put(tr, k, k);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(ar.used > 0);
+	tkvdb_tr_free(tr);
+	TEST_CHECK((ar.used == 0) && (ar.resets == 1));
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+/* backup, diff and freeze of database with custom allocator must not touch
+ * memory of transactions created from it */
+static void
+allocator_helpers_check(const tkvdb_allocator *alloc)
+{
+	const char fn[] = "data_test_allocator.tkv";
+	const char fn_backup[] = "data_test_allocator_backup.tkv";
+	const char fn_img[] = "data_test_allocator.img";
+	tkvdb_params *params;
+	tkvdb *db, *backup;
+	tkvdb_tr *tr;
+	tkvdb_datum key, val;
+	uint64_t root, gap_begin, gap_end;
+	struct diff_res res;
+	FILE *f;
+	size_t i;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set_allocator(params, alloc);
+
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<100; i++) {
+		char k[20];
+
+		sprintf(k, "k%03u", (unsigned int)i);
+		merge_put(tr, k, k);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_dbinfo(db, &root, &gap_begin, &gap_end) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	merge_put(tr, "k050", "new");
+
+	f = fopen(fn_backup, "w");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(tkvdb_backup(db, fileno(f)) == TKVDB_OK);
+	fclose(f);
+
+	res.n = 0;
+	TEST_CHECK(tkvdb_diff(db, 0, root, &diff_cb, &res) == TKVDB_OK);
+	TEST_CHECK(res.n == 100);
+
+	f = fopen(fn_img, "w");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(tkvdb_freeze(tr, fileno(f)) == TKVDB_OK);
+	fclose(f);
+
+	/* transaction still sees its own and on-disk data */
+	key.data = "k050";
+	key.len = 4;
+	TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK((val.len == 3) && (memcmp(val.data, "new", 3) == 0));
+	key.data = "k099";
+	TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK((val.len == 4) && (memcmp(val.data, "k099", 4) == 0));
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	backup = tkvdb_open(fn_backup, NULL);
+	TEST_CHECK(backup != NULL);
+	check_same_content(db, backup);
+	tkvdb_close(backup);
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+	unlink(fn_backup);
+	unlink(fn_img);
+}
+
+void
+test_allocator_helpers(void)
+{
+	struct count_alloc ca = {0, 0, 0, 0};
+	tkvdb_allocator alloc = {count_alloc_alloc, count_alloc_free,
+		NULL, &ca};
+	static struct arena ar;
+	tkvdb_allocator arena = {arena_alloc, arena_free, arena_reset, &ar};
+
+	allocator_helpers_check(&alloc);
+	TEST_CHECK(ca.blocks == 0);
+	TEST_CHECK(!ca.bad_size);
+
+	/* only user transactions reset arena: ours and one of
+	 * check_same_content() */
+	ar.used = ar.resets = 0;
+	allocator_helpers_check(&arena);
+	TEST_CHECK(ar.resets == 2);
+}
+
+/* malloc-based allocator that fails on demand */
+static void *
+fail_alloc_alloc(void *ctx, size_t size)
+{
+	int *fail = ctx;
+
+	return *fail ? NULL : malloc(size);
+}
+
+static void
+fail_alloc_free(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+void
+test_spill_nomem(void)
+{
+	const char fn[] = "data_test_spill_nomem.tkv";
+	int fail = 0;
+	tkvdb_allocator alloc = {fail_alloc_alloc, fail_alloc_free,
+		NULL, &fail};
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	tkvdb_datum key, val;
+	size_t i;
+	TKVDB_RES r;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set_allocator(params, &alloc);
+
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N / 10; i++) {
+		char k[20];
+
+		sprintf(k, "k%05u", (unsigned int)i);
+		merge_put(tr, k, k);
+	}
+
+	/* root can't be copied, transaction stays in memory */
+	fail = 1;
+	TEST_CHECK(tkvdb_tr_spill(tr) == TKVDB_ENOMEM);
+	fail = 0;
+	key.data = "k00042";
+	key.len = 6;
+	TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK((val.len == 6) && (memcmp(val.data, "k00042", 6) == 0));
+
+	TEST_CHECK(tkvdb_tr_spill(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	for (i=0, r=tkvdb_first(c); r == TKVDB_OK; r=tkvdb_next(c)) {
+		i++;
+	}
+	TEST_CHECK(i == N / 10);
+	tkvdb_cursor_free(c);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+void
+test_u64_keys(void)
+{
+	const char fn[] = "data_test_u64.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	tkvdb_datum key, val;
+	unsigned char be[8] = {0, 0, 0, 0, 0, 0, 0x01, 0x02};
+	unsigned char be_long[9] = {0, 0, 0, 0, 0, 0, 0x01, 0x02, 0x03};
+	uint64_t prev;
+	size_t i, n;
+	TKVDB_RES r;
+
+	tr = tkvdb_tr_create(NULL);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+
+	srand(1);
+	for (i=0; i<N; i++) {
+		uint64_t k = ((uint64_t)rand() << 33) ^ (uint64_t)rand();
+
+		val.data = &k;
+		val.len = sizeof(k);
+		TEST_CHECK(tkvdb_put_u64(tr, k, &val) == TKVDB_OK);
+		TEST_CHECK(tkvdb_get_u64(tr, k, &val) == TKVDB_OK);
+		TEST_CHECK((val.len == sizeof(k))
+			&& (memcmp(val.data, &k, sizeof(k)) == 0));
+	}
+	val.data = "x";
+	val.len = 1;
+	TEST_CHECK(tkvdb_put_u64(tr, 0x0102, &val) == TKVDB_OK);
+
+	/* the same key as big-endian bytes */
+	key.data = be;
+	key.len = sizeof(be);
+	TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK((val.len == 1) && (*(char *)val.data == 'x'));
+
+	/* cursor returns keys in numeric order */
+	c = tkvdb_cursor_create(tr);
+	prev = 0;
+	n = 0;
+	for (r = tkvdb_first(c); r == TKVDB_OK; r = tkvdb_next(c)) {
+		const unsigned char *k = tkvdb_cursor_key(c);
+		uint64_t cur = 0;
+
+		TEST_CHECK(tkvdb_cursor_keysize(c) == 8);
+		for (i=0; i<8; i++) {
+			cur = (cur << 8) | k[i];
+		}
+		TEST_CHECK((n == 0) || (cur > prev));
+		prev = cur;
+		n++;
+	}
+	tkvdb_cursor_free(c);
+
+	/* keys of other sizes on the same path */
+	key.len = 4;
+	TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+	key.data = be_long;
+	key.len = sizeof(be_long);
+	TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get_u64(tr, 0, &val) == TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_get_u64(tr, 0x0102, &val) == TKVDB_OK);
+	TEST_CHECK((val.len == 1) && (*(char *)val.data == 'x'));
+
+	TEST_CHECK(tkvdb_del_u64(tr, 0x0102) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get_u64(tr, 0x0102, &val) == TKVDB_NOT_FOUND);
+
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	/* nodes are loaded from disk during lookup */
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		uint64_t k = i * 0x10001;
+
+		val.data = &k;
+		val.len = sizeof(k);
+		TEST_CHECK(tkvdb_put_u64(tr, k, &val) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		uint64_t k = i * 0x10001;
+
+		TEST_CHECK(tkvdb_get_u64(tr, k, &val) == TKVDB_OK);
+		TEST_CHECK((val.len == sizeof(k))
+			&& (memcmp(val.data, &k, sizeof(k)) == 0));
+		TEST_CHECK(tkvdb_get_u64(tr, k + 1, &val) == TKVDB_NOT_FOUND);
+	}
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+	unlink(fn);
+}
+
+void
+test_leaves(void)
+{
+	const char fn[] = "data_test_leaves.tkv";
+	struct count_alloc ca = {0, 0, 0, 0};
+	tkvdb_allocator alloc = {count_alloc_alloc, count_alloc_free,
+		NULL, &ca};
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_datum key, val;
+	size_t i, sp;
+	char k[64];
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set_allocator(params, &alloc);
+
+	/* unique suffixes don't take tables of subnodes */
+	tr = tkvdb_tr_create_p(NULL, params);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	srand(1);
+	for (i=0; i<N; i++) {
+		sprintf(k, "user/%08x%08x", (unsigned int)rand(),
+			(unsigned int)rand());
+		merge_put(tr, k, "v");
+	}
+	TEST_CHECK(ca.bytes < (N * 2048));
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* leaf gets subnodes */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	merge_put(tr, "k", "0");
+	for (i=1; i<10; i++) {
+		char v[32];
+
+		sprintf(v, "%u", (unsigned int)i);
+		sprintf(k, "k%u", (unsigned int)i);
+		merge_put(tr, k, v);
+		sprintf(k, "k%u%u", (unsigned int)i, (unsigned int)i);
+		merge_put(tr, k, v);
+	}
+	TEST_CHECK(tkvdb_savepoint(tr, &sp) == TKVDB_OK);
+	merge_put(tr, "k11x", "x");
+	merge_put(tr, "k1y", "y");
+	TEST_CHECK(tkvdb_rollback_to(tr, sp) == TKVDB_OK);
+	prefix_check(tr, "k11x", 0, 1, TKVDB_NOT_FOUND);
+	prefix_check(tr, "k", 1, 10, TKVDB_OK);
+	TEST_CHECK(tkvdb_savepoint_release(tr, sp) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK((ca.blocks == 0) && (ca.bytes == 0) && !ca.bad_size);
+
+	/* leaves read from disk */
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		sprintf(k, "%u", (unsigned int)i);
+		merge_put(tr, k, k);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		sprintf(k, "%u", (unsigned int)i);
+		key.data = k;
+		key.len = strlen(k);
+		TEST_CHECK(tkvdb_del(tr, &key, 0) == TKVDB_OK);
+	}
+	for (i=0; i<N; i++) {
+		sprintf(k, "%ux", (unsigned int)i);
+		merge_put(tr, k, k);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	prefix_check(tr, "", 0, N, TKVDB_NOT_FOUND);
+	for (i=0; i<N; i++) {
+		sprintf(k, "%ux", (unsigned int)i);
+		key.data = k;
+		key.len = strlen(k);
+		TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+		TEST_CHECK((val.len == key.len)
+			&& (memcmp(val.data, k, val.len) == 0));
+	}
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK((ca.blocks == 0) && !ca.bad_size);
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+
+/* put or check keys "<pfx><sym>" with value "<sym>" for sym in [from, to) */
+static void
+sym_apply(tkvdb_tr *tr, unsigned char pfx, int from, int to, int put,
+	TKVDB_RES expected)
+{
+	int i;
+
+	for (i=from; i<to; i++) {
+		unsigned char k[2], v;
+		tkvdb_datum key, val;
+
+		k[0] = pfx;
+		k[1] = v = i;
+		key.data = k;
+		key.len = sizeof(k);
+		if (put) {
+			val.data = &v;
+			val.len = 1;
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == expected);
+		} else {
+			TEST_CHECK(tkvdb_get(tr, &key, &val) == expected);
+			TEST_CHECK((expected != TKVDB_OK) || ((val.len == 1)
+				&& (*(unsigned char *)val.data == v)));
+		}
+	}
+}
+
+/* cursor walks all symbols after 'pfx' in both directions */
+static void
+sym_walk(tkvdb_tr *tr, unsigned char pfx, int n)
+{
+	tkvdb_cursor *c;
+	tkvdb_datum key;
+	TKVDB_RES r;
+	int i;
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	key.data = &pfx;
+	key.len = 1;
+
+	i = 0;
+	for (r = tkvdb_seek(c, &key, TKVDB_SEEK_GE); r == TKVDB_OK;
+		r = tkvdb_next(c)) {
+		const unsigned char *k = tkvdb_cursor_key(c);
+
+		if (k[0] != pfx) {
+			break;
+		}
+		TEST_CHECK((tkvdb_cursor_keysize(c) == 2) && (k[1] == i));
+		i++;
+	}
+	TEST_CHECK(i == n);
+
+	for (r = tkvdb_prev(c); r == TKVDB_OK; r = tkvdb_prev(c)) {
+		const unsigned char *k = tkvdb_cursor_key(c);
+
+		if (k[0] != pfx) {
+			break;
+		}
+		i--;
+		TEST_CHECK((tkvdb_cursor_keysize(c) == 2) && (k[1] == i));
+	}
+	TEST_CHECK(i == 0);
+	tkvdb_cursor_free(c);
+}
+
+void
+test_small_nodes(void)
+{
+	const char fn[] = "data_test_small_nodes.tkv";
+	struct count_alloc ca = {0, 0, 0, 0};
+	tkvdb_allocator alloc = {count_alloc_alloc, count_alloc_free,
+		NULL, &ca};
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr, *src;
+	size_t i, sp;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set_allocator(params, &alloc);
+
+	/* random keys branch into few subnodes below the top levels */
+	tr = tkvdb_tr_create_p(NULL, params);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	srand(1);
+	for (i=0; i<N; i++) {
+		uint64_t k = ((uint64_t)rand() << 33) ^ (uint64_t)rand();
+		tkvdb_datum val;
+
+		val.data = &k;
+		val.len = sizeof(k);
+		TEST_CHECK(tkvdb_put_u64(tr, k, &val) == TKVDB_OK);
+	}
+	TEST_CHECK(ca.bytes < (N * 512));
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* leaf -> small -> full, rollback restores smaller node */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	sym_apply(tr, 'g', 0, 10, 1, TKVDB_OK);
+	TEST_CHECK(tkvdb_savepoint(tr, &sp) == TKVDB_OK);
+	sym_apply(tr, 'g', 10, 256, 1, TKVDB_OK);
+	sym_walk(tr, 'g', 256);
+	TEST_CHECK(tkvdb_rollback_to(tr, sp) == TKVDB_OK);
+	sym_apply(tr, 'g', 0, 10, 0, TKVDB_OK);
+	sym_apply(tr, 'g', 10, 256, 0, TKVDB_NOT_FOUND);
+	sym_walk(tr, 'g', 10);
+	TEST_CHECK(tkvdb_savepoint_release(tr, sp) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK((ca.blocks == 0) && (ca.bytes == 0) && !ca.bad_size);
+
+	/* small and full nodes read from disk */
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	sym_apply(tr, 'a', 0, 100, 1, TKVDB_OK);
+	sym_apply(tr, 'b', 0, 16, 1, TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	sym_apply(tr, 'a', 100, 256, 1, TKVDB_OK);
+	sym_apply(tr, 'b', 16, 40, 1, TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	/* merge adds subnodes to nodes of the same database */
+	src = tkvdb_tr_create(NULL);
+	TEST_CHECK(tkvdb_begin(src) == TKVDB_OK);
+	sym_apply(src, 'b', 40, 256, 1, TKVDB_OK);
+	sym_apply(src, 'c', 0, 20, 1, TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_merge(tr, src) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(src) == TKVDB_OK);
+	tkvdb_tr_free(src);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	sym_walk(tr, 'a', 256);
+	sym_walk(tr, 'b', 256);
+	sym_walk(tr, 'c', 20);
+	sym_apply(tr, 'b', 0, 256, 0, TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	TEST_CHECK((ca.blocks == 0) && !ca.bad_size);
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+
+/* get all keys of kvs, 'alt' is expected value of keys with odd index */
+static void
+hash_check(tkvdb_tr *tr, const char *alt)
+{
+	size_t i;
+
+	for (i=0; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs[i].key;
+		key.len = kvs[i].klen;
+		if (alt && (i & 1)) {
+			if (*alt == '\0') {
+				TEST_CHECK(tkvdb_get(tr, &key, &val)
+					== TKVDB_NOT_FOUND);
+				continue;
+			}
+			TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+			TEST_CHECK((val.len == strlen(alt))
+				&& (memcmp(val.data, alt, val.len) == 0));
+		} else {
+			TEST_CHECK(tkvdb_get(tr, &key, &val) == TKVDB_OK);
+			TEST_CHECK((val.len == kvs[i].vlen)
+				&& (memcmp(val.data, kvs[i].val,
+				val.len) == 0));
+		}
+	}
+}
+
+/* change keys with odd index, value "" deletes them */
+static void
+hash_apply(tkvdb_tr *tr, const char *alt)
+{
+	size_t i;
+
+	for (i=1; i<N; i+=2) {
+		tkvdb_datum key, val;
+
+		key.data = kvs[i].key;
+		key.len = kvs[i].klen;
+		if (*alt == '\0') {
+			TEST_CHECK(tkvdb_del(tr, &key, 0) == TKVDB_OK);
+		} else {
+			val.data = (void *)alt;
+			val.len = strlen(alt);
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+		}
+	}
+}
+
+void
+test_hash(void)
+{
+	const char fn[] = "data_test_hash.tkv";
+	const size_t sizes[] = {1, 100, 4096};
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	size_t i, j, sp;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+
+	for (j=0; j<sizeof(sizes) / sizeof(sizes[0]); j++) {
+		tkvdb_param_set(params, TKVDB_PARAM_TR_HASH, sizes[j]);
+
+		/* cached nodes are dropped by changes */
+		tr = tkvdb_tr_create_p(NULL, params);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		for (i=0; i<N; i++) {
+			tkvdb_datum key, val;
+
+			key.data = kvs_unsorted[i].key;
+			key.len = kvs_unsorted[i].klen;
+			val.data = kvs_unsorted[i].val;
+			val.len = kvs_unsorted[i].vlen;
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+		}
+		hash_check(tr, NULL);
+		hash_check(tr, NULL);
+
+		hash_apply(tr, "x");
+		hash_check(tr, "x");
+		TEST_CHECK(tkvdb_savepoint(tr, &sp) == TKVDB_OK);
+		hash_apply(tr, "longer value");
+		hash_check(tr, "longer value");
+		hash_apply(tr, "");
+		hash_check(tr, "");
+		TEST_CHECK(tkvdb_rollback_to(tr, sp) == TKVDB_OK);
+		hash_check(tr, "x");
+		TEST_CHECK(tkvdb_savepoint_release(tr, sp) == TKVDB_OK);
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+		tkvdb_tr_free(tr);
+	}
+
+	/* nodes read from disk, transaction inherits db params */
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs[i].key;
+		key.len = kvs[i].klen;
+		val.data = kvs[i].val;
+		val.len = kvs[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+	}
+	hash_check(tr, NULL);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_check(tr, NULL);
+	hash_check(tr, NULL);
+	hash_apply(tr, "");
+	hash_check(tr, "");
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_check(tr, NULL);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+
+void
+test_crown(void)
+{
+	const char fn[] = "data_test_crown.tkv";
+	const char fn_compact[] = "data_test_crown_compact.tkv";
+	const int64_t sizes[] = {1, 4096, 1024 * 1024};
+	tkvdb_params *params;
+	tkvdb *db, *other;
+	tkvdb_tr *tr, *snap;
+	size_t i, j;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+
+	for (j=0; j<sizeof(sizes) / sizeof(sizes[0]); j++) {
+		tkvdb_param_set(params, TKVDB_PARAM_CROWN_SIZE, sizes[j]);
+
+		unlink(fn);
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db);
+
+		/* crown is rebuilt after each commit */
+		for (i=0; i<N; i++) {
+			tkvdb_datum key, val;
+
+			if ((i % (N / 10)) == 0) {
+				TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+			}
+			key.data = kvs_unsorted[i].key;
+			key.len = kvs_unsorted[i].klen;
+			val.data = kvs_unsorted[i].val;
+			val.len = kvs_unsorted[i].vlen;
+			TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+			if ((i % (N / 10)) == (N / 10 - 1)) {
+				TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+			}
+		}
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		hash_check(tr, NULL);
+		hash_apply(tr, "x");
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		hash_check(tr, "x");
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+		/* past root shares nodes with crown */
+		snap = tkvdb_tr_create_at(db, 9);
+		TEST_CHECK(snap != NULL);
+		TEST_CHECK(tkvdb_begin(snap) == TKVDB_OK);
+		hash_check(snap, NULL);
+		TEST_CHECK(tkvdb_rollback(snap) == TKVDB_OK);
+		tkvdb_tr_free(snap);
+
+		/* commit of other handle is seen by begin */
+		other = tkvdb_open(fn, params);
+		TEST_CHECK(other != NULL);
+		snap = tkvdb_tr_create(other);
+		TEST_CHECK(tkvdb_begin(snap) == TKVDB_OK);
+		hash_check(snap, "x");
+		hash_apply(snap, "");
+		TEST_CHECK(tkvdb_commit(snap) == TKVDB_OK);
+		tkvdb_tr_free(snap);
+		tkvdb_close(other);
+
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		hash_check(tr, "");
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+		/* offsets are changed by compaction */
+		TEST_CHECK(tkvdb_compact_to(db, fn_compact, NULL)
+			== TKVDB_OK);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		hash_check(tr, "");
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+		tkvdb_tr_free(tr);
+		tkvdb_close(db);
+	}
+
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+
+/* batched lookups must give the same results as single ones */
+static void
+multi_check(tkvdb_tr *tr)
+{
+	static tkvdb_datum keys[N * 3 + 1], vals[N * 3 + 1];
+	static TKVDB_RES res[N * 3 + 1];
+	static unsigned char missing[N][KLEN + 1];
+	size_t i, n = 0;
+
+	for (i=0; i<N; i++) {
+		/* existing key, longer key and some duplicates */
+		keys[n].data = kvs_unsorted[i].key;
+		keys[n].len = kvs_unsorted[i].klen;
+		n++;
+
+		memcpy(missing[i], kvs_unsorted[i].key, kvs_unsorted[i].klen);
+		missing[i][kvs_unsorted[i].klen] = 0xff;
+		keys[n].data = missing[i];
+		keys[n].len = kvs_unsorted[i].klen + 1;
+		n++;
+
+		if ((i % 7) == 0) {
+			keys[n] = keys[n - 2];
+			n++;
+		}
+	}
+	/* empty key */
+	keys[n].data = missing[0];
+	keys[n].len = 0;
+	n++;
+
+	TEST_CHECK(tkvdb_get_multi(tr, keys, vals, res, n) == TKVDB_OK);
+
+	for (i=0; i<n; i++) {
+		tkvdb_datum val;
+
+		TEST_CHECK(tkvdb_get(tr, &keys[i], &val) == res[i]);
+		if (res[i] == TKVDB_OK) {
+			TEST_CHECK((val.len == vals[i].len)
+				&& (memcmp(val.data, vals[i].data,
+				val.len) == 0));
+		}
+	}
+}
+
+void
+test_multi(void)
+{
+	const char fn[] = "data_test_multi.tkv";
+	tkvdb_params *params;
+	tkvdb_datum key, val;
+	TKVDB_RES r;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	size_t i;
+
+	/* in-memory transaction */
+	tr = tkvdb_tr_create(NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		key.data = kvs_unsorted[i].key;
+		key.len = kvs_unsorted[i].klen;
+		val.data = kvs_unsorted[i].val;
+		val.len = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+	}
+	multi_check(tr);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create_p(db, params);
+
+	/* empty database */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	key.data = kvs[0].key;
+	key.len = kvs[0].klen;
+	TEST_CHECK(tkvdb_get_multi(tr, &key, &val, &r, 1) == TKVDB_OK);
+	TEST_CHECK(r == TKVDB_EMPTY);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_apply(tr, "x");
+	for (i=0; i<N; i+=2) {
+		key.data = kvs[i].key;
+		key.len = kvs[i].klen;
+		val.data = kvs[i].val;
+		val.len = kvs[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &key, &val) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	/* all nodes are read from disk */
+	tr = tkvdb_tr_create_p(db, params);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	multi_check(tr);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* part of nodes is modified in memory */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_apply(tr, "");
+	multi_check(tr);
+	hash_check(tr, "");
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	/* with cache of point lookups */
+	tkvdb_param_set(params, TKVDB_PARAM_TR_HASH, 1024);
+	tr = tkvdb_tr_create_p(db, params);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_check(tr, "x");
+	multi_check(tr);
+	multi_check(tr);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+
+/* number of keys in kvs lesser than 'k' */
+static size_t
+kv_lower_bound(const struct kv *k)
+{
+	size_t lo = 0, hi = N;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (keycmp(&kvs[mid], k) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static void
+kv_check_cursor(tkvdb_cursor *c, TKVDB_RES r, size_t idx)
+{
+	if (idx >= N) {
+		TEST_CHECK(r == TKVDB_NOT_FOUND);
+		return;
+	}
+	TEST_CHECK(r == TKVDB_OK);
+	TEST_CHECK((tkvdb_cursor_keysize(c) == kvs[idx].klen)
+		&& (memcmp(tkvdb_cursor_key(c), kvs[idx].key,
+		kvs[idx].klen) == 0));
+	TEST_CHECK((tkvdb_cursor_valsize(c) == kvs[idx].vlen)
+		&& (memcmp(tkvdb_cursor_val(c), kvs[idx].val,
+		kvs[idx].vlen) == 0));
+}
+
+static void
+frozen_write(tkvdb_tr *tr, const char *fn)
+{
+	FILE *f;
+
+	f = fopen(fn, "w");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(tkvdb_freeze(tr, fileno(f)) == TKVDB_OK);
+	fclose(f);
+}
+
+void
+test_frozen(void)
+{
+	const char fn[] = "data_test_frozen.tkv";
+	const char fn_img[] = "data_test_frozen.img";
+	tkvdb *db;
+	tkvdb_tr *tr, *ftr;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	struct stat st_db, st_img;
+	size_t i, j;
+	char k[32];
+	TKVDB_RES r;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tr != NULL);
+
+	/* half of keys is committed, the rest is in transaction */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i+=2) {
+		dtk.data = kvs[i].key;
+		dtk.len = kvs[i].klen;
+		dtv.data = kvs[i].val;
+		dtv.len = kvs[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	merge_put(tr, "deleted", "x");
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=1; i<N; i+=2) {
+		dtk.data = kvs[i].key;
+		dtk.len = kvs[i].klen;
+		dtv.data = kvs[i].val;
+		dtv.len = kvs[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	dtk.data = "deleted";
+	dtk.len = strlen("deleted");
+	TEST_CHECK(tkvdb_del(tr, &dtk, 0) == TKVDB_OK);
+	frozen_write(tr, fn_img);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	ftr = tkvdb_tr_create_frozen(fn_img);
+	TEST_CHECK(ftr != NULL);
+	TEST_CHECK(tkvdb_begin(ftr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs[i].key;
+		dtk.len = kvs[i].klen;
+		TEST_CHECK(tkvdb_get(ftr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK((dtv.len == kvs[i].vlen)
+			&& (memcmp(dtv.data, kvs[i].val, dtv.len) == 0));
+	}
+	dtk.data = "deleted";
+	dtk.len = strlen("deleted");
+	TEST_CHECK(tkvdb_get(ftr, &dtk, &dtv) == TKVDB_NOT_FOUND);
+	dtv.data = "x";
+	dtv.len = 1;
+	TEST_CHECK(tkvdb_put(ftr, &dtk, &dtv) == TKVDB_READONLY);
+	TEST_CHECK(tkvdb_tr_keyspace(ftr, "ks") == NULL);
+
+	/* iteration in both directions */
+	c = tkvdb_cursor_create(ftr);
+	TEST_CHECK(c != NULL);
+	r = tkvdb_first(c);
+	for (i=0; i<N; i++) {
+		kv_check_cursor(c, r, i);
+		r = tkvdb_next(c);
+	}
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+
+	r = tkvdb_last(c);
+	for (i=N; i>0; i--) {
+		kv_check_cursor(c, r, i - 1);
+		r = tkvdb_prev(c);
+	}
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+
+	/* seeks to existing keys, their prefixes and extensions */
+	for (i=0; i<N; i++) {
+		struct kv datum;
+		size_t idx;
+
+		datum = kvs[rand() % N];
+		switch (i % 4) {
+			case 0:
+				break;
+			case 1:
+				datum.klen = rand() % datum.klen + 1;
+				break;
+			case 2:
+				datum.key[datum.klen++] = rand();
+				break;
+			default:
+				for (j=0; j<datum.klen; j++) {
+					datum.key[j] = rand();
+				}
+				break;
+		}
+		idx = kv_lower_bound(&datum);
+
+		dtk.data = datum.key;
+		dtk.len = datum.klen;
+		if ((idx < N) && (keycmp(&kvs[idx], &datum) == 0)) {
+			r = tkvdb_seek(c, &dtk, TKVDB_SEEK_EQ);
+			kv_check_cursor(c, r, idx);
+			kv_check_cursor(c, tkvdb_next(c), idx + 1);
+			continue;
+		}
+
+		TEST_CHECK(tkvdb_seek(c, &dtk, TKVDB_SEEK_EQ)
+			== TKVDB_NOT_FOUND);
+		kv_check_cursor(c, tkvdb_seek(c, &dtk, TKVDB_SEEK_GE), idx);
+		r = tkvdb_seek(c, &dtk, TKVDB_SEEK_LE);
+		kv_check_cursor(c, r, idx > 0 ? idx - 1 : N);
+	}
+	tkvdb_cursor_free(c);
+	tkvdb_tr_free(ftr);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	/* image of committed data is smaller than database file */
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		sprintf(k, "%u", (unsigned int)i);
+		merge_put(tr, k, k);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	frozen_write(tr, fn_img);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st_db) == 0);
+	TEST_CHECK(stat(fn_img, &st_img) == 0);
+	TEST_CHECK(st_img.st_size * 3 < st_db.st_size);
+
+	ftr = tkvdb_tr_create_frozen(fn_img);
+	TEST_CHECK(ftr != NULL);
+	TEST_CHECK(tkvdb_begin(ftr) == TKVDB_OK);
+	check_same_tr(tr, ftr);
+	tkvdb_tr_free(ftr);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	/* not an image */
+	TEST_CHECK(tkvdb_tr_create_frozen(fn) == NULL);
+	unlink(fn);
+
+	/* empty in-memory transaction */
+	tr = tkvdb_tr_create(NULL);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	frozen_write(tr, fn_img);
+	tkvdb_tr_free(tr);
+
+	ftr = tkvdb_tr_create_frozen(fn_img);
+	TEST_CHECK(ftr != NULL);
+	TEST_CHECK(tkvdb_begin(ftr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_get(ftr, &dtk, &dtv) == TKVDB_EMPTY);
+	c = tkvdb_cursor_create(ftr);
+	TEST_CHECK(tkvdb_first(c) == TKVDB_EMPTY);
+	tkvdb_cursor_free(c);
+	tkvdb_tr_free(ftr);
+	unlink(fn_img);
+}
+
+void
+test_readahead(void)
+{
+	const char fn[] = "data_test_readahead.tkv";
+	const int64_t windows[] = {0, 1, 8, 256};
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	size_t i, j, k;
+	TKVDB_RES r;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+
+	for (j=0; j<sizeof(windows) / sizeof(windows[0]); j++) {
+		tkvdb_param_set(params, TKVDB_PARAM_CURSOR_READAHEAD,
+			windows[j]);
+
+		unlink(fn);
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		for (i=0; i<N; i++) {
+			dtk.data = kvs_unsorted[i].key;
+			dtk.len = kvs_unsorted[i].klen;
+			dtv.data = kvs_unsorted[i].val;
+			dtv.len = kvs_unsorted[i].vlen;
+			TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+		/* all nodes are read by cursor, then some are changed */
+		for (k=0; k<2; k++) {
+			TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+			if (k == 1) {
+				hash_apply(tr, "x");
+				hash_apply(tr, "");
+				for (i=1; i<N; i+=2) {
+					dtk.data = kvs[i].key;
+					dtk.len = kvs[i].klen;
+					dtv.data = kvs[i].val;
+					dtv.len = kvs[i].vlen;
+					TEST_CHECK(tkvdb_put(tr, &dtk, &dtv)
+						== TKVDB_OK);
+				}
+			}
+			c = tkvdb_cursor_create(tr);
+			TEST_CHECK(c != NULL);
+
+			r = tkvdb_first(c);
+			for (i=0; i<N; i++) {
+				kv_check_cursor(c, r, i);
+				r = tkvdb_next(c);
+			}
+			TEST_CHECK(r == TKVDB_NOT_FOUND);
+
+			r = tkvdb_last(c);
+			for (i=N; i>0; i--) {
+				kv_check_cursor(c, r, i - 1);
+				r = tkvdb_prev(c);
+			}
+			TEST_CHECK(r == TKVDB_NOT_FOUND);
+
+			/* short scans in both directions after seek */
+			for (i=0; i<N; i+=97) {
+				size_t s;
+
+				dtk.data = kvs[i].key;
+				dtk.len = kvs[i].klen;
+				r = tkvdb_seek(c, &dtk, TKVDB_SEEK_EQ);
+				kv_check_cursor(c, r, i);
+				for (s=1; s<=10; s++) {
+					kv_check_cursor(c, tkvdb_next(c),
+						i + s);
+				}
+				for (s=9; (s>0) && (i + s < N); s--) {
+					kv_check_cursor(c, tkvdb_prev(c),
+						i + s);
+				}
+			}
+
+			tkvdb_cursor_free(c);
+			TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+		}
+
+		tkvdb_tr_free(tr);
+		tkvdb_close(db);
+	}
+
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+void
+test_pipeline(void)
+{
+	const char fn[] = "data_test_pipeline.tkv";
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr, *batch[2];
+	size_t i, b;
+
+	/* buffer is grown geometrically, but not above limit */
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_WRITE_BUF_LIMIT, 48 * 1024);
+
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	batch[0] = tkvdb_tr_create(NULL);
+	batch[1] = tkvdb_tr_create(NULL);
+	TEST_CHECK(tkvdb_begin(batch[0]) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(batch[1]) == TKVDB_OK);
+
+	/* batches are filled in turn, full one is merged and committed */
+	for (i=0, b=0; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs_unsorted[i].key;
+		key.len = kvs_unsorted[i].klen;
+		val.data = kvs_unsorted[i].val;
+		val.len = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(batch[b], &key, &val) == TKVDB_OK);
+
+		if (((i + 1) % (N / 10)) == 0) {
+			TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+			TEST_CHECK(tkvdb_tr_merge(tr, batch[b]) == TKVDB_OK);
+			TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+			TEST_CHECK(tkvdb_rollback(batch[b]) == TKVDB_OK);
+			TEST_CHECK(tkvdb_begin(batch[b]) == TKVDB_OK);
+			b = 1 - b;
+		}
+	}
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_check(tr, NULL);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* transaction larger than write buffer */
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_apply(tr, "x");
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_ENOMEM);
+
+	tkvdb_tr_free(batch[0]);
+	tkvdb_tr_free(batch[1]);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+
+/* evict db file from page cache, so reads have to wait for disk */
+static void
+drop_cache(const char *fn)
+{
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	TEST_CHECK(fd >= 0);
+	/* dirty pages are not dropped */
+	TEST_CHECK(fsync(fd) == 0);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+void
+test_nowait(void)
+{
+	const char fn[] = "data_test_nowait.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	size_t i, sp;
+	TKVDB_RES r;
+
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	dtk.data = "x";
+	dtk.len = 1;
+	TEST_CHECK(tkvdb_get_nowait(tr, &dtk, &dtv) == TKVDB_EMPTY);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len = kvs_unsorted[i].klen;
+		dtv.data = kvs_unsorted[i].val;
+		dtv.len = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+
+	/* lookups are repeated until nodes are read,
+	 * nodes loaded under savepoint are unloaded by rollback */
+	drop_cache(fn);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_savepoint(tr, &sp) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len = kvs_unsorted[i].klen;
+		while ((r = tkvdb_get_nowait(tr, &dtk, &dtv)) == TKVDB_AGAIN);
+		TEST_CHECK(r == TKVDB_OK);
+		TEST_CHECK((dtv.len == kvs_unsorted[i].vlen)
+			&& (memcmp(dtv.data, kvs_unsorted[i].val, dtv.len)
+			== 0));
+	}
+	dtk.data = "x";
+	dtk.len = 1;
+	while ((r = tkvdb_get_nowait(tr, &dtk, &dtv)) == TKVDB_AGAIN);
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_rollback_to(tr, sp) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	/* cursor stays on its key until next one is loaded */
+	drop_cache(fn);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+
+	r = tkvdb_first(c);
+	for (i=0; i<N; i++) {
+		kv_check_cursor(c, r, i);
+		while ((r = tkvdb_next_nowait(c)) == TKVDB_AGAIN) {
+			kv_check_cursor(c, TKVDB_OK, i);
+		}
+	}
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+
+	drop_cache(fn);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	r = tkvdb_last(c);
+	for (i=N; i>0; i--) {
+		kv_check_cursor(c, r, i - 1);
+		while ((r = tkvdb_prev_nowait(c)) == TKVDB_AGAIN) {
+			kv_check_cursor(c, TKVDB_OK, i - 1);
+		}
+	}
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+
+	tkvdb_cursor_free(c);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+	unlink(fn);
+}
+
+/* end of file stays aligned after commits with O_DIRECT */
+static void
+direct_check(const char *fn)
+{
+#ifdef O_DIRECT
+	struct stat st;
+
+	TEST_CHECK(stat(fn, &st) == 0);
+	TEST_CHECK((st.st_size % 4096) == 0);
+#else
+	(void)fn;
+#endif
+}
+
+void
+test_direct(void)
+{
+	const char fn[] = "data_test_direct.tkv";
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr, *ks;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	size_t i;
+	TKVDB_RES r;
+
+	/* file with unaligned end, written without O_DIRECT */
+	unlink(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	dtk.data = kvs[0].key;
+	dtk.len = kvs[0].klen;
+	dtv.data = kvs[0].val;
+	dtv.len = kvs[0].vlen;
+	TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	/* spilled nodes and transactions are written with O_DIRECT */
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_DIRECT_IO, 1);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_SPILL, 64 * 1024);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len = kvs_unsorted[i].klen;
+		dtv.data = kvs_unsorted[i].val;
+		dtv.len = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	direct_check(fn);
+
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	r = tkvdb_first(c);
+	for (i=0; i<N; i++) {
+		kv_check_cursor(c, r, i);
+		r = tkvdb_next(c);
+	}
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+	tkvdb_cursor_free(c);
+
+	/* catalog of keyspaces is after padding */
+	hash_apply(tr, "x");
+	ks = tkvdb_tr_keyspace(tr, "ks");
+	TEST_CHECK(ks != NULL);
+	TEST_CHECK(tkvdb_put(ks, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	direct_check(fn);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	/* format is the same */
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	ks = tkvdb_tr_keyspace(tr, "ks");
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	hash_check(tr, "x");
+	TEST_CHECK(tkvdb_get(ks, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	tkvdb_params_free(params);
+	unlink(fn);
+}
+
+/* puts into pending root, applied after background commit */
+static void
+async_put(tkvdb_tr *tr, size_t from, size_t to)
+{
+	tkvdb_datum dtk, dtv;
+	size_t i;
+
+	for (i=from; i<to; i++) {
+		dtk.data = kvs_unsorted[i].key;
+		dtk.len = kvs_unsorted[i].klen;
+		dtv.data = kvs_unsorted[i].val;
+		dtv.len = kvs_unsorted[i].vlen;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+}
+
+void
+test_async_commit(void)
+{
+	const char fn[] = "data_test_async_commit.tkv";
+	tkvdb_params *params;
+	tkvdb *db;
+	tkvdb_tr *tr, *tr2;
+	tkvdb_pending *p1, *p2;
+	tkvdb_cursor *c;
+	tkvdb_datum dtk, dtv;
+	int prealloc;
+	size_t i;
+	TKVDB_RES r;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_ASYNC_COMMIT, 1);
+
+	for (prealloc=0; prealloc<2; prealloc++) {
+		unlink(fn);
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		if (prealloc) {
+			tr = tkvdb_tr_create_m(db, 4 * 1024 * 1024, 0);
+		} else {
+			tr = tkvdb_tr_create_m(db, SIZE_MAX, 1);
+		}
+		TEST_CHECK(tr != NULL);
+
+		/* second transaction is started on pending root */
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		async_put(tr, 0, N / 4);
+		TEST_CHECK(tkvdb_commit_async(tr, &p1) == TKVDB_OK);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		async_put(tr, N / 4, N / 2);
+
+		/* read waits for writer and sees both */
+		dtk.data = kvs_unsorted[0].key;
+		dtk.len = kvs_unsorted[0].klen;
+		TEST_CHECK(tkvdb_get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.len == kvs_unsorted[0].vlen);
+		dtk.data = kvs_unsorted[N / 2 - 1].key;
+		dtk.len = kvs_unsorted[N / 2 - 1].klen;
+		TEST_CHECK(tkvdb_get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.len == kvs_unsorted[N / 2 - 1].vlen);
+
+		/* delta is committed with the next commit */
+		async_put(tr, N / 2, 3 * N / 4);
+		TEST_CHECK(tkvdb_commit_async(tr, &p2) == TKVDB_OK);
+		TEST_CHECK(tkvdb_commit_wait(p1) == TKVDB_OK);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		async_put(tr, 3 * N / 4, N);
+		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+		TEST_CHECK(tkvdb_commit_wait(p2) == TKVDB_OK);
+
+		/* rolled back delta is dropped */
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		dtk.data = dtv.data = "async";
+		dtk.len = dtv.len = 5;
+		TEST_CHECK(tkvdb_put(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(tkvdb_commit_async(tr, &p1) == TKVDB_OK);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		async_put(tr, 0, 1);
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+		TEST_CHECK(tkvdb_commit_wait(p1) == TKVDB_OK);
+		tkvdb_tr_free(tr);
+		tkvdb_close(db);
+
+		db = tkvdb_open(fn, NULL);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db);
+		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+		TEST_CHECK(tkvdb_get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(tkvdb_del(tr, &dtk, 0) == TKVDB_OK);
+		c = tkvdb_cursor_create(tr);
+		TEST_CHECK(c != NULL);
+		r = tkvdb_first(c);
+		for (i=0; i<N; i++) {
+			kv_check_cursor(c, r, i);
+			r = tkvdb_next(c);
+		}
+		TEST_CHECK(r == TKVDB_NOT_FOUND);
+		tkvdb_cursor_free(c);
+		TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+		tkvdb_tr_free(tr);
+		tkvdb_close(db);
+	}
+
+	/* other transaction waits for writer before commit */
+	unlink(fn);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	tr2 = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	async_put(tr, 0, N / 2);
+	TEST_CHECK(tkvdb_commit_async(tr, &p1) == TKVDB_OK);
+	TEST_CHECK(tkvdb_begin(tr2) == TKVDB_OK);
+	async_put(tr2, N / 2, N);
+	TEST_CHECK(tkvdb_commit(tr2) == TKVDB_OK);
+	TEST_CHECK(tkvdb_commit_wait(p1) == TKVDB_OK);
+	tkvdb_tr_free(tr2);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db);
+	TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	r = tkvdb_first(c);
+	for (i=0; i<N; i++) {
+		kv_check_cursor(c, r, i);
+		r = tkvdb_next(c);
+	}
+	TEST_CHECK(r == TKVDB_NOT_FOUND);
+	tkvdb_cursor_free(c);
+	TEST_CHECK(tkvdb_rollback(tr) == TKVDB_OK);
+	tkvdb_tr_free(tr);
+	tkvdb_close(db);
+
+	tkvdb_params_free(params);
+	unlink(fn);
+}
 
 TEST_LIST = {
 	{ "open db", test_open_db },
@@ -519,6 +3633,31 @@ TEST_LIST = {
 	{ "get", test_get },
 	{ "delete", test_del },
 	{ "vacuum", test_vacuum },
+	{ "diff", test_diff },
+	{ "replication", test_repl },
+	{ "historical reads", test_history },
+	{ "backup", test_backup },
+	{ "compaction", test_compact },
+	{ "spill to disk", test_spill },
+	{ "savepoints", test_savepoint },
+	{ "merge", test_merge },
+	{ "prefix move", test_prefix_move },
+	{ "keyspaces", test_keyspaces },
+	{ "allocator", test_allocator },
+	{ "allocator and helpers", test_allocator_helpers },
+	{ "spill without memory", test_spill_nomem },
+	{ "integer keys", test_u64_keys },
+	{ "leaf nodes", test_leaves },
+	{ "small nodes", test_small_nodes },
+	{ "hash index", test_hash },
+	{ "crown", test_crown },
+	{ "multi get", test_multi },
+	{ "frozen image", test_frozen },
+	{ "cursor readahead", test_readahead },
+	{ "ingest pipeline", test_pipeline },
+	{ "non-blocking reads", test_nowait },
+	{ "direct I/O", test_direct },
+	{ "async commit", test_async_commit },
 	{ 0 }
 };
 
@@ -0,0 +1,514 @@
+#include <algorithm>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tkvdb.hpp"
+
+#include "cutest.h"
+
+#define N 1000
+
+static std::string
+num(size_t i)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%08u", (unsigned int)i);
+	return buf;
+}
+
+void
+test_raii(void)
+{
+	const char fn[] = "data_test_cpp.tkv";
+
+	unlink(fn);
+	{
+		tkvdb::db db(fn);
+		tkvdb::transaction tr(db);
+
+		TEST_CHECK(tr.begin() == TKVDB_OK);
+		for (size_t i=0; i<N; i++) {
+			TEST_CHECK(tr.put("k" + num(i), num(i)) == TKVDB_OK);
+		}
+		TEST_CHECK(tr.commit() == TKVDB_OK);
+
+		/* handles are moved, not copied */
+		tkvdb::db db2(std::move(db));
+		tkvdb::transaction tr2(std::move(tr));
+		TEST_CHECK(db.native() == nullptr);
+		TEST_CHECK(tr.native() == nullptr);
+
+		TEST_CHECK(tr2.begin() == TKVDB_OK);
+		for (size_t i=0; i<N; i++) {
+			auto val = tr2.get("k" + num(i));
+
+			TEST_CHECK(val.has_value());
+			TEST_CHECK(val
+				&& (tkvdb::as_string_view(*val) == num(i)));
+		}
+		TEST_CHECK(!tr2.get(std::string_view("absent")));
+
+		const std::byte raw[] = {std::byte{0}, std::byte{0xff}};
+		TEST_CHECK(tr2.put(tkvdb::bytes(raw), "raw") == TKVDB_OK);
+		auto val = tr2.get(tkvdb::bytes(raw));
+		TEST_CHECK(val && (tkvdb::as_string_view(*val) == "raw"));
+		TEST_CHECK(tr2.rollback() == TKVDB_OK);
+	}
+
+	{
+		tkvdb::db db(fn);
+		tkvdb::transaction tr(db);
+		tkvdb::cursor c(tr);
+		size_t i = 0;
+
+		TEST_CHECK(tr.begin() == TKVDB_OK);
+		for (TKVDB_RES r = c.first(); r == TKVDB_OK; r = c.next()) {
+			TEST_CHECK(tkvdb::as_string_view(c.key())
+				== "k" + num(i));
+			TEST_CHECK(tkvdb::as_string_view(c.val()) == num(i));
+			i++;
+		}
+		TEST_CHECK(i == N);
+
+		TEST_CHECK(c.seek("k" + num(N / 2), TKVDB_SEEK_EQ) == TKVDB_OK);
+		TEST_CHECK(tkvdb::as_string_view(c.val()) == num(N / 2));
+		TEST_CHECK(tr.rollback() == TKVDB_OK);
+	}
+
+	try {
+		tkvdb::db db("no/such/dir/db.tkv");
+		TEST_CHECK(false);
+	} catch (const tkvdb::error &e) {
+		TEST_CHECK(e.code() == TKVDB_IO_ERROR);
+	}
+
+	unlink(fn);
+}
+
+void
+test_keyspace(void)
+{
+	tkvdb::transaction tr;
+	tkvdb::transaction users = tr.keyspace("users");
+
+	TEST_CHECK(users.begin() == TKVDB_OK);
+	TEST_CHECK(users.put("alice", "1") == TKVDB_OK);
+	TEST_CHECK(users.get("alice").has_value());
+	TEST_CHECK(!tr.get("alice").has_value());
+	TEST_CHECK(tr.rollback() == TKVDB_OK);
+}
+
+void
+test_map(void)
+{
+	tkvdb::transaction tr;
+	tkvdb::map m(tr);
+	std::map<std::string, std::string> ref;
+
+	TEST_CHECK(tr.begin() == TKVDB_OK);
+	TEST_CHECK(m.empty());
+	TEST_CHECK(m.begin() == m.end());
+
+	/* short keys from small alphabet, many keys are prefixes of others */
+	srand(1);
+	for (size_t i=0; i<N; i++) {
+		std::string key;
+		size_t len = rand() % 6;
+
+		for (size_t j=0; j<len; j++) {
+			key += "ab\xff"[rand() % 3];
+		}
+		ref[key] = num(i);
+		TEST_CHECK(m.insert_or_assign(key, num(i)) == TKVDB_OK);
+	}
+
+	/* forward and backward */
+	TEST_CHECK((size_t)std::distance(m.begin(), m.end()) == ref.size());
+	TEST_CHECK(std::equal(m.begin(), m.end(), ref.begin(), ref.end(),
+		[](const tkvdb::map::value_type &a,
+		const std::pair<const std::string, std::string> &b) {
+
+		return (tkvdb::as_string_view(a.first) == b.first)
+			&& (tkvdb::as_string_view(a.second) == b.second);
+	}));
+	auto rit = ref.rbegin();
+	for (auto it = m.end(); it != m.begin(); ) {
+		--it;
+		TEST_CHECK(tkvdb::as_string_view(it.key()) == rit->first);
+		++rit;
+	}
+	TEST_CHECK(rit == ref.rend());
+
+	/* copies share cursor until one of them moves */
+	{
+		auto a = m.begin(), b = a;
+		auto c = b;
+
+		TEST_CHECK(a.key().data() == b.key().data());
+		++b;
+		TEST_CHECK(a.key().data() != b.key().data());
+		TEST_CHECK(tkvdb::as_string_view(a.key()) == ref.begin()->first);
+		TEST_CHECK(tkvdb::as_string_view(b.key())
+			== std::next(ref.begin())->first);
+		TEST_CHECK((a == c) && (a != b));
+		TEST_CHECK(tkvdb::as_string_view((a++).key())
+			== ref.begin()->first);
+		TEST_CHECK((a == b) && (a != c));
+		TEST_CHECK(tkvdb::as_string_view(c.key()) == ref.begin()->first);
+	}
+
+	/* bounds */
+	for (size_t i=0; i<N; i++) {
+		std::string key;
+		size_t len = rand() % 7;
+
+		for (size_t j=0; j<len; j++) {
+			key += "ab\xff"[rand() % 3];
+		}
+
+		auto lb = m.lower_bound(key);
+		auto ref_lb = ref.lower_bound(key);
+		TEST_CHECK((lb == m.end()) == (ref_lb == ref.end()));
+		if ((lb != m.end()) && (ref_lb != ref.end())) {
+			TEST_CHECK(tkvdb::as_string_view(lb.key())
+				== ref_lb->first);
+		}
+
+		auto ub = m.upper_bound(key);
+		auto ref_ub = ref.upper_bound(key);
+		TEST_CHECK((ub == m.end()) == (ref_ub == ref.end()));
+		if ((ub != m.end()) && (ref_ub != ref.end())) {
+			TEST_CHECK(tkvdb::as_string_view(ub.key())
+				== ref_ub->first);
+		}
+
+		TEST_CHECK((m.find(key) != m.end()) == (ref.count(key) == 1));
+		TEST_CHECK(m.contains(key) == (ref.count(key) == 1));
+
+		auto [b, e] = m.equal_range(key);
+		TEST_CHECK(std::distance(b, e) == (long)ref.count(key));
+	}
+
+	/* prefixes */
+	for (const char *pfx : {"", "a", "ab", "b\xff", "\xff\xff", "ba"}) {
+		size_t n = 0;
+		std::string p(pfx);
+
+		for (auto [key, val] : m.prefix(p)) {
+			TEST_CHECK(tkvdb::as_string_view(key).starts_with(p));
+			n++;
+		}
+		TEST_CHECK(n == (size_t)std::count_if(ref.begin(), ref.end(),
+			[&p](const auto &kv) {
+			return kv.first.starts_with(p);
+		}));
+	}
+
+	/* copies are independent */
+	auto it = m.begin();
+	auto copy = it;
+	++it;
+	TEST_CHECK(copy == m.begin());
+	TEST_CHECK(it == std::next(m.begin()));
+	copy = it;
+	TEST_CHECK(copy == it);
+
+	TEST_CHECK(m.erase(ref.begin()->first) == TKVDB_OK);
+	TEST_CHECK(!m.contains(ref.begin()->first));
+	TEST_CHECK(tr.rollback() == TKVDB_OK);
+}
+
+using user_key = tkvdb::key_codec<
+	std::tuple<uint64_t, std::string_view, tkvdb::desc<int32_t>>>;
+
+static_assert(tkvdb::key_codec<std::tuple<uint64_t, int32_t>>::fixed_size);
+static_assert(tkvdb::key_codec<std::tuple<uint64_t, int32_t>>::max_size == 12);
+static_assert(!user_key::fixed_size);
+
+void
+test_key_codec(void)
+{
+	using tuple = std::tuple<uint64_t, std::string, int32_t>;
+	std::vector<tuple> tuples;
+	const std::string strs[] = {"", std::string("\0", 1),
+		std::string("\0\0", 2), std::string("a\0", 2), "a", "ab",
+		std::string("a\xff", 2), "b"};
+	const int32_t ints[] = {INT32_MIN, -1, 0, 1, INT32_MAX};
+
+	for (uint64_t u : {(uint64_t)0, (uint64_t)1, (uint64_t)256,
+		UINT64_MAX}) {
+
+		for (const auto &str : strs) {
+			for (int32_t i : ints) {
+				tuples.emplace_back(u, str, i);
+			}
+		}
+	}
+
+	/* memcmp() order of keys is the order of tuples,
+	 * last field is descending */
+	for (const auto &a : tuples) {
+		auto ka = user_key::encode(std::get<0>(a), std::get<1>(a),
+			std::get<2>(a));
+		auto dec = user_key::decode(ka);
+
+		TEST_CHECK(dec && (*dec == a));
+
+		for (const auto &b : tuples) {
+			auto kb = user_key::encode(std::get<0>(b),
+				std::get<1>(b), std::get<2>(b));
+			bool key_less = std::lexicographical_compare(
+				ka.data(), ka.data() + ka.size(),
+				kb.data(), kb.data() + kb.size());
+			bool less = (std::tie(std::get<0>(a), std::get<1>(a),
+				std::get<2>(b)) < std::tie(std::get<0>(b),
+				std::get<1>(b), std::get<2>(a)));
+
+			TEST_CHECK(key_less == less);
+		}
+	}
+
+	TEST_CHECK(!user_key::decode(tkvdb::bytes()));
+	try {
+		(void)user_key::encode(1, std::string(300, 'x'), 1);
+		TEST_CHECK(false);
+	} catch (const tkvdb::error &e) {
+		TEST_CHECK(e.code() == TKVDB_INVALID);
+	}
+
+	/* leading fields as prefix */
+	tkvdb::transaction tr;
+	tkvdb::map m(tr);
+	size_t n = 0;
+
+	TEST_CHECK(tr.begin() == TKVDB_OK);
+	for (const auto &t : tuples) {
+		TEST_CHECK(m.insert_or_assign(user_key::encode(std::get<0>(t),
+			std::get<1>(t), std::get<2>(t)), "") == TKVDB_OK);
+	}
+	for (auto [key, val] : m.prefix(user_key::encode(256, "a"))) {
+		auto dec = user_key::decode(key);
+
+		TEST_CHECK(dec && (std::get<0>(*dec) == 256)
+			&& (std::get<1>(*dec) == "a")
+			&& (std::get<2>(*dec) == ints[4 - n]));
+		n++;
+	}
+	TEST_CHECK(n == 5);
+
+	/* integer keys are encoded as key_codec<std::tuple<uint64_t>> */
+	using id_key = tkvdb::key_codec<std::tuple<uint64_t>>;
+
+	TEST_CHECK(tr.put((uint64_t)42, "answer") == TKVDB_OK);
+	auto val = tr.get(id_key::encode(42));
+	TEST_CHECK(val && (tkvdb::as_string_view(*val) == "answer"));
+	TEST_CHECK(tr.get((uint64_t)42).has_value());
+	TEST_CHECK(tr.del((uint64_t)42) == TKVDB_OK);
+	TEST_CHECK(!tr.get((uint64_t)42).has_value());
+	TEST_CHECK(tr.rollback() == TKVDB_OK);
+}
+
+void
+test_pmr(void)
+{
+	/* every block comes from pool and is returned to it */
+	std::pmr::unsynchronized_pool_resource pool;
+	std::pmr::monotonic_buffer_resource arena;
+	tkvdb::params p;
+
+	p.set_allocator(&pool);
+	{
+		tkvdb::transaction tr(p);
+		tkvdb::map m(tr);
+
+		TEST_CHECK(tr.begin() == TKVDB_OK);
+		for (size_t i=0; i<N; i++) {
+			TEST_CHECK(m.insert_or_assign(num(i), num(i))
+				== TKVDB_OK);
+		}
+		TEST_CHECK((size_t)std::distance(m.begin(), m.end()) == N);
+		TEST_CHECK(tr.commit() == TKVDB_OK);
+	}
+
+	/* per-request arena, released with transaction */
+	p.set_allocator(&arena);
+	for (int request=0; request<3; request++) {
+		tkvdb::transaction tr(p);
+
+		TEST_CHECK(tr.begin() == TKVDB_OK);
+		for (size_t i=0; i<N; i++) {
+			TEST_CHECK(tr.put(num(i), "v") == TKVDB_OK);
+		}
+		TEST_CHECK(tr.get(num(N - 1)).has_value());
+		TEST_CHECK(tr.rollback() == TKVDB_OK);
+	}
+}
+
+void
+test_frozen(void)
+{
+	const char fn[] = "data_test_cpp.img";
+	tkvdb::transaction tr;
+
+	TEST_CHECK(tr.begin() == TKVDB_OK);
+	for (size_t i=0; i<N; i++) {
+		TEST_CHECK(tr.put(num(i), "v" + num(i)) == TKVDB_OK);
+	}
+	FILE *f = fopen(fn, "w");
+	TEST_CHECK(f != nullptr);
+	TEST_CHECK(tr.freeze(fileno(f)) == TKVDB_OK);
+	fclose(f);
+
+	{
+		tkvdb::transaction img = tkvdb::transaction::frozen(fn);
+		tkvdb::map m(img);
+
+		TEST_CHECK(img.begin() == TKVDB_OK);
+		TEST_CHECK((size_t)std::distance(m.begin(), m.end()) == N);
+		auto val = img.get(num(N / 2));
+		TEST_CHECK(val
+			&& (tkvdb::as_string_view(*val) == "v" + num(N / 2)));
+		TEST_CHECK(img.put("k", "v") == TKVDB_READONLY);
+	}
+	unlink(fn);
+
+	try {
+		tkvdb::transaction::frozen(fn);
+		TEST_CHECK(false);
+	} catch (const tkvdb::error &e) {
+		TEST_CHECK(e.code() == TKVDB_IO_ERROR);
+	}
+}
+
+
+/* coroutine started immediately, without result */
+struct task
+{
+	struct promise_type
+	{
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() { std::abort(); }
+	};
+};
+
+/* event loop of test */
+struct loop
+{
+	std::deque<std::function<void()>> queue;
+
+	auto executor()
+	{
+		return [this](std::function<void()> f) {
+			queue.push_back(std::move(f));
+		};
+	}
+	void run()
+	{
+		while (!queue.empty()) {
+			auto f = std::move(queue.front());
+			queue.pop_front();
+			f();
+		}
+	}
+};
+
+static task
+lookups(tkvdb::transaction &tr, loop &l, size_t &done)
+{
+	for (size_t i=0; i<N; i++) {
+		std::string key = "k" + num(i);
+		auto val = co_await tr.get_async(key, l.executor());
+
+		TEST_CHECK(val && (tkvdb::as_string_view(*val) == num(i)));
+	}
+	TEST_CHECK(!(co_await tr.get_async("x", l.executor())));
+	done++;
+}
+
+static task
+scan(tkvdb::cursor &c, loop &l, size_t &done)
+{
+	size_t i = 0;
+	TKVDB_RES r;
+
+	for (r = c.first(); r == TKVDB_OK; r = co_await c.next_async(
+		l.executor())) {
+
+		TEST_CHECK(tkvdb::as_string_view(c.key()) == "k" + num(i));
+		i++;
+	}
+	TEST_CHECK((r == TKVDB_NOT_FOUND) && (i == N));
+
+	for (r = c.last(); r == TKVDB_OK; r = co_await c.prev_async(
+		l.executor())) {
+
+		i--;
+		TEST_CHECK(tkvdb::as_string_view(c.key()) == "k" + num(i));
+	}
+	TEST_CHECK((r == TKVDB_NOT_FOUND) && (i == 0));
+	done++;
+}
+
+void
+test_coroutines(void)
+{
+	const char fn[] = "data_test_cpp.tkv";
+
+	unlink(fn);
+	{
+		tkvdb::db db(fn);
+		tkvdb::transaction tr(db);
+		loop l;
+		size_t done = 0;
+
+		TEST_CHECK(tr.begin() == TKVDB_OK);
+		for (size_t i=0; i<N; i++) {
+			TEST_CHECK(tr.put("k" + num(i), num(i)) == TKVDB_OK);
+		}
+		TEST_CHECK(tr.commit() == TKVDB_OK);
+
+		/* drop file from page cache, so coroutines are suspended */
+		int fd = open(fn, O_RDONLY);
+		TEST_CHECK(fd >= 0);
+		TEST_CHECK(fsync(fd) == 0);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+
+		/* both walk the same transaction in turn */
+		TEST_CHECK(tr.begin() == TKVDB_OK);
+		tkvdb::cursor c(tr);
+		lookups(tr, l, done);
+		scan(c, l, done);
+		l.run();
+		TEST_CHECK(done == 2);
+		TEST_CHECK(tr.rollback() == TKVDB_OK);
+	}
+	unlink(fn);
+}
+
+TEST_LIST = {
+	{ "RAII handles", test_raii },
+	{ "keyspace", test_keyspace },
+	{ "map", test_map },
+	{ "key codec", test_key_codec },
+	{ "pmr allocator", test_pmr },
+	{ "frozen image", test_frozen },
+	{ "coroutines", test_coroutines },
+	{ NULL, NULL }
+};
+
@@ -16,13 +16,22 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifndef _GNU_SOURCE
+/* preadv2() */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include "tkvdb.h"
 
@@ -33,6 +42,11 @@
 #define TKVDB_BLOCKTYPE_TRANSACTION  0
 #define TKVDB_BLOCKTYPE_FOOTER       1
 #define TKVDB_BLOCKTYPE_RM_FOOTER    2
+/* copy of last footer written after nodes spilled by uncommitted
+ * transaction, 'transaction_size' is the size of spilled block */
+#define TKVDB_BLOCKTYPE_SPILL_FOOTER 3
+/* flag in footer type, transaction block ends with catalog of keyspaces */
+#define TKVDB_BLOCKTYPE_KEYSPACES    0x80
 
 /* node properties */
 #define TKVDB_NODE_VAL  (1 << 0)
@@ -45,10 +59,18 @@
 
 /* read block size */
 #define TKVDB_READ_SIZE 4096
+/* alignment of offsets, sizes and memory of O_DIRECT I/O */
+#define TKVDB_DIRECT_ALIGN 4096
 
 /* FIXME: allocate stack dynamically */
 #define TKVDB_STACK_MAX_DEPTH 128
 
+/* subnodes requested ahead of cursor after seek */
+#define TKVDB_RA_MIN 2
+
+/* recently requested blocks remembered by cursor (power of 2) */
+#define TKVDB_RA_BLOCKS 256
+
 /* helper macro for executing functions which returns TKVDB_RES */
 #define TKVDB_EXEC(FUNC)                   \
 do {                                       \
@@ -66,9 +88,9 @@ while (NODE->replaced_by) {                \
 
 /* replace node with updated one */
 /* FIXME: (optional) memory barrier? */
-#define TKVDB_REPLACE_NODE(NODE, NEWNODE)  \
-do {                                       \
-	NODE->replaced_by = NEWNODE;       \
+#define TKVDB_REPLACE_NODE(TR, NODE, NEWNODE)        \
+do {                                                 \
+	TKVDB_UNDO_SET(TR, NODE->replaced_by, NEWNODE); \
 } while (0)
 
 struct tkvdb_params
@@ -81,6 +103,19 @@ struct tkvdb_params
 
 	size_t tr_buf_limit;    /* size of transaction buffer */
 	int tr_buf_dynalloc;    /* realloc transaction buffer when needed */
+	size_t tr_spill_size;   /* spill nodes to file when transaction
+	                           takes more memory, 0 to disable */
+	size_t tr_hash_size;    /* entries of point lookup cache,
+	                           0 to disable */
+	size_t crown_size;      /* bytes of top nodes kept by database,
+	                           0 to disable */
+	size_t readahead;       /* max subnodes prefetched by cursors,
+	                           0 to disable */
+	int direct_io;          /* O_DIRECT reads of nodes and writes of
+	                           transactions */
+	int async_commit;       /* tkvdb_commit_async() uses writer thread */
+
+	tkvdb_allocator allocator; /* memory of transactions and cursors */
 };
 
 /* on-disk transaction header */
@@ -114,15 +149,95 @@ struct tkvdb_db_info
 };
 
 /* database */
+/* copy of on-disk node kept in crown */
+struct tkvdb_crown_item
+{
+	uint64_t off;               /* offset of node in file */
+	size_t pos;                 /* position of node in crown buffer */
+};
+
+/* top levels of committed tree, read by transactions instead of file,
+ * valid while root of database is 'root_off' */
+struct tkvdb_crown
+{
+	uint64_t root_off;
+	struct tkvdb_crown_item *items;  /* sorted by offset */
+	size_t nitems;
+	uint8_t *buf;
+	size_t buf_size;
+	size_t buf_allocated;
+};
+
 struct tkvdb
 {
 	int fd;                     /* database file handle */
+	int dfd;                    /* O_DIRECT handle or -1 */
+	char *path;                 /* database file path */
 	struct tkvdb_db_info info;
 
 	tkvdb_params params;        /* database params */
 
 	uint8_t *write_buf;
 	size_t write_buf_allocated;
+
+	/* index of past transactions, built on demand */
+	struct tkvdb_history_item *history;
+	size_t history_size;
+	size_t history_allocated;
+
+	struct tkvdb_crown crown;
+
+	/* changed when file is replaced by compaction */
+	uint64_t generation;
+
+	/* commit running in background, database is used by writer thread
+	 * until it's joined */
+	tkvdb_pending *pending;
+};
+
+/* commit started by tkvdb_commit_async() */
+struct tkvdb_pending
+{
+	tkvdb *db;
+	tkvdb_tr *tr;               /* transaction based on this commit,
+	                             * NULL when it's detached or freed */
+	tkvdb_tr *wtr;              /* transaction committed by writer */
+	pthread_t thread;
+	int running;                /* thread is not joined yet */
+	TKVDB_RES res;
+};
+
+/* named root in database */
+struct tkvdb_keyspace
+{
+	char *name;
+	size_t name_size;
+	uint64_t root_off;          /* committed root, 0 if keyspace is empty */
+	tkvdb_tr *tr;               /* transaction on keyspace root */
+};
+
+/* keyspaces of transaction or database */
+struct tkvdb_catalog
+{
+	struct tkvdb_keyspace *items;
+	size_t size;
+	size_t allocated;
+};
+
+/* on-disk catalog entry (followed by name), catalog is written at the end
+ * of transaction block and followed by 64-bit size of catalog */
+struct tkvdb_catalog_entry
+{
+	uint64_t root_off;
+	uint16_t name_size;
+} __attribute__((packed));
+
+/* past transaction */
+struct tkvdb_history_item
+{
+	uint64_t transaction_id;
+	uint64_t footer_off;
+	uint64_t root_off;
 };
 
 /* on-disk node */
@@ -151,12 +266,40 @@ typedef struct tkvdb_memnode
 
 	struct tkvdb_memnode *replaced_by;
 
-	struct tkvdb_memnode *next[256];  /* subnodes in memory */
-	uint64_t fnext[256];              /* positions of subnodes in file */
+	/* tables of subnodes follow prefix, value and metadata,
+	 * full node has slot for each symbol, small node maps symbols
+	 * to its slots with 'index', leaf has no slots */
+	unsigned int slots;               /* size of tables */
+	unsigned int used;                /* slots taken in small node */
+	uint8_t *index;                   /* slot + 1, NULL in full node */
+	struct tkvdb_memnode **next;      /* subnodes in memory */
+	uint64_t *fnext;                  /* positions of subnodes in file */
 
 	unsigned char prefix_val_meta[1]; /* prefix, value and metadata */
 } tkvdb_memnode;
 
+/* slots of small node, node is replaced by bigger one
+ * when subnode is added to node without free slot
+ * (leaf -> small -> full, see tkvdb_node_slot()) */
+#define TKVDB_SMALL_SLOTS 16
+
+/* index of leaf nodes, read-only */
+static const uint8_t tkvdb_leaf_index[256] = {0};
+
+#define TKVDB_NODE_LEAF(NODE) ((NODE)->slots == 0)
+
+/* slot of subnode in tables of node, -1 if there is no slot for symbol */
+#define TKVDB_SLOT(NODE, SYM)                                             \
+	((NODE)->index ? (int)(NODE)->index[SYM] - 1 : (int)(SYM))
+
+/* subnode in memory and its position in file, NULL or 0 if there is none */
+#define TKVDB_NEXT(NODE, SYM)                                             \
+	(TKVDB_SLOT(NODE, SYM) < 0 ? NULL                                 \
+		: (NODE)->next[TKVDB_SLOT(NODE, SYM)])
+#define TKVDB_FNEXT(NODE, SYM)                                            \
+	(TKVDB_SLOT(NODE, SYM) < 0 ? 0                                    \
+		: (NODE)->fnext[TKVDB_SLOT(NODE, SYM)])
+
 /* transaction in memory */
 struct tkvdb_tr
 {
@@ -164,6 +307,9 @@ struct tkvdb_tr
 	tkvdb_memnode *root;
 
 	int started;
+	uint64_t generation;            /* of db file, checked on reads */
+
+	tkvdb_allocator allocator;      /* nodes, buffer and handle itself */
 
 	uint8_t *tr_buf;                /* transaction buffer */
 	size_t tr_buf_allocated;
@@ -173,13 +319,95 @@ struct tkvdb_tr
 	size_t tr_buf_limit;
 	/* allow reallocation of transaction buffer when needed */
 	int tr_buf_dynalloc;
+
+	/* read-only transaction on historical root */
+	int readonly;
+	uint64_t snapshot_root_off;
+
+	/* read-only transaction on frozen image mapped to memory */
+	const uint8_t *frozen;
+	size_t frozen_size;
+	uint64_t frozen_root;           /* 0 if image is empty */
+
+	/* spill nodes to file when transaction takes more memory */
+	size_t tr_spill_size;
+	int spilled;
+	uint64_t spill_start;           /* file size before first spill */
+	size_t ncursors;                /* spill from tkvdb_put() waits
+	                                 * until cursors are freed */
+
+	/* cache of point lookups, key hash -> node with value,
+	 * entries of older generation are dropped by any change */
+	struct tkvdb_hash_item *hash;
+	size_t hash_size;               /* requested size, 0 if disabled */
+	size_t hash_mask;               /* allocated size - 1 */
+	uint64_t hash_gen;
+
+	size_t readahead;               /* max window of cursors */
+
+	/* savepoints and log of changes made after the first one */
+	struct tkvdb_savepoint_item *savepoints;
+	size_t nsavepoints;
+	size_t savepoints_allocated;
+
+	struct tkvdb_undo_item *undo;
+	size_t undo_size;
+	size_t undo_allocated;
+
+	/* async commit: tree is handed to second transaction with its own
+	 * buffer, new changes are kept as delta until commit is finished */
+	tkvdb_tr *async;
+	tkvdb_pending *pending;
+	int delta;
+	TKVDB_RES async_res;
+
+	/* named keyspaces, each one has its own transaction */
+	struct tkvdb_catalog keyspaces;
+	/* transaction of keyspace points to transaction of default root */
+	tkvdb_tr *parent;
+	size_t ks;                      /* index of keyspace in parent */
+};
+
+/* state of transaction at savepoint */
+struct tkvdb_savepoint_item
+{
+	size_t undo_size;               /* position in undo log */
+	tkvdb_memnode *root;
+	uint8_t *tr_buf_ptr;
+	size_t tr_buf_allocated;
+};
+
+#define TKVDB_UNDO_DATA  0          /* restore old value of field */
+#define TKVDB_UNDO_ALLOC 1          /* free node allocated after savepoint */
+#define TKVDB_UNDO_FREE  2          /* deferred free of detached subtree */
+
+/* undo log entry */
+struct tkvdb_undo_item
+{
+	int type;
+	void *addr;                     /* changed field or node */
+	size_t size;                    /* size of field */
+	uint64_t old;                   /* old value of field */
+};
+
+/* entry of point lookup cache */
+struct tkvdb_hash_item
+{
+	uint64_t gen;                   /* 0 if entry is empty */
+	uint64_t hash;
+	tkvdb_memnode *node;
+	size_t key_size;
+	size_t key_allocated;
+	unsigned char *key;
 };
 
 struct tkvdb_visit_helper
 {
 	tkvdb_memnode *node;
 	int off;                /* index of subnode in node */
+	int ra;                 /* last subnode checked by readahead */
 
+	uint64_t frozen_off;    /* node of frozen image */
 };
 
 /* database cursor */
@@ -189,23 +417,50 @@ struct tkvdb_cursor
 	struct tkvdb_visit_helper stack[TKVDB_STACK_MAX_DEPTH];
 
 	size_t prefix_size;
+	size_t prefix_allocated;
 	unsigned char *prefix;
 
 	size_t val_size;
 	uint8_t *val;
 
+	/* subnodes requested ahead of cursor, grows on each step of
+	 * tkvdb_next()/tkvdb_prev() and starts over after seek */
+	size_t ra_window;
+	/* blocks of file already requested, (offset / block size + 1) */
+	uint64_t ra_blocks[TKVDB_RA_BLOCKS];
+
 	tkvdb_tr *tr;
+	uint64_t gen;                   /* hash_gen of transaction when
+	                                 * stack was checked last time */
+	/* transaction cursor was created on and its allocator,
+	 * cursor may be moved to other transaction by vacuum */
+	tkvdb_tr *origin;
+	tkvdb_allocator allocator;
 };
 
+/* change field of node, old value is saved to undo log when transaction
+ * has savepoints (space in log must be reserved with tkvdb_undo_reserve()) */
+#define TKVDB_UNDO_SET(TR, FIELD, VAL)                                    \
+do {                                                                      \
+	if ((TR)->nsavepoints > 0) {                                      \
+		tkvdb_undo_push(TR, TKVDB_UNDO_DATA, &(FIELD),            \
+			sizeof(FIELD));                                   \
+	}                                                                 \
+	FIELD = VAL;                                                      \
+} while (0)
+
 /* get next subnode (or load from disk) */
 #define TKVDB_SUBNODE_NEXT(TR, NODE, NEXT, OFF)                           \
 do {                                                                      \
-	if (NODE->next[OFF]) {                                            \
-		NEXT = node->next[OFF];                                   \
-	} else if (TR->db && NODE->fnext[OFF]) {                          \
+	int slot = TKVDB_SLOT(NODE, OFF);                                 \
+	if (slot < 0) {                                                   \
+		/* no subnode */                                          \
+	} else if (NODE->next[slot]) {                                    \
+		NEXT = NODE->next[slot];                                  \
+	} else if (TR->db && NODE->fnext[slot]) {                         \
 		tkvdb_memnode *tmp;                                       \
-		TKVDB_EXEC( tkvdb_node_read(TR, NODE->fnext[OFF], &tmp) );\
-		NODE->next[OFF] = tmp;                                    \
+		TKVDB_EXEC( tkvdb_node_read(TR, NODE->fnext[slot], &tmp) );\
+		TKVDB_UNDO_SET(TR, NODE->next[slot], tmp);                \
 		NEXT = tmp;                                               \
 	}                                                                 \
 } while (0)
@@ -230,6 +485,272 @@ do {                                                      \
 } while (0)
 
 
+static TKVDB_RES
+tkvdb_read_full(int fd, void *buf, size_t n, size_t *nread)
+{
+	uint8_t *ptr = buf;
+
+	*nread = 0;
+	while (*nread < n) {
+		ssize_t r = read(fd, ptr + *nread, n - *nread);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return TKVDB_IO_ERROR;
+		}
+		if (r == 0) {
+			/* end of file */
+			break;
+		}
+		*nread += r;
+	}
+
+	return TKVDB_OK;
+}
+
+/* the same at offset, file position of shared descriptor isn't moved */
+static TKVDB_RES
+tkvdb_pread_full(int fd, void *buf, size_t n, uint64_t off, size_t *nread)
+{
+	uint8_t *ptr = buf;
+
+	*nread = 0;
+	while (*nread < n) {
+		ssize_t r = pread(fd, ptr + *nread, n - *nread,
+			off + *nread);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return TKVDB_IO_ERROR;
+		}
+		if (r == 0) {
+			break;
+		}
+		*nread += r;
+	}
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_pwrite_full(int fd, const void *buf, size_t n, uint64_t off)
+{
+	const uint8_t *ptr = buf;
+
+	while (n > 0) {
+		ssize_t r = pwrite(fd, ptr, n, off);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return TKVDB_IO_ERROR;
+		}
+		ptr += r;
+		off += r;
+		n -= r;
+	}
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_write_full(int fd, const void *buf, size_t n)
+{
+	const uint8_t *ptr = buf;
+
+	while (n > 0) {
+		ssize_t r = write(fd, ptr, n);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return TKVDB_IO_ERROR;
+		}
+		ptr += r;
+		n -= r;
+	}
+
+	return TKVDB_OK;
+}
+
+/* pread() from file opened with O_DIRECT, range is extended to aligned
+ * blocks which are read to aligned memory */
+static ssize_t
+tkvdb_direct_pread(int fd, void *buf, size_t n, uint64_t off)
+{
+	uint8_t stack_buf[2 * TKVDB_DIRECT_ALIGN]
+		__attribute__((aligned(TKVDB_DIRECT_ALIGN)));
+	uint8_t *tmp = stack_buf;
+	uint64_t start, end;
+	size_t head;
+	ssize_t r;
+
+	start = off & ~(uint64_t)(TKVDB_DIRECT_ALIGN - 1);
+	end = (off + n + TKVDB_DIRECT_ALIGN - 1)
+		& ~(uint64_t)(TKVDB_DIRECT_ALIGN - 1);
+	head = off - start;
+
+	if (((end - start) > sizeof(stack_buf))
+		&& (posix_memalign((void **)&tmp, TKVDB_DIRECT_ALIGN,
+		end - start) != 0)) {
+
+		errno = ENOMEM;
+		return -1;
+	}
+
+	r = pread(fd, tmp, end - start, start);
+	if (r >= 0) {
+		/* end of file may be inside of range */
+		r = ((size_t)r > head) ? (ssize_t)(r - head) : 0;
+		if ((size_t)r > n) {
+			r = n;
+		}
+		memcpy(buf, tmp + head, r);
+	}
+
+	if (tmp != stack_buf) {
+		free(tmp);
+	}
+	return r;
+}
+
+/* write to file opened with O_DIRECT, unaligned range is written with
+ * blocks at its ends read from file, file is truncated to end of data */
+static TKVDB_RES
+tkvdb_direct_write(int fd, const void *buf, size_t n, uint64_t off)
+{
+	uint64_t start, end;
+	uint8_t *tmp = NULL;
+	const uint8_t *ptr = buf;
+	struct stat st;
+	size_t size;
+	ssize_t r;
+
+	start = off & ~(uint64_t)(TKVDB_DIRECT_ALIGN - 1);
+	end = (off + n + TKVDB_DIRECT_ALIGN - 1)
+		& ~(uint64_t)(TKVDB_DIRECT_ALIGN - 1);
+	size = end - start;
+
+	if ((start != off) || (end != (off + n))
+		|| ((uintptr_t)buf & (TKVDB_DIRECT_ALIGN - 1))) {
+
+		if (fstat(fd, &st) != 0) {
+			return TKVDB_IO_ERROR;
+		}
+		if (posix_memalign((void **)&tmp, TKVDB_DIRECT_ALIGN, size)
+			!= 0) {
+
+			return TKVDB_ENOMEM;
+		}
+
+		/* blocks at the ends, parts beyond end of file are zeroes */
+		memset(tmp, 0, size);
+		if (((start != off) && (pread(fd, tmp, TKVDB_DIRECT_ALIGN,
+			start) < 0))
+			|| ((end != (off + n)) && (pread(fd,
+			tmp + size - TKVDB_DIRECT_ALIGN, TKVDB_DIRECT_ALIGN,
+			end - TKVDB_DIRECT_ALIGN) < 0))) {
+
+			free(tmp);
+			return TKVDB_IO_ERROR;
+		}
+		memcpy(tmp + (off - start), buf, n);
+		ptr = tmp;
+	}
+
+	while (size > 0) {
+		r = pwrite(fd, ptr, size, start);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(tmp);
+			return TKVDB_IO_ERROR;
+		}
+		ptr += r;
+		start += r;
+		size -= r;
+	}
+	free(tmp);
+
+	if ((end != (off + n)) && (end > (uint64_t)st.st_size)) {
+		/* padding of last block is not a part of file */
+		if (ftruncate(fd, ((off + n) > (uint64_t)st.st_size)
+			? (off_t)(off + n) : st.st_size) != 0) {
+
+			return TKVDB_IO_ERROR;
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+/* read nodes of database */
+static ssize_t
+tkvdb_db_pread(tkvdb *db, void *buf, size_t n, uint64_t off)
+{
+	if (db->dfd >= 0) {
+		return tkvdb_direct_pread(db->dfd, buf, n, off);
+	}
+
+	return pread(db->fd, buf, n, off);
+}
+
+/* write block of transaction or footer to database file */
+static TKVDB_RES
+tkvdb_db_write(tkvdb *db, const void *buf, size_t n, uint64_t off)
+{
+	if (db->dfd >= 0) {
+		return tkvdb_direct_write(db->dfd, buf, n, off);
+	}
+
+	if (lseek(db->fd, off, SEEK_SET) != (off_t)off) {
+		return TKVDB_IO_ERROR;
+	}
+	return tkvdb_write_full(db->fd, buf, n);
+}
+
+/* O_DIRECT handle of database file, other reads (footers, catalogs)
+ * are done by buffered handle */
+static TKVDB_RES
+tkvdb_direct_open(tkvdb *db)
+{
+	if (db->dfd >= 0) {
+		close(db->dfd);
+		db->dfd = -1;
+	}
+
+#ifdef O_DIRECT
+	if (db->params.direct_io) {
+		db->dfd = open(db->path, (db->params.flags
+			& ~(O_CREAT | O_TRUNC | O_EXCL)) | O_DIRECT);
+		if (db->dfd < 0) {
+			return TKVDB_IO_ERROR;
+		}
+	}
+#endif
+
+	return TKVDB_OK;
+}
+
+/* memory of write buffer, aligned for O_DIRECT */
+static uint8_t *
+tkvdb_writebuf_alloc(tkvdb *db, size_t size)
+{
+	void *ptr;
+
+	if (db->dfd < 0) {
+		return malloc(size);
+	}
+
+	if (posix_memalign(&ptr, TKVDB_DIRECT_ALIGN, size) != 0) {
+		return NULL;
+	}
+	return ptr;
+}
+
 static TKVDB_RES
 tkvdb_info_read(const int fd, struct tkvdb_db_info *info)
 {
@@ -280,6 +801,26 @@ tkvdb_info_read(const int fd, struct tkvdb_db_info *info)
 	return TKVDB_OK;
 }
 
+/* default allocator, malloc() and free() */
+static void *
+tkvdb_std_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void
+tkvdb_std_free(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+static const tkvdb_allocator tkvdb_std_allocator = {
+	tkvdb_std_alloc, tkvdb_std_free, NULL, NULL
+};
+
 /* fill tkvdb_params with default values */
 void
 tkvdb_params_init(tkvdb_params *params)
@@ -290,99 +831,598 @@ tkvdb_params_init(tkvdb_params *params)
 	params->tr_buf_dynalloc = 1;
 	params->tr_buf_limit = SIZE_MAX;
 
+	params->tr_spill_size = 0;
+	params->tr_hash_size = 0;
+	params->crown_size = 0;
+	params->readahead = 0;
+	params->direct_io = 0;
+	params->async_commit = 0;
+
 	params->flags = O_RDWR | O_CREAT;
 	params->mode = S_IRUSR | S_IWUSR;
+
+	params->allocator = tkvdb_std_allocator;
 }
 
-/* open database file */
-tkvdb *
-tkvdb_open(const char *path, tkvdb_params *user_params)
+tkvdb_params *
+tkvdb_params_create(void)
 {
-	tkvdb *db;
-	TKVDB_RES r;
-
-	db = malloc(sizeof(tkvdb));
-	if (!db) {
-		goto fail;
-	}
+	tkvdb_params *params;
 
-	if (user_params) {
-		db->params = *user_params;
-	} else {
-		tkvdb_params_init(&db->params);
+	params = malloc(sizeof(tkvdb_params));
+	if (!params) {
+		return NULL;
 	}
+	tkvdb_params_init(params);
 
-	db->fd = open(path, db->params.flags, db->params.mode);
-	if (db->fd < 0) {
-		goto fail_free;
-	}
+	return params;
+}
 
-	r = tkvdb_info_read(db->fd, &(db->info));
-	if (r != TKVDB_OK) {
-		/* error */
-		goto fail_close;
+void
+tkvdb_param_set(tkvdb_params *params, TKVDB_PARAM p, int64_t val)
+{
+	switch (p) {
+		case TKVDB_PARAM_TR_DYNALLOC:
+			params->tr_buf_dynalloc = val;
+			break;
+		case TKVDB_PARAM_TR_LIMIT:
+			params->tr_buf_limit = val;
+			break;
+		case TKVDB_PARAM_TR_SPILL:
+			params->tr_spill_size = val;
+			break;
+		case TKVDB_PARAM_TR_HASH:
+			params->tr_hash_size = val;
+			break;
+		case TKVDB_PARAM_CROWN_SIZE:
+			params->crown_size = val;
+			break;
+		case TKVDB_PARAM_CURSOR_READAHEAD:
+			params->readahead = val;
+			break;
+		case TKVDB_PARAM_DIRECT_IO:
+			params->direct_io = val;
+			break;
+		case TKVDB_PARAM_ASYNC_COMMIT:
+			params->async_commit = val;
+			break;
+		case TKVDB_PARAM_WRITE_BUF_DYNALLOC:
+			params->write_buf_dynalloc = val;
+			break;
+		case TKVDB_PARAM_WRITE_BUF_LIMIT:
+			params->write_buf_limit = val;
+			break;
+		case TKVDB_PARAM_DBFILE_OPEN_FLAGS:
+			params->flags = val;
+			break;
+		case TKVDB_PARAM_DBFILE_OPEN_MODE:
+			params->mode = val;
+			break;
+		default:
+			break;
 	}
+}
 
-	/* init params */
-	if (db->params.write_buf_dynalloc) {
-		db->write_buf = NULL;
-		db->write_buf_allocated = 0;
+void
+tkvdb_param_set_allocator(tkvdb_params *params,
+	const tkvdb_allocator *allocator)
+{
+	if (allocator) {
+		params->allocator = *allocator;
 	} else {
-		db->write_buf = malloc(db->params.write_buf_limit);
-		if (!db->write_buf) {
-			goto fail_close;
-		}
-		db->write_buf_allocated = db->params.write_buf_limit;
+		params->allocator = tkvdb_std_allocator;
 	}
+}
 
-	return db;
+void
+tkvdb_params_free(tkvdb_params *params)
+{
+	free(params);
+}
 
-fail_close:
-	close(db->fd);
-fail_free:
-	free(db);
-fail:
-	return NULL;
+/* crown: copies of top nodes of committed tree
+ * nodes are added breadth-first while they fit into 'crown_size' bytes,
+ * crown is rebuilt when root of database changes, nodes which were not
+ * changed by commit are taken from old crown, new ones from write buffer */
+
+static void
+tkvdb_crown_free(struct tkvdb_crown *crown)
+{
+	free(crown->items);
+	free(crown->buf);
+	memset(crown, 0, sizeof(struct tkvdb_crown));
 }
 
-/* close database and free data */
-TKVDB_RES
-tkvdb_close(tkvdb *db)
+static int
+tkvdb_crown_cmp(const void *a, const void *b)
 {
-	TKVDB_RES r = TKVDB_OK;
+	const struct tkvdb_crown_item *ia = a, *ib = b;
 
-	if (!db) {
+	return (ia->off > ib->off) - (ia->off < ib->off);
+}
+
+/* copy of node or NULL if node is not in crown */
+static uint8_t *
+tkvdb_crown_find(const struct tkvdb_crown *crown, uint64_t off)
+{
+	struct tkvdb_crown_item key, *item;
+
+	if (crown->nitems == 0) {
+		return NULL;
+	}
+
+	key.off = off;
+	item = bsearch(&key, crown->items, crown->nitems,
+		sizeof(struct tkvdb_crown_item), &tkvdb_crown_cmp);
+
+	return item ? crown->buf + item->pos : NULL;
+}
+
+/* append node at 'off' to buffer of new crown, node is taken from
+ * 'src' (just written block starting at 'src_off'), old crown or file,
+ * returns TKVDB_ENOMEM if there is no more space in crown */
+static TKVDB_RES
+tkvdb_crown_fetch(tkvdb *db, struct tkvdb_crown *crown, uint64_t off,
+	const uint8_t *src, uint64_t src_off, size_t src_size)
+{
+	const uint8_t *node = NULL;
+	uint32_t size;
+	uint8_t *tmp;
+
+	if (src && (off >= src_off)
+		&& ((off - src_off + sizeof(uint32_t)) <= src_size)) {
+
+		node = src + (off - src_off);
+	} else {
+		node = tkvdb_crown_find(&db->crown, off);
+	}
+
+	if (node) {
+		memcpy(&size, node, sizeof(uint32_t));
+	} else if (tkvdb_db_pread(db, &size, sizeof(uint32_t), off)
+		!= sizeof(uint32_t)) {
+
+		return TKVDB_IO_ERROR;
+	}
+
+	if (size < (sizeof(struct tkvdb_disknode) - 1)) {
+		return TKVDB_CORRUPTED;
+	}
+	if ((crown->buf_size + size) > db->params.crown_size) {
+		return TKVDB_ENOMEM;
+	}
+
+	if ((crown->buf_size + size) > crown->buf_allocated) {
+		size_t new_size = crown->buf_allocated * 2 + size;
+
+		if (new_size > db->params.crown_size) {
+			new_size = db->params.crown_size;
+		}
+		tmp = realloc(crown->buf, new_size);
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		crown->buf = tmp;
+		crown->buf_allocated = new_size;
+	}
+
+	if (node) {
+		memcpy(crown->buf + crown->buf_size, node, size);
+	} else if (tkvdb_db_pread(db, crown->buf + crown->buf_size, size,
+		off) != (ssize_t)size) {
+
+		return TKVDB_IO_ERROR;
+	}
+
+	crown->buf_size += size;
+	return TKVDB_OK;
+}
+
+/* add offsets of subnodes of 'node' to queue of crown */
+static TKVDB_RES
+tkvdb_crown_enqueue(struct tkvdb_crown *crown, size_t *allocated,
+	const uint8_t *node)
+{
+	const struct tkvdb_disknode *disknode;
+	const uint8_t *ptr;
+	size_t i, nsubnodes;
+
+	disknode = (const struct tkvdb_disknode *)node;
+	ptr = disknode->data;
+	nsubnodes = disknode->nsubnodes;
+
+	if (disknode->type & TKVDB_NODE_VAL) {
+		ptr += sizeof(uint32_t);
+	}
+	if (disknode->type & TKVDB_NODE_META) {
+		ptr += sizeof(uint32_t);
+	}
+	if (nsubnodes <= TKVDB_SUBNODES_THR) {
+		/* skip symbols */
+		ptr += nsubnodes;
+	}
+
+	for (i=0; i<((nsubnodes > TKVDB_SUBNODES_THR) ? 256 : nsubnodes);
+		i++) {
+
+		uint64_t off;
+
+		memcpy(&off, ptr + i * sizeof(uint64_t), sizeof(uint64_t));
+		if (off == 0) {
+			continue;
+		}
+
+		if (crown->nitems == *allocated) {
+			struct tkvdb_crown_item *tmp;
+			size_t new_size = *allocated ? *allocated * 2 : 256;
+
+			tmp = realloc(crown->items,
+				new_size * sizeof(struct tkvdb_crown_item));
+			if (!tmp) {
+				return TKVDB_ENOMEM;
+			}
+			crown->items = tmp;
+			*allocated = new_size;
+		}
+		crown->items[crown->nitems].off = off;
+		crown->nitems++;
+	}
+
+	return TKVDB_OK;
+}
+
+/* rebuild crown for current root of database, on error crown is dropped,
+ * database works without it */
+static void
+tkvdb_crown_build(tkvdb *db, const uint8_t *src, uint64_t src_off,
+	size_t src_size)
+{
+	struct tkvdb_crown crown;
+	size_t allocated = 1, i;
+	TKVDB_RES r = TKVDB_OK;
+
+	if ((db->params.crown_size == 0) || (db->info.footer.root_off == 0)
+		|| (db->info.filesize == 0)) {
+
+		tkvdb_crown_free(&db->crown);
+		return;
+	}
+
+	memset(&crown, 0, sizeof(struct tkvdb_crown));
+	crown.root_off = db->info.footer.root_off;
+	crown.items = malloc(sizeof(struct tkvdb_crown_item));
+	if (!crown.items) {
+		tkvdb_crown_free(&db->crown);
+		return;
+	}
+	crown.items[0].off = crown.root_off;
+	crown.nitems = 1;
+
+	/* items form queue of breadth-first walk,
+	 * nodes of items before 'i' are already in buffer */
+	for (i=0; i<crown.nitems; i++) {
+		size_t pos = crown.buf_size;
+
+		r = tkvdb_crown_fetch(db, &crown, crown.items[i].off,
+			src, src_off, src_size);
+		if (r != TKVDB_OK) {
+			break;
+		}
+		crown.items[i].pos = pos;
+
+		r = tkvdb_crown_enqueue(&crown, &allocated, crown.buf + pos);
+		if (r != TKVDB_OK) {
+			i++;
+			break;
+		}
+	}
+
+	if ((r != TKVDB_OK) && (r != TKVDB_ENOMEM)) {
+		/* I/O error or damaged node */
+		tkvdb_crown_free(&crown);
+		tkvdb_crown_free(&db->crown);
+		return;
+	}
+
+	/* nodes which didn't fit are not in crown */
+	crown.nitems = i;
+	qsort(crown.items, crown.nitems, sizeof(struct tkvdb_crown_item),
+		&tkvdb_crown_cmp);
+
+	tkvdb_crown_free(&db->crown);
+	db->crown = crown;
+}
+
+/* background commit: writer thread uses database until it's joined,
+ * so everything else touching database waits for it first */
+static void
+tkvdb_pending_join(tkvdb_pending *p)
+{
+	if (!p->running) {
+		return;
+	}
+
+	pthread_join(p->thread, NULL);
+	p->running = 0;
+	p->db->pending = NULL;
+	if (p->tr) {
+		p->tr->async_res = p->res;
+	}
+}
+
+static void
+tkvdb_db_wait(tkvdb *db)
+{
+	if (db->pending) {
+		tkvdb_pending_join(db->pending);
+	}
+}
+
+/* the same for transactions, writer doesn't wait for itself */
+static void
+tkvdb_tr_wait(tkvdb_tr *tr)
+{
+	if (tr->db && tr->db->pending && (tr->db->pending->wtr != tr)) {
+		tkvdb_pending_join(tr->db->pending);
+	}
+}
+
+/* changes made on pending root are applied after writer is joined */
+static TKVDB_RES tkvdb_tr_settle(tkvdb_tr *tr);
+
+/* check that path still refers to opened file,
+ * it may be replaced by tkvdb_compact_to() in other handle or process */
+static TKVDB_RES
+tkvdb_file_check(tkvdb *db)
+{
+	struct stat st_fd, st_path;
+
+	if (fstat(db->fd, &st_fd) != 0) {
+		return TKVDB_IO_ERROR;
+	}
+	if (stat(db->path, &st_path) != 0) {
+		return (errno == ENOENT) ? TKVDB_MODIFIED : TKVDB_IO_ERROR;
+	}
+	if ((st_fd.st_dev != st_path.st_dev)
+		|| (st_fd.st_ino != st_path.st_ino)) {
+
+		return TKVDB_MODIFIED;
+	}
+
+	return TKVDB_OK;
+}
+
+/* open database file */
+tkvdb *
+tkvdb_open(const char *path, tkvdb_params *user_params)
+{
+	tkvdb *db;
+	TKVDB_RES r;
+
+	db = malloc(sizeof(tkvdb));
+	if (!db) {
+		goto fail;
+	}
+	/* direct I/O descriptor is opened later, but closed on any error */
+	db->dfd = -1;
+	db->generation = 0;
+	db->pending = NULL;
+
+	if (user_params) {
+		db->params = *user_params;
+	} else {
+		tkvdb_params_init(&db->params);
+	}
+
+	db->path = strdup(path);
+	if (!db->path) {
+		goto fail_free;
+	}
+
+	db->fd = open(path, db->params.flags, db->params.mode);
+	if (db->fd < 0) {
+		goto fail_free_path;
+	}
+
+	r = tkvdb_info_read(db->fd, &(db->info));
+	if (r != TKVDB_OK) {
+		/* error */
+		goto fail_close;
+	}
+
+	if (tkvdb_direct_open(db) != TKVDB_OK) {
+		goto fail_close;
+	}
+
+	/* init params */
+	if (db->params.write_buf_dynalloc) {
+		db->write_buf = NULL;
+		db->write_buf_allocated = 0;
+	} else {
+		db->write_buf = tkvdb_writebuf_alloc(db,
+			db->params.write_buf_limit);
+		if (!db->write_buf) {
+			goto fail_close;
+		}
+		db->write_buf_allocated = db->params.write_buf_limit;
+	}
+
+	db->history = NULL;
+	db->history_size = db->history_allocated = 0;
+
+	memset(&db->crown, 0, sizeof(struct tkvdb_crown));
+
+	return db;
+
+fail_close:
+	if (db->dfd >= 0) {
+		close(db->dfd);
+	}
+	close(db->fd);
+fail_free_path:
+	free(db->path);
+fail_free:
+	free(db);
+fail:
+	return NULL;
+}
+
+/* close database and free data */
+TKVDB_RES
+tkvdb_close(tkvdb *db)
+{
+	TKVDB_RES r = TKVDB_OK;
+
+	if (!db) {
 		return TKVDB_OK;
 	}
 
+	tkvdb_db_wait(db);
 	if (close(db->fd) < 0) {
 		r = TKVDB_IO_ERROR;
 	}
+	if ((db->dfd >= 0) && (close(db->dfd) < 0)) {
+		r = TKVDB_IO_ERROR;
+	}
 	if (db->write_buf) {
 		free(db->write_buf);
 	}
+	free(db->history);
+	tkvdb_crown_free(&db->crown);
+	free(db->path);
 
 	free(db);
 	return r;
 }
 
-/* get memory for node
- * memory block is taken from system using malloc()
+/* make sure undo log has space for 'n' more entries */
+static TKVDB_RES
+tkvdb_undo_reserve(tkvdb_tr *tr, size_t n)
+{
+	struct tkvdb_undo_item *tmp;
+	size_t new_size;
+
+	if ((tr->nsavepoints == 0)
+		|| ((tr->undo_size + n) <= tr->undo_allocated)) {
+		return TKVDB_OK;
+	}
+
+	new_size = tr->undo_allocated * 2 + n;
+	tmp = realloc(tr->undo, new_size * sizeof(struct tkvdb_undo_item));
+	if (!tmp) {
+		return TKVDB_ENOMEM;
+	}
+	tr->undo = tmp;
+	tr->undo_allocated = new_size;
+
+	return TKVDB_OK;
+}
+
+/* append entry to undo log, space should be reserved */
+static void
+tkvdb_undo_push(tkvdb_tr *tr, int type, void *addr, size_t size)
+{
+	struct tkvdb_undo_item *item;
+
+	item = &tr->undo[tr->undo_size++];
+	item->type = type;
+	item->addr = addr;
+	item->size = size;
+	if (type == TKVDB_UNDO_DATA) {
+		memcpy(&item->old, addr, size);
+	}
+}
+
+/* offset of tables in memory block of node */
+static size_t
+tkvdb_node_tables_off(size_t prefix_val_meta_size)
+{
+	size_t off;
+
+	off = sizeof(tkvdb_memnode) + prefix_val_meta_size;
+	return (off + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+/* size of memory block of node with 'slots' slots for subnodes
+ * (0 for leaf, TKVDB_SMALL_SLOTS or 256) */
+static size_t
+tkvdb_node_block_size(size_t prefix_val_meta_size, unsigned int slots)
+{
+	size_t size;
+
+	if (slots == 0) {
+		return sizeof(tkvdb_memnode) + prefix_val_meta_size;
+	}
+
+	size = tkvdb_node_tables_off(prefix_val_meta_size);
+	size += slots * (sizeof(tkvdb_memnode *) + sizeof(uint64_t));
+	if (slots < 256) {
+		size += 256 * sizeof(uint8_t);
+	}
+
+	return size;
+}
+
+/* point node to its tables of subnodes */
+static void
+tkvdb_node_set_tables(tkvdb_memnode *node, size_t prefix_val_meta_size,
+	unsigned int slots)
+{
+	node->slots = slots;
+
+	if (slots == 0) {
+		node->index = (uint8_t *)tkvdb_leaf_index;
+		node->next = NULL;
+		node->fnext = NULL;
+		return;
+	}
+
+	node->next = (tkvdb_memnode **)((uint8_t *)node
+		+ tkvdb_node_tables_off(prefix_val_meta_size));
+	node->fnext = (uint64_t *)(node->next + slots);
+	node->index = (slots < 256) ? (uint8_t *)(node->fnext + slots) : NULL;
+}
+
+/* slots for node with given number of subnodes */
+static unsigned int
+tkvdb_node_slots_for(unsigned int nsubnodes)
+{
+	if (nsubnodes == 0) {
+		return 0;
+	} else if (nsubnodes <= TKVDB_SMALL_SLOTS) {
+		return TKVDB_SMALL_SLOTS;
+	}
+
+	return 256;
+}
+
+/* get memory for node with empty tables of subnodes
+ * memory block is taken from transaction allocator
  * when 'tr->tr_buf_dynalloc' is true
  * or from preallocated buffer
  * preallocation occurs in tkvdb_tr_create_m() */
 static tkvdb_memnode *
-tkvdb_node_alloc(tkvdb_tr *tr, size_t node_size)
+tkvdb_node_alloc(tkvdb_tr *tr, size_t prefix_val_meta_size,
+	unsigned int slots)
 {
 	tkvdb_memnode *node;
+	size_t node_size;
+
+	node_size = tkvdb_node_block_size(prefix_val_meta_size, slots);
 
 	if ((tr->tr_buf_allocated + node_size) > tr->tr_buf_limit) {
 		/* memory limit exceeded */
 		return NULL;
 	}
 
+	/* after savepoint node and pointer to it are logged, also when
+	 * node is just read from disk by lookup or cursor */
+	if (tkvdb_undo_reserve(tr, 2) != TKVDB_OK) {
+		return NULL;
+	}
+
 	if (tr->tr_buf_dynalloc) {
-		node = malloc(node_size);
+		node = tr->allocator.alloc(tr->allocator.ctx, node_size);
 		if (!node) {
 			return NULL;
 		}
@@ -395,20 +1435,34 @@ tkvdb_node_alloc(tkvdb_tr *tr, size_t node_size)
 		tr->tr_buf_ptr += node_size;
 	}
 
+	if (tr->tr_buf_dynalloc && (tr->nsavepoints > 0)) {
+		tkvdb_undo_push(tr, TKVDB_UNDO_ALLOC, node, 0);
+	}
+
+	tkvdb_node_set_tables(node, prefix_val_meta_size, slots);
+	node->used = 0;
+	if (slots > 0) {
+		memset(node->next, 0, sizeof(tkvdb_memnode *) * slots);
+		memset(node->fnext, 0, sizeof(uint64_t) * slots);
+	}
+	if ((slots > 0) && node->index) {
+		memset(node->index, 0, 256);
+	}
+
 	tr->tr_buf_allocated += node_size;
 	return node;
 }
 
-/* create new node and append prefix and value */
+/* create new node and append prefix and value,
+ * new subnodes are added with tkvdb_node_link() to just created node
+ * and with tkvdb_node_slot() to others */
 static tkvdb_memnode *
 tkvdb_node_new(tkvdb_tr *tr, int type, size_t prefix_size,
-	const void *prefix, size_t vlen, const void *val)
+	const void *prefix, size_t vlen, const void *val, unsigned int slots)
 {
 	tkvdb_memnode *node;
-	size_t node_size;
 
-	node_size = sizeof(tkvdb_memnode) + prefix_size + vlen;
-	node = tkvdb_node_alloc(tr, node_size);
+	node = tkvdb_node_alloc(tr, prefix_size + vlen, slots);
 	if (!node) {
 		return NULL;
 	}
@@ -426,48 +1480,147 @@ tkvdb_node_new(tkvdb_tr *tr, int type, size_t prefix_size,
 			val, node->val_size);
 	}
 
-	memset(node->next, 0, sizeof(tkvdb_memnode *) * 256);
-	memset(node->fnext, 0, sizeof(uint64_t) * 256);
-
 	node->disk_size = 0;
 	node->disk_off = 0;
 
 	return node;
 }
 
-static void
-tkvdb_clone_subnodes(tkvdb_memnode *dst, tkvdb_memnode *src)
+/* slot for subnode 'sym' of just allocated node, there must be free slot */
+static int
+tkvdb_node_link(tkvdb_memnode *node, int sym)
 {
-	memcpy(dst->next,  src->next, sizeof(tkvdb_memnode *) * 256);
-	memcpy(dst->fnext, src->fnext, sizeof(uint64_t) * 256);
+	if (!node->index) {
+		return sym;
+	}
+	if (!node->index[sym]) {
+		node->index[sym] = ++node->used;
+	}
+
+	return node->index[sym] - 1;
 }
 
-/* read node from disk */
-static TKVDB_RES
-tkvdb_node_read(tkvdb_tr *tr, uint64_t off, tkvdb_memnode **node_ptr)
+/* copy subnodes to just allocated node with enough slots */
+static void
+tkvdb_clone_subnodes(tkvdb_memnode *dst, tkvdb_memnode *src)
 {
-	uint8_t buf[TKVDB_READ_SIZE];
-	ssize_t read_res;
-	struct tkvdb_disknode *disknode;
-	size_t prefix_val_meta_size;
-	uint8_t *ptr;
-	int fd;
+	int i, slot;
 
-	fd = tr->db->fd;
+	if (TKVDB_NODE_LEAF(src)) {
+		return;
+	}
 
-	if (lseek(fd, off, SEEK_SET) != (off_t)off) {
-		return TKVDB_IO_ERROR;
+	if (dst->slots == src->slots) {
+		memcpy(dst->next,  src->next,
+			sizeof(tkvdb_memnode *) * src->slots);
+		memcpy(dst->fnext, src->fnext, sizeof(uint64_t) * src->slots);
+		if (src->index) {
+			memcpy(dst->index, src->index, 256);
+		}
+		dst->used = src->used;
+		return;
 	}
 
-	read_res = read(fd, buf, TKVDB_READ_SIZE);
-	if (read_res < 0) {
-		return TKVDB_IO_ERROR;
+	for (i=0; i<256; i++) {
+		slot = TKVDB_SLOT(src, i);
+		if ((slot >= 0) && (src->next[slot] || src->fnext[slot])) {
+			int dslot = tkvdb_node_link(dst, i);
+
+			dst->next[dslot] = src->next[slot];
+			dst->fnext[dslot] = src->fnext[slot];
+		}
+	}
+}
+
+/* find or take slot for subnode 'sym', node without free slot
+ * is replaced by bigger one (leaf -> small -> full) */
+static TKVDB_RES
+tkvdb_node_slot(tkvdb_tr *tr, tkvdb_memnode **node_ptr, int sym, int *slot)
+{
+	tkvdb_memnode *node = *node_ptr, *bigger;
+
+	*slot = TKVDB_SLOT(node, sym);
+	if (*slot >= 0) {
+		return TKVDB_OK;
 	}
 
-	disknode = (struct tkvdb_disknode *)buf;
+	/* index and counter of slots or new node and pointer to it */
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 2) );
 
-	if (((uint32_t)read_res < disknode->size) && (disknode->size < TKVDB_READ_SIZE)) {
-		return TKVDB_IO_ERROR;
+	if (node->used < node->slots) {
+		*slot = node->used;
+		TKVDB_UNDO_SET(tr, node->index[sym], *slot + 1);
+		TKVDB_UNDO_SET(tr, node->used, node->used + 1);
+		return TKVDB_OK;
+	}
+
+	bigger = tkvdb_node_alloc(tr, node->prefix_size + node->val_size
+		+ node->meta_size,
+		TKVDB_NODE_LEAF(node) ? TKVDB_SMALL_SLOTS : 256);
+	if (!bigger) {
+		return TKVDB_ENOMEM;
+	}
+
+	bigger->type = node->type;
+	bigger->prefix_size = node->prefix_size;
+	bigger->val_size = node->val_size;
+	bigger->meta_size = node->meta_size;
+	bigger->replaced_by = NULL;
+	bigger->disk_size = 0;
+	bigger->disk_off = 0;
+	memcpy(bigger->prefix_val_meta, node->prefix_val_meta,
+		node->prefix_size + node->val_size + node->meta_size);
+	tkvdb_clone_subnodes(bigger, node);
+	*slot = tkvdb_node_link(bigger, sym);
+
+	TKVDB_REPLACE_NODE(tr, node, bigger);
+	*node_ptr = bigger;
+
+	return TKVDB_OK;
+}
+
+/* read node from disk */
+static TKVDB_RES
+tkvdb_node_read(tkvdb_tr *tr, uint64_t off, tkvdb_memnode **node_ptr)
+{
+	uint8_t buf[TKVDB_READ_SIZE], *pinned = NULL;
+	ssize_t read_res;
+	struct tkvdb_disknode *disknode;
+	size_t prefix_val_meta_size;
+	uint8_t *ptr;
+
+	tkvdb_tr_wait(tr);
+	if (tr->generation != tr->db->generation) {
+		/* offset is from file replaced by compaction */
+		return TKVDB_MODIFIED;
+	}
+
+	/* node and pointer to it from parent */
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 2) );
+
+	if (tr->db->crown.root_off == tr->db->info.footer.root_off) {
+		/* whole node is in crown */
+		pinned = tkvdb_crown_find(&tr->db->crown, off);
+	}
+
+	if (pinned) {
+		disknode = (struct tkvdb_disknode *)pinned;
+		read_res = disknode->size;
+	} else {
+		/* pread() doesn't move file position, so nodes of
+		 * committed transactions can be read while other
+		 * transaction is written */
+		read_res = tkvdb_db_pread(tr->db, buf, TKVDB_READ_SIZE, off);
+		if (read_res < 0) {
+			return TKVDB_IO_ERROR;
+		}
+
+		disknode = (struct tkvdb_disknode *)buf;
+
+		if (((uint32_t)read_res < disknode->size)
+			&& (disknode->size < TKVDB_READ_SIZE)) {
+			return TKVDB_IO_ERROR;
+		}
 	}
 
 	/* calculate size of prefix + value + metadata */
@@ -488,9 +1641,9 @@ tkvdb_node_read(tkvdb_tr *tr, uint64_t off, tkvdb_memnode **node_ptr)
 		prefix_val_meta_size -= disknode->nsubnodes * sizeof(uint64_t);
 	}
 
-	/* allocate memnode */
-	*node_ptr = tkvdb_node_alloc(tr, sizeof(tkvdb_memnode)
-		+ prefix_val_meta_size);
+	/* allocate memnode with tables for its subnodes */
+	*node_ptr = tkvdb_node_alloc(tr, prefix_val_meta_size,
+		tkvdb_node_slots_for(disknode->nsubnodes));
 
 	if (!(*node_ptr)) {
 		return TKVDB_ENOMEM;
@@ -515,8 +1668,11 @@ tkvdb_node_read(tkvdb_tr *tr, uint64_t off, tkvdb_memnode **node_ptr)
 		(*node_ptr)->meta_size = *((uint32_t *)ptr);
 		ptr += sizeof(uint32_t);
 	}
-
-	memset((*node_ptr)->next, 0, sizeof(tkvdb_memnode *) * 256);
+	if (!(disknode->type & TKVDB_NODE_VAL)) {
+		/* value of deleted key may be still stored after prefix */
+		(*node_ptr)->val_size = prefix_val_meta_size
+			- (*node_ptr)->prefix_size - (*node_ptr)->meta_size;
+	}
 
 	if (disknode->nsubnodes > TKVDB_SUBNODES_THR) {
 		memcpy((*node_ptr)->fnext, ptr, 256 * sizeof(uint64_t));
@@ -528,24 +1684,31 @@ tkvdb_node_read(tkvdb_tr *tr, uint64_t off, tkvdb_memnode **node_ptr)
 		offptr = (uint64_t *)(ptr
 			+ disknode->nsubnodes * sizeof(uint8_t));
 
-		memset((*node_ptr)->fnext, 0, sizeof(uint64_t) * 256);
-
 		for (i=0; i<disknode->nsubnodes; i++) {
-			(*node_ptr)->fnext[*ptr] = *offptr;
+			(*node_ptr)->fnext[tkvdb_node_link(*node_ptr, *ptr)]
+				= *offptr;
 			ptr++;
 			offptr++;
 		}
 		ptr += disknode->nsubnodes * sizeof(uint64_t);
 	}
 
-	if (disknode->size > TKVDB_READ_SIZE) {
+	if (!pinned && (disknode->size > TKVDB_READ_SIZE)) {
 		/* prefix + value + metadata bigger than read block */
-		size_t blk_tail = disknode->size - prefix_val_meta_size;
+		size_t in_buf = TKVDB_READ_SIZE - (ptr - buf);
+		size_t rest = prefix_val_meta_size - in_buf;
 
-		memcpy((*node_ptr)->prefix_val_meta, ptr,
-			TKVDB_READ_SIZE - blk_tail);
-		ptr += TKVDB_READ_SIZE - blk_tail;
-		read(fd, ptr, disknode->size - (TKVDB_READ_SIZE - blk_tail));
+		if (read_res < TKVDB_READ_SIZE) {
+			return TKVDB_IO_ERROR;
+		}
+
+		memcpy((*node_ptr)->prefix_val_meta, ptr, in_buf);
+		read_res = tkvdb_db_pread(tr->db,
+			(*node_ptr)->prefix_val_meta + in_buf,
+			rest, off + TKVDB_READ_SIZE);
+		if ((read_res < 0) || ((size_t)read_res != rest)) {
+			return TKVDB_IO_ERROR;
+		}
 	} else {
 		memcpy((*node_ptr)->prefix_val_meta, ptr,
 			prefix_val_meta_size);
@@ -554,9 +1717,97 @@ tkvdb_node_read(tkvdb_tr *tr, uint64_t off, tkvdb_memnode **node_ptr)
 	return TKVDB_OK;
 }
 
+/* node is in crown of database */
+static int
+tkvdb_node_pinned(tkvdb_tr *tr, uint64_t off)
+{
+	tkvdb_tr_wait(tr);
+	return (tr->db->crown.root_off == tr->db->info.footer.root_off)
+		&& tkvdb_crown_find(&tr->db->crown, off);
+}
+
+/* start reading of node by kernel without waiting for it,
+ * so reads of several nodes are in flight at once */
+static void
+tkvdb_node_prefetch(tkvdb_tr *tr, uint64_t off)
+{
+	if (tkvdb_node_pinned(tr, off) || (tr->db->dfd >= 0)) {
+		/* node is in memory or page cache is not used */
+		return;
+	}
+
+	posix_fadvise(tr->db->fd, off, TKVDB_READ_SIZE, POSIX_FADV_WILLNEED);
+}
+
+/* node can be read without waiting for disk: it's pinned or its first byte
+ * is in page cache, otherwise reading of node is started */
+static int
+tkvdb_node_ready(tkvdb_tr *tr, uint64_t off)
+{
+#ifdef RWF_NOWAIT
+	uint8_t b;
+	struct iovec iov;
+
+	if (tkvdb_node_pinned(tr, off) || (tr->db->dfd >= 0)) {
+		/* with O_DIRECT read always waits */
+		return 1;
+	}
+
+	iov.iov_base = &b;
+	iov.iov_len = 1;
+	if ((preadv2(tr->db->fd, &iov, 1, off, RWF_NOWAIT) < 0)
+		&& (errno == EAGAIN)) {
+
+		tkvdb_node_prefetch(tr, off);
+		return 0;
+	}
+#else
+	(void)tr;
+	(void)off;
+#endif
+	/* cached, or flag isn't supported and read will wait */
+	return 1;
+}
+
+/* load subnode if it's ready */
+static TKVDB_RES
+tkvdb_subnode_nowait(tkvdb_tr *tr, tkvdb_memnode *node, int slot)
+{
+	tkvdb_memnode *tmp;
+
+	if (node->next[slot]) {
+		return TKVDB_OK;
+	}
+
+	if (!tkvdb_node_ready(tr, node->fnext[slot])) {
+		return TKVDB_AGAIN;
+	}
+
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+	TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[slot], &tmp) );
+	TKVDB_UNDO_SET(tr, node->next[slot], tmp);
+
+	return TKVDB_OK;
+}
+
+/* size of memory block taken by node */
+static size_t
+tkvdb_node_size(const tkvdb_memnode *node)
+{
+	return tkvdb_node_block_size(node->prefix_size + node->val_size
+		+ node->meta_size, node->slots);
+}
+
+/* return memory of single node to transaction allocator */
+static void
+tkvdb_node_dealloc(tkvdb_tr *tr, tkvdb_memnode *node)
+{
+	tr->allocator.free(tr->allocator.ctx, node, tkvdb_node_size(node));
+}
+
 /* free node and subnodes */
 static void
-tkvdb_node_free(tkvdb_memnode *node)
+tkvdb_node_free(tkvdb_tr *tr, tkvdb_memnode *node)
 {
 	size_t stack_size = 0;
 	struct tkvdb_visit_helper stack[TKVDB_STACK_MAX_DEPTH];
@@ -567,14 +1818,14 @@ tkvdb_node_free(tkvdb_memnode *node)
 	for (;;) {
 		if (node->replaced_by) {
 			next = node->replaced_by;
-			free(node);
+			tkvdb_node_dealloc(tr, node);
 			node = next;
 			continue;
 		}
 
 		/* search in subnodes */
 		next = NULL;
-		for (; off<256; off++) {
+		for (; off<(int)node->slots; off++) {
 			if (node->next[off]) {
 				next = node->next[off];
 				break;
@@ -595,7 +1846,7 @@ tkvdb_node_free(tkvdb_memnode *node)
 				break;
 			}
 
-			free(node);
+			tkvdb_node_dealloc(tr, node);
 			/* get node from stack's top */
 			stack_size--;
 			node = stack[stack_size].node;
@@ -603,7 +1854,116 @@ tkvdb_node_free(tkvdb_memnode *node)
 			off++;
 		}
 	}
-	free(node);
+	tkvdb_node_dealloc(tr, node);
+}
+
+/* free detached subtree, deferred while transaction has savepoints */
+static void
+tkvdb_node_release(tkvdb_tr *tr, tkvdb_memnode *node)
+{
+	if (!tr->tr_buf_dynalloc) {
+		/* memory is reclaimed on transaction reset */
+		return;
+	}
+
+	if (tr->nsavepoints > 0) {
+		tkvdb_undo_push(tr, TKVDB_UNDO_FREE, node, 0);
+	} else {
+		tkvdb_node_free(tr, node);
+	}
+}
+
+/* free just allocated node on error path */
+static void
+tkvdb_node_unalloc(tkvdb_tr *tr, tkvdb_memnode *node)
+{
+	if (!tr->tr_buf_dynalloc) {
+		return;
+	}
+
+	if ((tr->undo_size > 0)
+		&& (tr->undo[tr->undo_size - 1].type == TKVDB_UNDO_ALLOC)
+		&& (tr->undo[tr->undo_size - 1].addr == node)) {
+
+		tr->undo_size--;
+	}
+	tkvdb_node_dealloc(tr, node);
+}
+
+/* undo changes back to log position */
+static void
+tkvdb_undo_to(tkvdb_tr *tr, size_t pos)
+{
+	while (tr->undo_size > pos) {
+		struct tkvdb_undo_item *item;
+
+		item = &tr->undo[--tr->undo_size];
+		if (item->type == TKVDB_UNDO_DATA) {
+			memcpy(item->addr, &item->old, item->size);
+		} else if (item->type == TKVDB_UNDO_ALLOC) {
+			tkvdb_node_dealloc(tr, item->addr);
+		}
+		/* detached subtree is attached again, nothing to free */
+	}
+}
+
+/* forget all savepoints and free subtrees detached after them */
+static void
+tkvdb_undo_clear(tkvdb_tr *tr)
+{
+	size_t i;
+
+	for (i=0; i<tr->undo_size; i++) {
+		if (tr->undo[i].type == TKVDB_UNDO_FREE) {
+			tkvdb_node_free(tr, tr->undo[i].addr);
+		}
+	}
+
+	tr->undo_size = 0;
+	tr->nsavepoints = 0;
+}
+
+/* drop cached lookups, nodes may be replaced or freed */
+static void
+tkvdb_hash_invalidate(tkvdb_tr *tr)
+{
+	tr->hash_gen++;
+}
+
+static void
+tkvdb_hash_free(tkvdb_tr *tr)
+{
+	size_t i;
+
+	if (!tr->hash) {
+		return;
+	}
+	for (i=0; i<=tr->hash_mask; i++) {
+		free(tr->hash[i].key);
+	}
+	free(tr->hash);
+	tr->hash = NULL;
+}
+
+/* offset of committed root node, 0 if there is no root on disk */
+static uint64_t
+tkvdb_tr_root_off(tkvdb_tr *tr)
+{
+	if (!tr->db) {
+		return 0;
+	}
+	tkvdb_tr_wait(tr);
+	if (tr->parent) {
+		return tr->parent->keyspaces.items[tr->ks].root_off;
+	}
+	if (tr->readonly) {
+		return tr->snapshot_root_off;
+	}
+	if (tr->db->info.filesize == 0) {
+		return 0;
+	}
+
+	return tr->db->info.footer.root_off;
 }
 
 /* add key-value pair to memory transaction */
@@ -618,16 +1978,32 @@ tkvdb_put(tkvdb_tr *tr, const tkvdb_datum *key, const tkvdb_datum *val)
 		return TKVDB_NOT_STARTED;
 	}
 
+	if (tr->readonly) {
+		return TKVDB_READONLY;
+	}
+
+	tkvdb_hash_invalidate(tr);
+
+	/* spill frees nodes, cursors point to them */
+	if (tr->tr_spill_size && (tr->tr_buf_allocated > tr->tr_spill_size)
+		&& (tr->nsavepoints == 0) && (tr->ncursors == 0)
+		&& !tr->delta) {
+
+		TKVDB_EXEC( tkvdb_tr_spill(tr) );
+	}
+
 	/* new root */
 	if (tr->root == NULL) {
-		if (tr->db && (tr->db->info.filesize > 0)) {
+		/* root allocated after savepoint */
+		TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+		if (!tr->delta && tkvdb_tr_root_off(tr)) {
 			/* we have underlying non-empty db file */
 			TKVDB_EXEC( tkvdb_node_read(tr,
-				tr->db->info.footer.root_off,
+				tkvdb_tr_root_off(tr),
 				&(tr->root)) );
 		} else {
 			tr->root = tkvdb_node_new(tr, TKVDB_NODE_VAL,
-				key->len, key->data, val->len, val->data);
+				key->len, key->data, val->len, val->data, 0);
 			if (!tr->root) {
 				return TKVDB_ENOMEM;
 			}
@@ -641,6 +2017,8 @@ tkvdb_put(tkvdb_tr *tr, const tkvdb_datum *key, const tkvdb_datum *val)
 next_node:
 	TKVDB_SKIP_RNODES(node);
 	pi = 0;
+	/* nodes allocated at this step and pointers to them */
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 8) );
 
 next_byte:
 
@@ -658,7 +2036,10 @@ next_byte:
 
 		if (pi == node->prefix_size) {
 			/* exact match */
-			if ((node->val_size == val->len) && (val->len != 0)) {
+			if ((node->type & TKVDB_NODE_VAL)
+				&& (node->val_size == val->len)
+				&& (val->len != 0)
+				&& (tr->nsavepoints == 0)) {
 				/* same value size, so copy new value and
 					return */
 				memcpy(node->prefix_val_meta
@@ -669,12 +2050,12 @@ next_byte:
 
 			newroot = tkvdb_node_new(tr, TKVDB_NODE_VAL,
 				pi, node->prefix_val_meta,
-				val->len, val->data);
+				val->len, val->data, node->slots);
 			if (!newroot) return TKVDB_ENOMEM;
 
 			tkvdb_clone_subnodes(newroot, node);
 
-			TKVDB_REPLACE_NODE(node, newroot);
+			TKVDB_REPLACE_NODE(tr, node, newroot);
 
 			return TKVDB_OK;
 		}
@@ -689,26 +2070,26 @@ next_byte:
 */
 		newroot = tkvdb_node_new(tr, TKVDB_NODE_VAL, pi,
 			node->prefix_val_meta,
-			val->len, val->data);
+			val->len, val->data, TKVDB_SMALL_SLOTS);
 		if (!newroot) return TKVDB_ENOMEM;
 
 		subnode_rest = tkvdb_node_new(tr, node->type,
 			node->prefix_size - pi - 1,
 			node->prefix_val_meta + pi + 1,
 			node->val_size,
-			node->prefix_val_meta + node->prefix_size);
+			node->prefix_val_meta + node->prefix_size,
+			node->slots);
 
 		if (!subnode_rest) {
-			if (tr->tr_buf_dynalloc) {
-				free(newroot);
-			}
+			tkvdb_node_unalloc(tr, newroot);
 			return TKVDB_ENOMEM;
 		}
 		tkvdb_clone_subnodes(subnode_rest, node);
 
-		newroot->next[node->prefix_val_meta[pi]] = subnode_rest;
+		newroot->next[tkvdb_node_link(newroot,
+			node->prefix_val_meta[pi])] = subnode_rest;
 
-		TKVDB_REPLACE_NODE(node, newroot);
+		TKVDB_REPLACE_NODE(tr, node, newroot);
 
 		return TKVDB_OK;
 	}
@@ -722,34 +2103,39 @@ next_byte:
   next['n'] => [e][w] - tail
 */
 	if (pi >= node->prefix_size) {
-		if (node->next[*sym] != NULL) {
+		int slot = TKVDB_SLOT(node, *sym);
+
+		if ((slot >= 0) && (node->next[slot] != NULL)) {
 			/* continue with next node */
-			node = node->next[*sym];
+			node = node->next[slot];
 			sym++;
 			goto next_node;
-		} else if (tr->db && (node->fnext[*sym] != 0)) {
+		} else if (tr->db && (slot >= 0)
+			&& (node->fnext[slot] != 0)) {
 			tkvdb_memnode *tmp;
 
 			/* load subnode from disk */
-			TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[*sym],
+			TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[slot],
 				&tmp) );
 
-			node->next[*sym] = tmp;
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
 			node = tmp;
 			sym++;
 			goto next_node;
 		} else {
 			tkvdb_memnode *tmp;
 
+			TKVDB_EXEC( tkvdb_node_slot(tr, &node, *sym, &slot) );
+
 			/* allocate tail */
 			tmp = tkvdb_node_new(tr, TKVDB_NODE_VAL,
 				key->len -
 					(sym - (unsigned char *)key->data) - 1,
 				sym + 1,
-				val->len, val->data);
+				val->len, val->data, 0);
 			if (!tmp) return TKVDB_ENOMEM;
 
-			node->next[*sym] = tmp;
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
 			return TKVDB_OK;
 		}
 	}
@@ -767,7 +2153,7 @@ next_byte:
 
 		/* split current node into 3 subnodes */
 		newroot = tkvdb_node_new(tr, 0, pi,
-			node->prefix_val_meta, 0, NULL);
+			node->prefix_val_meta, 0, NULL, TKVDB_SMALL_SLOTS);
 		if (!newroot) return TKVDB_ENOMEM;
 
 		/* rest of prefix (skip current symbol) */
@@ -775,11 +2161,10 @@ next_byte:
 			node->prefix_size - pi - 1,
 			node->prefix_val_meta + pi + 1,
 			node->val_size,
-			node->prefix_val_meta + node->prefix_size);
+			node->prefix_val_meta + node->prefix_size,
+			node->slots);
 		if (!subnode_rest) {
-			if (tr->tr_buf_dynalloc) {
-				free(newroot);
-			}
+			tkvdb_node_unalloc(tr, newroot);
 			return TKVDB_ENOMEM;
 		}
 		tkvdb_clone_subnodes(subnode_rest, node);
@@ -789,19 +2174,18 @@ next_byte:
 			key->len -
 				(sym - (unsigned char *)key->data) - 1,
 			sym + 1,
-			val->len, val->data);
+			val->len, val->data, 0);
 		if (!subnode_key) {
-			if (tr->tr_buf_dynalloc) {
-				free(subnode_rest);
-				free(newroot);
-			}
+			tkvdb_node_unalloc(tr, subnode_rest);
+			tkvdb_node_unalloc(tr, newroot);
 			return TKVDB_ENOMEM;
 		}
 
-		newroot->next[node->prefix_val_meta[pi]] = subnode_rest;
-		newroot->next[*sym] = subnode_key;
+		newroot->next[tkvdb_node_link(newroot,
+			node->prefix_val_meta[pi])] = subnode_rest;
+		newroot->next[tkvdb_node_link(newroot, *sym)] = subnode_key;
 
-		TKVDB_REPLACE_NODE(node, newroot);
+		TKVDB_REPLACE_NODE(tr, node, newroot);
 
 		return TKVDB_OK;
 	}
@@ -820,20 +2204,28 @@ tkvdb_cursor_create(tkvdb_tr *tr)
 {
 	tkvdb_cursor *c;
 
-	c = malloc(sizeof(tkvdb_cursor));
+	c = tr->allocator.alloc(tr->allocator.ctx, sizeof(tkvdb_cursor));
 	if (!c) {
 		return NULL;
 	}
+	c->allocator = tr->allocator;
 
 	c->stack_size = 0;
 
 	c->prefix_size = 0;
+	c->prefix_allocated = 0;
 	c->prefix = NULL;
 
 	c->val_size = 0;
 	c->val = NULL;
 
+	c->ra_window = TKVDB_RA_MIN;
+	memset(c->ra_blocks, 0, sizeof(c->ra_blocks));
+
 	c->tr = tr;
+	c->gen = tr->hash_gen;
+	c->origin = tr;
+	tr->ncursors++;
 
 	return c;
 }
@@ -841,51 +2233,55 @@ tkvdb_cursor_create(tkvdb_tr *tr)
 TKVDB_RES
 tkvdb_cursor_free(tkvdb_cursor *c)
 {
+	tkvdb_allocator a = c->allocator;
+
 	if (c->prefix) {
-		free(c->prefix);
+		a.free(a.ctx, c->prefix, c->prefix_allocated);
 		c->prefix = NULL;
 	}
 	c->prefix_size = 0;
+	c->prefix_allocated = 0;
 
 	c->val_size = 0;
 	c->val = NULL;
 
 	c->stack_size = 0;
 
-	free(c);
+	c->origin->ncursors--;
+	a.free(a.ctx, c, sizeof(tkvdb_cursor));
 
 	return TKVDB_OK;
 }
 
 /* todo: rewrite */
 static int
-tkvdb_cursor_expand_prefix(tkvdb_cursor *c, int n)
+tkvdb_cursor_expand_prefix(tkvdb_cursor *c, size_t n)
 {
 	unsigned char *tmp_pfx;
+	size_t new_size;
 
-	if (n == 0) {
-		/* underflow */
-		if (c->prefix) {
-			free(c->prefix);
-			c->prefix = NULL;
-		}
+	/* buffer is never shrinked, so moving cursor doesn't allocate
+	 * memory after the longest key was seen */
+	if ((c->prefix_size + n) <= c->prefix_allocated) {
 		return TKVDB_OK;
 	}
 
-	/* empty key is ok */
-	if ((c->prefix_size + n) == 0) {
-		free(c->prefix);
-		c->prefix = NULL;
-		return TKVDB_OK;
+	new_size = c->prefix_allocated ? c->prefix_allocated : 64;
+	while (new_size < (c->prefix_size + n)) {
+		new_size *= 2;
 	}
 
-	tmp_pfx = realloc(c->prefix, c->prefix_size + n);
+	tmp_pfx = c->allocator.alloc(c->allocator.ctx, new_size);
 	if (!tmp_pfx) {
-		free(c->prefix);
-		c->prefix = NULL;
 		return TKVDB_ENOMEM;
 	}
+	if (c->prefix) {
+		memcpy(tmp_pfx, c->prefix, c->prefix_size);
+		c->allocator.free(c->allocator.ctx, c->prefix,
+			c->prefix_allocated);
+	}
 	c->prefix = tmp_pfx;
+	c->prefix_allocated = new_size;
 
 	return TKVDB_OK;
 }
@@ -896,6 +2292,7 @@ tkvdb_cursor_push(tkvdb_cursor *c, tkvdb_memnode *node, int off)
 {
 	c->stack[c->stack_size].node = node;
 	c->stack[c->stack_size].off = off;
+	c->stack[c->stack_size].ra = off;
 	c->stack_size++;
 
 	c->val_size = node->val_size;
@@ -908,7 +2305,6 @@ tkvdb_cursor_push(tkvdb_cursor *c, tkvdb_memnode *node, int off)
 static int
 tkvdb_cursor_pop(tkvdb_cursor *c)
 {
-	int r;
 	tkvdb_memnode *node;
 
 	if (c->stack_size <= 1) {
@@ -917,14 +2313,12 @@ tkvdb_cursor_pop(tkvdb_cursor *c)
 
 	node = c->stack[c->stack_size - 1].node;
 	/* erase prefix */
-	if ((r = tkvdb_cursor_expand_prefix(c, -(node->prefix_size + 1)))
-		!= TKVDB_OK) {
-		return r;
-	}
 	c->prefix_size -= node->prefix_size + 1;
 
 	c->stack_size--;
 
+	/* value of node on top of stack, tkvdb_prev() may stop on it */
+	node = c->stack[c->stack_size - 1].node;
 	c->val_size = node->val_size;
 	c->val = node->prefix_val_meta + node->prefix_size;
 
@@ -957,14 +2351,78 @@ static void
 tkvdb_cursor_reset(tkvdb_cursor *c)
 {
 	c->stack_size = 0;
-	if (c->prefix_size && c->prefix) {
-		free(c->prefix);
-		c->prefix = NULL;
-	}
 	c->prefix_size = 0;
 
 	c->val_size = 0;
 	c->val = NULL;
+
+	c->ra_window = TKVDB_RA_MIN;
+}
+
+/* most of nodes share blocks with their siblings, so block requested
+ * recently is not requested again */
+static void
+tkvdb_cursor_prefetch(tkvdb_cursor *c, uint64_t off)
+{
+	uint64_t block = off / TKVDB_READ_SIZE + 1;
+	uint64_t *item = &c->ra_blocks[block & (TKVDB_RA_BLOCKS - 1)];
+
+	if ((*item != block) && !tkvdb_node_pinned(c->tr, off)) {
+		*item = block;
+		posix_fadvise(c->tr->db->fd, off, TKVDB_READ_SIZE,
+			POSIX_FADV_WILLNEED);
+	}
+}
+
+/* request from file subnodes following the one cursor is entering on top
+ * of stack, new ones are requested when half of window is passed */
+static void
+tkvdb_cursor_readahead(tkvdb_cursor *c, int incr, int grow)
+{
+	struct tkvdb_visit_helper *top = &c->stack[c->stack_size - 1];
+	tkvdb_memnode *node = top->node;
+	int sym, step, half = (int)(c->ra_window / 2);
+	size_t n;
+
+	if (!c->tr->db || (c->tr->readahead == 0) || (c->tr->db->dfd >= 0)) {
+		return;
+	}
+
+	if (incr) {
+		if ((top->ra - top->off) > half) {
+			return;
+		}
+		step = 1;
+		sym = (top->ra > top->off ? top->ra : top->off) + step;
+	} else {
+		if ((top->off - top->ra) > half) {
+			return;
+		}
+		step = -1;
+		sym = (top->ra < top->off ? top->ra : top->off) + step;
+	}
+
+	for (n=0; (n < c->ra_window) && (sym >= 0) && (sym < 256);
+		sym+=step) {
+
+		int slot = TKVDB_SLOT(node, sym);
+
+		if (slot < 0) {
+			continue;
+		}
+		n++;
+		if (!node->next[slot] && node->fnext[slot]) {
+			tkvdb_cursor_prefetch(c, node->fnext[slot]);
+		}
+	}
+	top->ra = sym - step;
+
+	if (grow && (c->ra_window < c->tr->readahead)) {
+		c->ra_window *= 2;
+		if (c->ra_window > c->tr->readahead) {
+			c->ra_window = c->tr->readahead;
+		}
+	}
 }
 
 static TKVDB_RES
@@ -1000,6 +2458,10 @@ tkvdb_smallest(tkvdb_cursor *c, tkvdb_memnode *node)
 
 		TKVDB_SUBNODE_SEARCH(c->tr, node, next, off, 1);
 		if (!next) {
+			if (c->stack_size == 0) {
+				/* empty root */
+				return TKVDB_EMPTY;
+			}
 			/* key node and no subnodes, return error */
 			return TKVDB_CORRUPTED;
 		}
@@ -1011,6 +2473,7 @@ tkvdb_smallest(tkvdb_cursor *c, tkvdb_memnode *node)
 
 		/* push node */
 		TKVDB_EXEC( tkvdb_cursor_push(c, node, off) );
+		tkvdb_cursor_readahead(c, 1, 0);
 
 		node = next;
 	}
@@ -1047,6 +2510,8 @@ tkvdb_biggest(tkvdb_cursor *c, tkvdb_memnode *node)
 			if (node->type & TKVDB_NODE_VAL) {
 				TKVDB_EXEC( tkvdb_cursor_push(c, node, -1) );
 				break;
+			} else if (c->stack_size == 0) {
+				return TKVDB_EMPTY;
 			} else {
 				return TKVDB_CORRUPTED;
 			}
@@ -1058,6 +2523,7 @@ tkvdb_biggest(tkvdb_cursor *c, tkvdb_memnode *node)
 		c->prefix_size++;
 
 		TKVDB_EXEC( tkvdb_cursor_push(c, node, off) );
+		tkvdb_cursor_readahead(c, 0, 0);
 
 		node = next;
 	}
@@ -1068,6 +2534,7 @@ tkvdb_biggest(tkvdb_cursor *c, tkvdb_memnode *node)
 static TKVDB_RES
 tkvdb_cursor_load_root(tkvdb_cursor *c)
 {
+	TKVDB_EXEC( tkvdb_tr_settle(c->tr) );
 	if (!c->tr->root) {
 		/* empty root node */
 		if (!c->tr->db) {
@@ -1075,62 +2542,519 @@ tkvdb_cursor_load_root(tkvdb_cursor *c)
 			return TKVDB_EMPTY;
 		}
 
-		if (c->tr->db->info.filesize == 0) {
+		if (tkvdb_tr_root_off(c->tr) == 0) {
 			/* database is empty */
 			return TKVDB_EMPTY;
 		}
 		/* try to read root node */
 		TKVDB_EXEC( tkvdb_node_read(c->tr,
-			c->tr->db->info.footer.root_off, &(c->tr->root)) );
+			tkvdb_tr_root_off(c->tr), &(c->tr->root)) );
 	}
 
 	return TKVDB_OK;
 }
 
-TKVDB_RES
-tkvdb_first(tkvdb_cursor *c)
+/* frozen image
+ *
+ * immutable copy of transaction without pointers and in-memory tables,
+ * file is mapped to memory and nodes are used in place:
+ *
+ *   signature, nodes, footer
+ *
+ * nodes are written after their subnodes, so root is the last one.
+ * node is
+ *   type                    1 byte, TKVDB_NODE_VAL, TKVDB_FROZEN_SUBNODES
+ *                           and log2 of width of subnode offsets
+ *   number of subnodes - 1  1 byte, if node has subnodes
+ *   prefix size             varint
+ *   value size              varint, if node has value
+ *   prefix and value
+ *   symbols of subnodes     sorted
+ *   offsets of subnodes     distance back from node, little-endian */
+#define TKVDB_FROZEN_SIGNATURE "tkvfrz01"
+#define TKVDB_FROZEN_SUBNODES (1 << 2)
+#define TKVDB_FROZEN_WIDTH_SHIFT 4
+
+struct tkvdb_frozen_footer
 {
-	tkvdb_cursor_reset(c);
-	TKVDB_EXEC( tkvdb_cursor_load_root(c) );
-	return tkvdb_smallest(c, c->tr->root);
-}
+	uint64_t root_off;      /* offset of root node, 0 if image is empty */
+	uint64_t nkeys;         /* number of keys */
+	uint8_t signature[8];
+} __attribute__((packed));
 
-TKVDB_RES
-tkvdb_last(tkvdb_cursor *c)
+#define TKVDB_FROZEN_HDRSIZE (sizeof(TKVDB_FROZEN_SIGNATURE) - 1)
+#define TKVDB_FROZEN_FTRSIZE (sizeof(struct tkvdb_frozen_footer))
+
+/* node of frozen image, points to mapped memory */
+struct tkvdb_frozen_node
 {
-	tkvdb_cursor_reset(c);
-	TKVDB_EXEC( tkvdb_cursor_load_root(c) );
-	return tkvdb_biggest(c, c->tr->root);
+	int type;
+	size_t prefix_size;
+	size_t val_size;
+	unsigned int nsubnodes;
+	unsigned int width;     /* width of subnode offset */
+
+	const uint8_t *prefix;  /* prefix followed by value */
+	const uint8_t *syms;    /* symbols of subnodes */
+	const uint8_t *offs;    /* offsets of subnodes */
+	uint64_t off;
+};
+
+static TKVDB_RES
+tkvdb_frozen_varint(const uint8_t **ptr, const uint8_t *end, size_t *val)
+{
+	int shift;
+
+	*val = 0;
+	for (shift=0; shift<64; shift+=7) {
+		if (*ptr >= end) {
+			return TKVDB_CORRUPTED;
+		}
+		*val |= (size_t)(**ptr & 0x7f) << shift;
+		if (!(*((*ptr)++) & 0x80)) {
+			return TKVDB_OK;
+		}
+	}
+
+	return TKVDB_CORRUPTED;
 }
 
-/* seek to key (or to nearest key, less or greater) */
-TKVDB_RES
-tkvdb_seek(tkvdb_cursor *c, const tkvdb_datum *key, TKVDB_SEEK seek)
+/* decode node at offset, nodes are checked to not cross the footer */
+static TKVDB_RES
+tkvdb_frozen_node_read(const tkvdb_tr *tr, uint64_t off,
+	struct tkvdb_frozen_node *n)
 {
-	tkvdb_memnode *node, *next;
+	const uint8_t *ptr, *end;
 
-	const uint8_t *sym;
-	size_t pi;
-	int off = 0;
+	end = tr->frozen + tr->frozen_size - TKVDB_FROZEN_FTRSIZE;
+	if ((off < TKVDB_FROZEN_HDRSIZE)
+		|| (off >= (tr->frozen_size - TKVDB_FROZEN_FTRSIZE))) {
 
-	TKVDB_EXEC( tkvdb_cursor_load_root(c) );
-	tkvdb_cursor_reset(c);
+		return TKVDB_CORRUPTED;
+	}
+	ptr = tr->frozen + off;
+
+	n->off = off;
+	n->type = *ptr++;
+	n->nsubnodes = 0;
+	n->width = 1 << ((n->type >> TKVDB_FROZEN_WIDTH_SHIFT) & 3);
+	if (n->type & TKVDB_FROZEN_SUBNODES) {
+		if (ptr >= end) {
+			return TKVDB_CORRUPTED;
+		}
+		n->nsubnodes = *ptr++ + 1;
+	}
 
-	node = c->tr->root;
-	sym = key->data;
+	TKVDB_EXEC( tkvdb_frozen_varint(&ptr, end, &n->prefix_size) );
+	n->val_size = 0;
+	if (n->type & TKVDB_NODE_VAL) {
+		TKVDB_EXEC( tkvdb_frozen_varint(&ptr, end, &n->val_size) );
+	}
 
-next_node:
-	TKVDB_SKIP_RNODES(node);
-	pi = 0;
+	if (((size_t)(end - ptr) < n->prefix_size)
+		|| ((size_t)(end - ptr) - n->prefix_size < n->val_size)) {
+
+		return TKVDB_CORRUPTED;
+	}
+	n->prefix = ptr;
+	ptr += n->prefix_size + n->val_size;
+
+	if ((size_t)(end - ptr) < (size_t)n->nsubnodes * (1 + n->width)) {
+		return TKVDB_CORRUPTED;
+	}
+	n->syms = ptr;
+	n->offs = ptr + n->nsubnodes;
+
+	return TKVDB_OK;
+}
+
+/* offset of i-th subnode, subnodes are always before node */
+static TKVDB_RES
+tkvdb_frozen_subnode(const struct tkvdb_frozen_node *n, unsigned int i,
+	uint64_t *off)
+{
+	const uint8_t *ptr = n->offs + (size_t)i * n->width;
+	uint64_t dist = 0;
+	unsigned int j;
+
+	for (j=0; j<n->width; j++) {
+		dist |= (uint64_t)ptr[j] << (j * 8);
+	}
+
+	if ((dist == 0) || (dist > (n->off - TKVDB_FROZEN_HDRSIZE))) {
+		return TKVDB_CORRUPTED;
+	}
+	*off = n->off - dist;
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_frozen_get(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val)
+{
+	const unsigned char *sym, *end, *found;
+	struct tkvdb_frozen_node n;
+	uint64_t off;
+
+	if (!tr->frozen_root) {
+		return TKVDB_EMPTY;
+	}
+
+	sym = key->data;
+	end = sym + key->len;
+	off = tr->frozen_root;
+
+	for (;;) {
+		TKVDB_EXEC( tkvdb_frozen_node_read(tr, off, &n) );
+
+		if (((size_t)(end - sym) < n.prefix_size)
+			|| (memcmp(sym, n.prefix, n.prefix_size) != 0)) {
+
+			return TKVDB_NOT_FOUND;
+		}
+		sym += n.prefix_size;
+
+		if (sym == end) {
+			if (!(n.type & TKVDB_NODE_VAL)) {
+				return TKVDB_NOT_FOUND;
+			}
+			val->data = (void *)(n.prefix + n.prefix_size);
+			val->len = n.val_size;
+			return TKVDB_OK;
+		}
+
+		found = memchr(n.syms, *sym, n.nsubnodes);
+		if (!found) {
+			return TKVDB_NOT_FOUND;
+		}
+		TKVDB_EXEC( tkvdb_frozen_subnode(&n, found - n.syms, &off) );
+		sym++;
+	}
+}
+
+/* 'off' is index of subnode (not symbol) for nodes of frozen image */
+static TKVDB_RES
+tkvdb_frozen_push(tkvdb_cursor *c, const struct tkvdb_frozen_node *n,
+	int off)
+{
+	if (c->stack_size >= TKVDB_STACK_MAX_DEPTH) {
+		return TKVDB_ENOMEM;
+	}
+
+	c->stack[c->stack_size].node = NULL;
+	c->stack[c->stack_size].off = off;
+	c->stack[c->stack_size].frozen_off = n->off;
+	c->stack_size++;
+
+	c->val_size = n->val_size;
+	c->val = (uint8_t *)n->prefix + n->prefix_size;
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_frozen_pop(tkvdb_cursor *c, const struct tkvdb_frozen_node *n)
+{
+	if (c->stack_size <= 1) {
+		return TKVDB_NOT_FOUND;
+	}
+
+	c->prefix_size -= n->prefix_size + 1;
+	c->stack_size--;
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_frozen_smallest(tkvdb_cursor *c, uint64_t off)
+{
+	struct tkvdb_frozen_node n;
+
+	for (;;) {
+		TKVDB_EXEC( tkvdb_frozen_node_read(c->tr, off, &n) );
+		TKVDB_EXEC( tkvdb_cursor_append(c, (uint8_t *)n.prefix,
+			n.prefix_size) );
+
+		if (n.type & TKVDB_NODE_VAL) {
+			return tkvdb_frozen_push(c, &n, -1);
+		}
+		if (n.nsubnodes == 0) {
+			return TKVDB_CORRUPTED;
+		}
+
+		TKVDB_EXEC( tkvdb_cursor_append_sym(c, n.syms[0]) );
+		TKVDB_EXEC( tkvdb_frozen_push(c, &n, 0) );
+		TKVDB_EXEC( tkvdb_frozen_subnode(&n, 0, &off) );
+	}
+}
+
+static TKVDB_RES
+tkvdb_frozen_biggest(tkvdb_cursor *c, uint64_t off)
+{
+	struct tkvdb_frozen_node n;
+	unsigned int last;
+
+	for (;;) {
+		TKVDB_EXEC( tkvdb_frozen_node_read(c->tr, off, &n) );
+		TKVDB_EXEC( tkvdb_cursor_append(c, (uint8_t *)n.prefix,
+			n.prefix_size) );
+
+		if (n.nsubnodes == 0) {
+			if (!(n.type & TKVDB_NODE_VAL)) {
+				return TKVDB_CORRUPTED;
+			}
+			return tkvdb_frozen_push(c, &n, -1);
+		}
+
+		last = n.nsubnodes - 1;
+		TKVDB_EXEC( tkvdb_cursor_append_sym(c, n.syms[last]) );
+		TKVDB_EXEC( tkvdb_frozen_push(c, &n, last) );
+		TKVDB_EXEC( tkvdb_frozen_subnode(&n, last, &off) );
+	}
+}
+
+static TKVDB_RES
+tkvdb_frozen_next(tkvdb_cursor *c)
+{
+	struct tkvdb_frozen_node n;
+	struct tkvdb_visit_helper *top;
+	uint64_t off;
+
+	while (c->stack_size > 0) {
+		top = &(c->stack[c->stack_size - 1]);
+		TKVDB_EXEC( tkvdb_frozen_node_read(c->tr, top->frozen_off,
+			&n) );
+
+		top->off++;
+		if (top->off < (int)n.nsubnodes) {
+			TKVDB_EXEC( tkvdb_cursor_append_sym(c,
+				n.syms[top->off]) );
+			TKVDB_EXEC( tkvdb_frozen_subnode(&n, top->off, &off) );
+			return tkvdb_frozen_smallest(c, off);
+		}
+
+		TKVDB_EXEC( tkvdb_frozen_pop(c, &n) );
+	}
+
+	return TKVDB_NOT_FOUND;
+}
+
+static TKVDB_RES
+tkvdb_frozen_prev(tkvdb_cursor *c)
+{
+	struct tkvdb_frozen_node n;
+	struct tkvdb_visit_helper *top;
+	uint64_t off;
+
+	while (c->stack_size > 0) {
+		top = &(c->stack[c->stack_size - 1]);
+		TKVDB_EXEC( tkvdb_frozen_node_read(c->tr, top->frozen_off,
+			&n) );
+
+		top->off--;
+		if ((top->off == -1) && (n.type & TKVDB_NODE_VAL)) {
+			/* key of node itself */
+			c->val_size = n.val_size;
+			c->val = (uint8_t *)n.prefix + n.prefix_size;
+			return TKVDB_OK;
+		}
+
+		if (top->off >= 0) {
+			TKVDB_EXEC( tkvdb_cursor_append_sym(c,
+				n.syms[top->off]) );
+			TKVDB_EXEC( tkvdb_frozen_subnode(&n, top->off, &off) );
+			return tkvdb_frozen_biggest(c, off);
+		}
+
+		TKVDB_EXEC( tkvdb_frozen_pop(c, &n) );
+	}
+
+	return TKVDB_NOT_FOUND;
+}
+
+static TKVDB_RES
+tkvdb_frozen_seek(tkvdb_cursor *c, const tkvdb_datum *key, TKVDB_SEEK seek)
+{
+	const uint8_t *sym, *end;
+	struct tkvdb_frozen_node n;
+	uint64_t off;
+	size_t pi;
+	unsigned int i;
+
+	tkvdb_cursor_reset(c);
+	if (!c->tr->frozen_root) {
+		return TKVDB_EMPTY;
+	}
+
+	sym = key->data;
+	end = sym + key->len;
+	off = c->tr->frozen_root;
+
+	for (;;) {
+		TKVDB_EXEC( tkvdb_frozen_node_read(c->tr, off, &n) );
+
+		for (pi=0; (pi < n.prefix_size) && (sym < end)
+			&& (n.prefix[pi] == *sym); pi++) {
+
+			sym++;
+		}
+
+		if ((pi < n.prefix_size) && (sym < end)) {
+			/* prefix differs from key */
+			if (seek == TKVDB_SEEK_EQ) {
+				tkvdb_cursor_reset(c);
+				return TKVDB_NOT_FOUND;
+			}
+			if ((seek == TKVDB_SEEK_LE) && (n.prefix[pi] < *sym)) {
+				/* all keys of node are lesser */
+				return tkvdb_frozen_biggest(c, off);
+			}
+			if ((seek == TKVDB_SEEK_GE) && (n.prefix[pi] > *sym)) {
+				return tkvdb_frozen_smallest(c, off);
+			}
+
+			/* skip keys of node */
+			TKVDB_EXEC( tkvdb_cursor_append(c, (uint8_t *)n.prefix,
+				n.prefix_size) );
+			if (seek == TKVDB_SEEK_LE) {
+				TKVDB_EXEC( tkvdb_frozen_push(c, &n, -1) );
+				return tkvdb_frozen_prev(c);
+			}
+			TKVDB_EXEC( tkvdb_frozen_push(c, &n,
+				(int)n.nsubnodes - 1) );
+			return tkvdb_frozen_next(c);
+		}
+
+		if (sym == end) {
+			/* end of key */
+			if ((pi == n.prefix_size)
+				&& (n.type & TKVDB_NODE_VAL)) {
+
+				TKVDB_EXEC( tkvdb_cursor_append(c,
+					(uint8_t *)n.prefix, n.prefix_size) );
+				return tkvdb_frozen_push(c, &n, -1);
+			}
+			if (seek == TKVDB_SEEK_EQ) {
+				tkvdb_cursor_reset(c);
+				return TKVDB_NOT_FOUND;
+			}
+
+			/* key is lesser than all keys of node */
+			TKVDB_EXEC( tkvdb_frozen_smallest(c, off) );
+			if (seek == TKVDB_SEEK_LE) {
+				return tkvdb_frozen_prev(c);
+			}
+			return TKVDB_OK;
+		}
+
+		/* end of prefix (but not the key) */
+		for (i=0; (i < n.nsubnodes) && (n.syms[i] < *sym); i++);
+
+		if ((i < n.nsubnodes) && (n.syms[i] == *sym)) {
+			TKVDB_EXEC( tkvdb_cursor_append(c, (uint8_t *)n.prefix,
+				n.prefix_size) );
+			TKVDB_EXEC( tkvdb_cursor_append_sym(c, *sym) );
+			TKVDB_EXEC( tkvdb_frozen_push(c, &n, i) );
+			TKVDB_EXEC( tkvdb_frozen_subnode(&n, i, &off) );
+			sym++;
+			continue;
+		}
+
+		if (seek == TKVDB_SEEK_EQ) {
+			tkvdb_cursor_reset(c);
+			return TKVDB_NOT_FOUND;
+		}
+
+		TKVDB_EXEC( tkvdb_cursor_append(c, (uint8_t *)n.prefix,
+			n.prefix_size) );
+		if (seek == TKVDB_SEEK_LE) {
+			if (i > 0) {
+				/* the biggest key of lesser subnode */
+				i--;
+			} else {
+				/* node key or key before node */
+				TKVDB_EXEC( tkvdb_frozen_push(c, &n, 0) );
+				return tkvdb_frozen_prev(c);
+			}
+			TKVDB_EXEC( tkvdb_cursor_append_sym(c, n.syms[i]) );
+			TKVDB_EXEC( tkvdb_frozen_push(c, &n, i) );
+			TKVDB_EXEC( tkvdb_frozen_subnode(&n, i, &off) );
+			return tkvdb_frozen_biggest(c, off);
+		}
+
+		/* greater */
+		if (i < n.nsubnodes) {
+			TKVDB_EXEC( tkvdb_cursor_append_sym(c, n.syms[i]) );
+			TKVDB_EXEC( tkvdb_frozen_push(c, &n, i) );
+			TKVDB_EXEC( tkvdb_frozen_subnode(&n, i, &off) );
+			return tkvdb_frozen_smallest(c, off);
+		}
+		TKVDB_EXEC( tkvdb_frozen_push(c, &n, (int)n.nsubnodes - 1) );
+		return tkvdb_frozen_next(c);
+	}
+}
+
+TKVDB_RES
+tkvdb_first(tkvdb_cursor *c)
+{
+	tkvdb_cursor_reset(c);
+	if (c->tr->frozen) {
+		if (!c->tr->frozen_root) {
+			return TKVDB_EMPTY;
+		}
+		return tkvdb_frozen_smallest(c, c->tr->frozen_root);
+	}
+	TKVDB_EXEC( tkvdb_cursor_load_root(c) );
+	return tkvdb_smallest(c, c->tr->root);
+}
+
+TKVDB_RES
+tkvdb_last(tkvdb_cursor *c)
+{
+	tkvdb_cursor_reset(c);
+	if (c->tr->frozen) {
+		if (!c->tr->frozen_root) {
+			return TKVDB_EMPTY;
+		}
+		return tkvdb_frozen_biggest(c, c->tr->frozen_root);
+	}
+	TKVDB_EXEC( tkvdb_cursor_load_root(c) );
+	return tkvdb_biggest(c, c->tr->root);
+}
+
+/* seek to key (or to nearest key, less or greater) */
+TKVDB_RES
+tkvdb_seek(tkvdb_cursor *c, const tkvdb_datum *key, TKVDB_SEEK seek)
+{
+	tkvdb_memnode *node, *next;
+
+	const uint8_t *sym;
+	size_t pi;
+	int off = 0;
+
+	if (c->tr->frozen) {
+		return tkvdb_frozen_seek(c, key, seek);
+	}
+
+	TKVDB_EXEC( tkvdb_cursor_load_root(c) );
+	tkvdb_cursor_reset(c);
+
+	node = c->tr->root;
+	sym = key->data;
+
+next_node:
+	TKVDB_SKIP_RNODES(node);
+	pi = 0;
 
 next_byte:
 	if (sym >= ((uint8_t *)key->data + key->len)) {
 		/* end of key */
 		if ((pi == node->prefix_size)
 			&& (node->type & TKVDB_NODE_VAL)) {
+			/* exact match, next key is in subnodes */
 			TKVDB_EXEC ( tkvdb_cursor_append(c,
 				node->prefix_val_meta, node->prefix_size) );
-			TKVDB_EXEC ( tkvdb_cursor_push(c, node, *sym) );
+			TKVDB_EXEC ( tkvdb_cursor_push(c, node, -1) );
 			return TKVDB_OK;
 		}
 
@@ -1176,6 +3100,11 @@ next_byte:
 				return tkvdb_biggest(c, next);
 			}
 			if (node->type & TKVDB_NODE_VAL) {
+				/* key of node is the nearest lesser */
+				TKVDB_EXEC ( tkvdb_cursor_append(c,
+					node->prefix_val_meta,
+					node->prefix_size) );
+				TKVDB_EXEC ( tkvdb_cursor_push(c, node, -1) );
 				return TKVDB_OK;
 			}
 			TKVDB_EXEC ( tkvdb_smallest(c, node) );
@@ -1230,12 +3159,74 @@ next_byte:
 	return TKVDB_OK;
 }
 
+/* check if nodes on stack were replaced by tkvdb_put(),
+ * subnodes must not be loaded into old nodes */
+static int
+tkvdb_cursor_stale(tkvdb_cursor *c)
+{
+	size_t i;
+
+	if (c->gen == c->tr->hash_gen) {
+		return 0;
+	}
+
+	for (i=0; i<c->stack_size; i++) {
+		if (c->stack[i].node->replaced_by) {
+			return 1;
+		}
+	}
+	c->gen = c->tr->hash_gen;
+
+	return 0;
+}
+
+/* move stale cursor to the same key in new nodes,
+ * 'moved' is set if key is not found and cursor is on the next one */
+static TKVDB_RES
+tkvdb_cursor_follow(tkvdb_cursor *c, TKVDB_SEEK seek, int *moved)
+{
+	tkvdb_datum key;
+	TKVDB_RES r;
+
+	*moved = 0;
+	if (!tkvdb_cursor_stale(c)) {
+		return TKVDB_OK;
+	}
+
+	key.len = c->prefix_size;
+	key.data = malloc(key.len + 1);
+	if (!key.data) {
+		return TKVDB_ENOMEM;
+	}
+	memcpy(key.data, c->prefix, key.len);
+
+	r = tkvdb_seek(c, &key, seek);
+	if ((r == TKVDB_OK) && ((c->prefix_size != key.len)
+		|| (memcmp(c->prefix, key.data, key.len) != 0))) {
+
+		*moved = 1;
+	}
+	free(key.data);
+	c->gen = c->tr->hash_gen;
+
+	return r;
+}
+
 TKVDB_RES
 tkvdb_next(tkvdb_cursor *c)
 {
-	int *off;
+	int *off, moved;
 	tkvdb_memnode *node, *next;
 
+	if (c->tr->frozen) {
+		return tkvdb_frozen_next(c);
+	}
+
+	TKVDB_EXEC( tkvdb_cursor_follow(c, TKVDB_SEEK_GE, &moved) );
+	if (moved) {
+		return TKVDB_OK;
+	}
+
 	for (;;) {
 		if (c->stack_size < 1) {
 			break;
@@ -1254,6 +3245,8 @@ tkvdb_next(tkvdb_cursor *c)
 		TKVDB_SUBNODE_SEARCH(c->tr, node, next, *off, 1);
 
 		if (next) {
+			tkvdb_cursor_readahead(c, 1, 1);
+
 			/* expand cursor key */
 			TKVDB_EXEC( tkvdb_cursor_expand_prefix(c, 1) );
 			c->prefix[c->prefix_size] = *off;
@@ -1272,9 +3265,18 @@ tkvdb_next(tkvdb_cursor *c)
 TKVDB_RES
 tkvdb_prev(tkvdb_cursor *c)
 {
-	int *off;
+	int *off, moved;
 	tkvdb_memnode *node, *next = NULL;
 
+	if (c->tr->frozen) {
+		return tkvdb_frozen_prev(c);
+	}
+
+	TKVDB_EXEC( tkvdb_cursor_follow(c, TKVDB_SEEK_LE, &moved) );
+	if (moved) {
+		return TKVDB_OK;
+	}
+
 	for (;;) {
 		if (c->stack_size < 1) {
 			return TKVDB_NOT_FOUND;
@@ -1297,6 +3299,8 @@ tkvdb_prev(tkvdb_cursor *c)
 		TKVDB_SUBNODE_SEARCH(c->tr, node, next, *off, 0);
 
 		if (next) {
+			tkvdb_cursor_readahead(c, 0, 1);
+
 			TKVDB_EXEC( tkvdb_cursor_expand_prefix(c, 1) );
 			c->prefix[c->prefix_size] = *off;
 			c->prefix_size++;
@@ -1314,8 +3318,95 @@ tkvdb_prev(tkvdb_cursor *c)
 	return TKVDB_OK;
 }
 
-void *
-tkvdb_cursor_key(tkvdb_cursor *c)
+/* load nodes tkvdb_next() (incr) or tkvdb_prev() is going to visit,
+ * cursor is not moved */
+static TKVDB_RES
+tkvdb_cursor_load(tkvdb_cursor *c, int incr)
+{
+	tkvdb_memnode *node = NULL, *next;
+	size_t depth;
+	int sym, slot, step = incr ? 1 : -1;
+
+	if (c->tr->frozen || !c->tr->db || tkvdb_cursor_stale(c)) {
+		/* stale cursor is moved by tkvdb_next() (tkvdb_prev()) */
+		return TKVDB_OK;
+	}
+
+	/* sibling to the right (left) of current key */
+	for (depth=c->stack_size; (depth > 0) && !node; depth--) {
+		struct tkvdb_visit_helper *top = &c->stack[depth - 1];
+
+		sym = top->off + step;
+		if (sym < 0) {
+			if ((sym == -1) && (top->node->type & TKVDB_NODE_VAL)) {
+				/* tkvdb_prev() stops on node */
+				return TKVDB_OK;
+			}
+			continue;
+		}
+
+		for (; (sym >= 0) && (sym < 256); sym+=step) {
+			slot = TKVDB_SLOT(top->node, sym);
+			if ((slot >= 0) && (top->node->next[slot]
+				|| top->node->fnext[slot])) {
+
+				TKVDB_EXEC( tkvdb_subnode_nowait(c->tr,
+					top->node, slot) );
+				node = top->node->next[slot];
+				break;
+			}
+		}
+
+		if (!node && !incr && (top->node->type & TKVDB_NODE_VAL)) {
+			return TKVDB_OK;
+		}
+	}
+
+	/* and path to its smallest (biggest) key */
+	while (node) {
+		TKVDB_SKIP_RNODES(node);
+		if (incr && (node->type & TKVDB_NODE_VAL)) {
+			break;
+		}
+
+		next = NULL;
+		for (sym=(incr ? 0 : 255); (sym >= 0) && (sym < 256);
+			sym+=step) {
+
+			slot = TKVDB_SLOT(node, sym);
+			if ((slot >= 0) && (node->next[slot]
+				|| node->fnext[slot])) {
+
+				TKVDB_EXEC( tkvdb_subnode_nowait(c->tr,
+					node, slot) );
+				next = node->next[slot];
+				break;
+			}
+		}
+		node = next;
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_next_nowait(tkvdb_cursor *c)
+{
+	TKVDB_EXEC( tkvdb_cursor_load(c, 1) );
+
+	return tkvdb_next(c);
+}
+
+TKVDB_RES
+tkvdb_prev_nowait(tkvdb_cursor *c)
+{
+	TKVDB_EXEC( tkvdb_cursor_load(c, 0) );
+
+	return tkvdb_prev(c);
+}
+
+void *
+tkvdb_cursor_key(tkvdb_cursor *c)
 {
 	return c->prefix;
 }
@@ -1338,31 +3429,353 @@ tkvdb_cursor_valsize(tkvdb_cursor *c)
 	return c->val_size;
 }
 
+static TKVDB_RES tkvdb_footer_read(int fd, uint64_t *off,
+	struct tkvdb_tr_footer *footer);
+
+/* keyspaces */
+static void
+tkvdb_catalog_free(struct tkvdb_catalog *cat)
+{
+	size_t i;
+
+	for (i=0; i<cat->size; i++) {
+		free(cat->items[i].name);
+	}
+	free(cat->items);
+
+	cat->items = NULL;
+	cat->size = cat->allocated = 0;
+}
+
+/* find keyspace by name or add empty one */
+static TKVDB_RES
+tkvdb_catalog_add(struct tkvdb_catalog *cat, const char *name,
+	size_t name_size, size_t *idx)
+{
+	struct tkvdb_keyspace *ks;
+	size_t i;
+
+	for (i=0; i<cat->size; i++) {
+		if ((cat->items[i].name_size == name_size)
+			&& (memcmp(cat->items[i].name, name, name_size) == 0)) {
+
+			*idx = i;
+			return TKVDB_OK;
+		}
+	}
+
+	if (cat->size == cat->allocated) {
+		struct tkvdb_keyspace *tmp;
+		size_t new_size = cat->allocated * 2 + 4;
+
+		tmp = realloc(cat->items,
+			new_size * sizeof(struct tkvdb_keyspace));
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		cat->items = tmp;
+		cat->allocated = new_size;
+	}
+
+	ks = &cat->items[cat->size];
+	ks->name = malloc(name_size + 1);
+	if (!ks->name) {
+		return TKVDB_ENOMEM;
+	}
+	memcpy(ks->name, name, name_size);
+	ks->name[name_size] = '\0';
+	ks->name_size = name_size;
+	ks->root_off = 0;
+	ks->tr = NULL;
+
+	*idx = cat->size++;
+
+	return TKVDB_OK;
+}
+
+/* read roots of keyspaces from catalog of committed transaction,
+ * keyspaces which are not in catalog are empty */
+static TKVDB_RES
+tkvdb_catalog_read(int fd, const struct tkvdb_tr_footer *footer,
+	struct tkvdb_catalog *cat)
+{
+	uint64_t transaction_off, trailer_off, size;
+	uint8_t *buf, *ptr, *end;
+	size_t i, nread;
+	TKVDB_RES r;
+
+	for (i=0; i<cat->size; i++) {
+		cat->items[i].root_off = 0;
+	}
+
+	if (!(footer->type & TKVDB_BLOCKTYPE_KEYSPACES)) {
+		return TKVDB_OK;
+	}
+
+	if ((footer->root_off < sizeof(struct tkvdb_tr_header))
+		|| (footer->transaction_size < (sizeof(struct tkvdb_tr_header)
+		+ sizeof(uint64_t)))) {
+
+		return TKVDB_CORRUPTED;
+	}
+	transaction_off = footer->root_off - sizeof(struct tkvdb_tr_header);
+	trailer_off = transaction_off + footer->transaction_size
+		- sizeof(uint64_t);
+
+	/* size of catalog is at the end of transaction block */
+	if (lseek(fd, trailer_off, SEEK_SET) != (off_t)trailer_off) {
+		return TKVDB_IO_ERROR;
+	}
+	TKVDB_EXEC( tkvdb_read_full(fd, &size, sizeof(uint64_t), &nread) );
+	if ((nread != sizeof(uint64_t))
+		|| (size > (footer->transaction_size
+		- sizeof(struct tkvdb_tr_header) - sizeof(uint64_t)))) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		return TKVDB_ENOMEM;
+	}
+
+	if (lseek(fd, trailer_off - size, SEEK_SET)
+		!= (off_t)(trailer_off - size)) {
+
+		r = TKVDB_IO_ERROR;
+		goto end;
+	}
+	r = tkvdb_read_full(fd, buf, size, &nread);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+	if (nread != size) {
+		r = TKVDB_CORRUPTED;
+		goto end;
+	}
+
+	ptr = buf;
+	end = buf + size;
+	while (ptr < end) {
+		struct tkvdb_catalog_entry entry;
+		size_t idx;
+
+		if ((size_t)(end - ptr) < sizeof(struct tkvdb_catalog_entry)) {
+			r = TKVDB_CORRUPTED;
+			goto end;
+		}
+		memcpy(&entry, ptr, sizeof(struct tkvdb_catalog_entry));
+		ptr += sizeof(struct tkvdb_catalog_entry);
+
+		if ((size_t)(end - ptr) < entry.name_size) {
+			r = TKVDB_CORRUPTED;
+			goto end;
+		}
+		r = tkvdb_catalog_add(cat, (const char *)ptr, entry.name_size,
+			&idx);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+		cat->items[idx].root_off = entry.root_off;
+		ptr += entry.name_size;
+	}
+
+	r = TKVDB_OK;
+
+end:
+	free(buf);
+	return r;
+}
+
+/* read catalog of last committed transaction */
+static TKVDB_RES
+tkvdb_catalog_load(tkvdb *db, const struct tkvdb_db_info *info,
+	struct tkvdb_catalog *cat)
+{
+	struct tkvdb_tr_footer footer;
+
+	memset(&footer, 0, sizeof(struct tkvdb_tr_footer));
+
+	if ((info->filesize > 0)
+		&& (info->footer.type == TKVDB_BLOCKTYPE_SPILL_FOOTER)) {
+
+		/* catalog is in block of committed transaction */
+		uint64_t off = info->filesize - TKVDB_TR_FTRSIZE;
+		TKVDB_RES r;
+
+		r = tkvdb_footer_read(db->fd, &off, &footer);
+		if (r == TKVDB_EMPTY) {
+			memset(&footer, 0, sizeof(struct tkvdb_tr_footer));
+		} else if (r != TKVDB_OK) {
+			return r;
+		}
+	} else if (info->filesize > 0) {
+		footer = info->footer;
+	}
+
+	return tkvdb_catalog_read(db->fd, &footer, cat);
+}
+
+/* size of on-disk catalog with trailer, 0 if all keyspaces are empty */
+static size_t
+tkvdb_catalog_size(const struct tkvdb_catalog *cat)
+{
+	size_t i, size = 0;
+
+	for (i=0; i<cat->size; i++) {
+		if (cat->items[i].root_off) {
+			size += sizeof(struct tkvdb_catalog_entry)
+				+ cat->items[i].name_size;
+		}
+	}
+
+	return size ? (size + sizeof(uint64_t)) : 0;
+}
+
+static void
+tkvdb_catalog_write(const struct tkvdb_catalog *cat, uint8_t *buf,
+	size_t size)
+{
+	uint64_t entries_size = size - sizeof(uint64_t);
+	size_t i;
+
+	for (i=0; i<cat->size; i++) {
+		struct tkvdb_catalog_entry entry;
+
+		if (!cat->items[i].root_off) {
+			continue;
+		}
+
+		entry.root_off = cat->items[i].root_off;
+		entry.name_size = cat->items[i].name_size;
+		memcpy(buf, &entry, sizeof(struct tkvdb_catalog_entry));
+		buf += sizeof(struct tkvdb_catalog_entry);
+		memcpy(buf, cat->items[i].name, cat->items[i].name_size);
+		buf += cat->items[i].name_size;
+	}
+
+	memcpy(buf, &entries_size, sizeof(uint64_t));
+}
+
+static tkvdb_tr *tkvdb_tr_create_a(tkvdb *db, size_t limit, int dynalloc,
+	const tkvdb_allocator *allocator);
+
 tkvdb_tr *
-tkvdb_tr_create_m(tkvdb *db, size_t limit, int dynalloc)
+tkvdb_tr_keyspace(tkvdb_tr *tr, const char *name)
+{
+	tkvdb_tr *ks_tr;
+	size_t idx, name_size;
+
+	if (tr->parent) {
+		tr = tr->parent;
+	}
+
+	if (tkvdb_tr_settle(tr) != TKVDB_OK) {
+		return NULL;
+	}
+
+	if (tr->frozen) {
+		/* image has only default root */
+		return NULL;
+	}
+
+	name_size = strlen(name);
+	if (name_size > UINT16_MAX) {
+		return NULL;
+	}
+
+	if (tkvdb_catalog_add(&tr->keyspaces, name, name_size, &idx)
+		!= TKVDB_OK) {
+
+		return NULL;
+	}
+
+	if (tr->keyspaces.items[idx].tr) {
+		return tr->keyspaces.items[idx].tr;
+	}
+
+	ks_tr = tkvdb_tr_create_a(tr->db, tr->tr_buf_limit,
+		tr->tr_buf_dynalloc, &tr->allocator);
+	if (!ks_tr) {
+		return NULL;
+	}
+	ks_tr->tr_spill_size = tr->tr_spill_size;
+	ks_tr->hash_size = tr->hash_size;
+	ks_tr->readahead = tr->readahead;
+
+	ks_tr->parent = tr;
+	ks_tr->ks = idx;
+	ks_tr->readonly = tr->readonly;
+	ks_tr->started = tr->started;
+
+	tr->keyspaces.items[idx].tr = ks_tr;
+
+	return ks_tr;
+}
+
+static tkvdb_tr *
+tkvdb_tr_create_a(tkvdb *db, size_t limit, int dynalloc,
+	const tkvdb_allocator *allocator)
 {
 	tkvdb_tr *tr;
 
-	tr = malloc(sizeof(tkvdb_tr));
+	tr = allocator->alloc(allocator->ctx, sizeof(tkvdb_tr));
 	if (!tr) {
 		return NULL;
 	}
 
+	tr->allocator = *allocator;
 	tr->db = db;
 	tr->root = NULL;
 
 	tr->started = 0;
+	tr->generation = db ? db->generation : 0;
+
+	tr->readonly = 0;
+	tr->snapshot_root_off = 0;
+
+	tr->frozen = NULL;
+	tr->frozen_size = 0;
+	tr->frozen_root = 0;
+
+	tr->tr_spill_size = db ? db->params.tr_spill_size : 0;
+	tr->spilled = 0;
+	tr->spill_start = 0;
+	tr->ncursors = 0;
+
+	tr->hash = NULL;
+	tr->hash_size = db ? db->params.tr_hash_size : 0;
+	tr->hash_mask = 0;
+	tr->hash_gen = 1;
+
+	tr->readahead = db ? db->params.readahead : 0;
+
+	tr->savepoints = NULL;
+	tr->nsavepoints = tr->savepoints_allocated = 0;
+	tr->undo = NULL;
+	tr->undo_size = tr->undo_allocated = 0;
+
+	tr->async = NULL;
+	tr->pending = NULL;
+	tr->delta = 0;
+	tr->async_res = TKVDB_OK;
+
+	tr->keyspaces.items = NULL;
+	tr->keyspaces.size = tr->keyspaces.allocated = 0;
+	tr->parent = NULL;
+	tr->ks = 0;
 
 	tr->tr_buf_dynalloc = dynalloc;
 	tr->tr_buf_limit = limit;
 
 	if (!tr->tr_buf_dynalloc) {
-		tr->tr_buf = malloc(tr->tr_buf_limit);
+		tr->tr_buf = allocator->alloc(allocator->ctx,
+			tr->tr_buf_limit);
 		if (tr->tr_buf) {
 			tr->tr_buf_ptr = tr->tr_buf;
 		} else {
-			free(tr);
-			tr = NULL;
+			allocator->free(allocator->ctx, tr, sizeof(tkvdb_tr));
+			return NULL;
 		}
 	} else {
 		tr->tr_buf = NULL;
@@ -1373,6 +3786,29 @@ tkvdb_tr_create_m(tkvdb *db, size_t limit, int dynalloc)
 	return tr;
 }
 
+tkvdb_tr *
+tkvdb_tr_create_m(tkvdb *db, size_t limit, int dynalloc)
+{
+	return tkvdb_tr_create_a(db, limit, dynalloc,
+		db ? &db->params.allocator : &tkvdb_std_allocator);
+}
+
+tkvdb_tr *
+tkvdb_tr_create_p(tkvdb *db, const tkvdb_params *params)
+{
+	tkvdb_tr *tr;
+
+	tr = tkvdb_tr_create_a(db, params->tr_buf_limit,
+		params->tr_buf_dynalloc, &params->allocator);
+	if (tr) {
+		tr->tr_spill_size = db ? params->tr_spill_size : 0;
+		tr->hash_size = params->tr_hash_size;
+		tr->readahead = params->readahead;
+	}
+
+	return tr;
+}
+
 tkvdb_tr *
 tkvdb_tr_create(tkvdb *db)
 {
@@ -1395,9 +3831,14 @@ tkvdb_tr_create(tkvdb *db)
 static void
 tkvdb_tr_reset(tkvdb_tr *tr)
 {
+	size_t i;
+
+	tkvdb_undo_clear(tr);
+	tkvdb_hash_invalidate(tr);
+
 	if (tr->tr_buf_dynalloc) {
 		if (tr->root) {
-			tkvdb_node_free(tr->root);
+			tkvdb_node_free(tr, tr->root);
 		}
 	} else {
 		tr->tr_buf_ptr = tr->tr_buf;
@@ -1407,37 +3848,138 @@ tkvdb_tr_reset(tkvdb_tr *tr)
 
 	tr->tr_buf_allocated = 0;
 	tr->started = 0;
+	tr->spilled = 0;
+
+	/* keyspaces are the part of the same transaction */
+	for (i=0; i<tr->keyspaces.size; i++) {
+		if (tr->keyspaces.items[i].tr) {
+			tkvdb_tr_reset(tr->keyspaces.items[i].tr);
+		}
+	}
+}
+
+/* free transaction, memory of allocator with reset() is not returned
+ * block by block, it's dropped at once by tkvdb_tr_free() */
+static void
+tkvdb_tr_destroy(tkvdb_tr *tr)
+{
+	tkvdb_allocator a = tr->allocator;
+
+	if (!a.reset) {
+		if (tr->tr_buf_dynalloc) {
+			tkvdb_tr_reset(tr);
+		} else {
+			a.free(a.ctx, tr->tr_buf, tr->tr_buf_limit);
+		}
+	}
+
+	tkvdb_hash_free(tr);
+	free(tr->savepoints);
+	free(tr->undo);
+	if (tr->frozen) {
+		munmap((void *)tr->frozen, tr->frozen_size);
+	}
+	if (!a.reset) {
+		a.free(a.ctx, tr, sizeof(tkvdb_tr));
+	}
 }
 
 void
 tkvdb_tr_free(tkvdb_tr *tr)
 {
-	if (tr->tr_buf_dynalloc) {
-		tkvdb_tr_reset(tr);
-	} else {
-		free(tr->tr_buf);
+	size_t i;
+	tkvdb_allocator a;
+
+	if (tr->parent) {
+		/* transaction of keyspace is freed with parent */
+		return;
+	}
+
+	if (tr->pending) {
+		/* handle of pending commit is freed by tkvdb_commit_wait() */
+		tkvdb_pending_join(tr->pending);
+		tr->pending->tr = NULL;
+	}
+	if (tr->async) {
+		tkvdb_tr_destroy(tr->async);
+	}
+
+	for (i=0; i<tr->keyspaces.size; i++) {
+		tkvdb_tr *ks_tr = tr->keyspaces.items[i].tr;
+
+		if (ks_tr) {
+			ks_tr->parent = NULL;
+			tkvdb_tr_destroy(ks_tr);
+		}
 	}
+	tkvdb_catalog_free(&tr->keyspaces);
 
-	free(tr);
+	a = tr->allocator;
+	tkvdb_tr_destroy(tr);
+	if (a.reset) {
+		a.reset(a.ctx);
+	}
 }
 
 
+static void
+tkvdb_keyspaces_start(tkvdb_tr *tr)
+{
+	size_t i;
+
+	for (i=0; i<tr->keyspaces.size; i++) {
+		if (tr->keyspaces.items[i].tr) {
+			tr->keyspaces.items[i].tr->started = 1;
+			tr->keyspaces.items[i].tr->generation = tr->generation;
+		}
+	}
+}
+
 TKVDB_RES
 tkvdb_begin(tkvdb_tr *tr)
 {
+	if (tr->parent) {
+		/* keyspaces are started together */
+		return tkvdb_begin(tr->parent);
+	}
+
 	if (tr->started) {
 		/* ignore if transaction is already started */
 		return TKVDB_OK;
 	}
 
-	if (!tr->db) {
-		/* no underlying database file */
+	if (tr->delta && tr->db->pending && (tr->db->pending == tr->pending)) {
+		/* changes are collected without reading database until
+		 * background commit is finished */
+		tr->started = 1;
+		return TKVDB_OK;
+	}
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+
+	if (!tr->db || tr->readonly) {
+		/* no underlying database file or historical root */
 		tr->started = 1;
+		tkvdb_keyspaces_start(tr);
 		return TKVDB_OK;
 	}
 
+	/* background commit of other transaction changes root */
+	tkvdb_tr_wait(tr);
+
+	/* file may be replaced by compaction in other handle */
+	TKVDB_EXEC( tkvdb_file_check(tr->db) );
+	tr->generation = tr->db->generation;
+
 	/* read database info to find root node */
 	TKVDB_EXEC( tkvdb_info_read(tr->db->fd, &(tr->db->info)) );
+	if (tr->db->params.crown_size
+		&& (tr->db->crown.root_off != tr->db->info.footer.root_off)) {
+		/* first transaction or committed by other process */
+		tkvdb_crown_build(tr->db, NULL, 0, 0);
+	}
+	/* and roots of keyspaces */
+	TKVDB_EXEC( tkvdb_catalog_load(tr->db, &(tr->db->info),
+		&(tr->keyspaces)) );
 
 	if (tr->db->info.filesize == 0) {
 		memset(&(tr->db->info.footer),
@@ -1448,6 +3990,7 @@ tkvdb_begin(tkvdb_tr *tr)
 	}
 
 	tr->started = 1;
+	tkvdb_keyspaces_start(tr);
 
 	return TKVDB_OK;
 }
@@ -1455,28 +3998,85 @@ tkvdb_begin(tkvdb_tr *tr)
 TKVDB_RES
 tkvdb_rollback(tkvdb_tr *tr)
 {
-	tkvdb_tr_reset(tr);
-
-	return TKVDB_OK;
-}
+	int spilled;
+	uint64_t spill_start;
+	size_t i;
 
-static TKVDB_RES
-tkvdb_writebuf_realloc(tkvdb *db, size_t new_size)
-{
-	if (new_size > db->params.write_buf_limit) {
-		/* not enough space for node in buffer */
-		return TKVDB_ENOMEM;
+	if (tr->parent) {
+		return tkvdb_rollback(tr->parent);
 	}
-	if (new_size > db->write_buf_allocated) {
+
+	/* keyspaces may spill too, find the first spilled block */
+	spilled = tr->spilled;
+	spill_start = tr->spill_start;
+	for (i=0; i<tr->keyspaces.size; i++) {
+		tkvdb_tr *ks_tr = tr->keyspaces.items[i].tr;
+
+		if (ks_tr && ks_tr->spilled
+			&& (!spilled || (ks_tr->spill_start < spill_start))) {
+
+			spilled = 1;
+			spill_start = ks_tr->spill_start;
+		}
+	}
+
+	if (spilled) {
+		struct tkvdb_db_info info;
+
+		/* drop spilled nodes if nothing was written after them */
+		if ((tr->generation == tr->db->generation)
+			&& (tkvdb_info_read(tr->db->fd, &info) == TKVDB_OK)
+			&& (info.filesize == tr->db->info.filesize)
+			&& (ftruncate(tr->db->fd, spill_start) == 0)) {
+
+			tr->db->info.filesize = spill_start;
+		}
+	}
+
+	tkvdb_tr_reset(tr);
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_writebuf_realloc(tkvdb *db, size_t new_size)
+{
+	if (new_size > db->params.write_buf_limit) {
+		/* not enough space for node in buffer */
+		return TKVDB_ENOMEM;
+	}
+	if (new_size > db->write_buf_allocated) {
 		uint8_t *tmp;
 
 		if (!db->params.write_buf_dynalloc) {
 			return TKVDB_ENOMEM;
 		}
 
-		tmp = realloc(db->write_buf, new_size);
-		if (!tmp) {
-			return TKVDB_ENOMEM;
+		/* buffer is extended for each node, so grow it
+		 * geometrically instead of by size of node */
+		if (new_size < db->write_buf_allocated * 2) {
+			new_size = db->write_buf_allocated * 2;
+		}
+		if (new_size > db->params.write_buf_limit) {
+			new_size = db->params.write_buf_limit;
+		}
+
+		if (db->dfd >= 0) {
+			/* realloc() doesn't keep alignment */
+			tmp = tkvdb_writebuf_alloc(db, new_size);
+			if (!tmp) {
+				return TKVDB_ENOMEM;
+			}
+			if (db->write_buf) {
+				memcpy(tmp, db->write_buf,
+					db->write_buf_allocated);
+				free(db->write_buf);
+			}
+		} else {
+			tmp = realloc(db->write_buf, new_size);
+			if (!tmp) {
+				return TKVDB_ENOMEM;
+			}
 		}
 
 		db->write_buf = tmp;
@@ -1486,19 +4086,37 @@ tkvdb_writebuf_realloc(tkvdb *db, size_t new_size)
 	return TKVDB_OK;
 }
 
-/* compact node and put it to write buffer */
+/* with O_DIRECT zeroes after nodes of block appended at 'block_off' keep
+ * end of file aligned, so next block is written without reading,
+ * 'tail' is size of data following nodes */
 static TKVDB_RES
-tkvdb_node_to_buf(tkvdb *db, tkvdb_memnode *node, uint64_t transaction_off)
+tkvdb_writebuf_pad(tkvdb *db, uint64_t block_off, uint64_t *node_off,
+	size_t tail)
 {
-	struct tkvdb_disknode *disknode;
-	uint8_t *ptr;
-	uint64_t iobuf_off;
+	uint64_t end = *node_off + tail;
+	size_t pad;
 
-	iobuf_off = node->disk_off - transaction_off;
+	if (db->dfd < 0) {
+		return TKVDB_OK;
+	}
 
-	TKVDB_EXEC( tkvdb_writebuf_realloc(db, iobuf_off + node->disk_size) );
+	pad = (TKVDB_DIRECT_ALIGN - end % TKVDB_DIRECT_ALIGN)
+		% TKVDB_DIRECT_ALIGN;
+	TKVDB_EXEC( tkvdb_writebuf_realloc(db, *node_off - block_off + pad) );
+	memset(db->write_buf + (*node_off - block_off), 0, pad);
+	*node_off += pad;
+
+	return TKVDB_OK;
+}
+
+/* serialize node with calculated disk size to memory */
+static void
+tkvdb_node_serialize(tkvdb_memnode *node, uint8_t *buf)
+{
+	struct tkvdb_disknode *disknode;
+	uint8_t *ptr;
 
-	disknode = (struct tkvdb_disknode *)(db->write_buf + iobuf_off);
+	disknode = (struct tkvdb_disknode *)buf;
 
 	disknode->size = node->disk_size;
 	disknode->type = node->type;
@@ -1517,6 +4135,7 @@ tkvdb_node_to_buf(tkvdb *db, tkvdb_memnode *node, uint64_t transaction_off)
 	}
 
 	if (node->nsubnodes > TKVDB_SUBNODES_THR) {
+		/* only full node has so many subnodes */
 		memcpy(ptr, node->fnext, sizeof(uint64_t) * 256);
 		ptr += sizeof(uint64_t) * 256;
 	} else {
@@ -1526,12 +4145,12 @@ tkvdb_node_to_buf(tkvdb *db, tkvdb_memnode *node, uint64_t transaction_off)
 		/* array of next symbols */
 		symbols = ptr;
 		ptr += node->nsubnodes * sizeof(uint8_t);
-		for (i=0; i<256; i++) {
-			if (node->fnext[i]) {
+		for (i=0; (node->nsubnodes > 0) && (i<256); i++) {
+			if (TKVDB_FNEXT(node, i)) {
 				*symbols = i;
 				symbols++;
 
-				*((uint64_t *)ptr) = node->fnext[i];
+				*((uint64_t *)ptr) = TKVDB_FNEXT(node, i);
 				ptr += sizeof(uint64_t);
 			}
 		}
@@ -1539,6 +4158,19 @@ tkvdb_node_to_buf(tkvdb *db, tkvdb_memnode *node, uint64_t transaction_off)
 
 	memcpy(ptr, node->prefix_val_meta, node->prefix_size + node->val_size
 		+ node->meta_size);
+}
+
+/* compact node and put it to write buffer */
+static TKVDB_RES
+tkvdb_node_to_buf(tkvdb *db, tkvdb_memnode *node, uint64_t transaction_off)
+{
+	uint64_t iobuf_off;
+
+	iobuf_off = node->disk_off - transaction_off;
+
+	TKVDB_EXEC( tkvdb_writebuf_realloc(db, iobuf_off + node->disk_size) );
+
+	tkvdb_node_serialize(node, db->write_buf + iobuf_off);
 
 	return TKVDB_OK;
 }
@@ -1551,7 +4183,7 @@ tkvdb_node_calc_disksize(tkvdb_memnode *node)
 
 	node->nsubnodes = 0;
 
-	for (i=0; i<256; i++) {
+	for (i=0; i<node->slots; i++) {
 		if (node->next[i] || node->fnext[i]) {
 			node->nsubnodes++;
 		}
@@ -1581,26 +4213,141 @@ tkvdb_node_calc_disksize(tkvdb_memnode *node)
 		+ node->meta_size;
 }
 
-/* commit and return new root offset */
+/* first symbol starting from 'sym' with subnode in memory, 256 if none */
+static int
+tkvdb_next_sym(const tkvdb_memnode *node, int sym)
+{
+	if (TKVDB_NODE_LEAF(node)) {
+		return 256;
+	}
+
+	if (!node->index) {
+		for (; sym<256; sym++) {
+			if (node->next[sym]) {
+				break;
+			}
+		}
+		return sym;
+	}
+
+	/* index of small node is mostly empty, skip it word by word */
+	for (; sym<256; sym++) {
+		if ((sym % sizeof(uint64_t)) == 0) {
+			uint64_t w;
+
+			memcpy(&w, node->index + sym, sizeof(uint64_t));
+			if (w == 0) {
+				sym += sizeof(uint64_t) - 1;
+				continue;
+			}
+		}
+		if (node->index[sym] && node->next[node->index[sym] - 1]) {
+			break;
+		}
+	}
+	return sym;
+}
+
+/* calculate offsets of nodes in subtree and put them to write buffer,
+ * 'node_off_ptr' is offset of subtree root in file,
+ * on return it's set to the end of subtree */
 static TKVDB_RES
-tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
+tkvdb_subtree_to_buf(tkvdb *db, tkvdb_memnode *node, uint64_t transaction_off,
+	uint64_t *node_off_ptr)
 {
 	size_t stack_depth = 0;
 	struct tkvdb_visit_helper stack[TKVDB_STACK_MAX_DEPTH];
 
+	/* offset of next node in file */
+	uint64_t node_off = *node_off_ptr;
+	/* size of last accessed node, will be added to node_off */
+	uint64_t last_node_size = 0;
+	int off = 0;
+
+	/* now iterate through nodes in transaction */
+	for (;;) {
+		tkvdb_memnode *next;
+
+		TKVDB_SKIP_RNODES(node);
+
+		if (node->disk_size == 0) {
+			tkvdb_node_calc_disksize(node);
+
+			node->disk_off = node_off;
+			last_node_size = node->disk_size;
+		}
+
+		off = tkvdb_next_sym(node, off);
+		next = (off < 256) ? TKVDB_NEXT(node, off) : NULL;
+
+		if (next) {
+			TKVDB_SKIP_RNODES(next);
+
+			node_off += last_node_size;
+			node->fnext[TKVDB_SLOT(node, off)] = node_off;
+
+			/* push node and position to stack */
+			stack[stack_depth].node = node;
+			stack[stack_depth].off = off;
+			stack_depth++;
+
+			node = next;
+			off = 0;
+		} else {
+			/* no more subnodes, serialize node to memory buffer */
+			TKVDB_EXEC( tkvdb_node_to_buf(db, node,
+				transaction_off) );
+
+			/* pop */
+			if (stack_depth == 0) {
+				break;
+			}
+
+			stack_depth--;
+			node = stack[stack_depth].node;
+			off  = stack[stack_depth].off + 1;
+		}
+	}
+
+	*node_off_ptr = node_off + last_node_size;
+
+	return TKVDB_OK;
+}
+
+/* memory taken by transaction and its keyspaces,
+ * 'changed' is set if any of roots was modified */
+static size_t
+tkvdb_tr_allocated(tkvdb_tr *tr, int *changed)
+{
+	size_t i, allocated = tr->tr_buf_allocated;
+
+	*changed = (tr->root != NULL);
+	for (i=0; i<tr->keyspaces.size; i++) {
+		tkvdb_tr *ks_tr = tr->keyspaces.items[i].tr;
+
+		if (ks_tr && ks_tr->root) {
+			allocated += ks_tr->tr_buf_allocated;
+			*changed = 1;
+		}
+	}
+
+	return allocated;
+}
+
+/* commit and return new root offset */
+static TKVDB_RES
+tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
+{
 	struct tkvdb_db_info info;
 
 	/* offset of whole transaction in file */
 	uint64_t transaction_off;
-	/* offset of next node in file */
+	/* end of last node in file */
 	uint64_t node_off;
-	/* size of last accessed node, will be added to node_off */
-	uint64_t last_node_size;
-	int append;
+	int append, changed;
+	size_t allocated, catalog_size, i;
 	struct tkvdb_tr_header *header_ptr;
 
-	tkvdb_memnode *node;
-	int off = 0;
 	TKVDB_RES r = TKVDB_OK;
 
 	if (!tr->started) {
@@ -1612,12 +4359,27 @@ tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
 		return TKVDB_OK;
 	}
 
-	if (!tr->root) {
+	if (tr->readonly) {
+		tkvdb_tr_reset(tr);
+		return TKVDB_READONLY;
+	}
+
+	/* one commit at a time, writer thread doesn't wait for itself */
+	tkvdb_tr_wait(tr);
+
+	allocated = tkvdb_tr_allocated(tr, &changed);
+	if (!changed) {
 		/* empty transaction, rollback */
 		tkvdb_tr_reset(tr);
 		return TKVDB_OK;
 	}
 
+	/* nodes reference offsets in file replaced by compaction */
+	if (tr->generation != tr->db->generation) {
+		return TKVDB_MODIFIED;
+	}
+	TKVDB_EXEC( tkvdb_file_check(tr->db) );
+
 	/* read transaction footer before commit to make some checks */
 	TKVDB_EXEC( tkvdb_info_read(tr->db->fd, &info) );
 
@@ -1634,7 +4396,7 @@ tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
 		}
 
 		if ((info.footer.gap_end - info.footer.gap_begin)
-			> tr->tr_buf_allocated) {
+			> allocated) {
 
 			/* we have enough space in vacuumed gap */
 			transaction_off = info.footer.gap_begin;
@@ -1654,82 +4416,87 @@ tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
 		append = 1;
 	}
 
+	if (!tr->root) {
+		/* only keyspaces was changed, but block starts with root */
+		if (tkvdb_tr_root_off(tr)) {
+			r = tkvdb_node_read(tr, tkvdb_tr_root_off(tr),
+				&(tr->root));
+			if (r != TKVDB_OK) {
+				goto fail_node_to_buf;
+			}
+		} else {
+			tr->root = tkvdb_node_new(tr, 0, 0, NULL, 0, NULL, 0);
+			if (!tr->root) {
+				r = TKVDB_ENOMEM;
+				goto fail_node_to_buf;
+			}
+		}
+	}
+
 	/* first node offset, skip transaction header */
 	node_off = transaction_off + sizeof(struct tkvdb_tr_header);
 
-	last_node_size = 0;
-
-	/* now iterate through nodes in transaction */
-	node = tr->root;
-
-	for (;;) {
-		tkvdb_memnode *next;
-
-		TKVDB_SKIP_RNODES(node);
+	r = tkvdb_subtree_to_buf(tr->db, tr->root, transaction_off, &node_off);
+	if (r != TKVDB_OK) {
+		goto fail_node_to_buf;
+	}
 
-		if (node->disk_size == 0) {
-			tkvdb_node_calc_disksize(node);
+	/* roots of changed keyspaces follow default root */
+	for (i=0; i<tr->keyspaces.size; i++) {
+		tkvdb_tr *ks_tr = tr->keyspaces.items[i].tr;
+		tkvdb_memnode *ks_root;
 
-			node->disk_off = node_off;
-			last_node_size = node->disk_size;
+		if (!ks_tr || !ks_tr->root) {
+			continue;
 		}
 
-		next = NULL;
-		for (; off<256; off++) {
-			if (node->next[off]) {
-				/* found next subnode */
-				next = node->next[off];
-				break;
-			}
+		r = tkvdb_subtree_to_buf(tr->db, ks_tr->root, transaction_off,
+			&node_off);
+		if (r != TKVDB_OK) {
+			goto fail_node_to_buf;
 		}
 
-		if (next) {
-			TKVDB_SKIP_RNODES(next);
-
-			node_off += last_node_size;
-			node->fnext[off] = node_off;
-
-			/* push node and position to stack */
-			stack[stack_depth].node = node;
-			stack[stack_depth].off = off;
-			stack_depth++;
-
-			node = next;
-			off = 0;
-		} else {
-			/* no more subnodes, serialize node to memory buffer */
-			r = tkvdb_node_to_buf(tr->db, node, transaction_off);
-			if (r != TKVDB_OK) {
-				goto fail_node_to_buf;
-			}
+		ks_root = ks_tr->root;
+		TKVDB_SKIP_RNODES(ks_root);
+		tr->keyspaces.items[i].root_off = ks_root->disk_off;
+	}
 
-			/* pop */
-			if (stack_depth == 0) {
-				break;
-			}
+	/* and catalog of keyspaces */
+	catalog_size = tkvdb_catalog_size(&(tr->keyspaces));
 
-			stack_depth--;
-			node = stack[stack_depth].node;
-			off  = stack[stack_depth].off + 1;
+	if (append) {
+		/* padding goes before catalog */
+		r = tkvdb_writebuf_pad(tr->db, transaction_off, &node_off,
+			catalog_size + TKVDB_TR_FTRSIZE);
+		if (r != TKVDB_OK) {
+			goto fail_node_to_buf;
 		}
 	}
 
-	node_off += last_node_size;
+	if (catalog_size > 0) {
+		r = tkvdb_writebuf_realloc(tr->db,
+			node_off - transaction_off + catalog_size);
+		if (r != TKVDB_OK) {
+			goto fail_node_to_buf;
+		}
+
+		tkvdb_catalog_write(&(tr->keyspaces),
+			tr->db->write_buf + (node_off - transaction_off),
+			catalog_size);
+		node_off += catalog_size;
+	}
 
 	tr->db->info.footer.root_off = transaction_off
 		+ sizeof(struct tkvdb_tr_header);
 	tr->db->info.footer.transaction_size = node_off - transaction_off;
 
-	/* seek */
-	if (lseek(tr->db->fd, transaction_off, SEEK_SET)
-		!= (off_t)transaction_off) {
-		return TKVDB_IO_ERROR;
-	}
-
 	/* prepare header, footer and write */
 	header_ptr = (struct tkvdb_tr_header *)tr->db->write_buf;
 	header_ptr->type = TKVDB_BLOCKTYPE_TRANSACTION;
 	tr->db->info.footer.type = TKVDB_BLOCKTYPE_FOOTER;
+	if (catalog_size > 0) {
+		tr->db->info.footer.type |= TKVDB_BLOCKTYPE_KEYSPACES;
+	}
 	if (gap_end_ptr) {
 		tr->db->info.footer.gap_end = *gap_end_ptr;
 	}
@@ -1749,9 +4516,8 @@ tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
 			&(tr->db->write_buf[wsize - TKVDB_TR_FTRSIZE]);
 
 		*footer_ptr = tr->db->info.footer;
-		if (write(tr->db->fd, tr->db->write_buf, wsize) != wsize) {
-			return TKVDB_IO_ERROR;
-		}
+		TKVDB_EXEC( tkvdb_db_write(tr->db, tr->db->write_buf, wsize,
+			transaction_off) );
 	} else {
 		ssize_t wsize;
 
@@ -1759,20 +4525,18 @@ tkvdb_do_commit(tkvdb_tr *tr, uint64_t *gap_end_ptr)
 		tr->db->info.footer.gap_begin += wsize;
 
 		header_ptr->footer_off = tr->db->info.filesize;
-		if (write(tr->db->fd, tr->db->write_buf, wsize) != wsize) {
-			return TKVDB_IO_ERROR;
-		}
-		/* seek to end of file */
-		if (lseek(tr->db->fd, tr->db->info.filesize, SEEK_SET)
-			!= (off_t)tr->db->info.filesize) {
-
-			return TKVDB_IO_ERROR;
-		}
-		/* write footer */
+		TKVDB_EXEC( tkvdb_db_write(tr->db, tr->db->write_buf, wsize,
+			transaction_off) );
+		/* footer at the end of file */
 		wsize = sizeof(struct tkvdb_tr_footer);
-		if (write(tr->db->fd, &tr->db->info.footer, wsize) != wsize) {
-			return TKVDB_IO_ERROR;
-		}
+		TKVDB_EXEC( tkvdb_db_write(tr->db, &tr->db->info.footer,
+			wsize, tr->db->info.filesize) );
+	}
+
+	if (tr->db->params.crown_size) {
+		/* new nodes are still in write buffer */
+		tkvdb_crown_build(tr->db, tr->db->write_buf, transaction_off,
+			tr->db->info.footer.transaction_size);
 	}
 
 	r = TKVDB_OK;
@@ -1797,36 +4561,291 @@ fail_node_to_buf:
 TKVDB_RES
 tkvdb_commit(tkvdb_tr *tr)
 {
+	if (tr->parent) {
+		/* keyspaces are committed together */
+		return tkvdb_commit(tr->parent);
+	}
+
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+
 	return tkvdb_do_commit(tr, NULL);
 }
 
-static TKVDB_RES
-tkvdb_do_del(tkvdb_tr *tr, tkvdb_memnode *node, tkvdb_memnode *prev,
-	int prev_off, int del_pfx)
+/* savepoints */
+TKVDB_RES
+tkvdb_savepoint(tkvdb_tr *tr, size_t *sp)
 {
-	int i, n_subnodes = 0, concat_sym = -1;
-	tkvdb_memnode *new_node, *old_node;
+	struct tkvdb_savepoint_item *item;
 
-	if (!prev) {
-		/* remove root node */
-		tkvdb_node_free(node);
-		node = tkvdb_node_new(tr, 0, 0, NULL, 0, NULL);
-		if (!node) {
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	if (tr->nsavepoints == tr->savepoints_allocated) {
+		struct tkvdb_savepoint_item *tmp;
+		size_t new_size = tr->savepoints_allocated * 2 + 4;
+
+		tmp = realloc(tr->savepoints,
+			new_size * sizeof(struct tkvdb_savepoint_item));
+		if (!tmp) {
 			return TKVDB_ENOMEM;
 		}
-		tr->root = node;
-
-		return TKVDB_OK;
+		tr->savepoints = tmp;
+		tr->savepoints_allocated = new_size;
 	}
 
-	if (del_pfx) {
-		prev->next[prev_off] = NULL;
-		prev->fnext[prev_off] = 0;
-		tkvdb_node_free(node);
-		return TKVDB_OK;
-	} else if (node->type & TKVDB_NODE_VAL) {
-		/* check if we have at least 1 subnode */
-		for (i=0; i<256; i++) {
+	item = &tr->savepoints[tr->nsavepoints];
+	item->undo_size = tr->undo_size;
+	item->root = tr->root;
+	item->tr_buf_ptr = tr->tr_buf_ptr;
+	item->tr_buf_allocated = tr->tr_buf_allocated;
+
+	*sp = tr->nsavepoints++;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_rollback_to(tkvdb_tr *tr, size_t sp)
+{
+	struct tkvdb_savepoint_item *item;
+
+	if (sp >= tr->nsavepoints) {
+		return TKVDB_NOT_FOUND;
+	}
+
+	item = &tr->savepoints[sp];
+	tkvdb_undo_to(tr, item->undo_size);
+	tkvdb_hash_invalidate(tr);
+
+	tr->root = item->root;
+	tr->tr_buf_ptr = item->tr_buf_ptr;
+	tr->tr_buf_allocated = item->tr_buf_allocated;
+
+	/* savepoints created after this one are gone */
+	tr->nsavepoints = sp + 1;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_savepoint_release(tkvdb_tr *tr, size_t sp)
+{
+	if (sp >= tr->nsavepoints) {
+		return TKVDB_NOT_FOUND;
+	}
+
+	if (sp == 0) {
+		/* no more savepoints, changes can't be undone */
+		tkvdb_undo_clear(tr);
+	} else {
+		tr->nsavepoints = sp;
+	}
+
+	return TKVDB_OK;
+}
+
+/* write all in-memory subtrees of root to the end of file and leave only
+ * root in memory, root references spilled nodes by offset */
+TKVDB_RES
+tkvdb_tr_spill(tkvdb_tr *tr)
+{
+	struct tkvdb_db_info info;
+	uint64_t spill_off, node_off;
+	struct tkvdb_tr_header *header_ptr;
+	struct tkvdb_tr_footer *footer_ptr;
+	tkvdb_memnode *root, *tmp;
+	size_t root_size, pvm_size;
+	ssize_t wsize;
+	int i;
+	unsigned int slots;
+	TKVDB_RES r;
+
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	tkvdb_tr_wait(tr);
+	if (!tr->db || tr->readonly || !tr->started || !tr->root
+		|| (tr->nsavepoints > 0)) {
+		/* nothing to spill or changes still may be undone */
+		return TKVDB_OK;
+	}
+
+	if (tr->generation != tr->db->generation) {
+		return TKVDB_MODIFIED;
+	}
+
+	/* nodes are freed */
+	tkvdb_hash_invalidate(tr);
+
+	TKVDB_EXEC( tkvdb_info_read(tr->db->fd, &info) );
+
+	if (info.filesize != tr->db->info.filesize) {
+		/* file was modified during transaction */
+		return TKVDB_MODIFIED;
+	}
+
+	if (info.filesize == 0) {
+		/* empty data file, spill footer is the only one in file
+		 * and it should look like footer before first transaction */
+		memcpy(tr->db->info.footer.signature,
+			TKVDB_SIGNATURE,
+			sizeof(TKVDB_SIGNATURE) - 1);
+		memset(&info.footer, 0, sizeof(struct tkvdb_tr_footer));
+		memcpy(info.footer.signature,
+			TKVDB_SIGNATURE,
+			sizeof(TKVDB_SIGNATURE) - 1);
+		info.footer.transaction_id = UINT64_MAX;
+	}
+
+	root = tr->root;
+	TKVDB_SKIP_RNODES(root);
+
+	/* memory for copy of root is taken before anything is written,
+	 * so lack of it leaves transaction untouched */
+	pvm_size = root->prefix_size + root->val_size + root->meta_size;
+	slots = root->slots;
+	root_size = tkvdb_node_size(root);
+	if (tr->tr_buf_dynalloc) {
+		/* copy becomes new root */
+		tmp = tr->allocator.alloc(tr->allocator.ctx, root_size);
+	} else {
+		/* new root overlaps old nodes in buffer */
+		tmp = malloc(root_size);
+	}
+	if (!tmp) {
+		return TKVDB_ENOMEM;
+	}
+
+	spill_off = info.filesize;
+	node_off = spill_off + sizeof(struct tkvdb_tr_header);
+
+	for (i=0; i<(int)root->slots; i++) {
+		if (root->next[i]) {
+			r = tkvdb_subtree_to_buf(tr->db, root->next[i],
+				spill_off, &node_off);
+			if (r != TKVDB_OK) {
+				goto end;
+			}
+		}
+	}
+
+	if (node_off == (spill_off + sizeof(struct tkvdb_tr_header))) {
+		/* nothing to spill */
+		r = TKVDB_OK;
+		goto end;
+	}
+
+	r = tkvdb_writebuf_pad(tr->db, spill_off, &node_off,
+		TKVDB_TR_FTRSIZE);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+	wsize = node_off - spill_off + TKVDB_TR_FTRSIZE;
+	r = tkvdb_writebuf_realloc(tr->db, wsize);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+
+	header_ptr = (struct tkvdb_tr_header *)tr->db->write_buf;
+	header_ptr->type = TKVDB_BLOCKTYPE_TRANSACTION;
+	header_ptr->footer_off = node_off;
+
+	/* copy of last footer, so database opened after crash sees state
+	 * before transaction */
+	footer_ptr = (struct tkvdb_tr_footer *)
+		&(tr->db->write_buf[wsize - TKVDB_TR_FTRSIZE]);
+	*footer_ptr = info.footer;
+	footer_ptr->type = TKVDB_BLOCKTYPE_SPILL_FOOTER;
+	footer_ptr->transaction_size = node_off - spill_off;
+
+	r = tkvdb_db_write(tr->db, tr->db->write_buf, wsize, spill_off);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+
+	if (!tr->spilled) {
+		tr->spill_start = spill_off;
+		tr->spilled = 1;
+	}
+	tr->db->info.filesize = spill_off + wsize;
+
+	/* subnodes are on disk now */
+	for (i=0; i<(int)root->slots; i++) {
+		if (root->next[i]) {
+			tkvdb_memnode *next = root->next[i];
+
+			TKVDB_SKIP_RNODES(next);
+			root->fnext[i] = next->disk_off;
+		}
+	}
+
+	/* keep copy of root and free the rest */
+	memcpy(tmp, root, root_size);
+	if (tr->tr_buf_dynalloc) {
+		tkvdb_node_free(tr, tr->root);
+		tr->root = tmp;
+		tr->tr_buf_allocated = root_size;
+	} else {
+		tr->tr_buf_ptr = tr->tr_buf;
+		tr->tr_buf_allocated = 0;
+
+		/* can't fail, buffer space was taken by old root */
+		tr->root = tkvdb_node_alloc(tr, pvm_size, slots);
+		memcpy(tr->root, tmp, root_size);
+		free(tmp);
+	}
+	tkvdb_node_set_tables(tr->root, pvm_size, slots);
+
+	tr->root->replaced_by = NULL;
+	tr->root->disk_size = 0;
+	tr->root->disk_off = 0;
+	for (i=0; i<(int)slots; i++) {
+		tr->root->next[i] = NULL;
+	}
+
+	return TKVDB_OK;
+
+end:
+	if (tr->tr_buf_dynalloc) {
+		tr->allocator.free(tr->allocator.ctx, tmp, root_size);
+	} else {
+		free(tmp);
+	}
+	return r;
+}
+
+static TKVDB_RES
+tkvdb_do_del(tkvdb_tr *tr, tkvdb_memnode *node, tkvdb_memnode *prev,
+	int prev_off, int del_pfx)
+{
+	int i, n_subnodes = 0, concat_sym = -1, prev_slot;
+	tkvdb_memnode *new_node, *old_node;
+
+	if (!prev) {
+		/* remove root node */
+		node = tkvdb_node_new(tr, 0, 0, NULL, 0, NULL, 0);
+		if (!node) {
+			return TKVDB_ENOMEM;
+		}
+		tkvdb_node_release(tr, tr->root);
+		tr->root = node;
+
+		return TKVDB_OK;
+	}
+
+	/* node is subnode of prev, so slot exists */
+	prev_slot = TKVDB_SLOT(prev, prev_off);
+	/* prev points to the first of replaced nodes, free them all */
+	old_node = prev->next[prev_slot];
+
+	if (del_pfx) {
+		TKVDB_UNDO_SET(tr, prev->next[prev_slot], NULL);
+		TKVDB_UNDO_SET(tr, prev->fnext[prev_slot], 0);
+		tkvdb_node_release(tr, old_node);
+		return TKVDB_OK;
+	} else if (node->type & TKVDB_NODE_VAL) {
+		/* check if we have at least 1 subnode */
+		for (i=0; i<(int)node->slots; i++) {
 			if (node->next[i] || node->fnext[i]) {
 				n_subnodes = 1;
 				break;
@@ -1835,13 +4854,13 @@ tkvdb_do_del(tkvdb_tr *tr, tkvdb_memnode *node, tkvdb_memnode *prev,
 
 		if (!n_subnodes) {
 			/* no subnodes, delete node */
-			prev->next[prev_off] = NULL;
-			prev->fnext[prev_off] = 0;
-			tkvdb_node_free(node);
+			TKVDB_UNDO_SET(tr, prev->next[prev_slot], NULL);
+			TKVDB_UNDO_SET(tr, prev->fnext[prev_slot], 0);
+			tkvdb_node_release(tr, old_node);
 			return TKVDB_OK;
 		}
 		/* we have subnodes, so just clear value bit */
-		node->type &= ~TKVDB_NODE_VAL;
+		TKVDB_UNDO_SET(tr, node->type, node->type & ~TKVDB_NODE_VAL);
 		return TKVDB_OK;
 	} else {
 		return TKVDB_NOT_FOUND;
@@ -1853,7 +4872,7 @@ tkvdb_do_del(tkvdb_tr *tr, tkvdb_memnode *node, tkvdb_memnode *prev,
 
 	/* calculate number of subnodes in parent (prev) */
 	for (i=0; i<256; i++) {
-		if (prev->next[i] || prev->fnext[i]) {
+		if (TKVDB_NEXT(prev, i) || TKVDB_FNEXT(prev, i)) {
 			n_subnodes++;
 			if (n_subnodes > 1) {
 				/* more than one subnode */
@@ -1869,16 +4888,16 @@ tkvdb_do_del(tkvdb_tr *tr, tkvdb_memnode *node, tkvdb_memnode *prev,
 
 
 	/* we have parent node with just one subnode */
-	old_node = prev->next[concat_sym];
+	old_node = TKVDB_NEXT(prev, concat_sym);
 	if (!old_node) {
-		TKVDB_EXEC( tkvdb_node_read(tr, prev->fnext[concat_sym],
+		TKVDB_EXEC( tkvdb_node_read(tr, TKVDB_FNEXT(prev, concat_sym),
 			&old_node) );
 	}
 	/* allocate new (concatenated) node */
-	new_node = tkvdb_node_alloc(tr, sizeof(tkvdb_memnode)
-		+ prev->prefix_size + 1
+	new_node = tkvdb_node_alloc(tr, prev->prefix_size + 1
 		+ old_node->prefix_size
-		+ old_node->val_size + old_node->meta_size);
+		+ old_node->val_size + old_node->meta_size,
+		old_node->slots);
 	if (!new_node) {
 		return TKVDB_ENOMEM;
 	}
@@ -1904,13 +4923,12 @@ tkvdb_do_del(tkvdb_tr *tr, tkvdb_memnode *node, tkvdb_memnode *prev,
 			old_node->prefix_val_meta + old_node->prefix_size,
 			old_node->val_size);
 	}
-	memcpy(new_node->next, old_node->next, sizeof(tkvdb_memnode *) * 256);
-	memcpy(new_node->fnext, old_node->fnext, sizeof(uint64_t) * 256);
+	tkvdb_clone_subnodes(new_node, old_node);
 
 	new_node->disk_size = 0;
 	new_node->disk_off = 0;
 
-	TKVDB_REPLACE_NODE(prev, new_node);
+	TKVDB_REPLACE_NODE(tr, prev, new_node);
 
 	return TKVDB_OK;
 }
@@ -1923,16 +4941,23 @@ tkvdb_del(tkvdb_tr *tr, const tkvdb_datum *key, int del_pfx)
 	size_t pi;
 	int prev_off = 0;
 
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
 	if (!tr->started) {
 		return TKVDB_NOT_STARTED;
 	}
 
+	if (tr->readonly) {
+		return TKVDB_READONLY;
+	}
+
+	tkvdb_hash_invalidate(tr);
+
 	/* check root */
 	if (tr->root == NULL) {
-		if (tr->db && (tr->db->info.filesize > 0)) {
+		if (tkvdb_tr_root_off(tr)) {
 			/* we have underlying non-empty db file */
 			TKVDB_EXEC( tkvdb_node_read(tr,
-				tr->db->info.footer.root_off,
+				tkvdb_tr_root_off(tr),
 				&(tr->root)) );
 		} else {
 			return TKVDB_EMPTY;
@@ -1946,6 +4971,7 @@ tkvdb_del(tkvdb_tr *tr, const tkvdb_datum *key, int del_pfx)
 next_node:
 	TKVDB_SKIP_RNODES(node);
 	pi = 0;
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 8) );
 
 next_byte:
 
@@ -1959,25 +4985,28 @@ next_byte:
 
 	if (pi >= node->prefix_size) {
 		/* end of prefix */
-		if (node->next[*sym] != NULL) {
+		int slot = TKVDB_SLOT(node, *sym);
+
+		if ((slot >= 0) && (node->next[slot] != NULL)) {
 			/* continue with next node */
 			prev = node;
 			prev_off = *sym;
 
-			node = node->next[*sym];
+			node = node->next[slot];
 			sym++;
 			goto next_node;
-		} else if (tr->db && (node->fnext[*sym] != 0)) {
+		} else if (tr->db && (slot >= 0)
+			&& (node->fnext[slot] != 0)) {
 			tkvdb_memnode *tmp;
 
 			/* load subnode from disk */
-			TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[*sym],
+			TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[slot],
 				&tmp) );
 
 			prev = node;
 			prev_off = *sym;
 
-			node->next[*sym] = tmp;
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
 			node = tmp;
 			sym++;
 			goto next_node;
@@ -1997,6 +5026,93 @@ next_byte:
 	return TKVDB_OK;
 }
 
+/* point lookup cache */
+
+static uint64_t
+tkvdb_hash_key(const tkvdb_datum *key)
+{
+	const unsigned char *ptr = key->data;
+	size_t len = key->len;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		memcpy(&w, ptr, sizeof(uint64_t));
+		ptr += sizeof(uint64_t);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, ptr, len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
+
+	return h;
+}
+
+/* node with value of key or NULL if key isn't cached */
+static tkvdb_memnode *
+tkvdb_hash_get(tkvdb_tr *tr, const tkvdb_datum *key, uint64_t h)
+{
+	struct tkvdb_hash_item *item;
+
+	if (!tr->hash) {
+		return NULL;
+	}
+
+	item = &tr->hash[h & tr->hash_mask];
+	if ((item->gen == tr->hash_gen) && (item->hash == h)
+		&& (item->key_size == key->len)
+		&& ((key->len == 0)
+			|| (memcmp(item->key, key->data, key->len) == 0))) {
+
+		return item->node;
+	}
+
+	return NULL;
+}
+
+/* remember node found by key, cache is allocated on first use,
+ * entry is just overwritten on collision */
+static void
+tkvdb_hash_put(tkvdb_tr *tr, const tkvdb_datum *key, uint64_t h,
+	tkvdb_memnode *node)
+{
+	struct tkvdb_hash_item *item;
+
+	if (!tr->hash) {
+		size_t n = 1;
+
+		while (n < tr->hash_size) {
+			n <<= 1;
+		}
+		tr->hash = calloc(n, sizeof(struct tkvdb_hash_item));
+		if (!tr->hash) {
+			return;
+		}
+		tr->hash_mask = n - 1;
+	}
+
+	item = &tr->hash[h & tr->hash_mask];
+	if (item->key_allocated < key->len) {
+		unsigned char *tmp = realloc(item->key, key->len);
+
+		if (!tmp) {
+			item->gen = 0;
+			return;
+		}
+		item->key = tmp;
+		item->key_allocated = key->len;
+	}
+
+	if (key->len > 0) {
+		memcpy(item->key, key->data, key->len);
+	}
+	item->key_size = key->len;
+	item->hash = h;
+	item->node = node;
+	item->gen = tr->hash_gen;
+}
+
 /* get value for given key */
 TKVDB_RES
 tkvdb_get(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val)
@@ -2004,18 +5120,33 @@ tkvdb_get(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val)
 	const unsigned char *sym;
 	size_t pi;
 	tkvdb_memnode *node = NULL;
-	uint64_t off;
+	uint64_t off, h = 0;
 
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
 	if (!tr->started) {
 		return TKVDB_NOT_STARTED;
 	}
 
+	if (tr->frozen) {
+		return tkvdb_frozen_get(tr, key, val);
+	}
+
+	if (tr->hash_size) {
+		h = tkvdb_hash_key(key);
+		node = tkvdb_hash_get(tr, key, h);
+		if (node) {
+			val->len = node->val_size;
+			val->data = node->prefix_val_meta + node->prefix_size;
+			return TKVDB_OK;
+		}
+	}
+
 	/* check root */
 	if (tr->root == NULL) {
-		if (tr->db && (tr->db->info.filesize > 0)) {
+		if (tkvdb_tr_root_off(tr)) {
 			/* we have underlying non-empty db file */
 			TKVDB_EXEC( tkvdb_node_read(tr,
-				tr->db->info.footer.root_off,
+				tkvdb_tr_root_off(tr),
 				&(tr->root)) );
 		} else {
 			return TKVDB_EMPTY;
@@ -2024,7 +5155,7 @@ tkvdb_get(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val)
 
 	sym = key->data;
 	node = tr->root;
-	off = tr->db->info.footer.root_off;
+	off = tkvdb_tr_root_off(tr);
 
 next_node:
 	TKVDB_SKIP_RNODES(node);
@@ -2037,6 +5168,9 @@ next_byte:
 		if ((pi == node->prefix_size)
 			&& (node->type & TKVDB_NODE_VAL)) {
 			/* exact match and node with value */
+			if (tr->hash_size) {
+				tkvdb_hash_put(tr, key, h, node);
+			}
 			val->len = node->val_size;
 			val->data = node->prefix_val_meta + node->prefix_size;
 			return TKVDB_OK;
@@ -2047,20 +5181,23 @@ next_byte:
 
 	if (pi >= node->prefix_size) {
 		/* end of prefix */
-		if (node->next[*sym] != NULL) {
+		int slot = TKVDB_SLOT(node, *sym);
+
+		if ((slot >= 0) && (node->next[slot] != NULL)) {
 			/* continue with next node */
-			node = node->next[*sym];
+			node = node->next[slot];
 			sym++;
 			goto next_node;
-		} else if (tr->db && (node->fnext[*sym] != 0)) {
+		} else if (tr->db && (slot >= 0)
+			&& (node->fnext[slot] != 0)) {
 			tkvdb_memnode *tmp;
 
 			/* load subnode from disk */
-			off = node->fnext[*sym];
+			off = node->fnext[slot];
 			TKVDB_EXEC( tkvdb_node_read(tr, off,
 				&tmp) );
 
-			node->next[*sym] = tmp;
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
 			node = tmp;
 			sym++;
 			goto next_node;
@@ -2080,87 +5217,63 @@ next_byte:
 	return TKVDB_OK;
 }
 
-/* get value for given key;
- * the only difference from tkvdb_get is that this function sets flag (in_tr)
- * if any part of key (node) is in given range on disk */
-static TKVDB_RES
-tkvdb_vac_get(tkvdb_tr *tr, const void *key, size_t klen,
-	int *in_tr, uint64_t trdisk_begin, uint64_t trdisk_end)
-{
-	const unsigned char *sym;
-	size_t pi;
-	tkvdb_memnode *node = NULL;
-	uint64_t off;
+/* batched lookups */
 
-	if (!tr->started) {
-		return TKVDB_NOT_STARTED;
-	}
+/* number of lookups walked together, reads of one step are in flight */
+#define TKVDB_MULTI_BATCH 64
 
-	/* check root */
-	if (tr->root == NULL) {
-		if (tr->db && (tr->db->info.filesize > 0)) {
-			/* we have underlying non-empty db file */
-			TKVDB_EXEC( tkvdb_node_read(tr,
-				tr->db->info.footer.root_off,
-				&(tr->root)) );
-		} else {
-			return TKVDB_EMPTY;
-		}
-	}
+/* state of one lookup of tkvdb_get_multi() */
+struct tkvdb_multi_item
+{
+	tkvdb_memnode *node;       /* current node or node with value */
+	const unsigned char *sym;  /* current symbol of key */
+	int slot;                  /* subnode to read, -1 if lookup is done */
+};
 
-	sym = key;
-	node = tr->root;
-	off = tr->db->info.footer.root_off;
+/* walk through nodes in memory until value is found or subnode must be
+ * read from disk (then 'slot' is set and node->fnext[slot] is needed) */
+static TKVDB_RES
+tkvdb_multi_walk(tkvdb_tr *tr, const tkvdb_datum *key,
+	struct tkvdb_multi_item *it)
+{
+	const unsigned char *sym = it->sym;
+	tkvdb_memnode *node = it->node;
+	size_t pi;
 
-	if ((off >= trdisk_begin) && (off <= trdisk_end)) {
-		*in_tr = 1;
-	} else {
-		*in_tr = 0;
-	}
+	it->slot = -1;
 
 next_node:
 	TKVDB_SKIP_RNODES(node);
 	pi = 0;
 
 next_byte:
-
-	if (sym >= ((unsigned char *)key + klen)) {
+	if (sym >= ((unsigned char *)key->data + key->len)) {
 		/* end of key */
 		if ((pi == node->prefix_size)
 			&& (node->type & TKVDB_NODE_VAL)) {
-			/* exact match and node with value */
+
+			it->node = node;
 			return TKVDB_OK;
-		} else {
-			return TKVDB_NOT_FOUND;
 		}
+		return TKVDB_NOT_FOUND;
 	}
 
 	if (pi >= node->prefix_size) {
-		/* end of prefix */
-		if (node->next[*sym] != NULL) {
-			/* continue with next node */
-			node = node->next[*sym];
-			sym++;
-			goto next_node;
-		} else if (tr->db && (node->fnext[*sym] != 0)) {
-			tkvdb_memnode *tmp;
+		int slot = TKVDB_SLOT(node, *sym);
 
-			/* load subnode from disk */
-			off = node->fnext[*sym];
-			TKVDB_EXEC( tkvdb_node_read(tr, off,
-				&tmp) );
-
-			if ((off >= trdisk_begin) && (off <= trdisk_end)) {
-				*in_tr = 1;
-			}
-
-			node->next[*sym] = tmp;
-			node = tmp;
+		if ((slot >= 0) && (node->next[slot] != NULL)) {
+			node = node->next[slot];
 			sym++;
 			goto next_node;
-		} else {
-			return TKVDB_NOT_FOUND;
+		} else if (tr->db && (slot >= 0)
+			&& (node->fnext[slot] != 0)) {
+			/* wait for other lookups */
+			it->node = node;
+			it->sym = sym;
+			it->slot = slot;
+			return TKVDB_OK;
 		}
+		return TKVDB_NOT_FOUND;
 	}
 
 	if (node->prefix_val_meta[pi] != *sym) {
@@ -2170,223 +5283,3097 @@ next_byte:
 	sym++;
 	pi++;
 	goto next_byte;
-
-	return TKVDB_OK;
 }
 
-
-
-/* smallest key-value pair of vacuumed transaction */
+/* result of finished lookup */
 static TKVDB_RES
-tkvdb_vac_smallest(tkvdb_cursor *c, tkvdb_memnode *node,
-	uint64_t trdisk_begin, uint64_t trdisk_end)
+tkvdb_multi_done(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val,
+	struct tkvdb_multi_item *it, TKVDB_RES r)
 {
-	int off;
-	tkvdb_memnode *next;
+	if ((r == TKVDB_OK) && (it->slot < 0)) {
+		if (tr->hash_size) {
+			tkvdb_hash_put(tr, key, tkvdb_hash_key(key), it->node);
+		}
+		val->len = it->node->val_size;
+		val->data = it->node->prefix_val_meta
+			+ it->node->prefix_size;
+	}
 
-	for (;;) {
-		/* if node has prefix, append it to cursor */
-		if (node->prefix_size > 0) {
-			TKVDB_EXEC( tkvdb_cursor_expand_prefix(c,
-				node->prefix_size) );
+	return r;
+}
 
-			/* append prefix */
-			memcpy(c->prefix + c->prefix_size,
-				node->prefix_val_meta,
-				node->prefix_size);
-			c->prefix_size += node->prefix_size;
+TKVDB_RES
+tkvdb_get_multi(tkvdb_tr *tr, const tkvdb_datum *keys, tkvdb_datum *vals,
+	TKVDB_RES *res, size_t n)
+{
+	struct tkvdb_multi_item items[TKVDB_MULTI_BATCH];
+	size_t base, i, cnt, pending;
+
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	if (tr->frozen) {
+		/* image is in memory, nothing to read */
+		for (i=0; i<n; i++) {
+			res[i] = tkvdb_get(tr, &keys[i], &vals[i]);
 		}
+		return TKVDB_OK;
+	}
 
-		/* stop search at key-value node */
-		if (node->type & TKVDB_NODE_VAL) {
-			TKVDB_EXEC( tkvdb_cursor_push(c, node, -1) );
-			break;
+	if (tr->root == NULL) {
+		if (tkvdb_tr_root_off(tr)) {
+			TKVDB_EXEC( tkvdb_node_read(tr,
+				tkvdb_tr_root_off(tr),
+				&(tr->root)) );
+		} else {
+			for (i=0; i<n; i++) {
+				res[i] = TKVDB_EMPTY;
+			}
+			return TKVDB_OK;
 		}
+	}
 
-		/* if current node is key without value, search in subnodes */
-		next = NULL;
-		for (off=0; off<256; off++) {
-			if ((node->fnext[off] > trdisk_begin)
-				&& (node->fnext[off] < trdisk_end)) {
+	for (base=0; base<n; base+=cnt) {
+		cnt = n - base;
+		if (cnt > TKVDB_MULTI_BATCH) {
+			cnt = TKVDB_MULTI_BATCH;
+		}
 
-				if (node->next[off]) {
-					/* next subnode already loaded */
-					next = node->next[off];
-				} else {
-					tkvdb_memnode *tmp;
-					TKVDB_EXEC( tkvdb_node_read(c->tr, node->fnext[off], &tmp) );
-					node->next[off] = tmp;
-					next = tmp;
-				}
-				break;
+		pending = 0;
+		for (i=0; i<cnt; i++) {
+			const tkvdb_datum *key = &keys[base + i];
+
+			items[i].node = tr->hash_size
+				? tkvdb_hash_get(tr, key, tkvdb_hash_key(key))
+				: NULL;
+			if (items[i].node) {
+				/* cached, no walk needed */
+				items[i].slot = -1;
+				vals[base + i].len = items[i].node->val_size;
+				vals[base + i].data =
+					items[i].node->prefix_val_meta
+					+ items[i].node->prefix_size;
+				res[base + i] = TKVDB_OK;
+				continue;
 			}
-		}
 
-		if (!next) {
-			/* XXX: return not found? */
-			return TKVDB_CORRUPTED;
+			items[i].node = tr->root;
+			items[i].sym = key->data;
+			res[base + i] = tkvdb_multi_done(tr, key,
+				&vals[base + i], &items[i],
+				tkvdb_multi_walk(tr, key, &items[i]));
+			if (items[i].slot >= 0) {
+				pending++;
+			}
 		}
 
-		TKVDB_EXEC( tkvdb_cursor_expand_prefix(c, 1) );
+		while (pending > 0) {
+			/* all reads of this step go to disk together */
+			for (i=0; i<cnt; i++) {
+				tkvdb_memnode *node = items[i].node;
 
-		c->prefix[c->prefix_size] = off;
-		c->prefix_size++;
+				if ((items[i].slot >= 0)
+					&& !node->next[items[i].slot]) {
 
-		/* push node */
-		TKVDB_EXEC( tkvdb_cursor_push(c, node, off) );
+					tkvdb_node_prefetch(tr,
+						node->fnext[items[i].slot]);
+				}
+			}
 
-		node = next;
+			pending = 0;
+			for (i=0; i<cnt; i++) {
+				const tkvdb_datum *key = &keys[base + i];
+				tkvdb_memnode *node = items[i].node, *tmp;
+				int slot = items[i].slot;
+
+				if (slot < 0) {
+					continue;
+				}
+
+				/* subnode may be loaded by other lookup */
+				if (!node->next[slot]) {
+					TKVDB_EXEC( tkvdb_node_read(tr,
+						node->fnext[slot], &tmp) );
+					TKVDB_UNDO_SET(tr, node->next[slot],
+						tmp);
+				}
+
+				items[i].node = node->next[slot];
+				items[i].sym++;
+				res[base + i] = tkvdb_multi_done(tr, key,
+					&vals[base + i], &items[i],
+					tkvdb_multi_walk(tr, key, &items[i]));
+				if (items[i].slot >= 0) {
+					pending++;
+				}
+			}
+		}
 	}
 
 	return TKVDB_OK;
 }
 
-static TKVDB_RES
-tkvdb_vac_next(tkvdb_cursor *c, uint64_t trdisk_begin, uint64_t trdisk_end)
+TKVDB_RES
+tkvdb_get_nowait(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val)
 {
-	int *off;
-	tkvdb_memnode *node, *next;
+	struct tkvdb_multi_item it;
+	TKVDB_RES r;
 
-	for (;;) {
-		if (c->stack_size < 1) {
-			break;
-		}
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
 
-		/* get node from stack's top */
-		node = c->stack[c->stack_size - 1].node;
-		off = &(c->stack[c->stack_size - 1].off);
-		(*off)++;
+	if (tr->frozen) {
+		return tkvdb_get(tr, key, val);
+	}
 
-		if (*off > 255) {
-			TKVDB_EXEC( tkvdb_cursor_pop(c) );
-			continue;
+	if (tr->hash_size) {
+		it.node = tkvdb_hash_get(tr, key, tkvdb_hash_key(key));
+		if (it.node) {
+			val->len = it.node->val_size;
+			val->data = it.node->prefix_val_meta
+				+ it.node->prefix_size;
+			return TKVDB_OK;
 		}
+	}
 
-		next = NULL;
-		for (; (*off)<256; (*off)++) {
-			if ((node->fnext[*off] > trdisk_begin)
-				&& (node->fnext[*off] <= trdisk_end)) {
+	if (tr->root == NULL) {
+		uint64_t root_off = tkvdb_tr_root_off(tr);
 
-				if (node->next[*off]) {
-					/* next subnode already loaded */
-					next = node->next[*off];
-				} else {
-					tkvdb_memnode *tmp;
-					TKVDB_EXEC( tkvdb_node_read(c->tr, node->fnext[*off], &tmp) );
-					node->next[*off] = tmp;
-					next = tmp;
-				}
-				break;
-			}
+		if (!root_off) {
+			return TKVDB_EMPTY;
 		}
+		if (!tkvdb_node_ready(tr, root_off)) {
+			return TKVDB_AGAIN;
+		}
+		TKVDB_EXEC( tkvdb_node_read(tr, root_off, &(tr->root)) );
+	}
 
-		if (next) {
-			/* expand cursor key */
-			TKVDB_EXEC( tkvdb_cursor_expand_prefix(c, 1) );
-			c->prefix[c->prefix_size] = *off;
-			c->prefix_size++;
-
-			return tkvdb_vac_smallest(c, next, trdisk_begin, trdisk_end);
+	/* nodes loaded before TKVDB_AGAIN are in memory on next call */
+	it.node = tr->root;
+	it.sym = key->data;
+	for (;;) {
+		r = tkvdb_multi_done(tr, key, val, &it,
+			tkvdb_multi_walk(tr, key, &it));
+		if ((r != TKVDB_OK) || (it.slot < 0)) {
+			return r;
 		}
 
-		/* pop */
-		TKVDB_EXEC( tkvdb_cursor_pop(c) );
+		TKVDB_EXEC( tkvdb_subnode_nowait(tr, it.node, it.slot) );
+		it.node = it.node->next[it.slot];
+		it.sym++;
 	}
+}
 
-	return TKVDB_OK;
+/* fixed-width integer keys, stored in big-endian byte order,
+ * so order of keys is numeric order */
+static void
+tkvdb_u64_key(uint64_t k, unsigned char *buf, tkvdb_datum *key)
+{
+	int i;
+
+	for (i=7; i>=0; i--) {
+		buf[i] = k & 0xff;
+		k >>= 8;
+	}
+	key->data = buf;
+	key->len = sizeof(uint64_t);
 }
 
+/* lookup of 8-byte key: symbols are taken from the top byte of 'k',
+ * end of key is known from number of bytes left, so there are no checks
+ * of key end on each byte and no pointer to key in memory */
 TKVDB_RES
-tkvdb_vacuum(tkvdb_tr *tr, tkvdb_tr *vac, tkvdb_tr *tres, tkvdb_cursor *c)
+tkvdb_get_u64(tkvdb_tr *tr, uint64_t k, tkvdb_datum *val)
 {
-	struct tkvdb *db;
-	struct tkvdb_db_info info;
-	size_t vac_tr_start; /* start of vacuumed transaction */
-	uint64_t trsize;
-	uint64_t root_off; /* offset of root after commit */
+	unsigned char buf[sizeof(uint64_t)];
+	tkvdb_datum key;
 	tkvdb_memnode *node;
-	TKVDB_RES r;
+	size_t left = sizeof(uint64_t), i;
+	int slot;
 
-	db = tr->db;
-	if (!db) {
-		return TKVDB_OK; /* XXX: return error? */
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
 	}
 
-	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	if (tr->frozen || tr->hash_size || !tr->root) {
+		/* image, lookup cache and root on disk are handled by
+		 * generic code */
+		tkvdb_u64_key(k, buf, &key);
+		return tkvdb_get(tr, &key, val);
+	}
 
-	trsize = info.footer.transaction_size;
+	node = tr->root;
+	for (;;) {
+		const uint8_t *prefix;
 
-	if (info.filesize == 0) {
-		/* empty database */
-		return TKVDB_OK;
-	} else {
-		/* read root node */
-		TKVDB_EXEC( tkvdb_node_read(tr,
-			tr->db->info.footer.root_off,
-			&(tr->root)) );
+		TKVDB_SKIP_RNODES(node);
+
+		if (node->prefix_size > left) {
+			return TKVDB_NOT_FOUND;
+		}
+		prefix = node->prefix_val_meta;
+		for (i=0; i<node->prefix_size; i++) {
+			if (prefix[i] != (uint8_t)(k >> 56)) {
+				return TKVDB_NOT_FOUND;
+			}
+			k <<= 8;
+		}
+		left -= node->prefix_size;
+
+		if (left == 0) {
+			/* end of key */
+			if (!(node->type & TKVDB_NODE_VAL)) {
+				return TKVDB_NOT_FOUND;
+			}
+			val->len = node->val_size;
+			val->data = node->prefix_val_meta + node->prefix_size;
+			return TKVDB_OK;
+		}
+
+		slot = TKVDB_SLOT(node, (int)(k >> 56));
+		k <<= 8;
+		left--;
+
+		if (slot < 0) {
+			return TKVDB_NOT_FOUND;
+		} else if (node->next[slot]) {
+			node = node->next[slot];
+		} else if (tr->db && node->fnext[slot]) {
+			tkvdb_memnode *tmp;
+
+			/* load subnode from disk */
+			TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[slot],
+				&tmp) );
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
+			node = tmp;
+		} else {
+			return TKVDB_NOT_FOUND;
+		}
 	}
+}
 
-	/* read root node of old transaction */
-	TKVDB_EXEC( tkvdb_node_read(vac,
-		tr->db->info.footer.gap_end + sizeof(struct tkvdb_tr_header),
-		&(vac->root)) );
+TKVDB_RES
+tkvdb_put_u64(tkvdb_tr *tr, uint64_t k, const tkvdb_datum *val)
+{
+	unsigned char buf[sizeof(uint64_t)];
+	tkvdb_datum key;
 
+	tkvdb_u64_key(k, buf, &key);
+	return tkvdb_put(tr, &key, val);
+}
 
-	node = vac->root;
-	/* forcibly assign cursor to vacuumed transaction */
-	c->tr = vac;
+TKVDB_RES
+tkvdb_del_u64(tkvdb_tr *tr, uint64_t k)
+{
+	unsigned char buf[sizeof(uint64_t)];
+	tkvdb_datum key;
 
-	TKVDB_EXEC( tkvdb_begin(tres) );
+	tkvdb_u64_key(k, buf, &key);
+	return tkvdb_del(tr, &key, 0);
+}
 
-	r = tkvdb_vac_smallest(c, node,
-		tr->db->info.footer.gap_end,
-		tr->db->info.footer.gap_end + trsize);
+/* merge of transactions */
 
-	while (r == TKVDB_OK) {
-		int in_tr;
+/* copy subtree, prefix of new root is 'pfx' followed by prefix of 'src'
+ * without first 'skip' bytes, subtrees on disk are copied by offset */
+static TKVDB_RES
+tkvdb_merge_copy(tkvdb_tr *tr, const unsigned char *pfx, size_t pfx_size,
+	tkvdb_memnode *src, size_t skip, tkvdb_memnode **res)
+{
+	tkvdb_memnode *node;
+	size_t prefix_size;
+	int i;
 
-		r = tkvdb_vac_get(tr, tkvdb_cursor_key(c),
-			tkvdb_cursor_keysize(c),
-			&in_tr,
-			tr->db->info.footer.gap_end,
-			tr->db->info.footer.gap_end + trsize);
+	TKVDB_SKIP_RNODES(src);
 
-		if ((r == TKVDB_OK) && in_tr) {
-			/* key is in vac transaction */
-			tkvdb_datum key, val;
+	prefix_size = pfx_size + src->prefix_size - skip;
 
-			key.data = tkvdb_cursor_key(c);
-			key.len  = tkvdb_cursor_keysize(c);
-			val.data = tkvdb_cursor_val(c);
-			val.len  = tkvdb_cursor_valsize(c);
-			TKVDB_EXEC( tkvdb_put(tres, &key, &val) );
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+	node = tkvdb_node_alloc(tr, prefix_size + src->val_size, src->slots);
+	if (!node) {
+		return TKVDB_ENOMEM;
+	}
+
+	node->type = src->type;
+	node->prefix_size = prefix_size;
+	node->val_size = src->val_size;
+	node->meta_size = 0;
+	node->replaced_by = NULL;
+	node->disk_size = 0;
+	node->disk_off = 0;
+
+	if (pfx_size > 0) {
+		memcpy(node->prefix_val_meta, pfx, pfx_size);
+	}
+	memcpy(node->prefix_val_meta + pfx_size, src->prefix_val_meta + skip,
+		src->prefix_size - skip + src->val_size);
+
+	/* the same tables, so subnodes keep their slots */
+	if (src->slots > 0) {
+		memcpy(node->fnext, src->fnext,
+			sizeof(uint64_t) * src->slots);
+	}
+	if ((src->slots > 0) && src->index) {
+		memcpy(node->index, src->index, 256);
+		node->used = src->used;
+	}
+
+	for (i=0; i<(int)src->slots; i++) {
+		if (src->next[i]) {
+			TKVDB_EXEC( tkvdb_merge_copy(tr, NULL, 0,
+				src->next[i], 0, &node->next[i]) );
 		}
-		r = tkvdb_vac_next(c,
-			tr->db->info.footer.gap_end,
-			tr->db->info.footer.gap_end + trsize);
 	}
 
-	TKVDB_EXEC( tkvdb_do_commit(tres, &root_off) );
+	*res = node;
+	return TKVDB_OK;
+}
 
-	/* FIXME: wrong! (DB header changed after commit) */
-	/* write new database footer */
+/* node with tail of prefix, value and subnodes of 'node' */
+static tkvdb_memnode *
+tkvdb_merge_tail(tkvdb_tr *tr, tkvdb_memnode *node, size_t skip)
+{
+	tkvdb_memnode *tail;
+
+	tail = tkvdb_node_new(tr, node->type,
+		node->prefix_size - skip,
+		node->prefix_val_meta + skip,
+		node->val_size,
+		node->prefix_val_meta + node->prefix_size,
+		node->slots);
+	if (!tail) {
+		return NULL;
+	}
+	tkvdb_clone_subnodes(tail, node);
+
+	return tail;
+}
+
+static TKVDB_RES tkvdb_merge_node(tkvdb_tr *tr, tkvdb_memnode *dst,
+	tkvdb_memnode *src, size_t skip);
+
+/* merge subtree into subnode 'sym' of 'dst' */
+static TKVDB_RES
+tkvdb_merge_subnode(tkvdb_tr *tr, tkvdb_memnode *dst, int sym,
+	tkvdb_memnode *src, size_t skip)
+{
+	tkvdb_memnode *tmp;
+	int slot;
+
+	TKVDB_SKIP_RNODES(dst);
+	slot = TKVDB_SLOT(dst, sym);
+
+	if ((slot >= 0) && dst->next[slot]) {
+		return tkvdb_merge_node(tr, dst->next[slot], src, skip);
+	} else if (tr->db && (slot >= 0) && dst->fnext[slot]) {
+		/* load subnode from disk */
+		TKVDB_EXEC( tkvdb_node_read(tr, dst->fnext[slot], &tmp) );
+		TKVDB_UNDO_SET(tr, dst->next[slot], tmp);
+
+		return tkvdb_merge_node(tr, tmp, src, skip);
+	}
+
+	/* graft whole subtree */
+	TKVDB_EXEC( tkvdb_node_slot(tr, &dst, sym, &slot) );
+	TKVDB_EXEC( tkvdb_merge_copy(tr, NULL, 0, src, skip, &tmp) );
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+	TKVDB_UNDO_SET(tr, dst->next[slot], tmp);
 
 	return TKVDB_OK;
 }
 
-TKVDB_RES
-tkvdb_dbinfo(tkvdb *db, uint64_t *root_off,
-	uint64_t *gap_begin, uint64_t *gap_end)
+/* merge value and subnodes of 'src' into 'dst' after end of prefixes */
+static TKVDB_RES
+tkvdb_merge_here(tkvdb_tr *tr, tkvdb_memnode *dst, tkvdb_memnode *src)
 {
-	struct tkvdb_db_info info;
+	int i;
 
-	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 2) );
 
-	*root_off = info.footer.root_off;
+	if (src->type & TKVDB_NODE_VAL) {
+		tkvdb_memnode *newroot;
 
-	*gap_begin = info.footer.gap_begin;
-	*gap_end = info.footer.gap_end;
+		newroot = tkvdb_node_new(tr, TKVDB_NODE_VAL,
+			dst->prefix_size, dst->prefix_val_meta,
+			src->val_size,
+			src->prefix_val_meta + src->prefix_size,
+			dst->slots);
+		if (!newroot) return TKVDB_ENOMEM;
+
+		tkvdb_clone_subnodes(newroot, dst);
+		TKVDB_REPLACE_NODE(tr, dst, newroot);
+		dst = newroot;
+	}
+
+	for (i=0; (src->slots > 0) && (i<256); i++) {
+		tkvdb_memnode *tmp;
+		int sslot = TKVDB_SLOT(src, i), dslot;
+
+		if (sslot < 0) {
+			continue;
+		}
+
+		/* dst is replaced when it grows */
+		TKVDB_SKIP_RNODES(dst);
+
+		if (src->next[sslot]) {
+			TKVDB_EXEC( tkvdb_merge_subnode(tr, dst, i,
+				src->next[sslot], 0) );
+		} else if (!src->fnext[sslot]
+			|| (src->fnext[sslot] == TKVDB_FNEXT(dst, i))) {
+			/* no subnode or the same subtree on disk */
+			continue;
+		} else if (!TKVDB_NEXT(dst, i) && !TKVDB_FNEXT(dst, i)) {
+			/* subtree of the same database, copy offset */
+			TKVDB_EXEC( tkvdb_node_slot(tr, &dst, i, &dslot) );
+			TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+			TKVDB_UNDO_SET(tr, dst->fnext[dslot],
+				src->fnext[sslot]);
+		} else {
+			TKVDB_EXEC( tkvdb_node_read(tr, src->fnext[sslot],
+				&tmp) );
+			TKVDB_UNDO_SET(tr, src->next[sslot], tmp);
+			TKVDB_EXEC( tkvdb_merge_subnode(tr, dst, i, tmp, 0) );
+		}
+	}
 
 	return TKVDB_OK;
 }
 
+/* merge two nodes at the same position in trie, values of 'src' win,
+ * first 'skip' bytes of 'src' prefix are already matched */
+static TKVDB_RES
+tkvdb_merge_node(tkvdb_tr *tr, tkvdb_memnode *dst, tkvdb_memnode *src,
+	size_t skip)
+{
+	tkvdb_memnode *newroot, *subnode_rest;
+	const unsigned char *src_prefix;
+	size_t src_prefix_size, pi;
+	int i;
+
+	TKVDB_SKIP_RNODES(dst);
+	TKVDB_SKIP_RNODES(src);
+	/* new nodes and pointers to them */
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 8) );
+
+	src_prefix = src->prefix_val_meta + skip;
+	src_prefix_size = src->prefix_size - skip;
+
+	for (pi=0; (pi < dst->prefix_size) && (pi < src_prefix_size); pi++) {
+		if (dst->prefix_val_meta[pi] != src_prefix[pi]) {
+			break;
+		}
+	}
+
+	if ((pi == dst->prefix_size) && (pi == src_prefix_size)) {
+		/* same prefix */
+		return tkvdb_merge_here(tr, dst, src);
+	}
+
+	if (pi == dst->prefix_size) {
+		/* src continues below dst */
+		return tkvdb_merge_subnode(tr, dst, src_prefix[pi],
+			src, skip + pi + 1);
+	}
+
+	/* split dst, tail of prefix goes to subnode */
+	subnode_rest = tkvdb_merge_tail(tr, dst, pi + 1);
+	if (!subnode_rest) return TKVDB_ENOMEM;
+
+	if (pi == src_prefix_size) {
+		int sym = dst->prefix_val_meta[pi];
+
+		/* dst continues below src */
+		int sslot = TKVDB_SLOT(src, sym), slot;
+
+		/* dst continues below src, tail of dst takes one more slot */
+		newroot = tkvdb_node_new(tr, src->type, pi, src_prefix,
+			src->val_size, src->prefix_val_meta + src->prefix_size,
+			src->index ? tkvdb_node_slots_for(src->used + 1) : 256);
+		if (!newroot) return TKVDB_ENOMEM;
+
+		for (i=0; (src->slots > 0) && (i<256); i++) {
+			if (!TKVDB_NEXT(src, i) && !TKVDB_FNEXT(src, i)) {
+				continue;
+			}
+			slot = tkvdb_node_link(newroot, i);
+			newroot->fnext[slot] = TKVDB_FNEXT(src, i);
+			if (TKVDB_NEXT(src, i) && (i != sym)) {
+				TKVDB_EXEC( tkvdb_merge_copy(tr, NULL, 0,
+					TKVDB_NEXT(src, i), 0,
+					&newroot->next[slot]) );
+			}
+		}
+		if ((sslot >= 0) && !src->next[sslot] && src->fnext[sslot]) {
+			tkvdb_memnode *tmp;
+
+			/* subtree of the same database */
+			TKVDB_EXEC( tkvdb_node_read(tr, src->fnext[sslot],
+				&tmp) );
+			TKVDB_UNDO_SET(tr, src->next[sslot], tmp);
+		}
+		if ((sslot >= 0) && src->next[sslot]) {
+			/* subnode of src is merged into tail of dst */
+			TKVDB_EXEC( tkvdb_merge_node(tr, subnode_rest,
+				src->next[sslot], 0) );
+		}
+		newroot->fnext[tkvdb_node_link(newroot, sym)] = 0;
+	} else {
+		/* prefixes differ */
+		newroot = tkvdb_node_new(tr, 0, pi, dst->prefix_val_meta,
+			0, NULL, TKVDB_SMALL_SLOTS);
+		if (!newroot) return TKVDB_ENOMEM;
+
+		TKVDB_EXEC( tkvdb_merge_copy(tr, NULL, 0, src, skip + pi + 1,
+			&newroot->next[tkvdb_node_link(newroot,
+				src_prefix[pi])]) );
+	}
+
+	newroot->next[tkvdb_node_link(newroot, dst->prefix_val_meta[pi])]
+		= subnode_rest;
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+	TKVDB_REPLACE_NODE(tr, dst, newroot);
+
+	return TKVDB_OK;
+}
+
+/* put all pairs of transaction using cursor */
+static TKVDB_RES
+tkvdb_merge_put(tkvdb_tr *dst, tkvdb_tr *src)
+{
+	tkvdb_cursor *c;
+	TKVDB_RES r;
+
+	c = tkvdb_cursor_create(src);
+	if (!c) {
+		return TKVDB_ENOMEM;
+	}
+
+	r = tkvdb_first(c);
+	while (r == TKVDB_OK) {
+		tkvdb_datum key, val;
+
+		key.data = tkvdb_cursor_key(c);
+		key.len = tkvdb_cursor_keysize(c);
+		val.data = tkvdb_cursor_val(c);
+		val.len = tkvdb_cursor_valsize(c);
+
+		r = tkvdb_put(dst, &key, &val);
+		if (r != TKVDB_OK) {
+			break;
+		}
+		r = tkvdb_next(c);
+	}
+	tkvdb_cursor_free(c);
+
+	if ((r == TKVDB_EMPTY) || (r == TKVDB_NOT_FOUND)) {
+		r = TKVDB_OK;
+	}
+
+	return r;
+}
+
+/* merge tree without nodes on disk */
+static TKVDB_RES
+tkvdb_merge_root(tkvdb_tr *dst, tkvdb_memnode *src_root)
+{
+	if (!src_root) {
+		return TKVDB_OK;
+	}
+
+	if (dst->root == NULL) {
+		if (tkvdb_tr_root_off(dst)) {
+			TKVDB_EXEC( tkvdb_node_read(dst,
+				tkvdb_tr_root_off(dst),
+				&(dst->root)) );
+		} else {
+			return tkvdb_merge_copy(dst, NULL, 0, src_root, 0,
+				&(dst->root));
+		}
+	}
+
+	return tkvdb_merge_node(dst, dst->root, src_root, 0);
+}
+
+TKVDB_RES
+tkvdb_tr_merge(tkvdb_tr *dst, tkvdb_tr *src)
+{
+	TKVDB_EXEC( tkvdb_tr_settle(dst) );
+	TKVDB_EXEC( tkvdb_tr_settle(src) );
+
+	if (!dst->started || !src->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	if (dst->readonly) {
+		return TKVDB_READONLY;
+	}
+
+	tkvdb_hash_invalidate(dst);
+
+	if (src->db || src->frozen) {
+		/* subtrees of src on disk may be changed in dst */
+		return tkvdb_merge_put(dst, src);
+	}
+
+	return tkvdb_merge_root(dst, src->root);
+}
+
+/* async commit */
+
+/* exchange trees of two transactions with the same allocation mode */
+static void
+tkvdb_tr_swap_tree(tkvdb_tr *a, tkvdb_tr *b)
+{
+	tkvdb_tr tmp = *a;
+
+	a->root = b->root;
+	a->started = b->started;
+	a->generation = b->generation;
+	a->tr_buf = b->tr_buf;
+	a->tr_buf_ptr = b->tr_buf_ptr;
+	a->tr_buf_allocated = b->tr_buf_allocated;
+	a->spilled = b->spilled;
+	a->spill_start = b->spill_start;
+
+	b->root = tmp.root;
+	b->started = tmp.started;
+	b->generation = tmp.generation;
+	b->tr_buf = tmp.tr_buf;
+	b->tr_buf_ptr = tmp.tr_buf_ptr;
+	b->tr_buf_allocated = tmp.tr_buf_allocated;
+	b->spilled = tmp.spilled;
+	b->spill_start = tmp.spill_start;
+
+	tkvdb_hash_invalidate(a);
+	tkvdb_hash_invalidate(b);
+}
+
+/* wait for background commit and apply changes made meanwhile
+ * on top of committed root */
+static TKVDB_RES
+tkvdb_tr_settle(tkvdb_tr *tr)
+{
+	tkvdb_tr *delta = tr->async;
+	TKVDB_RES r;
+
+	if (tr->pending) {
+		tkvdb_pending_join(tr->pending);
+		tr->pending->tr = NULL;
+		tr->pending = NULL;
+	}
+
+	if (!tr->delta) {
+		return TKVDB_OK;
+	}
+	tr->delta = 0;
+
+	if (tr->async_res != TKVDB_OK) {
+		/* changes were based on root that was not committed */
+		r = tr->async_res;
+		tr->async_res = TKVDB_OK;
+		tkvdb_tr_reset(tr);
+		return r;
+	}
+
+	if (!tr->started) {
+		return TKVDB_OK;
+	}
+
+	/* writer left empty tree in second transaction */
+	tkvdb_tr_swap_tree(tr, delta);
+	r = tkvdb_begin(tr);
+	if (r == TKVDB_OK) {
+		r = tkvdb_merge_root(tr, delta->root);
+	}
+	tkvdb_tr_reset(delta);
+	if (r != TKVDB_OK) {
+		tkvdb_tr_reset(tr);
+	}
+
+	return r;
+}
+
+static void *
+tkvdb_writer(void *arg)
+{
+	tkvdb_pending *p = arg;
+
+	p->res = tkvdb_do_commit(p->wtr, NULL);
+	if (p->wtr->started) {
+		/* commit failed before reset */
+		tkvdb_tr_reset(p->wtr);
+	}
+
+	return NULL;
+}
+
+TKVDB_RES
+tkvdb_commit_async(tkvdb_tr *tr, tkvdb_pending **pending)
+{
+	tkvdb_pending *p;
+
+	if (tr->parent) {
+		return tkvdb_commit_async(tr->parent, pending);
+	}
+
+	*pending = NULL;
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	p = malloc(sizeof(tkvdb_pending));
+	if (!p) {
+		return TKVDB_ENOMEM;
+	}
+	p->db = tr->db;
+	p->tr = NULL;
+	p->wtr = NULL;
+	p->running = 0;
+
+	/* keyspaces and allocators dropped at once by reset() are committed
+	 * in caller thread, result is kept in handle */
+	if (!tr->db || !tr->db->params.async_commit
+		|| tr->readonly || (tr->keyspaces.size > 0)
+		|| tr->allocator.reset) {
+
+		p->res = tkvdb_do_commit(tr, NULL);
+		*pending = p;
+		return TKVDB_OK;
+	}
+
+	if (!tr->async) {
+		tr->async = tkvdb_tr_create_a(NULL, tr->tr_buf_limit,
+			tr->tr_buf_dynalloc, &tr->allocator);
+		if (!tr->async) {
+			free(p);
+			return TKVDB_ENOMEM;
+		}
+		tr->async->db = tr->db;
+	}
+
+	/* one commit at a time */
+	tkvdb_db_wait(tr->db);
+
+	tkvdb_undo_clear(tr);
+	tkvdb_tr_swap_tree(tr, tr->async);
+	p->tr = tr;
+	p->wtr = tr->async;
+	p->running = 1;
+	tr->db->pending = p;
+
+	if (pthread_create(&p->thread, NULL, tkvdb_writer, p) != 0) {
+		p->running = 0;
+		tr->db->pending = NULL;
+		tkvdb_tr_swap_tree(tr, tr->async);
+		p->tr = NULL;
+		p->res = tkvdb_do_commit(tr, NULL);
+		*pending = p;
+		return TKVDB_OK;
+	}
+
+	tr->pending = p;
+	tr->delta = 1;
+	*pending = p;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_commit_wait(tkvdb_pending *pending)
+{
+	TKVDB_RES r;
+
+	tkvdb_pending_join(pending);
+	if (pending->tr) {
+		pending->tr->pending = NULL;
+	}
+	r = pending->res;
+	free(pending);
+
+	return r;
+}
+
+/* copy and move of subtrees */
+
+/* merge 'src' (prefix without first 'skip' bytes) at position 'key' */
+static TKVDB_RES
+tkvdb_merge_at(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_memnode *src,
+	size_t skip)
+{
+	const unsigned char *sym;
+	tkvdb_memnode *node, *newroot, *subnode_rest, *tmp;
+	size_t pi;
+
+	sym = key->data;
+	node = tr->root;
+
+next_node:
+	TKVDB_SKIP_RNODES(node);
+	pi = 0;
+	TKVDB_EXEC( tkvdb_undo_reserve(tr, 8) );
+
+next_byte:
+	if (sym >= ((unsigned char *)key->data + key->len)) {
+		if (pi < node->prefix_size) {
+			/* split node, key ends inside of prefix */
+			newroot = tkvdb_node_new(tr, 0, pi,
+				node->prefix_val_meta, 0, NULL,
+				TKVDB_SMALL_SLOTS);
+			if (!newroot) return TKVDB_ENOMEM;
+
+			subnode_rest = tkvdb_merge_tail(tr, node, pi + 1);
+			if (!subnode_rest) return TKVDB_ENOMEM;
+
+			newroot->next[tkvdb_node_link(newroot,
+				node->prefix_val_meta[pi])] = subnode_rest;
+			TKVDB_REPLACE_NODE(tr, node, newroot);
+			node = newroot;
+		}
+
+		if (skip < src->prefix_size) {
+			return tkvdb_merge_subnode(tr, node,
+				src->prefix_val_meta[skip], src, skip + 1);
+		}
+		return tkvdb_merge_here(tr, node, src);
+	}
+
+	if (pi >= node->prefix_size) {
+		int slot = TKVDB_SLOT(node, *sym);
+
+		if ((slot >= 0) && (node->next[slot] != NULL)) {
+			node = node->next[slot];
+			sym++;
+			goto next_node;
+		} else if (tr->db && (slot >= 0)
+			&& (node->fnext[slot] != 0)) {
+			TKVDB_EXEC( tkvdb_node_read(tr, node->fnext[slot],
+				&tmp) );
+
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
+			node = tmp;
+			sym++;
+			goto next_node;
+		}
+
+		/* rest of key and subtree */
+		TKVDB_EXEC( tkvdb_node_slot(tr, &node, *sym, &slot) );
+		TKVDB_EXEC( tkvdb_merge_copy(tr, sym + 1,
+			key->len - (sym - (unsigned char *)key->data) - 1,
+			src, skip, &tmp) );
+		TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+		TKVDB_UNDO_SET(tr, node->next[slot], tmp);
+
+		return TKVDB_OK;
+	}
+
+	if (node->prefix_val_meta[pi] != *sym) {
+		/* split node into common part, rest of prefix and subtree */
+		newroot = tkvdb_node_new(tr, 0, pi,
+			node->prefix_val_meta, 0, NULL, TKVDB_SMALL_SLOTS);
+		if (!newroot) return TKVDB_ENOMEM;
+
+		subnode_rest = tkvdb_merge_tail(tr, node, pi + 1);
+		if (!subnode_rest) return TKVDB_ENOMEM;
+
+		TKVDB_EXEC( tkvdb_merge_copy(tr, sym + 1,
+			key->len - (sym - (unsigned char *)key->data) - 1,
+			src, skip, &newroot->next[tkvdb_node_link(newroot,
+				*sym)]) );
+
+		newroot->next[tkvdb_node_link(newroot,
+			node->prefix_val_meta[pi])] = subnode_rest;
+		TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+		TKVDB_REPLACE_NODE(tr, node, newroot);
+
+		return TKVDB_OK;
+	}
+
+	sym++;
+	pi++;
+	goto next_byte;
+}
+
+static TKVDB_RES
+tkvdb_prefix_graft(tkvdb_tr *tr, const tkvdb_datum *from,
+	const tkvdb_datum *to, int move)
+{
+	const unsigned char *sym;
+	tkvdb_memnode *node, *head, *prev;
+	size_t pi, len;
+	int prev_off = 0;
+
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	if (tr->readonly) {
+		return TKVDB_READONLY;
+	}
+
+	tkvdb_hash_invalidate(tr);
+
+	/* subtree can't be moved into itself */
+	len = (from->len < to->len) ? from->len : to->len;
+	if (memcmp(from->data, to->data, len) == 0) {
+		return TKVDB_INVALID;
+	}
+
+	if (tr->root == NULL) {
+		if (tkvdb_tr_root_off(tr)) {
+			TKVDB_EXEC( tkvdb_node_read(tr,
+				tkvdb_tr_root_off(tr),
+				&(tr->root)) );
+		} else {
+			return TKVDB_EMPTY;
+		}
+	}
+
+	/* find node with keys starting with 'from' */
+	sym = from->data;
+	head = node = tr->root;
+	prev = NULL;
+
+next_node:
+	TKVDB_SKIP_RNODES(node);
+	pi = 0;
+
+next_byte:
+	if (sym < ((unsigned char *)from->data + from->len)) {
+		if (pi >= node->prefix_size) {
+			int slot = TKVDB_SLOT(node, *sym);
+
+			if (slot < 0) {
+				return TKVDB_NOT_FOUND;
+			}
+			if (node->next[slot] == NULL) {
+				tkvdb_memnode *tmp;
+
+				if (!tr->db || (node->fnext[slot] == 0)) {
+					return TKVDB_NOT_FOUND;
+				}
+				TKVDB_EXEC( tkvdb_node_read(tr,
+					node->fnext[slot], &tmp) );
+				TKVDB_UNDO_SET(tr, node->next[slot], tmp);
+			}
+			prev = node;
+			prev_off = slot;
+
+			head = node = node->next[slot];
+			sym++;
+			goto next_node;
+		}
+
+		if (node->prefix_val_meta[pi] != *sym) {
+			return TKVDB_NOT_FOUND;
+		}
+
+		sym++;
+		pi++;
+		goto next_byte;
+	}
+
+	if (move) {
+		TKVDB_EXEC( tkvdb_undo_reserve(tr, 8) );
+
+		/* detach subtree before changing other nodes */
+		if (prev) {
+			TKVDB_UNDO_SET(tr, prev->next[prev_off], NULL);
+			TKVDB_UNDO_SET(tr, prev->fnext[prev_off], 0);
+		} else {
+			tr->root = tkvdb_node_new(tr, 0, 0, NULL, 0, NULL, 0);
+			if (!tr->root) {
+				tr->root = head;
+				return TKVDB_ENOMEM;
+			}
+		}
+	}
+
+	TKVDB_EXEC( tkvdb_merge_at(tr, to, node, pi) );
+
+	if (move) {
+		TKVDB_EXEC( tkvdb_undo_reserve(tr, 1) );
+		tkvdb_node_release(tr, head);
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_copy_prefix(tkvdb_tr *tr, const tkvdb_datum *from,
+	const tkvdb_datum *to)
+{
+	return tkvdb_prefix_graft(tr, from, to, 0);
+}
+
+TKVDB_RES
+tkvdb_move_prefix(tkvdb_tr *tr, const tkvdb_datum *from,
+	const tkvdb_datum *to)
+{
+	return tkvdb_prefix_graft(tr, from, to, 1);
+}
+
+/* get value for given key;
+ * the only difference from tkvdb_get is that this function sets flag (in_tr)
+ * if any part of key (node) is in given range on disk */
+static TKVDB_RES
+tkvdb_vac_get(tkvdb_tr *tr, const void *key, size_t klen,
+	int *in_tr, uint64_t trdisk_begin, uint64_t trdisk_end)
+{
+	const unsigned char *sym;
+	size_t pi;
+	tkvdb_memnode *node = NULL;
+	uint64_t off;
+
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	/* check root */
+	if (tr->root == NULL) {
+		if (tkvdb_tr_root_off(tr)) {
+			/* we have underlying non-empty db file */
+			TKVDB_EXEC( tkvdb_node_read(tr,
+				tkvdb_tr_root_off(tr),
+				&(tr->root)) );
+		} else {
+			return TKVDB_EMPTY;
+		}
+	}
+
+	sym = key;
+	node = tr->root;
+	off = tkvdb_tr_root_off(tr);
+
+	if ((off >= trdisk_begin) && (off <= trdisk_end)) {
+		*in_tr = 1;
+	} else {
+		*in_tr = 0;
+	}
+
+next_node:
+	TKVDB_SKIP_RNODES(node);
+	pi = 0;
+
+next_byte:
+
+	if (sym >= ((unsigned char *)key + klen)) {
+		/* end of key */
+		if ((pi == node->prefix_size)
+			&& (node->type & TKVDB_NODE_VAL)) {
+			/* exact match and node with value */
+			return TKVDB_OK;
+		} else {
+			return TKVDB_NOT_FOUND;
+		}
+	}
+
+	if (pi >= node->prefix_size) {
+		/* end of prefix */
+		int slot = TKVDB_SLOT(node, *sym);
+
+		if ((slot >= 0) && (node->next[slot] != NULL)) {
+			/* continue with next node */
+			node = node->next[slot];
+			sym++;
+			goto next_node;
+		} else if (tr->db && (slot >= 0)
+			&& (node->fnext[slot] != 0)) {
+			tkvdb_memnode *tmp;
+
+			/* load subnode from disk */
+			off = node->fnext[slot];
+			TKVDB_EXEC( tkvdb_node_read(tr, off,
+				&tmp) );
+
+			if ((off >= trdisk_begin) && (off <= trdisk_end)) {
+				*in_tr = 1;
+			}
+
+			TKVDB_UNDO_SET(tr, node->next[slot], tmp);
+			node = tmp;
+			sym++;
+			goto next_node;
+		} else {
+			return TKVDB_NOT_FOUND;
+		}
+	}
+
+	if (node->prefix_val_meta[pi] != *sym) {
+		return TKVDB_NOT_FOUND;
+	}
+
+	sym++;
+	pi++;
+	goto next_byte;
+
+	return TKVDB_OK;
+}
+
+
+
+/* smallest key-value pair of vacuumed transaction */
+static TKVDB_RES
+tkvdb_vac_smallest(tkvdb_cursor *c, tkvdb_memnode *node,
+	uint64_t trdisk_begin, uint64_t trdisk_end)
+{
+	int off;
+	tkvdb_memnode *next;
+
+	for (;;) {
+		/* if node has prefix, append it to cursor */
+		if (node->prefix_size > 0) {
+			TKVDB_EXEC( tkvdb_cursor_expand_prefix(c,
+				node->prefix_size) );
+
+			/* append prefix */
+			memcpy(c->prefix + c->prefix_size,
+				node->prefix_val_meta,
+				node->prefix_size);
+			c->prefix_size += node->prefix_size;
+		}
+
+		/* stop search at key-value node */
+		if (node->type & TKVDB_NODE_VAL) {
+			TKVDB_EXEC( tkvdb_cursor_push(c, node, -1) );
+			break;
+		}
+
+		/* if current node is key without value, search in subnodes */
+		next = NULL;
+		for (off=0; off<256; off++) {
+			int slot = TKVDB_SLOT(node, off);
+
+			if ((slot >= 0) && (node->fnext[slot] > trdisk_begin)
+				&& (node->fnext[slot] < trdisk_end)) {
+
+				if (node->next[slot]) {
+					/* next subnode already loaded */
+					next = node->next[slot];
+				} else {
+					tkvdb_memnode *tmp;
+					TKVDB_EXEC( tkvdb_node_read(c->tr, node->fnext[slot], &tmp) );
+					TKVDB_UNDO_SET(c->tr, node->next[slot], tmp);
+					next = tmp;
+				}
+				break;
+			}
+		}
+
+		if (!next) {
+			/* XXX: return not found? */
+			return TKVDB_CORRUPTED;
+		}
+
+		TKVDB_EXEC( tkvdb_cursor_expand_prefix(c, 1) );
+
+		c->prefix[c->prefix_size] = off;
+		c->prefix_size++;
+
+		/* push node */
+		TKVDB_EXEC( tkvdb_cursor_push(c, node, off) );
+
+		node = next;
+	}
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_vac_next(tkvdb_cursor *c, uint64_t trdisk_begin, uint64_t trdisk_end)
+{
+	int *off;
+	tkvdb_memnode *node, *next;
+
+	for (;;) {
+		if (c->stack_size < 1) {
+			break;
+		}
+
+		/* get node from stack's top */
+		node = c->stack[c->stack_size - 1].node;
+		off = &(c->stack[c->stack_size - 1].off);
+		(*off)++;
+
+		if (*off > 255) {
+			TKVDB_EXEC( tkvdb_cursor_pop(c) );
+			continue;
+		}
+
+		next = NULL;
+		for (; (*off)<256; (*off)++) {
+			int slot = TKVDB_SLOT(node, *off);
+
+			if ((slot >= 0) && (node->fnext[slot] > trdisk_begin)
+				&& (node->fnext[slot] <= trdisk_end)) {
+
+				if (node->next[slot]) {
+					/* next subnode already loaded */
+					next = node->next[slot];
+				} else {
+					tkvdb_memnode *tmp;
+					TKVDB_EXEC( tkvdb_node_read(c->tr, node->fnext[slot], &tmp) );
+					TKVDB_UNDO_SET(c->tr, node->next[slot], tmp);
+					next = tmp;
+				}
+				break;
+			}
+		}
+
+		if (next) {
+			/* expand cursor key */
+			TKVDB_EXEC( tkvdb_cursor_expand_prefix(c, 1) );
+			c->prefix[c->prefix_size] = *off;
+			c->prefix_size++;
+
+			return tkvdb_vac_smallest(c, next, trdisk_begin, trdisk_end);
+		}
+
+		/* pop */
+		TKVDB_EXEC( tkvdb_cursor_pop(c) );
+	}
+
+	return TKVDB_OK;
+}
+
+/* put pairs of vacuumed root which are still reached through nodes
+ * of vacuumed transaction to 'tres', 'tr' is current root */
+static TKVDB_RES
+tkvdb_vac_root(tkvdb_tr *tr, tkvdb_tr *vac, tkvdb_tr *tres, tkvdb_cursor *c,
+	uint64_t root_off, uint64_t trdisk_begin, uint64_t trdisk_end)
+{
+	TKVDB_RES r;
+
+	tkvdb_tr_reset(vac);
+	vac->generation = tr->db->generation;
+	TKVDB_EXEC( tkvdb_node_read(vac, root_off, &(vac->root)) );
+
+	/* forcibly assign cursor to vacuumed transaction */
+	c->tr = vac;
+	tkvdb_cursor_reset(c);
+
+	r = tkvdb_vac_smallest(c, vac->root, trdisk_begin, trdisk_end);
+
+	while (r == TKVDB_OK) {
+		int in_tr;
+
+		r = tkvdb_vac_get(tr, tkvdb_cursor_key(c),
+			tkvdb_cursor_keysize(c),
+			&in_tr, trdisk_begin, trdisk_end);
+
+		if ((r == TKVDB_OK) && in_tr) {
+			/* key is in vac transaction */
+			tkvdb_datum key, val;
+
+			key.data = tkvdb_cursor_key(c);
+			key.len  = tkvdb_cursor_keysize(c);
+			val.data = tkvdb_cursor_val(c);
+			val.len  = tkvdb_cursor_valsize(c);
+			TKVDB_EXEC( tkvdb_put(tres, &key, &val) );
+		}
+		r = tkvdb_vac_next(c, trdisk_begin, trdisk_end);
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_vacuum(tkvdb_tr *tr, tkvdb_tr *vac, tkvdb_tr *tres, tkvdb_cursor *c)
+{
+	struct tkvdb *db;
+	struct tkvdb_db_info info;
+	struct tkvdb_tr_header hdr;
+	struct tkvdb_tr_footer footer;
+	size_t vac_tr_start; /* start of vacuumed transaction */
+	uint64_t trsize;
+	uint64_t root_off; /* end of gap after commit */
+	struct tkvdb_catalog cat = {NULL, 0, 0};
+	size_t i;
+	TKVDB_RES r;
+
+	db = tr->db;
+	if (!db) {
+		return TKVDB_OK; /* XXX: return error? */
+	}
+	TKVDB_EXEC( tkvdb_tr_settle(tr) );
+	tkvdb_db_wait(db);
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+
+	if ((info.filesize == 0) || (info.footer.root_off == 0)) {
+		/* empty database or only spilled nodes in file */
+		return TKVDB_OK;
+	} else {
+		/* read root node */
+		TKVDB_EXEC( tkvdb_node_read(tr,
+			tr->db->info.footer.root_off,
+			&(tr->root)) );
+	}
+
+	/* oldest transaction starts at the end of gap,
+	 * its size is in footer, appended footer follows nodes */
+	vac_tr_start = tr->db->info.footer.gap_end;
+	if ((pread(db->fd, &hdr, sizeof(struct tkvdb_tr_header),
+		vac_tr_start) != sizeof(struct tkvdb_tr_header))
+		|| (pread(db->fd, &footer, TKVDB_TR_FTRSIZE, hdr.footer_off)
+		!= TKVDB_TR_FTRSIZE)) {
+
+		return TKVDB_IO_ERROR;
+	}
+	trsize = footer.transaction_size;
+	/* new end of gap */
+	root_off = vac_tr_start + trsize;
+	if (hdr.footer_off == root_off) {
+		root_off += TKVDB_TR_FTRSIZE;
+	}
+
+	TKVDB_EXEC( tkvdb_begin(tres) );
+
+	/* default root of old transaction */
+	TKVDB_EXEC( tkvdb_vac_root(tr, vac, tres, c,
+		vac_tr_start + sizeof(struct tkvdb_tr_header),
+		vac_tr_start, vac_tr_start + trsize) );
+
+	/* and roots of keyspaces it changed */
+	r = tkvdb_catalog_read(db->fd, &footer, &cat);
+	for (i=0; (r == TKVDB_OK) && (i<cat.size); i++) {
+		tkvdb_tr *ks_tr, *ks_tres;
+
+		if ((cat.items[i].root_off < vac_tr_start)
+			|| (cat.items[i].root_off >= (vac_tr_start + trsize))) {
+
+			continue;
+		}
+
+		ks_tr = tkvdb_tr_keyspace(tr, cat.items[i].name);
+		ks_tres = tkvdb_tr_keyspace(tres, cat.items[i].name);
+		if (!ks_tr || !ks_tres) {
+			r = TKVDB_ENOMEM;
+			break;
+		}
+		r = tkvdb_vac_root(ks_tr, vac, ks_tres, c,
+			cat.items[i].root_off,
+			vac_tr_start, vac_tr_start + trsize);
+	}
+	tkvdb_catalog_free(&cat);
+	if (r != TKVDB_OK) {
+		return r;
+	}
+
+	TKVDB_EXEC( tkvdb_do_commit(tres, &root_off) );
+
+	/* FIXME: wrong! (DB header changed after commit) */
+	/* write new database footer */
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_dbinfo(tkvdb *db, uint64_t *root_off,
+	uint64_t *gap_begin, uint64_t *gap_end)
+{
+	struct tkvdb_db_info info;
+
+	tkvdb_db_wait(db);
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+
+	*root_off = info.footer.root_off;
+
+	*gap_begin = info.footer.gap_begin;
+	*gap_end = info.footer.gap_end;
+
+	return TKVDB_OK;
+}
+
+/* structural diff between two committed roots */
+
+/* kinds of diff walk frames */
+#define TKVDB_DIFF_SUBTREE 0    /* all keys of 'a' from prefix symbol 'ai' */
+#define TKVDB_DIFF_SHORTER 1    /* 'a' reached end of prefix, rest of 'b' */
+#define TKVDB_DIFF_NODES   2    /* old 'a' and new 'b' at the same key */
+
+/* frame owns node and deallocates it when popped */
+#define TKVDB_DIFF_OWN_A 1
+#define TKVDB_DIFF_OWN_B 2
+
+struct tkvdb_diff_frame
+{
+	int type;
+	TKVDB_DIFF op;          /* for keys found only in 'a' */
+
+	tkvdb_memnode *a, *b;
+	size_t ai, bi;          /* positions in prefixes */
+
+	int off;                /* next subnode, -1 before entering node */
+	int own;
+	size_t key_size;        /* key length restored when frame is popped */
+};
+
+struct tkvdb_diff_ctx
+{
+	tkvdb_tr *tr;           /* used only for node allocation */
+
+	tkvdb_diff_cb cb;
+	void *arg;
+
+	uint8_t *key;           /* key of current position */
+	size_t key_size;
+	size_t key_allocated;
+
+	struct tkvdb_diff_frame *stack;
+	size_t stack_depth;
+	size_t stack_allocated;
+};
+
+static TKVDB_RES
+tkvdb_diff_key_append(struct tkvdb_diff_ctx *ctx, const uint8_t *data,
+	size_t n)
+{
+	if ((ctx->key_size + n) > ctx->key_allocated) {
+		uint8_t *tmp;
+		size_t new_size = ctx->key_allocated * 2;
+
+		if (new_size < (ctx->key_size + n)) {
+			new_size = ctx->key_size + n;
+		}
+		tmp = realloc(ctx->key, new_size);
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		ctx->key = tmp;
+		ctx->key_allocated = new_size;
+	}
+
+	memcpy(ctx->key + ctx->key_size, data, n);
+	ctx->key_size += n;
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_diff_emit(struct tkvdb_diff_ctx *ctx, TKVDB_DIFF op,
+	tkvdb_memnode *node)
+{
+	tkvdb_datum key, val;
+
+	key.data = ctx->key;
+	key.len  = ctx->key_size;
+	val.data = node->prefix_val_meta + node->prefix_size;
+	val.len  = node->val_size;
+
+	return ctx->cb(ctx->arg, op, &key, &val);
+}
+
+static TKVDB_RES
+tkvdb_diff_push(struct tkvdb_diff_ctx *ctx, int type, TKVDB_DIFF op,
+	tkvdb_memnode *a, size_t ai, tkvdb_memnode *b, size_t bi, int own)
+{
+	struct tkvdb_diff_frame *f;
+
+	if (ctx->stack_depth == ctx->stack_allocated) {
+		struct tkvdb_diff_frame *tmp;
+		size_t new_size = ctx->stack_allocated * 2 + 16;
+
+		tmp = realloc(ctx->stack,
+			new_size * sizeof(struct tkvdb_diff_frame));
+		if (!tmp) {
+			/* nodes passed to frame are freed anyway */
+			if (own & TKVDB_DIFF_OWN_A) {
+				tkvdb_node_dealloc(ctx->tr, a);
+			}
+			if (own & TKVDB_DIFF_OWN_B) {
+				tkvdb_node_dealloc(ctx->tr, b);
+			}
+			return TKVDB_ENOMEM;
+		}
+		ctx->stack = tmp;
+		ctx->stack_allocated = new_size;
+	}
+
+	f = &ctx->stack[ctx->stack_depth++];
+	f->type = type;
+	f->op = op;
+	f->a = a;
+	f->ai = ai;
+	f->b = b;
+	f->bi = bi;
+	f->off = -1;
+	f->own = own;
+	f->key_size = ctx->key_size;
+
+	return TKVDB_OK;
+}
+
+static void
+tkvdb_diff_pop(struct tkvdb_diff_ctx *ctx)
+{
+	struct tkvdb_diff_frame *f = &ctx->stack[--ctx->stack_depth];
+
+	if (f->own & TKVDB_DIFF_OWN_A) {
+		tkvdb_node_dealloc(ctx->tr, f->a);
+	}
+	if (f->own & TKVDB_DIFF_OWN_B) {
+		tkvdb_node_dealloc(ctx->tr, f->b);
+	}
+	ctx->key_size = f->key_size;
+}
+
+/* emit keys of all subtree nodes in order */
+static TKVDB_RES
+tkvdb_diff_subtree_step(struct tkvdb_diff_ctx *ctx,
+	struct tkvdb_diff_frame *f)
+{
+	tkvdb_memnode *next;
+	TKVDB_DIFF op = f->op;
+	uint8_t sym;
+	int off;
+
+	if (f->off < 0) {
+		TKVDB_EXEC( tkvdb_diff_key_append(ctx,
+			f->a->prefix_val_meta + f->ai,
+			f->a->prefix_size - f->ai) );
+		f->off = 0;
+		if (f->a->type & TKVDB_NODE_VAL) {
+			TKVDB_EXEC( tkvdb_diff_emit(ctx, op, f->a) );
+		}
+	}
+
+	for (off=f->off; off<256; off++) {
+		if (TKVDB_FNEXT(f->a, off)) {
+			break;
+		}
+	}
+	if (off == 256) {
+		tkvdb_diff_pop(ctx);
+		return TKVDB_OK;
+	}
+	f->off = off + 1;
+
+	sym = off;
+	TKVDB_EXEC( tkvdb_node_read(ctx->tr, TKVDB_FNEXT(f->a, off), &next) );
+	TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE, op, next, 0,
+		NULL, 0, TKVDB_DIFF_OWN_A) );
+
+	return tkvdb_diff_key_append(ctx, &sym, 1);
+}
+
+/* walk subnodes of 'a' (which reached end of prefix) in parallel with
+ * the rest of 'b' starting from prefix symbol 'bi' */
+static TKVDB_RES
+tkvdb_diff_shorter_step(struct tkvdb_diff_ctx *ctx,
+	struct tkvdb_diff_frame *f)
+{
+	tkvdb_memnode *next, *other = f->b;
+	TKVDB_DIFF op = f->op;
+	size_t opi = f->bi;
+	int off, osym = other->prefix_val_meta[opi];
+	uint8_t sym;
+
+	if (f->off < 0) {
+		/* shorter key comes first */
+		f->off = 0;
+		if (f->a->type & TKVDB_NODE_VAL) {
+			TKVDB_EXEC( tkvdb_diff_emit(ctx, op, f->a) );
+		}
+	}
+
+	for (off=f->off; off<256; off++) {
+		if (TKVDB_FNEXT(f->a, off) || (off == osym)) {
+			break;
+		}
+	}
+	if (off == 256) {
+		tkvdb_diff_pop(ctx);
+		return TKVDB_OK;
+	}
+	f->off = off + 1;
+
+	if (!TKVDB_FNEXT(f->a, off)) {
+		/* whole rest of other node */
+		return tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE,
+			(op == TKVDB_DIFF_PUT) ? TKVDB_DIFF_DEL : TKVDB_DIFF_PUT,
+			other, opi, NULL, 0, 0);
+	}
+
+	sym = off;
+	TKVDB_EXEC( tkvdb_node_read(ctx->tr, TKVDB_FNEXT(f->a, off), &next) );
+	if (off != osym) {
+		TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE, op,
+			next, 0, NULL, 0, TKVDB_DIFF_OWN_A) );
+	} else if (op == TKVDB_DIFF_DEL) {
+		TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_NODES, op,
+			next, 0, other, opi + 1, TKVDB_DIFF_OWN_A) );
+	} else {
+		TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_NODES, op,
+			other, opi + 1, next, 0, TKVDB_DIFF_OWN_B) );
+	}
+
+	return tkvdb_diff_key_append(ctx, &sym, 1);
+}
+
+/* compare old subtree 'a' and new subtree 'b' starting from prefix symbols
+ * 'ai' and 'bi', both positions are at the same key */
+static TKVDB_RES
+tkvdb_diff_nodes_step(struct tkvdb_diff_ctx *ctx,
+	struct tkvdb_diff_frame *f)
+{
+	tkvdb_memnode *a = f->a, *b = f->b;
+	tkvdb_memnode *anext = NULL, *bnext = NULL;
+	size_t ai = f->ai, bi = f->bi;
+	uint8_t sym;
+	int off;
+	TKVDB_RES r;
+
+	if (f->off < 0) {
+		/* common part of prefixes */
+		while ((ai < a->prefix_size) && (bi < b->prefix_size)) {
+			if (a->prefix_val_meta[ai] != b->prefix_val_meta[bi]) {
+				break;
+			}
+			TKVDB_EXEC( tkvdb_diff_key_append(ctx,
+				a->prefix_val_meta + ai, 1) );
+			ai++;
+			bi++;
+		}
+
+		/* frame is popped after subframes, pushed in reverse order */
+		f->off = 256;
+		if ((ai < a->prefix_size) && (bi < b->prefix_size)) {
+			/* prefixes diverged, subtrees have nothing in common */
+			if (a->prefix_val_meta[ai] < b->prefix_val_meta[bi]) {
+				TKVDB_EXEC( tkvdb_diff_push(ctx,
+					TKVDB_DIFF_SUBTREE, TKVDB_DIFF_PUT,
+					b, bi, NULL, 0, 0) );
+				return tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE,
+					TKVDB_DIFF_DEL, a, ai, NULL, 0, 0);
+			}
+			TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE,
+				TKVDB_DIFF_DEL, a, ai, NULL, 0, 0) );
+			return tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE,
+				TKVDB_DIFF_PUT, b, bi, NULL, 0, 0);
+		} else if (ai < a->prefix_size) {
+			/* end of new node prefix */
+			return tkvdb_diff_push(ctx, TKVDB_DIFF_SHORTER,
+				TKVDB_DIFF_PUT, b, 0, a, ai, 0);
+		} else if (bi < b->prefix_size) {
+			/* end of old node prefix */
+			return tkvdb_diff_push(ctx, TKVDB_DIFF_SHORTER,
+				TKVDB_DIFF_DEL, a, 0, b, bi, 0);
+		}
+
+		/* same key in both nodes */
+		f->off = 0;
+		if (b->type & TKVDB_NODE_VAL) {
+			if (!(a->type & TKVDB_NODE_VAL)
+				|| (a->val_size != b->val_size)
+				|| (memcmp(a->prefix_val_meta + a->prefix_size,
+					b->prefix_val_meta + b->prefix_size,
+					b->val_size) != 0)) {
+
+				TKVDB_EXEC( tkvdb_diff_emit(ctx,
+					TKVDB_DIFF_PUT, b) );
+			}
+		} else if (a->type & TKVDB_NODE_VAL) {
+			TKVDB_EXEC( tkvdb_diff_emit(ctx, TKVDB_DIFF_DEL, a) );
+		}
+	}
+
+	for (off=f->off; off<256; off++) {
+		/* both empty or unchanged subtree are skipped */
+		if (TKVDB_FNEXT(a, off) != TKVDB_FNEXT(b, off)) {
+			break;
+		}
+	}
+	if (off == 256) {
+		tkvdb_diff_pop(ctx);
+		return TKVDB_OK;
+	}
+	f->off = off + 1;
+
+	sym = off;
+	if (TKVDB_FNEXT(a, off)) {
+		TKVDB_EXEC( tkvdb_node_read(ctx->tr, TKVDB_FNEXT(a, off),
+			&anext) );
+	}
+	if (TKVDB_FNEXT(b, off)) {
+		r = tkvdb_node_read(ctx->tr, TKVDB_FNEXT(b, off), &bnext);
+		if (r != TKVDB_OK) {
+			if (anext) {
+				tkvdb_node_dealloc(ctx->tr, anext);
+			}
+			return r;
+		}
+	}
+
+	if (!bnext) {
+		TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE,
+			TKVDB_DIFF_DEL, anext, 0, NULL, 0, TKVDB_DIFF_OWN_A) );
+	} else if (!anext) {
+		TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_SUBTREE,
+			TKVDB_DIFF_PUT, bnext, 0, NULL, 0, TKVDB_DIFF_OWN_A) );
+	} else {
+		TKVDB_EXEC( tkvdb_diff_push(ctx, TKVDB_DIFF_NODES,
+			TKVDB_DIFF_PUT, anext, 0, bnext, 0,
+			TKVDB_DIFF_OWN_A | TKVDB_DIFF_OWN_B) );
+	}
+
+	return tkvdb_diff_key_append(ctx, &sym, 1);
+}
+
+/* depth-first walk with explicit stack, each step enters node or
+ * pushes next subnode, so deep tries don't consume call stack */
+static TKVDB_RES
+tkvdb_diff_walk(struct tkvdb_diff_ctx *ctx)
+{
+	while (ctx->stack_depth > 0) {
+		struct tkvdb_diff_frame *f;
+
+		f = &ctx->stack[ctx->stack_depth - 1];
+		switch (f->type) {
+			case TKVDB_DIFF_SUBTREE:
+				TKVDB_EXEC( tkvdb_diff_subtree_step(ctx, f) );
+				break;
+			case TKVDB_DIFF_SHORTER:
+				TKVDB_EXEC( tkvdb_diff_shorter_step(ctx, f) );
+				break;
+			default:
+				TKVDB_EXEC( tkvdb_diff_nodes_step(ctx, f) );
+				break;
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_diff(tkvdb *db, uint64_t old_root_off, uint64_t new_root_off,
+	tkvdb_diff_cb cb, void *arg)
+{
+	struct tkvdb_diff_ctx ctx;
+	tkvdb_memnode *a = NULL, *b = NULL;
+	TKVDB_RES r = TKVDB_OK;
+
+	if (old_root_off == new_root_off) {
+		return TKVDB_OK;
+	}
+
+	/* nodes are read one by one and freed right after comparison,
+	 * helper transaction never shares allocator with user transactions */
+	ctx.tr = tkvdb_tr_create_a(db, SIZE_MAX, 1, &tkvdb_std_allocator);
+	if (!ctx.tr) {
+		return TKVDB_ENOMEM;
+	}
+	ctx.cb = cb;
+	ctx.arg = arg;
+	ctx.key = NULL;
+	ctx.key_size = ctx.key_allocated = 0;
+	ctx.stack = NULL;
+	ctx.stack_depth = ctx.stack_allocated = 0;
+
+	if (old_root_off) {
+		r = tkvdb_node_read(ctx.tr, old_root_off, &a);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+	}
+	if (new_root_off) {
+		r = tkvdb_node_read(ctx.tr, new_root_off, &b);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+	}
+
+	if (!a) {
+		r = tkvdb_diff_push(&ctx, TKVDB_DIFF_SUBTREE, TKVDB_DIFF_PUT,
+			b, 0, NULL, 0, 0);
+	} else if (!b) {
+		r = tkvdb_diff_push(&ctx, TKVDB_DIFF_SUBTREE, TKVDB_DIFF_DEL,
+			a, 0, NULL, 0, 0);
+	} else {
+		r = tkvdb_diff_push(&ctx, TKVDB_DIFF_NODES, TKVDB_DIFF_PUT,
+			a, 0, b, 0, 0);
+	}
+	if (r == TKVDB_OK) {
+		r = tkvdb_diff_walk(&ctx);
+	}
+
+end:
+	while (ctx.stack_depth > 0) {
+		tkvdb_diff_pop(&ctx);
+	}
+	free(ctx.stack);
+	if (a) {
+		tkvdb_node_dealloc(ctx.tr, a);
+	}
+	if (b) {
+		tkvdb_node_dealloc(ctx.tr, b);
+	}
+	free(ctx.key);
+	tkvdb_tr_free(ctx.tr);
+
+	return r;
+}
+
+/* replication */
+
+#define TKVDB_REPL_BUFSIZE (TKVDB_READ_SIZE * 16)
+
+/* transaction record in replication stream,
+ * followed by 'gap_size' + 'tail_size' bytes of data */
+struct tkvdb_repl_header
+{
+	uint8_t signature[8];
+	uint64_t transaction_id;
+
+	uint64_t gap_off;       /* transaction block written to vacuumed gap */
+	uint64_t gap_size;
+	uint64_t tail_off;      /* data appended to the end of file */
+	uint64_t tail_size;
+} __attribute__((packed));
+
+/* read and check footer at given offset, footers of spilled blocks are
+ * skipped and '*off' is set to offset of committed transaction footer,
+ * returns TKVDB_EMPTY if there is no committed transaction before */
+static TKVDB_RES
+tkvdb_footer_read(int fd, uint64_t *off, struct tkvdb_tr_footer *footer)
+{
+	for (;;) {
+		size_t nread;
+		uint64_t spill_off;
+
+		TKVDB_EXEC( tkvdb_pread_full(fd, footer, TKVDB_TR_FTRSIZE,
+			*off, &nread) );
+		if (nread != TKVDB_TR_FTRSIZE) {
+			return TKVDB_CORRUPTED;
+		}
+
+		if ((memcmp(footer->signature, TKVDB_SIGNATURE,
+			sizeof(TKVDB_SIGNATURE) - 1)) != 0) {
+
+			return TKVDB_CORRUPTED;
+		}
+
+		if (footer->type != TKVDB_BLOCKTYPE_SPILL_FOOTER) {
+			break;
+		}
+
+		/* spilled nodes of uncommitted transaction */
+		if (footer->transaction_size > *off) {
+			return TKVDB_CORRUPTED;
+		}
+		spill_off = *off - footer->transaction_size;
+		if (spill_off == 0) {
+			return TKVDB_EMPTY;
+		}
+		if (spill_off < TKVDB_TR_FTRSIZE) {
+			return TKVDB_CORRUPTED;
+		}
+		*off = spill_off - TKVDB_TR_FTRSIZE;
+	}
+
+	return TKVDB_OK;
+}
+
+/* find offset of previous transaction footer,
+ * returns TKVDB_EMPTY for the first transaction in file */
+static TKVDB_RES
+tkvdb_footer_prev(uint64_t footer_off, const struct tkvdb_tr_footer *footer,
+	uint64_t *prev_off)
+{
+	uint64_t transaction_off, append_start;
+
+	transaction_off = footer->root_off - sizeof(struct tkvdb_tr_header);
+	if ((transaction_off + footer->transaction_size) == footer_off) {
+		/* transaction block was appended to the end of file */
+		append_start = transaction_off;
+	} else {
+		/* block was written to gap, only footer appended */
+		append_start = footer_off;
+	}
+
+	if (append_start == 0) {
+		return TKVDB_EMPTY;
+	}
+	if (append_start < TKVDB_TR_FTRSIZE) {
+		return TKVDB_CORRUPTED;
+	}
+
+	*prev_off = append_start - TKVDB_TR_FTRSIZE;
+	return TKVDB_OK;
+}
+
+/* copy 'size' bytes from file offset to stream */
+static TKVDB_RES
+tkvdb_repl_send_range(int db_fd, uint64_t off, uint64_t size, int fd,
+	uint8_t *buf)
+{
+	while (size > 0) {
+		size_t n, nread;
+
+		n = (size > TKVDB_REPL_BUFSIZE) ? TKVDB_REPL_BUFSIZE : size;
+		TKVDB_EXEC( tkvdb_pread_full(db_fd, buf, n, off, &nread) );
+		if (nread != n) {
+			return TKVDB_IO_ERROR;
+		}
+		TKVDB_EXEC( tkvdb_write_full(fd, buf, n) );
+		off += n;
+		size -= n;
+	}
+
+	return TKVDB_OK;
+}
+
+/* copy 'size' bytes from stream to file offset */
+static TKVDB_RES
+tkvdb_repl_recv_range(int fd, int db_fd, uint64_t off, uint64_t size,
+	uint8_t *buf)
+{
+	while (size > 0) {
+		size_t n, nread;
+
+		n = (size > TKVDB_REPL_BUFSIZE) ? TKVDB_REPL_BUFSIZE : size;
+		TKVDB_EXEC( tkvdb_read_full(fd, buf, n, &nread) );
+		if (nread != n) {
+			return TKVDB_IO_ERROR;
+		}
+		TKVDB_EXEC( tkvdb_pwrite_full(db_fd, buf, n, off) );
+		off += n;
+		size -= n;
+	}
+
+	return TKVDB_OK;
+}
+
+/* check received header before anything is written: gap block must be
+ * inside of vacuumed gap, tail ends with footer, and stream which is
+ * a regular file must have all the data */
+static TKVDB_RES
+tkvdb_repl_check(tkvdb *db, int fd, const struct tkvdb_repl_header *hdr)
+{
+	struct stat st;
+	off_t pos;
+
+	if (hdr->gap_size > 0) {
+		if ((hdr->gap_size < sizeof(struct tkvdb_tr_header))
+			|| ((hdr->gap_off + hdr->gap_size) < hdr->gap_off)
+			|| (hdr->gap_off < db->info.footer.gap_begin)
+			|| ((hdr->gap_off + hdr->gap_size)
+			> db->info.footer.gap_end)) {
+
+			return TKVDB_CORRUPTED;
+		}
+	}
+
+	if ((hdr->tail_size < TKVDB_TR_FTRSIZE)
+		|| ((hdr->tail_off + hdr->tail_size) < hdr->tail_off)
+		|| ((hdr->gap_size + hdr->tail_size) < hdr->tail_size)) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+		pos = lseek(fd, 0, SEEK_CUR);
+		if ((pos >= 0) && ((uint64_t)(st.st_size - pos)
+			< (hdr->gap_size + hdr->tail_size))) {
+
+			return TKVDB_CORRUPTED;
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+/* footer at the end of received tail must describe received transaction */
+static TKVDB_RES
+tkvdb_repl_check_footer(tkvdb *db, const struct tkvdb_repl_header *hdr)
+{
+	struct tkvdb_tr_footer footer;
+	uint64_t footer_off, transaction_off, tail_end;
+	size_t nread;
+
+	tail_end = hdr->tail_off + hdr->tail_size;
+	footer_off = tail_end - TKVDB_TR_FTRSIZE;
+	TKVDB_EXEC( tkvdb_pread_full(db->fd, &footer, TKVDB_TR_FTRSIZE,
+		footer_off, &nread) );
+	if ((nread != TKVDB_TR_FTRSIZE)
+		|| (memcmp(footer.signature, TKVDB_SIGNATURE,
+		sizeof(TKVDB_SIGNATURE) - 1) != 0)
+		|| (footer.type == TKVDB_BLOCKTYPE_SPILL_FOOTER)
+		|| (footer.transaction_id != hdr->transaction_id)
+		|| (footer.root_off < sizeof(struct tkvdb_tr_header))) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	transaction_off = footer.root_off - sizeof(struct tkvdb_tr_header);
+	if (hdr->gap_size > 0) {
+		/* block in gap, only footer is appended */
+		if ((transaction_off != hdr->gap_off)
+			|| (footer.transaction_size != hdr->gap_size)) {
+
+			return TKVDB_CORRUPTED;
+		}
+	} else if ((transaction_off < hdr->tail_off)
+		|| (footer.transaction_size > (footer_off - transaction_off))) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_repl_next_id(tkvdb *db, uint64_t *next_id)
+{
+	struct tkvdb_db_info info;
+
+	tkvdb_db_wait(db);
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+
+	if (info.filesize == 0) {
+		*next_id = 0;
+	} else {
+		*next_id = info.footer.transaction_id + 1;
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_repl_send(tkvdb *db, uint64_t *next_id, int fd)
+{
+	struct tkvdb_db_info info;
+	uint64_t *footers = NULL;  /* offsets of footers to send, newest first */
+	size_t nfooters = 0, footers_allocated = 0;
+	uint64_t footer_off;
+	uint8_t *buf = NULL;
+	TKVDB_RES r;
+
+	tkvdb_db_wait(db);
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+
+	if ((info.filesize == 0)
+		|| (info.footer.transaction_id < *next_id)) {
+		/* nothing to send */
+		return TKVDB_OK;
+	}
+
+	/* walk back through chain of footers */
+	footer_off = info.filesize - TKVDB_TR_FTRSIZE;
+	for (;;) {
+		struct tkvdb_tr_footer footer;
+
+		r = tkvdb_footer_read(db->fd, &footer_off, &footer);
+		if ((r == TKVDB_EMPTY) && (nfooters == 0)) {
+			/* only spilled nodes, nothing committed */
+			r = TKVDB_OK;
+			goto end;
+		} else if ((r == TKVDB_EMPTY) && (*next_id == 0)) {
+			/* first transaction in file */
+			break;
+		} else if (r != TKVDB_OK) {
+			/* part of history was overwritten by vacuum */
+			r = TKVDB_NOT_FOUND;
+			goto end;
+		}
+
+		if (nfooters == footers_allocated) {
+			uint64_t *tmp;
+
+			footers_allocated = footers_allocated * 2 + 16;
+			tmp = realloc(footers,
+				footers_allocated * sizeof(uint64_t));
+			if (!tmp) {
+				r = TKVDB_ENOMEM;
+				goto end;
+			}
+			footers = tmp;
+		}
+		footers[nfooters++] = footer_off;
+
+		if (footer.transaction_id == *next_id) {
+			break;
+		}
+
+		r = tkvdb_footer_prev(footer_off, &footer, &footer_off);
+		if (r == TKVDB_EMPTY) {
+			/* first transaction in file */
+			if (*next_id != 0) {
+				r = TKVDB_NOT_FOUND;
+				goto end;
+			}
+			break;
+		} else if (r != TKVDB_OK) {
+			goto end;
+		}
+	}
+
+	buf = malloc(TKVDB_REPL_BUFSIZE);
+	if (!buf) {
+		r = TKVDB_ENOMEM;
+		goto end;
+	}
+
+	/* send transactions, oldest first */
+	while (nfooters > 0) {
+		struct tkvdb_tr_footer footer;
+		struct tkvdb_repl_header hdr;
+		uint64_t prev_off;
+
+		footer_off = footers[--nfooters];
+		r = tkvdb_footer_read(db->fd, &footer_off, &footer);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+
+		memcpy(hdr.signature, TKVDB_SIGNATURE,
+			sizeof(TKVDB_SIGNATURE) - 1);
+		hdr.transaction_id = footer.transaction_id;
+
+		r = tkvdb_footer_prev(footer_off, &footer, &prev_off);
+		if (r == TKVDB_OK) {
+			/* spilled blocks before transaction are sent in tail */
+			struct tkvdb_tr_footer prev;
+
+			r = tkvdb_footer_read(db->fd, &prev_off, &prev);
+		}
+		if (r == TKVDB_EMPTY) {
+			hdr.tail_off = 0;
+		} else if (r == TKVDB_OK) {
+			hdr.tail_off = prev_off + TKVDB_TR_FTRSIZE;
+		} else {
+			goto end;
+		}
+		hdr.tail_size = footer_off + TKVDB_TR_FTRSIZE - hdr.tail_off;
+
+		hdr.gap_off = footer.root_off - sizeof(struct tkvdb_tr_header);
+		if (hdr.gap_off >= hdr.tail_off) {
+			/* transaction block is in tail */
+			hdr.gap_off = hdr.gap_size = 0;
+		} else {
+			hdr.gap_size = footer.transaction_size;
+		}
+
+		r = tkvdb_write_full(fd, &hdr, sizeof(struct tkvdb_repl_header));
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+
+		if (hdr.gap_size > 0) {
+			r = tkvdb_repl_send_range(db->fd, hdr.gap_off,
+				hdr.gap_size, fd, buf);
+			if (r != TKVDB_OK) {
+				goto end;
+			}
+		}
+
+		r = tkvdb_repl_send_range(db->fd, hdr.tail_off, hdr.tail_size,
+			fd, buf);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+
+		*next_id = footer.transaction_id + 1;
+	}
+
+	r = TKVDB_OK;
+
+end:
+	free(buf);
+	free(footers);
+
+	return r;
+}
+
+TKVDB_RES
+tkvdb_repl_recv(tkvdb *db, int fd)
+{
+	uint8_t *buf;
+	TKVDB_RES r;
+
+	tkvdb_db_wait(db);
+
+	buf = malloc(TKVDB_REPL_BUFSIZE);
+	if (!buf) {
+		return TKVDB_ENOMEM;
+	}
+
+	for (;;) {
+		struct tkvdb_repl_header hdr;
+		uint64_t next_id;
+		size_t nread;
+
+		r = tkvdb_read_full(fd, &hdr, sizeof(struct tkvdb_repl_header),
+			&nread);
+		if (r != TKVDB_OK) {
+			break;
+		}
+		if (nread == 0) {
+			/* end of stream */
+			break;
+		}
+		if ((nread != sizeof(struct tkvdb_repl_header))
+			|| (memcmp(hdr.signature, TKVDB_SIGNATURE,
+				sizeof(TKVDB_SIGNATURE) - 1) != 0)) {
+
+			r = TKVDB_CORRUPTED;
+			break;
+		}
+
+		r = tkvdb_info_read(db->fd, &db->info);
+		if (r != TKVDB_OK) {
+			break;
+		}
+		next_id = (db->info.filesize == 0)
+			? 0 : (db->info.footer.transaction_id + 1);
+
+		if ((hdr.transaction_id != next_id)
+			|| (hdr.tail_off != db->info.filesize)) {
+			/* missing transactions or follower was modified */
+			r = TKVDB_MODIFIED;
+			break;
+		}
+
+		r = tkvdb_repl_check(db, fd, &hdr);
+		if (r != TKVDB_OK) {
+			break;
+		}
+
+		if (hdr.gap_size > 0) {
+			r = tkvdb_repl_recv_range(fd, db->fd, hdr.gap_off,
+				hdr.gap_size, buf);
+			if (r != TKVDB_OK) {
+				break;
+			}
+		}
+
+		/* tail ends with footer, so it's written last */
+		r = tkvdb_repl_recv_range(fd, db->fd, hdr.tail_off,
+			hdr.tail_size, buf);
+		if (r == TKVDB_OK) {
+			r = tkvdb_repl_check_footer(db, &hdr);
+		}
+		if (r != TKVDB_OK) {
+			/* drop partial tail, so file ends with last complete
+			 * footer and recv may be resumed */
+			if (ftruncate(db->fd, hdr.tail_off) != 0) {
+				r = TKVDB_IO_ERROR;
+			}
+			break;
+		}
+	}
+
+	free(buf);
+	if (r == TKVDB_OK) {
+		r = tkvdb_info_read(db->fd, &db->info);
+	}
+
+	return r;
+}
+
+/* historical reads */
+
+/* add transactions committed since last call to index */
+static TKVDB_RES
+tkvdb_history_update(tkvdb *db)
+{
+	struct tkvdb_db_info info;
+	struct tkvdb_history_item *items = NULL;
+	size_t nitems = 0, items_allocated = 0;
+	uint64_t footer_off;
+	TKVDB_RES r = TKVDB_OK;
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	if (info.filesize == 0) {
+		return TKVDB_OK;
+	}
+
+	/* walk back until already indexed transaction */
+	footer_off = info.filesize - TKVDB_TR_FTRSIZE;
+	for (;;) {
+		struct tkvdb_tr_footer footer;
+
+		if (tkvdb_footer_read(db->fd, &footer_off, &footer)
+			!= TKVDB_OK) {
+			/* older transactions are overwritten by vacuum */
+			break;
+		}
+
+		if ((db->history_size > 0) && (footer.transaction_id
+			<= db->history[db->history_size - 1].transaction_id)) {
+			break;
+		}
+
+		if (nitems == items_allocated) {
+			struct tkvdb_history_item *tmp;
+
+			items_allocated = items_allocated * 2 + 16;
+			tmp = realloc(items, items_allocated
+				* sizeof(struct tkvdb_history_item));
+			if (!tmp) {
+				r = TKVDB_ENOMEM;
+				goto end;
+			}
+			items = tmp;
+		}
+		items[nitems].transaction_id = footer.transaction_id;
+		items[nitems].footer_off = footer_off;
+		items[nitems].root_off = footer.root_off;
+		nitems++;
+
+		if (tkvdb_footer_prev(footer_off, &footer, &footer_off)
+			!= TKVDB_OK) {
+			break;
+		}
+	}
+
+	if (nitems == 0) {
+		goto end;
+	}
+
+	if ((db->history_size + nitems) > db->history_allocated) {
+		struct tkvdb_history_item *tmp;
+		size_t new_size = db->history_allocated * 2;
+
+		if (new_size < (db->history_size + nitems)) {
+			new_size = db->history_size + nitems;
+		}
+		tmp = realloc(db->history,
+			new_size * sizeof(struct tkvdb_history_item));
+		if (!tmp) {
+			r = TKVDB_ENOMEM;
+			goto end;
+		}
+		db->history = tmp;
+		db->history_allocated = new_size;
+	}
+
+	/* append new transactions, oldest first */
+	while (nitems > 0) {
+		db->history[db->history_size++] = items[--nitems];
+	}
+
+end:
+	free(items);
+	return r;
+}
+
+tkvdb_tr *
+tkvdb_tr_create_at(tkvdb *db, uint64_t transaction_id)
+{
+	struct tkvdb_db_info info;
+	struct tkvdb_tr_footer footer;
+	uint64_t footer_off;
+	struct tkvdb_history_item *item = NULL;
+	size_t lo, hi;
+	tkvdb_tr *tr;
+
+	tkvdb_db_wait(db);
+	if (tkvdb_history_update(db) != TKVDB_OK) {
+		return NULL;
+	}
+
+	/* binary search in index */
+	lo = 0;
+	hi = db->history_size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (db->history[mid].transaction_id == transaction_id) {
+			item = &db->history[mid];
+			break;
+		} else if (db->history[mid].transaction_id < transaction_id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (!item) {
+		return NULL;
+	}
+
+	/* check that transaction is still in file */
+	footer_off = item->footer_off;
+	if ((tkvdb_footer_read(db->fd, &footer_off, &footer) != TKVDB_OK)
+		|| (footer_off != item->footer_off)
+		|| (footer.transaction_id != transaction_id)
+		|| (footer.root_off != item->root_off)) {
+
+		return NULL;
+	}
+
+	/* and older nodes it references too: gap only grows by vacuum,
+	 * so space reclaimed after this transaction may be overwritten */
+	if ((tkvdb_info_read(db->fd, &info) != TKVDB_OK)
+		|| (info.footer.gap_end != footer.gap_end)) {
+
+		return NULL;
+	}
+
+	tr = tkvdb_tr_create(db);
+	if (!tr) {
+		return NULL;
+	}
+
+	tr->readonly = 1;
+	tr->snapshot_root_off = item->root_off;
+
+	if (tkvdb_catalog_read(db->fd, &footer, &(tr->keyspaces))
+		!= TKVDB_OK) {
+
+		tkvdb_tr_free(tr);
+		return NULL;
+	}
+
+	return tr;
+}
+
+/* backup */
+
+/* offset of node in output file, nodes smaller than page
+ * are moved to the next page instead of crossing page boundary */
+static uint64_t
+tkvdb_node_place(uint64_t off, uint64_t size, size_t page_size)
+{
+	if (page_size && (size <= page_size)
+		&& ((off / page_size) != ((off + size - 1) / page_size))) {
+
+		off = (off / page_size + 1) * page_size;
+	}
+
+	return off;
+}
+
+/* write all nodes reachable from root to file starting from
+ * offset 'start', nodes are placed in depth-first order */
+static TKVDB_RES
+tkvdb_live_write(tkvdb *db, uint64_t root_off, int fd, uint64_t start,
+	size_t page_size, uint64_t *end)
+{
+	size_t stack_depth = 0;
+	struct tkvdb_visit_helper stack[TKVDB_STACK_MAX_DEPTH];
+
+	tkvdb_tr *tr;
+	tkvdb_memnode *node;
+	uint64_t node_off = start;
+	uint8_t *buf = NULL;
+	size_t buf_size = 0;
+	TKVDB_RES r;
+
+	/* nodes are read one by one and freed after write */
+	tr = tkvdb_tr_create_a(db, SIZE_MAX, 1, &tkvdb_std_allocator);
+	if (!tr) {
+		return TKVDB_ENOMEM;
+	}
+
+	r = tkvdb_node_read(tr, root_off, &node);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+	/* root is always at the start */
+	tkvdb_node_calc_disksize(node);
+	node->disk_off = node_off;
+	node_off = node->disk_off + node->disk_size;
+
+	stack[0].node = node;
+	stack[0].off = 0;
+	stack_depth = 1;
+
+	while (stack_depth > 0) {
+		int off;
+
+		node = stack[stack_depth - 1].node;
+		for (off=stack[stack_depth - 1].off; off<256; off++) {
+			if (TKVDB_FNEXT(node, off)) {
+				break;
+			}
+		}
+
+		if (off < 256) {
+			tkvdb_memnode *next;
+
+			if (stack_depth >= TKVDB_STACK_MAX_DEPTH) {
+				r = TKVDB_ENOMEM;
+				goto end;
+			}
+
+			r = tkvdb_node_read(tr, TKVDB_FNEXT(node, off), &next);
+			if (r != TKVDB_OK) {
+				goto end;
+			}
+			tkvdb_node_calc_disksize(next);
+			next->disk_off = tkvdb_node_place(node_off,
+				next->disk_size, page_size);
+			node_off = next->disk_off + next->disk_size;
+
+			/* replace offset of subnode in parent */
+			node->fnext[TKVDB_SLOT(node, off)] = next->disk_off;
+			stack[stack_depth - 1].off = off + 1;
+
+			stack[stack_depth].node = next;
+			stack[stack_depth].off = 0;
+			stack_depth++;
+			continue;
+		}
+
+		/* all subnodes are written, so node is complete */
+		if (node->disk_size > buf_size) {
+			uint8_t *tmp = realloc(buf, node->disk_size);
+			if (!tmp) {
+				r = TKVDB_ENOMEM;
+				goto end;
+			}
+			buf = tmp;
+			buf_size = node->disk_size;
+		}
+		tkvdb_node_serialize(node, buf);
+		if (pwrite(fd, buf, node->disk_size, node->disk_off)
+			!= (ssize_t)node->disk_size) {
+			r = TKVDB_IO_ERROR;
+			goto end;
+		}
+
+		tkvdb_node_dealloc(tr, node);
+		stack_depth--;
+	}
+
+	*end = node_off;
+	r = TKVDB_OK;
+
+end:
+	while (stack_depth > 0) {
+		tkvdb_node_dealloc(tr, stack[--stack_depth].node);
+	}
+	free(buf);
+	tkvdb_tr_free(tr);
+
+	return r;
+}
+
+/* write live data of database as a single transaction */
+static TKVDB_RES
+tkvdb_live_copy(tkvdb *db, const struct tkvdb_db_info *info, int fd,
+	size_t page_size)
+{
+	struct tkvdb_tr_header header;
+	struct tkvdb_tr_footer footer;
+	struct tkvdb_catalog cat = {NULL, 0, 0};
+	uint64_t node_off;
+	size_t catalog_size, i;
+	uint8_t *catalog = NULL;
+	TKVDB_RES r;
+
+	if ((info->filesize == 0) || (info->footer.root_off == 0)) {
+		/* empty database is an empty file */
+		if (ftruncate(fd, 0) != 0) {
+			return TKVDB_IO_ERROR;
+		}
+		return TKVDB_OK;
+	}
+
+	r = tkvdb_catalog_load(db, info, &cat);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+
+	r = tkvdb_live_write(db, info->footer.root_off, fd,
+		sizeof(struct tkvdb_tr_header), page_size, &node_off);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+
+	/* each keyspace is written after default root */
+	for (i=0; i<cat.size; i++) {
+		uint64_t ks_off = node_off;
+
+		if (!cat.items[i].root_off) {
+			continue;
+		}
+
+		r = tkvdb_live_write(db, cat.items[i].root_off, fd, ks_off,
+			page_size, &node_off);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+		cat.items[i].root_off = ks_off;
+	}
+
+	catalog_size = tkvdb_catalog_size(&cat);
+	if (catalog_size > 0) {
+		catalog = malloc(catalog_size);
+		if (!catalog) {
+			r = TKVDB_ENOMEM;
+			goto end;
+		}
+		tkvdb_catalog_write(&cat, catalog, catalog_size);
+
+		if (pwrite(fd, catalog, catalog_size, node_off)
+			!= (ssize_t)catalog_size) {
+
+			r = TKVDB_IO_ERROR;
+			goto end;
+		}
+		node_off += catalog_size;
+	}
+
+	header.type = TKVDB_BLOCKTYPE_TRANSACTION;
+	header.footer_off = node_off;
+
+	footer = info->footer;
+	footer.type = TKVDB_BLOCKTYPE_FOOTER;
+	if (catalog_size > 0) {
+		footer.type |= TKVDB_BLOCKTYPE_KEYSPACES;
+	}
+	footer.root_off = sizeof(struct tkvdb_tr_header);
+	footer.transaction_size = node_off;
+	footer.gap_begin = footer.gap_end = 0;
+
+	if ((pwrite(fd, &header, sizeof(struct tkvdb_tr_header), 0)
+		!= sizeof(struct tkvdb_tr_header))
+		|| (pwrite(fd, &footer, TKVDB_TR_FTRSIZE, node_off)
+		!= TKVDB_TR_FTRSIZE)) {
+
+		r = TKVDB_IO_ERROR;
+		goto end;
+	}
+
+	/* footer must be at the end of file */
+	if (ftruncate(fd, node_off + TKVDB_TR_FTRSIZE) != 0) {
+		r = TKVDB_IO_ERROR;
+		goto end;
+	}
+
+	r = TKVDB_OK;
+
+end:
+	free(catalog);
+	tkvdb_catalog_free(&cat);
+	return r;
+}
+
+TKVDB_RES
+tkvdb_backup(tkvdb *db, int fd)
+{
+	struct tkvdb_db_info info, info_after;
+
+	/* nodes are placed with pwrite(), pipes and sockets can't be used */
+	if (lseek(fd, 0, SEEK_CUR) < 0) {
+		return TKVDB_IO_ERROR;
+	}
+
+	tkvdb_db_wait(db);
+
+	/* pin current root, appended transactions don't touch its nodes */
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+
+	TKVDB_EXEC( tkvdb_live_copy(db, &info, fd, 0) );
+
+	/* commit to vacuumed gap may overwrite nodes of pinned root */
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info_after) );
+	if ((info_after.footer.gap_begin != info.footer.gap_begin)
+		|| (info_after.footer.gap_end != info.footer.gap_end)
+		|| (info_after.filesize < info.filesize)) {
+
+		return TKVDB_MODIFIED;
+	}
+
+	return TKVDB_OK;
+}
+
+/* fsync() directory containing file */
+static TKVDB_RES
+tkvdb_sync_dir(const char *path)
+{
+	char *dir, *slash;
+	int fd;
+	TKVDB_RES r = TKVDB_OK;
+
+	dir = strdup(path);
+	if (!dir) {
+		return TKVDB_ENOMEM;
+	}
+	slash = strrchr(dir, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		slash[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+
+	fd = open(dir, O_RDONLY);
+	if ((fd < 0) || (fsync(fd) != 0)) {
+		r = TKVDB_IO_ERROR;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(dir);
+
+	return r;
+}
+
+void
+tkvdb_compact_params_init(tkvdb_compact_params *params)
+{
+	params->page_size = TKVDB_READ_SIZE;
+	params->sync = 1;
+}
+
+TKVDB_RES
+tkvdb_compact_to(tkvdb *db, const char *new_path,
+	const tkvdb_compact_params *user_params)
+{
+	tkvdb_compact_params params;
+	struct tkvdb_db_info info, info_after;
+	int fd;
+	TKVDB_RES r;
+
+	if (user_params) {
+		params = *user_params;
+	} else {
+		tkvdb_compact_params_init(&params);
+	}
+
+	tkvdb_db_wait(db);
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+
+	fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC, db->params.mode);
+	if (fd < 0) {
+		return TKVDB_IO_ERROR;
+	}
+
+	r = tkvdb_live_copy(db, &info, fd, params.page_size);
+	if ((r == TKVDB_OK) && params.sync && (fsync(fd) != 0)) {
+		r = TKVDB_IO_ERROR;
+	}
+	if ((close(fd) != 0) && (r == TKVDB_OK)) {
+		r = TKVDB_IO_ERROR;
+	}
+	if (r != TKVDB_OK) {
+		goto fail_unlink;
+	}
+
+	/* check that nothing was committed during compaction */
+	r = tkvdb_info_read(db->fd, &info_after);
+	if (r != TKVDB_OK) {
+		goto fail_unlink;
+	}
+	if ((info_after.filesize != info.filesize)
+		|| (memcmp(&info_after.footer, &info.footer,
+			TKVDB_TR_FTRSIZE) != 0)) {
+
+		r = TKVDB_MODIFIED;
+		goto fail_unlink;
+	}
+
+	/* replace old file and reopen */
+	if (rename(new_path, db->path) != 0) {
+		r = TKVDB_IO_ERROR;
+		goto fail_unlink;
+	}
+
+	fd = open(db->path, db->params.flags & ~(O_CREAT | O_TRUNC | O_EXCL),
+		db->params.mode);
+	if (fd < 0) {
+		/* handle stays on old file, tkvdb_begin() detects it */
+		return TKVDB_IO_ERROR;
+	}
+	close(db->fd);
+	db->fd = fd;
+
+	/* offsets of past transactions are not valid anymore,
+	 * transactions begun before compaction fail on next read */
+	db->generation++;
+	db->history_size = 0;
+	tkvdb_crown_free(&db->crown);
+
+	r = tkvdb_direct_open(db);
+	if (r == TKVDB_OK) {
+		r = tkvdb_info_read(db->fd, &db->info);
+	}
+	if ((r == TKVDB_OK) && params.sync) {
+		r = tkvdb_sync_dir(db->path);
+	}
+
+	return r;
+
+fail_unlink:
+	unlink(new_path);
+	return r;
+}
+
+
+/* export to frozen image (format is described above tkvdb_frozen_get()) */
+
+#define TKVDB_FROZEN_BUFSIZE (TKVDB_READ_SIZE * 16)
+
+struct tkvdb_freeze_ctx
+{
+	tkvdb_tr *tr;           /* used only for reading nodes from disk */
+	int fd;
+
+	uint8_t *buf;
+	size_t buf_size;
+	uint64_t off;           /* size of image written so far */
+	uint64_t nkeys;
+};
+
+static TKVDB_RES
+tkvdb_freeze_flush(struct tkvdb_freeze_ctx *ctx)
+{
+	TKVDB_EXEC( tkvdb_write_full(ctx->fd, ctx->buf, ctx->buf_size) );
+	ctx->buf_size = 0;
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_freeze_write(struct tkvdb_freeze_ctx *ctx, const void *data, size_t n)
+{
+	if ((ctx->buf_size + n) > TKVDB_FROZEN_BUFSIZE) {
+		TKVDB_EXEC( tkvdb_freeze_flush(ctx) );
+	}
+
+	if (n > TKVDB_FROZEN_BUFSIZE) {
+		TKVDB_EXEC( tkvdb_write_full(ctx->fd, data, n) );
+	} else {
+		memcpy(ctx->buf + ctx->buf_size, data, n);
+		ctx->buf_size += n;
+	}
+	ctx->off += n;
+
+	return TKVDB_OK;
+}
+
+static uint8_t *
+tkvdb_freeze_varint(uint8_t *ptr, uint64_t val)
+{
+	while (val >= 0x80) {
+		*ptr++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*ptr++ = val;
+
+	return ptr;
+}
+
+/* write subnodes and then node itself, returns TKVDB_EMPTY for node
+ * without value and subnodes (left by deletion) */
+static TKVDB_RES
+tkvdb_freeze_node(struct tkvdb_freeze_ctx *ctx, tkvdb_memnode *node,
+	uint64_t *off)
+{
+	uint64_t subnodes[256], dist, maxdist = 0;
+	uint8_t syms[256], hdr[2 + 10 + 10], *ptr;
+	unsigned int i, j, n = 0, wlog = 0;
+	size_t val_size = 0;
+
+	TKVDB_SKIP_RNODES(node);
+
+	for (i=0; i<256; i++) {
+		tkvdb_memnode *next = TKVDB_NEXT(node, i);
+		int loaded = 0;
+		TKVDB_RES r;
+
+		if (!next) {
+			if (!ctx->tr->db || !TKVDB_FNEXT(node, i)) {
+				continue;
+			}
+			TKVDB_EXEC( tkvdb_node_read(ctx->tr,
+				TKVDB_FNEXT(node, i), &next) );
+			loaded = 1;
+		}
+
+		r = tkvdb_freeze_node(ctx, next, &subnodes[n]);
+		if (loaded) {
+			tkvdb_node_dealloc(ctx->tr, next);
+		}
+		if (r == TKVDB_EMPTY) {
+			continue;
+		} else if (r != TKVDB_OK) {
+			return r;
+		}
+		syms[n++] = i;
+	}
+
+	if (!(node->type & TKVDB_NODE_VAL) && (n == 0)) {
+		return TKVDB_EMPTY;
+	}
+
+	*off = ctx->off;
+	for (j=0; j<n; j++) {
+		dist = *off - subnodes[j];
+		if (dist > maxdist) {
+			maxdist = dist;
+		}
+	}
+	while ((wlog < 3) && (maxdist >> (8 << wlog))) {
+		wlog++;
+	}
+
+	ptr = hdr;
+	*ptr = node->type & TKVDB_NODE_VAL;
+	if (n > 0) {
+		*ptr |= TKVDB_FROZEN_SUBNODES
+			| (wlog << TKVDB_FROZEN_WIDTH_SHIFT);
+		ptr++;
+		*ptr = n - 1;
+	}
+	ptr++;
+	ptr = tkvdb_freeze_varint(ptr, node->prefix_size);
+	if (node->type & TKVDB_NODE_VAL) {
+		/* value of deleted key may be still kept in node otherwise */
+		val_size = node->val_size;
+		ptr = tkvdb_freeze_varint(ptr, val_size);
+		ctx->nkeys++;
+	}
+
+	TKVDB_EXEC( tkvdb_freeze_write(ctx, hdr, ptr - hdr) );
+	TKVDB_EXEC( tkvdb_freeze_write(ctx, node->prefix_val_meta,
+		node->prefix_size + val_size) );
+	TKVDB_EXEC( tkvdb_freeze_write(ctx, syms, n) );
+
+	for (j=0; j<n; j++) {
+		uint8_t le[sizeof(uint64_t)];
+
+		dist = *off - subnodes[j];
+		for (i=0; i<(1U << wlog); i++) {
+			le[i] = dist >> (i * 8);
+		}
+		TKVDB_EXEC( tkvdb_freeze_write(ctx, le, 1 << wlog) );
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_freeze(tkvdb_tr *tr, int fd)
+{
+	struct tkvdb_freeze_ctx ctx;
+	struct tkvdb_frozen_footer footer;
+	tkvdb_memnode *root = NULL;
+	uint64_t root_off = 0;
+	TKVDB_RES r;
+
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	if (tr->frozen) {
+		return tkvdb_write_full(fd, tr->frozen, tr->frozen_size);
+	}
+
+	/* nodes on disk are read one by one and freed after writing */
+	ctx.tr = tkvdb_tr_create_a(tr->db, SIZE_MAX, 1, &tkvdb_std_allocator);
+	if (!ctx.tr) {
+		return TKVDB_ENOMEM;
+	}
+	ctx.buf = malloc(TKVDB_FROZEN_BUFSIZE);
+	if (!ctx.buf) {
+		r = TKVDB_ENOMEM;
+		goto end;
+	}
+	ctx.fd = fd;
+	ctx.buf_size = 0;
+	ctx.off = 0;
+	ctx.nkeys = 0;
+
+	r = tkvdb_freeze_write(&ctx, TKVDB_FROZEN_SIGNATURE,
+		TKVDB_FROZEN_HDRSIZE);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+
+	if (tr->root) {
+		r = tkvdb_freeze_node(&ctx, tr->root, &root_off);
+	} else if (tkvdb_tr_root_off(tr)) {
+		r = tkvdb_node_read(ctx.tr, tkvdb_tr_root_off(tr), &root);
+		if (r == TKVDB_OK) {
+			r = tkvdb_freeze_node(&ctx, root, &root_off);
+			tkvdb_node_dealloc(ctx.tr, root);
+		}
+	}
+	if (r == TKVDB_EMPTY) {
+		root_off = 0;
+		r = TKVDB_OK;
+	}
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+
+	footer.root_off = root_off;
+	footer.nkeys = ctx.nkeys;
+	memcpy(footer.signature, TKVDB_FROZEN_SIGNATURE,
+		sizeof(footer.signature));
+	r = tkvdb_freeze_write(&ctx, &footer, TKVDB_FROZEN_FTRSIZE);
+	if (r == TKVDB_OK) {
+		r = tkvdb_freeze_flush(&ctx);
+	}
+
+end:
+	free(ctx.buf);
+	tkvdb_tr_free(ctx.tr);
+	return r;
+}
+
+tkvdb_tr *
+tkvdb_tr_create_frozen(const char *path)
+{
+	struct tkvdb_frozen_footer footer;
+	struct stat st;
+	uint8_t *map;
+	size_t size;
+	tkvdb_tr *tr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if ((fstat(fd, &st) != 0) || (st.st_size
+		< (off_t)(TKVDB_FROZEN_HDRSIZE + TKVDB_FROZEN_FTRSIZE))) {
+
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	memcpy(&footer, map + size - TKVDB_FROZEN_FTRSIZE,
+		TKVDB_FROZEN_FTRSIZE);
+	if ((memcmp(map, TKVDB_FROZEN_SIGNATURE, TKVDB_FROZEN_HDRSIZE) != 0)
+		|| (memcmp(footer.signature, TKVDB_FROZEN_SIGNATURE,
+			sizeof(footer.signature)) != 0)
+		|| (footer.root_off >= (size - TKVDB_FROZEN_FTRSIZE))) {
+
+		munmap(map, size);
+		return NULL;
+	}
+
+	tr = tkvdb_tr_create(NULL);
+	if (!tr) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	tr->readonly = 1;
+	tr->frozen = map;
+	tr->frozen_size = size;
+	tr->frozen_root = footer.root_off;
+
+	return tr;
+}
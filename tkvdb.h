@@ -10,6 +10,7 @@ typedef struct tkvdb_params tkvdb_params;
 
 typedef struct tkvdb_tr tkvdb_tr;
 typedef struct tkvdb_cursor tkvdb_cursor;
+typedef struct tkvdb_pending tkvdb_pending;
 
 typedef enum TKVDB_RES
 {
@@ -21,7 +22,10 @@ typedef enum TKVDB_RES
 	TKVDB_ENOMEM,
 	TKVDB_CORRUPTED,
 	TKVDB_NOT_STARTED,
-	TKVDB_MODIFIED
+	TKVDB_MODIFIED,
+	TKVDB_READONLY,
+	TKVDB_INVALID,
+	TKVDB_AGAIN        /* node is being read from file, call again later */
 } TKVDB_RES;
 
 typedef enum TKVDB_SEEK
@@ -37,12 +41,77 @@ typedef struct tkvdb_datum
 	size_t len;
 } tkvdb_datum;
 
+typedef enum TKVDB_DIFF
+{
+	TKVDB_DIFF_PUT,
+	TKVDB_DIFF_DEL
+} TKVDB_DIFF;
+
+/* diff callback, val is new value for TKVDB_DIFF_PUT
+ * and old value for TKVDB_DIFF_DEL */
+typedef TKVDB_RES (*tkvdb_diff_cb)(void *arg, TKVDB_DIFF op,
+	const tkvdb_datum *key, const tkvdb_datum *val);
+
+typedef enum TKVDB_PARAM
+{
+	TKVDB_PARAM_TR_DYNALLOC,
+	TKVDB_PARAM_TR_LIMIT,
+	TKVDB_PARAM_TR_SPILL,
+	TKVDB_PARAM_WRITE_BUF_DYNALLOC,
+	TKVDB_PARAM_WRITE_BUF_LIMIT,
+	TKVDB_PARAM_DBFILE_OPEN_FLAGS,
+	TKVDB_PARAM_DBFILE_OPEN_MODE,
+	/* entries of cache of tkvdb_get() results (key hash -> node),
+	 * cache is dropped by any change of transaction, 0 disables it */
+	TKVDB_PARAM_TR_HASH,
+	/* bytes of top nodes of committed tree kept by database and shared
+	 * by its transactions instead of reading them from file, 0 disables */
+	TKVDB_PARAM_CROWN_SIZE,
+	/* max number of next subnodes requested from file ahead of cursor,
+	 * window grows up to it while cursor moves sequentially, 0 disables */
+	TKVDB_PARAM_CURSOR_READAHEAD,
+	/* read nodes and write transactions with O_DIRECT, bypassing page
+	 * cache, appended transactions are padded to keep end of file
+	 * aligned, 0 disables */
+	TKVDB_PARAM_DIRECT_IO,
+	/* tkvdb_commit_async() serializes and writes transaction in
+	 * background thread, 0 commits in caller thread */
+	TKVDB_PARAM_ASYNC_COMMIT
+} TKVDB_PARAM;
+
+/* memory allocator of transactions and cursors (nodes, transaction buffer
+ * and handles), 'free' gets size of block passed to 'alloc',
+ * optional 'reset' is called by tkvdb_tr_free() to drop all memory at once,
+ * nodes are not freed one by one then, so allocator with 'reset' should
+ * serve only one transaction */
+typedef struct tkvdb_allocator
+{
+	void *(*alloc)(void *ctx, size_t size);
+	void (*free)(void *ctx, void *ptr, size_t size);
+	void (*reset)(void *ctx);
+	void *ctx;
+} tkvdb_allocator;
+
+/* parameters of database compaction */
+typedef struct tkvdb_compact_params
+{
+	size_t page_size; /* don't let nodes cross page boundary, 0 to pack */
+	int sync;         /* fsync() new file before replacing old one */
+} tkvdb_compact_params;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* fill db params with default values */
 void tkvdb_params_init(tkvdb_params *params);
+/* allocate params filled with default values */
+tkvdb_params *tkvdb_params_create(void);
+void tkvdb_param_set(tkvdb_params *params, TKVDB_PARAM p, int64_t val);
+/* NULL restores default allocator (malloc() and free()) */
+void tkvdb_param_set_allocator(tkvdb_params *params,
+	const tkvdb_allocator *allocator);
+void tkvdb_params_free(tkvdb_params *params);
 
 tkvdb    *tkvdb_open(const char *path, tkvdb_params *params);
 TKVDB_RES tkvdb_close(tkvdb *db);
@@ -51,11 +120,51 @@ TKVDB_RES tkvdb_close(tkvdb *db);
 tkvdb_tr *tkvdb_tr_create(tkvdb *db);
 /* create transaction with custom memory allocation parameters */
 tkvdb_tr *tkvdb_tr_create_m(tkvdb *db, size_t limit, int dynalloc);
+/* create transaction with parameters other than database ones
+ * (buffer, spill size and allocator), 'db' may be NULL */
+tkvdb_tr *tkvdb_tr_create_p(tkvdb *db, const tkvdb_params *params);
+/* read-only transaction on root of past transaction,
+ * returns NULL if transaction is not found or vacuum reclaimed space
+ * after it (nodes it references may be overwritten) */
+tkvdb_tr *tkvdb_tr_create_at(tkvdb *db, uint64_t transaction_id);
 void tkvdb_tr_free(tkvdb_tr *tr);
+/* transaction on named keyspace with its own root, created on first use,
+ * it's the part of 'tr': begin, commit and rollback of one of them
+ * apply to all, transaction of keyspace is freed with 'tr' */
+tkvdb_tr *tkvdb_tr_keyspace(tkvdb_tr *tr, const char *name);
 
 TKVDB_RES tkvdb_begin(tkvdb_tr *tr);
 TKVDB_RES tkvdb_commit(tkvdb_tr *tr);
 TKVDB_RES tkvdb_rollback(tkvdb_tr *tr);
+/* hand tree of transaction to background writer, 'tr' may be started again
+ * at once on pending root: tkvdb_put() doesn't wait for writer, other
+ * calls wait and then apply new changes on top of committed root,
+ * result of commit is returned by tkvdb_commit_wait() (which frees handle)
+ * and by the next call on 'tr' if commit failed */
+TKVDB_RES tkvdb_commit_async(tkvdb_tr *tr, tkvdb_pending **pending);
+TKVDB_RES tkvdb_commit_wait(tkvdb_pending *pending);
+/* put all pairs of 'src' to 'dst', subtrees of in-memory 'src' are merged
+ * structurally, 'src' is not changed */
+TKVDB_RES tkvdb_tr_merge(tkvdb_tr *dst, tkvdb_tr *src);
+/* copy or move all keys starting with 'from' under prefix 'to',
+ * existing keys under 'to' are kept unless replaced,
+ * subtrees on disk are referenced by offset,
+ * returns TKVDB_INVALID if one prefix starts with another */
+TKVDB_RES tkvdb_copy_prefix(tkvdb_tr *tr, const tkvdb_datum *from,
+	const tkvdb_datum *to);
+TKVDB_RES tkvdb_move_prefix(tkvdb_tr *tr, const tkvdb_datum *from,
+	const tkvdb_datum *to);
+/* savepoints inside transaction, rollback to savepoint undoes changes
+ * made after it and keeps savepoint, releasing savepoint also releases
+ * savepoints created after it, cursors are invalidated by rollback */
+TKVDB_RES tkvdb_savepoint(tkvdb_tr *tr, size_t *sp);
+TKVDB_RES tkvdb_rollback_to(tkvdb_tr *tr, size_t sp);
+TKVDB_RES tkvdb_savepoint_release(tkvdb_tr *tr, size_t sp);
+/* write dirty subtrees of transaction to the end of db file and free
+ * memory, nodes become reachable only after commit, cursors of transaction
+ * are invalidated, called from tkvdb_put() when TKVDB_PARAM_TR_SPILL size
+ * is exceeded and transaction has no cursors */
+TKVDB_RES tkvdb_tr_spill(tkvdb_tr *tr);
 
 /* fsync() db file */
 TKVDB_RES tkvdb_sync(tkvdb *db);
@@ -64,6 +173,20 @@ TKVDB_RES tkvdb_put(tkvdb_tr *tr,
 	const tkvdb_datum *key, const tkvdb_datum *val);
 TKVDB_RES tkvdb_del(tkvdb_tr *tr, const tkvdb_datum *key, int del_pfx);
 TKVDB_RES tkvdb_get(tkvdb_tr *tr, const tkvdb_datum *key, tkvdb_datum *val);
+/* get values of 'n' keys, res[i] is result of tkvdb_get() for keys[i],
+ * nodes needed by keys at the same depth are read from file together,
+ * returns error only if lookups can't be done at all */
+TKVDB_RES tkvdb_get_multi(tkvdb_tr *tr, const tkvdb_datum *keys,
+	tkvdb_datum *vals, TKVDB_RES *res, size_t n);
+/* tkvdb_get() which doesn't wait for disk: if node isn't in memory or page
+ * cache, its read is started and TKVDB_AGAIN is returned */
+TKVDB_RES tkvdb_get_nowait(tkvdb_tr *tr, const tkvdb_datum *key,
+	tkvdb_datum *val);
+/* 8-byte integer keys, stored in big-endian byte order,
+ * so cursors return them in numeric order, lookup walks fixed-depth key */
+TKVDB_RES tkvdb_put_u64(tkvdb_tr *tr, uint64_t key, const tkvdb_datum *val);
+TKVDB_RES tkvdb_del_u64(tkvdb_tr *tr, uint64_t key);
+TKVDB_RES tkvdb_get_u64(tkvdb_tr *tr, uint64_t key, tkvdb_datum *val);
 
 /* cursors */
 tkvdb_cursor *tkvdb_cursor_create(tkvdb_tr *tr);
@@ -81,6 +204,10 @@ TKVDB_RES tkvdb_last(tkvdb_cursor *c);
 
 TKVDB_RES tkvdb_next(tkvdb_cursor *c);
 TKVDB_RES tkvdb_prev(tkvdb_cursor *c);
+/* tkvdb_next() and tkvdb_prev() which return TKVDB_AGAIN instead of waiting
+ * for disk, cursor isn't moved then */
+TKVDB_RES tkvdb_next_nowait(tkvdb_cursor *c);
+TKVDB_RES tkvdb_prev_nowait(tkvdb_cursor *c);
 
 /* vacuum */
 TKVDB_RES tkvdb_vacuum(tkvdb_tr *tr, tkvdb_tr *vac, tkvdb_tr *tres,
@@ -89,6 +216,43 @@ TKVDB_RES tkvdb_vacuum(tkvdb_tr *tr, tkvdb_tr *vac, tkvdb_tr *tres,
 TKVDB_RES tkvdb_dbinfo(tkvdb *db, uint64_t *root_off,
 	uint64_t *gap_begin, uint64_t *gap_end);
 
+/* keys changed between two committed roots (in key order),
+ * pass 0 as root offset for empty database */
+TKVDB_RES tkvdb_diff(tkvdb *db, uint64_t old_root_off, uint64_t new_root_off,
+	tkvdb_diff_cb cb, void *arg);
+
+/* frozen image: compact immutable copy of transaction (committed data
+ * and changes of 'tr'), metadata and keyspaces are not exported */
+TKVDB_RES tkvdb_freeze(tkvdb_tr *tr, int fd);
+/* read-only transaction on frozen image, file is mapped to memory,
+ * tkvdb_get() and cursors work on image without allocation of nodes */
+tkvdb_tr *tkvdb_tr_create_frozen(const char *path);
+
+/* write live data of database to new file (fd must be seekable, pipe or
+ * socket returns TKVDB_IO_ERROR), transactions appended during backup are
+ * not included, if vacuum or commit to vacuumed gap happened during backup
+ * copy may be inconsistent and TKVDB_MODIFIED is returned */
+TKVDB_RES tkvdb_backup(tkvdb *db, int fd);
+
+/* rewrite live data to new file and atomically replace database file,
+ * returns TKVDB_MODIFIED if other transaction was committed during rewrite,
+ * transactions begun before it get TKVDB_MODIFIED on reads and commit,
+ * other handles of file get TKVDB_MODIFIED from begin and commit and
+ * should be reopened */
+void tkvdb_compact_params_init(tkvdb_compact_params *params);
+TKVDB_RES tkvdb_compact_to(tkvdb *db, const char *new_path,
+	const tkvdb_compact_params *params);
+
+/* replication */
+/* id of the next transaction expected by follower (0 for empty database) */
+TKVDB_RES tkvdb_repl_next_id(tkvdb *db, uint64_t *next_id);
+/* write transactions starting from *next_id to fd and advance *next_id,
+ * returns TKVDB_NOT_FOUND if part of history was reclaimed by vacuum */
+TKVDB_RES tkvdb_repl_send(tkvdb *db, uint64_t *next_id, int fd);
+/* apply transactions from fd until end of stream, block that doesn't match
+ * stream or database file returns TKVDB_CORRUPTED, partial tail is cut off */
+TKVDB_RES tkvdb_repl_recv(tkvdb *db, int fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1079 @@
+#ifndef tkvdb_hpp_included
+#define tkvdb_hpp_included
+
+/* header-only C++20 wrapper for tkvdb.h
+ *
+ * C API is declared in namespace tkvdb::c, since name of C database
+ * handle conflicts with namespace, so don't include tkvdb.h directly
+ * in the same translation unit */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#ifdef tkvdb_h_included
+#error "tkvdb.h must not be included together with tkvdb.hpp"
+#endif
+
+namespace tkvdb {
+namespace c {
+#include "tkvdb.h"
+} /* namespace c */
+} /* namespace tkvdb */
+
+/* result codes and other enums are used unqualified as in C */
+using tkvdb::c::TKVDB_RES;
+using enum tkvdb::c::TKVDB_RES;
+using tkvdb::c::TKVDB_SEEK;
+using enum tkvdb::c::TKVDB_SEEK;
+using tkvdb::c::TKVDB_PARAM;
+using enum tkvdb::c::TKVDB_PARAM;
+
+namespace tkvdb {
+
+using bytes = std::span<const std::byte>;
+
+inline const char *
+strerror(TKVDB_RES r) noexcept
+{
+	switch (r) {
+	case TKVDB_OK:          return "ok";
+	case TKVDB_IO_ERROR:    return "I/O error";
+	case TKVDB_LOCKED:      return "locked";
+	case TKVDB_EMPTY:       return "empty";
+	case TKVDB_NOT_FOUND:   return "not found";
+	case TKVDB_ENOMEM:      return "out of memory";
+	case TKVDB_CORRUPTED:   return "corrupted";
+	case TKVDB_NOT_STARTED: return "transaction not started";
+	case TKVDB_MODIFIED:    return "modified";
+	case TKVDB_READONLY:    return "read-only";
+	case TKVDB_INVALID:     return "invalid argument";
+	case TKVDB_AGAIN:       return "try again";
+	}
+	return "unknown error";
+}
+
+/* thrown by constructors and by functions which can't return TKVDB_RES */
+class error : public std::runtime_error
+{
+public:
+	explicit error(TKVDB_RES r)
+		: std::runtime_error(tkvdb::strerror(r)), code_(r) {}
+
+	TKVDB_RES code() const noexcept { return code_; }
+
+private:
+	TKVDB_RES code_;
+};
+
+inline std::string_view
+as_string_view(bytes b) noexcept
+{
+	return std::string_view(reinterpret_cast<const char *>(b.data()),
+		b.size());
+}
+
+/* key or value passed to tkvdb, data is never copied */
+class datum
+{
+public:
+	datum(std::string_view s) noexcept
+	{
+		d_.data = const_cast<char *>(s.data());
+		d_.len = s.size();
+	}
+	datum(const char *s) noexcept : datum(std::string_view(s)) {}
+	datum(const std::string &s) noexcept : datum(std::string_view(s)) {}
+	datum(bytes b) noexcept
+	{
+		d_.data = const_cast<std::byte *>(b.data());
+		d_.len = b.size();
+	}
+	datum(std::span<std::byte> b) noexcept : datum(bytes(b)) {}
+
+	const c::tkvdb_datum *get() const noexcept { return &d_; }
+
+private:
+	c::tkvdb_datum d_;
+};
+
+inline bool
+key_equal(bytes a, datum b) noexcept
+{
+	const c::tkvdb_datum *d = b.get();
+
+	return (a.size() == d->len)
+		&& ((d->len == 0)
+		|| (std::memcmp(a.data(), d->data, d->len) == 0));
+}
+
+class params
+{
+public:
+	params() : p_(c::tkvdb_params_create())
+	{
+		if (!p_) {
+			throw error(TKVDB_ENOMEM);
+		}
+	}
+	~params() { c::tkvdb_params_free(p_); }
+
+	params(const params &) = delete;
+	params &operator=(const params &) = delete;
+
+	params &set(TKVDB_PARAM p, int64_t val) noexcept
+	{
+		c::tkvdb_param_set(p_, p, val);
+		return *this;
+	}
+
+	params &set_allocator(const c::tkvdb_allocator &a) noexcept
+	{
+		c::tkvdb_param_set_allocator(p_, &a);
+		return *this;
+	}
+	/* nodes, transactions and cursors take memory from 'mr',
+	 * resource must outlive them */
+	params &set_allocator(std::pmr::memory_resource *mr) noexcept
+	{
+		return set_allocator({pmr_alloc, pmr_free, nullptr, mr});
+	}
+	/* arena is released at once when transaction is freed,
+	 * so it should serve only one transaction */
+	params &set_allocator(std::pmr::monotonic_buffer_resource *mr)
+		noexcept
+	{
+		return set_allocator({pmr_alloc, pmr_free, pmr_release, mr});
+	}
+
+	c::tkvdb_params *native() const noexcept { return p_; }
+
+private:
+	static void *pmr_alloc(void *ctx, size_t size) noexcept
+	{
+		try {
+			return static_cast<std::pmr::memory_resource *>(ctx)
+				->allocate(size, alignof(std::max_align_t));
+		} catch (...) {
+			return nullptr;
+		}
+	}
+	static void pmr_free(void *ctx, void *ptr, size_t size) noexcept
+	{
+		static_cast<std::pmr::memory_resource *>(ctx)
+			->deallocate(ptr, size, alignof(std::max_align_t));
+	}
+	static void pmr_release(void *ctx) noexcept
+	{
+		static_cast<std::pmr::monotonic_buffer_resource *>(ctx)
+			->release();
+	}
+
+	c::tkvdb_params *p_;
+};
+
+/* database file */
+class db
+{
+public:
+	explicit db(const std::string &path, params *p = nullptr)
+		: db_(c::tkvdb_open(path.c_str(), p ? p->native() : nullptr))
+	{
+		if (!db_) {
+			throw error(TKVDB_IO_ERROR);
+		}
+	}
+	~db() { close(); }
+
+	db(const db &) = delete;
+	db &operator=(const db &) = delete;
+	db(db &&other) noexcept : db_(std::exchange(other.db_, nullptr)) {}
+	db &operator=(db &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			db_ = std::exchange(other.db_, nullptr);
+		}
+		return *this;
+	}
+
+	[[nodiscard]] TKVDB_RES sync() noexcept { return c::tkvdb_sync(db_); }
+
+	c::tkvdb *native() const noexcept { return db_; }
+
+private:
+	void close() noexcept
+	{
+		if (db_) {
+			c::tkvdb_close(db_);
+			db_ = nullptr;
+		}
+	}
+
+	c::tkvdb *db_;
+};
+
+/* coroutines don't wait for reads of nodes from file: read is started and
+ * coroutine is suspended, executor is called with function which must be
+ * called later in thread of transaction (e.g. posted to event loop), it
+ * resumes coroutine when node is read or passes itself to executor again */
+template <class E>
+concept executor = std::invocable<E &, std::function<void()>>;
+
+/* repeats operation while it returns TKVDB_AGAIN,
+ * result of co_await is op.result() */
+template <class Op, executor E>
+class awaitable
+{
+public:
+	awaitable(Op op, E ex) : op_(std::move(op)), ex_(std::move(ex)) {}
+
+	bool await_ready() noexcept
+	{
+		r_ = op_();
+		return r_ != TKVDB_AGAIN;
+	}
+	void await_suspend(std::coroutine_handle<> h) { retry(h); }
+	decltype(auto) await_resume() { return op_.result(r_); }
+
+private:
+	void retry(std::coroutine_handle<> h)
+	{
+		ex_([this, h] {
+			r_ = op_();
+			if (r_ == TKVDB_AGAIN) {
+				retry(h);
+			} else {
+				h.resume();
+			}
+		});
+	}
+
+	Op op_;
+	E ex_;
+	TKVDB_RES r_ = TKVDB_OK;
+};
+
+/* transaction, RAM-only if created without database */
+class transaction
+{
+public:
+	transaction() : tr_(c::tkvdb_tr_create(nullptr)), owned_(true)
+	{
+		check();
+	}
+	explicit transaction(db &d)
+		: tr_(c::tkvdb_tr_create(d.native())), owned_(true)
+	{
+		check();
+	}
+	transaction(db &d, size_t limit, bool dynalloc)
+		: tr_(c::tkvdb_tr_create_m(d.native(), limit, dynalloc)),
+		owned_(true)
+	{
+		check();
+	}
+	/* transaction with its own parameters (buffer, allocator) */
+	transaction(db &d, const params &p)
+		: tr_(c::tkvdb_tr_create_p(d.native(), p.native())),
+		owned_(true)
+	{
+		check();
+	}
+	explicit transaction(const params &p)
+		: tr_(c::tkvdb_tr_create_p(nullptr, p.native())), owned_(true)
+	{
+		check();
+	}
+	~transaction() { free(); }
+
+	transaction(const transaction &) = delete;
+	transaction &operator=(const transaction &) = delete;
+	transaction(transaction &&other) noexcept
+		: tr_(std::exchange(other.tr_, nullptr)), owned_(other.owned_)
+	{
+	}
+	transaction &operator=(transaction &&other) noexcept
+	{
+		if (this != &other) {
+			free();
+			tr_ = std::exchange(other.tr_, nullptr);
+			owned_ = other.owned_;
+		}
+		return *this;
+	}
+
+	/* read-only transaction on root of past transaction */
+	static transaction at(db &d, uint64_t transaction_id)
+	{
+		c::tkvdb_tr *tr;
+
+		tr = c::tkvdb_tr_create_at(d.native(), transaction_id);
+
+		if (!tr) {
+			throw error(TKVDB_NOT_FOUND);
+		}
+		return transaction(tr, true);
+	}
+
+	/* read-only transaction on frozen image written by freeze() */
+	static transaction frozen(const std::string &path)
+	{
+		c::tkvdb_tr *tr = c::tkvdb_tr_create_frozen(path.c_str());
+
+		if (!tr) {
+			throw error(TKVDB_IO_ERROR);
+		}
+		return transaction(tr, true);
+	}
+
+	/* transaction on named keyspace, it's the part of this transaction
+	 * and must not outlive it */
+	transaction keyspace(const std::string &name)
+	{
+		c::tkvdb_tr *tr = c::tkvdb_tr_keyspace(tr_, name.c_str());
+
+		if (!tr) {
+			throw error(TKVDB_ENOMEM);
+		}
+		return transaction(tr, false);
+	}
+
+	[[nodiscard]] TKVDB_RES begin() noexcept
+	{
+		return c::tkvdb_begin(tr_);
+	}
+	[[nodiscard]] TKVDB_RES commit() noexcept
+	{
+		return c::tkvdb_commit(tr_);
+	}
+	[[nodiscard]] TKVDB_RES rollback() noexcept
+	{
+		return c::tkvdb_rollback(tr_);
+	}
+
+	[[nodiscard]] TKVDB_RES put(datum key, datum val) noexcept
+	{
+		return c::tkvdb_put(tr_, key.get(), val.get());
+	}
+	[[nodiscard]] TKVDB_RES del(datum key, bool prefix = false) noexcept
+	{
+		return c::tkvdb_del(tr_, key.get(), prefix);
+	}
+
+	/* value points to transaction memory and is valid until next change
+	 * of transaction, std::nullopt if there is no such key,
+	 * other errors are thrown */
+	[[nodiscard]] std::optional<bytes> get(datum key)
+	{
+		c::tkvdb_datum val;
+
+		return found(c::tkvdb_get(tr_, key.get(), &val), val);
+	}
+
+	/* co_await gives the same as get(),
+	 * key must be valid until coroutine is resumed */
+	template <executor E>
+	[[nodiscard]] auto get_async(datum key, E ex)
+	{
+		return awaitable<get_op, E>(get_op{tr_, key, {}},
+			std::move(ex));
+	}
+
+	/* integer keys, stored in big-endian byte order
+	 * (the same as key_codec<std::tuple<uint64_t>>) */
+	[[nodiscard]] TKVDB_RES put(uint64_t key, datum val) noexcept
+	{
+		return c::tkvdb_put_u64(tr_, key, val.get());
+	}
+	[[nodiscard]] TKVDB_RES del(uint64_t key) noexcept
+	{
+		return c::tkvdb_del_u64(tr_, key);
+	}
+	[[nodiscard]] std::optional<bytes> get(uint64_t key)
+	{
+		c::tkvdb_datum val;
+
+		return found(c::tkvdb_get_u64(tr_, key, &val), val);
+	}
+
+	[[nodiscard]] TKVDB_RES merge(transaction &src) noexcept
+	{
+		return c::tkvdb_tr_merge(tr_, src.tr_);
+	}
+	[[nodiscard]] TKVDB_RES copy_prefix(datum from, datum to) noexcept
+	{
+		return c::tkvdb_copy_prefix(tr_, from.get(), to.get());
+	}
+	[[nodiscard]] TKVDB_RES move_prefix(datum from, datum to) noexcept
+	{
+		return c::tkvdb_move_prefix(tr_, from.get(), to.get());
+	}
+
+	[[nodiscard]] TKVDB_RES savepoint(size_t &sp) noexcept
+	{
+		return c::tkvdb_savepoint(tr_, &sp);
+	}
+	[[nodiscard]] TKVDB_RES rollback_to(size_t sp) noexcept
+	{
+		return c::tkvdb_rollback_to(tr_, sp);
+	}
+	[[nodiscard]] TKVDB_RES savepoint_release(size_t sp) noexcept
+	{
+		return c::tkvdb_savepoint_release(tr_, sp);
+	}
+	[[nodiscard]] TKVDB_RES spill() noexcept
+	{
+		return c::tkvdb_tr_spill(tr_);
+	}
+	[[nodiscard]] TKVDB_RES freeze(int fd) noexcept
+	{
+		return c::tkvdb_freeze(tr_, fd);
+	}
+
+	c::tkvdb_tr *native() const noexcept { return tr_; }
+
+private:
+	transaction(c::tkvdb_tr *tr, bool owned) noexcept
+		: tr_(tr), owned_(owned) {}
+
+	struct get_op
+	{
+		c::tkvdb_tr *tr;
+		datum key;
+		c::tkvdb_datum val;
+
+		TKVDB_RES operator()() noexcept
+		{
+			return c::tkvdb_get_nowait(tr, key.get(), &val);
+		}
+		std::optional<bytes> result(TKVDB_RES r) const
+		{
+			return found(r, val);
+		}
+	};
+
+	static std::optional<bytes> found(TKVDB_RES r,
+		const c::tkvdb_datum &val)
+	{
+		if (r == TKVDB_OK) {
+			return bytes(static_cast<const std::byte *>(val.data),
+				val.len);
+		}
+		if ((r == TKVDB_NOT_FOUND) || (r == TKVDB_EMPTY)) {
+			return std::nullopt;
+		}
+		throw error(r);
+	}
+
+	void check() const
+	{
+		if (!tr_) {
+			throw error(TKVDB_ENOMEM);
+		}
+	}
+
+	void free() noexcept
+	{
+		if (tr_ && owned_) {
+			c::tkvdb_tr_free(tr_);
+		}
+		tr_ = nullptr;
+	}
+
+	c::tkvdb_tr *tr_;
+	bool owned_;            /* keyspaces are freed with parent */
+};
+
+/* cursor, key and value are valid until next move of cursor */
+class cursor
+{
+public:
+	explicit cursor(transaction &tr)
+		: c_(c::tkvdb_cursor_create(tr.native()))
+	{
+		if (!c_) {
+			throw error(TKVDB_ENOMEM);
+		}
+	}
+	~cursor() { free(); }
+
+	cursor(const cursor &) = delete;
+	cursor &operator=(const cursor &) = delete;
+	cursor(cursor &&other) noexcept
+		: c_(std::exchange(other.c_, nullptr)) {}
+	cursor &operator=(cursor &&other) noexcept
+	{
+		if (this != &other) {
+			free();
+			c_ = std::exchange(other.c_, nullptr);
+		}
+		return *this;
+	}
+
+	[[nodiscard]] TKVDB_RES first() noexcept { return c::tkvdb_first(c_); }
+	[[nodiscard]] TKVDB_RES last() noexcept { return c::tkvdb_last(c_); }
+	[[nodiscard]] TKVDB_RES next() noexcept { return c::tkvdb_next(c_); }
+	[[nodiscard]] TKVDB_RES prev() noexcept { return c::tkvdb_prev(c_); }
+	/* co_await gives result of next() and prev() */
+	template <executor E>
+	[[nodiscard]] auto next_async(E ex)
+	{
+		return awaitable<move_op, E>(move_op{c_, c::tkvdb_next_nowait},
+			std::move(ex));
+	}
+	template <executor E>
+	[[nodiscard]] auto prev_async(E ex)
+	{
+		return awaitable<move_op, E>(move_op{c_, c::tkvdb_prev_nowait},
+			std::move(ex));
+	}
+	[[nodiscard]] TKVDB_RES seek(datum key,
+		TKVDB_SEEK seek = TKVDB_SEEK_EQ) noexcept
+	{
+		return c::tkvdb_seek(c_, key.get(), seek);
+	}
+
+	bytes key() const noexcept
+	{
+		return bytes(static_cast<const std::byte *>(
+			c::tkvdb_cursor_key(c_)), c::tkvdb_cursor_keysize(c_));
+	}
+	bytes val() const noexcept
+	{
+		return bytes(static_cast<const std::byte *>(
+			c::tkvdb_cursor_val(c_)), c::tkvdb_cursor_valsize(c_));
+	}
+
+	c::tkvdb_cursor *native() const noexcept { return c_; }
+
+private:
+	struct move_op
+	{
+		c::tkvdb_cursor *c;
+		TKVDB_RES (*move)(c::tkvdb_cursor *);
+
+		TKVDB_RES operator()() noexcept { return move(c); }
+		TKVDB_RES result(TKVDB_RES r) const noexcept { return r; }
+	};
+
+	void free() noexcept
+	{
+		if (c_) {
+			c::tkvdb_cursor_free(c_);
+			c_ = nullptr;
+		}
+	}
+
+	c::tkvdb_cursor *c_;
+};
+
+/* ordered map on top of transaction, like std::map with byte string keys,
+ * copies of iterator share one cursor, so copying is cheap, iterator
+ * that is moved while cursor is shared creates own cursor and seeks to
+ * its key (copy on write), increment and decrement of unshared iterator
+ * don't allocate memory, iterators are invalidated by changes of
+ * transaction */
+class map
+{
+public:
+	class iterator
+	{
+	public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using value_type = std::pair<bytes, bytes>;
+		using difference_type = std::ptrdiff_t;
+		using reference = value_type;
+		using pointer = void;
+
+		iterator() = default;
+		iterator(const iterator &) = default;
+		iterator(iterator &&) noexcept = default;
+		iterator &operator=(const iterator &) = default;
+		iterator &operator=(iterator &&) noexcept = default;
+
+		bytes key() const noexcept { return c_->key(); }
+		bytes val() const noexcept { return c_->val(); }
+		value_type operator*() const noexcept
+		{
+			return value_type(key(), val());
+		}
+
+		iterator &operator++()
+		{
+			own();
+			step(c_->next());
+			return *this;
+		}
+		iterator operator++(int)
+		{
+			iterator tmp(*this);
+			++*this;
+			return tmp;
+		}
+		/* decrement of end() moves to the last pair */
+		iterator &operator--()
+		{
+			own();
+			if (end_) {
+				open();
+				step(c_->last());
+			} else {
+				step(c_->prev());
+			}
+			return *this;
+		}
+		iterator operator--(int)
+		{
+			iterator tmp(*this);
+			--*this;
+			return tmp;
+		}
+
+		friend bool operator==(const iterator &a, const iterator &b)
+		{
+			if (a.end_ || b.end_) {
+				return a.end_ && b.end_;
+			}
+			return key_equal(a.key(), b.key());
+		}
+
+	private:
+		friend class map;
+
+		explicit iterator(transaction *tr) noexcept : tr_(tr) {}
+
+		/* cursor is created once and reused after reaching end */
+		void open()
+		{
+			if (!c_) {
+				c_ = std::make_shared<cursor>(*tr_);
+			}
+		}
+
+		/* cursor shared with copies is left to them */
+		void own()
+		{
+			if (c_ && (c_.use_count() > 1)) {
+				std::shared_ptr<cursor> shared = std::move(c_);
+
+				open();
+				if (!end_) {
+					step(c_->seek(shared->key(),
+						TKVDB_SEEK_EQ));
+				}
+			}
+		}
+
+		void step(TKVDB_RES r)
+		{
+			end_ = (r != TKVDB_OK);
+			if ((r != TKVDB_OK) && (r != TKVDB_NOT_FOUND)
+				&& (r != TKVDB_EMPTY)) {
+
+				throw error(r);
+			}
+		}
+
+		transaction *tr_ = nullptr;
+		std::shared_ptr<cursor> c_;
+		bool end_ = true;
+	};
+
+	using const_iterator = iterator;
+	using key_type = bytes;
+	using mapped_type = bytes;
+	using value_type = iterator::value_type;
+
+	/* pairs with common prefix, usable in range-based for */
+	class range
+	{
+	public:
+		range(iterator b, iterator e)
+			: begin_(std::move(b)), end_(std::move(e)) {}
+
+		iterator begin() const { return begin_; }
+		iterator end() const { return end_; }
+
+	private:
+		iterator begin_, end_;
+	};
+
+	explicit map(transaction &tr) noexcept : tr_(&tr) {}
+
+	iterator begin() const
+	{
+		iterator it(tr_);
+
+		it.open();
+		it.step(it.c_->first());
+		return it;
+	}
+	iterator end() const noexcept { return iterator(tr_); }
+	bool empty() const { return begin() == end(); }
+
+	iterator find(datum key) const
+	{
+		iterator it(tr_);
+
+		it.open();
+		it.step(it.c_->seek(key, TKVDB_SEEK_EQ));
+		return it;
+	}
+	/* first key not less than 'key' */
+	iterator lower_bound(datum key) const
+	{
+		iterator it(tr_);
+
+		it.open();
+		it.step(it.c_->seek(key, TKVDB_SEEK_GE));
+		return it;
+	}
+	/* first key greater than 'key' */
+	iterator upper_bound(datum key) const
+	{
+		iterator it = lower_bound(key);
+
+		if ((it != end()) && key_equal(it.key(), key)) {
+			++it;
+		}
+		return it;
+	}
+	std::pair<iterator, iterator> equal_range(datum key) const
+	{
+		return std::make_pair(lower_bound(key), upper_bound(key));
+	}
+
+	bool contains(datum key) const { return tr_->get(key).has_value(); }
+	std::optional<bytes> get(datum key) const { return tr_->get(key); }
+
+	[[nodiscard]] TKVDB_RES insert_or_assign(datum key, datum val) noexcept
+	{
+		return tr_->put(key, val);
+	}
+	[[nodiscard]] TKVDB_RES erase(datum key) noexcept
+	{
+		return tr_->del(key);
+	}
+
+	/* all keys starting with 'pfx' */
+	range prefix(datum pfx) const
+	{
+		const c::tkvdb_datum *d = pfx.get();
+		std::string next(static_cast<const char *>(d->data), d->len);
+
+		/* the smallest key greater than all keys with prefix */
+		while (!next.empty()
+			&& (static_cast<unsigned char>(next.back()) == 0xff)) {
+
+			next.pop_back();
+		}
+		if (next.empty()) {
+			return range(lower_bound(pfx), end());
+		}
+		next.back() = static_cast<char>(
+			static_cast<unsigned char>(next.back()) + 1);
+
+		return range(lower_bound(pfx), lower_bound(next));
+	}
+
+private:
+	transaction *tr_;
+};
+
+/* order-preserving keys
+ *
+ * fields of tuple are encoded so memcmp() order of keys is the order of
+ * tuples: integers are big-endian with flipped sign bit, strings are
+ * terminated with 00 01 and zero bytes inside are escaped as 00 ff,
+ * fields wrapped in desc<> are inverted. Each field is prefix-free,
+ * so key of leading fields is a prefix of full key */
+
+/* field in descending order */
+template <class T>
+struct desc
+{
+	T value;
+};
+
+/* encoding of one field: size() bytes are written by encode(),
+ * decode() reads field and moves pointer, bytes are inverted if INV,
+ * max_size is 0 for fields of variable size */
+template <class T>
+struct key_field;
+
+template <std::unsigned_integral T>
+struct key_field<T>
+{
+	using value_type = T;
+	using decoded_type = T;
+	static constexpr bool fixed = true;
+	static constexpr size_t max_size = sizeof(T);
+
+	static constexpr size_t size(T) noexcept { return sizeof(T); }
+
+	static std::byte *encode(T v, std::byte *out) noexcept
+	{
+		for (size_t i=0; i<sizeof(T); i++) {
+			out[i] = static_cast<std::byte>(
+				v >> (8 * (sizeof(T) - 1 - i)));
+		}
+		return out + sizeof(T);
+	}
+
+	template <bool INV>
+	static bool decode(const std::byte *&p, const std::byte *end,
+		T &v) noexcept
+	{
+		if ((size_t)(end - p) < sizeof(T)) {
+			return false;
+		}
+		v = 0;
+		for (size_t i=0; i<sizeof(T); i++) {
+			std::byte b = INV ? ~p[i] : p[i];
+
+			v = static_cast<T>((v << 8) | static_cast<T>(b));
+		}
+		p += sizeof(T);
+		return true;
+	}
+};
+
+/* signed integers are shifted to unsigned range by flipping sign bit */
+template <std::signed_integral T>
+struct key_field<T>
+{
+	using U = std::make_unsigned_t<T>;
+	using value_type = T;
+	using decoded_type = T;
+	static constexpr bool fixed = true;
+	static constexpr size_t max_size = sizeof(T);
+	static constexpr U sign = U(1) << (sizeof(T) * 8 - 1);
+
+	static constexpr size_t size(T) noexcept { return sizeof(T); }
+
+	static std::byte *encode(T v, std::byte *out) noexcept
+	{
+		return key_field<U>::encode(static_cast<U>(v) ^ sign, out);
+	}
+
+	template <bool INV>
+	static bool decode(const std::byte *&p, const std::byte *end,
+		T &v) noexcept
+	{
+		U u;
+
+		if (!key_field<U>::template decode<INV>(p, end, u)) {
+			return false;
+		}
+		v = static_cast<T>(u ^ sign);
+		return true;
+	}
+};
+
+template <>
+struct key_field<std::string_view>
+{
+	using value_type = std::string_view;
+	using decoded_type = std::string;
+	static constexpr bool fixed = false;
+	static constexpr size_t max_size = 0;
+
+	static size_t size(std::string_view v) noexcept
+	{
+		return v.size() + std::count(v.begin(), v.end(), '\0') + 2;
+	}
+
+	static std::byte *encode(std::string_view v, std::byte *out) noexcept
+	{
+		for (char ch : v) {
+			*out++ = static_cast<std::byte>(ch);
+			if (ch == '\0') {
+				*out++ = std::byte{0xff};
+			}
+		}
+		*out++ = std::byte{0x00};
+		*out++ = std::byte{0x01};
+		return out;
+	}
+
+	template <bool INV>
+	static bool decode(const std::byte *&p, const std::byte *end,
+		std::string &v)
+	{
+		v.clear();
+		while (p < end) {
+			std::byte b = INV ? ~*p : *p;
+
+			p++;
+			if (b != std::byte{0x00}) {
+				v.push_back(static_cast<char>(b));
+				continue;
+			}
+			if (p == end) {
+				return false;
+			}
+			b = INV ? ~*p : *p;
+			p++;
+			if (b == std::byte{0x01}) {
+				return true;
+			}
+			if (b != std::byte{0xff}) {
+				return false;
+			}
+			v.push_back('\0');
+		}
+		return false;
+	}
+};
+
+template <>
+struct key_field<std::string> : key_field<std::string_view> {};
+
+template <class T>
+struct key_field<desc<T>>
+{
+	using value_type = typename key_field<T>::value_type;
+	using decoded_type = typename key_field<T>::decoded_type;
+	static constexpr bool fixed = key_field<T>::fixed;
+	static constexpr size_t max_size = fixed ? key_field<T>::max_size : 0;
+
+	static size_t size(const value_type &v) noexcept
+	{
+		return key_field<T>::size(v);
+	}
+
+	static std::byte *encode(const value_type &v, std::byte *out) noexcept
+	{
+		std::byte *end = key_field<T>::encode(v, out);
+
+		for (std::byte *p = out; p < end; p++) {
+			*p = ~*p;
+		}
+		return end;
+	}
+
+	template <bool INV>
+	static bool decode(const std::byte *&p, const std::byte *end,
+		decoded_type &v)
+	{
+		return key_field<T>::template decode<!INV>(p, end, v);
+	}
+};
+
+/* encoded key on stack */
+template <size_t N>
+class key_buffer
+{
+public:
+	const std::byte *data() const noexcept { return buf_.data(); }
+	size_t size() const noexcept { return size_; }
+
+	operator bytes() const noexcept { return bytes(buf_.data(), size_); }
+	operator datum() const noexcept { return datum(bytes(*this)); }
+
+private:
+	template <class T, size_t C> friend class key_codec;
+
+	std::array<std::byte, N> buf_;
+	size_t size_ = 0;
+};
+
+/* key_codec<std::tuple<...>> encodes tuple to key and back,
+ * buffer size is known at compile time for tuples of integers,
+ * otherwise keys are limited by 'CAPACITY' */
+template <class T, size_t CAPACITY = 256>
+class key_codec;
+
+template <class... Ts, size_t CAPACITY>
+class key_codec<std::tuple<Ts...>, CAPACITY>
+{
+public:
+	static constexpr bool fixed_size = (key_field<Ts>::fixed && ...);
+	static constexpr size_t max_size = fixed_size
+		? (size_t(0) + ... + key_field<Ts>::max_size) : CAPACITY;
+
+	using buffer = key_buffer<max_size>;
+	using decoded_type =
+		std::tuple<typename key_field<Ts>::decoded_type...>;
+
+	/* all fields or leading ones to get prefix for seek,
+	 * throws TKVDB_INVALID if key doesn't fit to buffer */
+	template <class... Args>
+		requires (sizeof...(Args) <= sizeof...(Ts))
+	static buffer encode(const Args &... args)
+	{
+		buffer b;
+
+		encode_fields(std::index_sequence_for<Args...>(), b, args...);
+		return b;
+	}
+
+	static std::optional<decoded_type> decode(bytes key)
+	{
+		decoded_type res;
+		const std::byte *p = key.data(), *end = key.data() + key.size();
+
+		if (!decode_fields(std::index_sequence_for<Ts...>(), p, end,
+			res) || (p != end)) {
+
+			return std::nullopt;
+		}
+		return res;
+	}
+
+private:
+	template <size_t I>
+	using field = key_field<std::tuple_element_t<I, std::tuple<Ts...>>>;
+
+	template <size_t... Is, class... Args>
+	static void encode_fields(std::index_sequence<Is...>, buffer &b,
+		const Args &... args)
+	{
+		std::byte *out = b.buf_.data();
+
+		if constexpr (!fixed_size) {
+			size_t size = (size_t(0) + ... + field<Is>::size(
+				typename field<Is>::value_type(args)));
+
+			if (size > max_size) {
+				throw error(TKVDB_INVALID);
+			}
+		}
+
+		((out = field<Is>::encode(typename field<Is>::value_type(args),
+			out)), ...);
+		b.size_ = out - b.buf_.data();
+	}
+
+	template <size_t... Is>
+	static bool decode_fields(std::index_sequence<Is...>,
+		const std::byte *&p, const std::byte *end, decoded_type &res)
+	{
+		return (field<Is>::template decode<false>(p, end,
+			std::get<Is>(res)) && ...);
+	}
+};
+
+} /* namespace tkvdb */
+
+#endif